@@ -4,32 +4,421 @@
    NOTE: File "encryption" is a simple XOR obfuscation (NOT secure).
 */
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE /* POSIX.1-2008 plus fallocate() hole punching */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdarg.h>
 #include <time.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/inotify.h>
 
 #define DATA_DIR "."
-#define TRAN_FILE DATA_DIR "/transactions.dat"
-#define CAT_FILE DATA_DIR "/categories.dat"
-#define BUD_FILE DATA_DIR "/budgets.dat"
+#define LEDGER_DIR DATA_DIR "/ledgers" /* one subdirectory per extra ledger */
+#define MAIN_LEDGER "main"             /* the ledger stored directly in DATA_DIR */
+#define TRAN_FILE "transactions.dat"   /* per-ledger files */
+#define CAT_FILE "categories.dat"
+#define BUD_FILE "budgets.dat"
+#define RATE_FILE DATA_DIR "/rates.dat"
+#define CONF_FILE DATA_DIR "/finance.conf"
 #define TEMP_FILE DATA_DIR "/tmp_import.csv"
 #define MAX_NOTE 256
 #define DATE_STRLEN 11 /* "YYYY-MM-DD" + NUL */
+#define PATH_LEN 512
+#define MAX_LEDGERS 64
+#define CUR_LEN 4      /* ISO 4217 code + NUL */
+#define DEFAULT_CURRENCY "EUR"
+
+/* Binary files start with this header; files without it are the
+   original headerless format (version 1). */
+#define FILE_MAGIC "PFM\x01"
+#define FORMAT_VERSION 3
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t rec_size;
+    uint32_t next_id;    /* transactions: next id to hand out, so ids of
+                            deleted rows are never reused (0 = unknown) */
+    uint64_t count;
+    uint64_t generation; /* journal seq the data reflects (version 3+) */
+} FileHeader;
+
+/* Task scheduler: every parallel path (file I/O, loading ledgers, report
+   scans, search, CSV import, index builds, archiving) submits tasks to
+   one pool of workers rather than starting threads of its own. Each
+   worker has a deque per priority: it pushes and pops its newest tasks
+   at the bottom, and an idle worker steals the oldest from the top of
+   another's. Other threads submit through a shared inject queue. A
+   thread waiting for a group of tasks runs queued ones meanwhile, so
+   nested parallel loops never starve the pool. Loops over rows are cut
+   into chunks whose size depends only on the row count, so results do
+   not depend on the number of workers, and small loops run inline. */
+#define SCHED_MAX_THREADS 64
+#define SCHED_GRAIN_ROWS 16384 /* smallest chunk of a store scan */
+#define SCHED_CHUNKS 64        /* a large loop is cut into about this many */
+#define IMPORT_BLOCK 16384     /* CSV lines read, then parsed in parallel */
+#define IMPORT_GRAIN 1024      /* smallest chunk of lines to parse */
+#define IMPORT_SEGMENT 16      /* blocks of a long import committed and checkpointed together */
+#define IMPORT_CKPT_FILE "import.ckpt" /* per-ledger, see ImportCkpt */
+#define IMPORT_DUPS_FILE "import.dups"
+#define IMPORT_CKPT_MAGIC "PFI\x04"
+#define IMPORT_ID_BYTES 4096
+#define FITID_TAG "[fitid:" /* ends the note of a row with a bank's transaction id */
+#define ACCT_LEN 33 /* an OFX ACCTID, which goes in that tag before the id */
+enum { PRIO_HIGH, PRIO_LOW, PRIO_COUNT }; /* foreground work, background work */
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t pending; /* spawned and not finished */
+    int prio;
+} TaskGroup;
+
+typedef struct {
+    void (*fn)(void *arg);
+    void *arg;
+    TaskGroup *group;
+} Task;
+
+typedef struct {
+    pthread_mutex_t lock;
+    Task **buf; /* ring of cap slots */
+    size_t head; /* oldest task, stolen from here */
+    size_t count;
+    size_t cap;
+} TaskDeque;
+
+/* Parallel file I/O: reads and writes of any number of files are queued
+   on an IoBatch and waited for once. They are split at IO_CHUNK file
+   offsets and run as scheduler tasks, so files and the chunks of large
+   files transfer concurrently and (de)obfuscating one chunk overlaps the
+   transfer of the others. */
+#define IO_CHUNK (1 << 20)
+#define IO_ALIGN 4096
+
+typedef struct {
+    int fd;
+    int sync;                /* fsync before closing */
+    char path[PATH_LEN + 64];
+    char tmp[PATH_LEN + 72]; /* non-empty: written here, renamed to path */
+} IoFile;
+
+typedef struct {
+    pthread_mutex_t lock; /* guards failed */
+    TaskGroup group;
+    int failed;
+    IoFile *files;
+    size_t nfiles;
+    size_t filescap;
+} IoBatch;
+
+typedef struct {
+    IoBatch *b;
+    int fd;
+    int write;
+    int xor;   /* apply obfuscate_buffer() to the chunk */
+    int owned; /* buf is a private copy, freed when done */
+    unsigned char *buf;
+    size_t len;
+    off_t off;
+} IoJob;
+
+/* Every change to a ledger is appended to its journal. Checkpoints are
+   full copies of the stores and say where in the journal to resume, so
+   rebuilding any past state replays a bounded tail. One is taken every
+   CHECKPOINT_EVERY records, or once there are as many records as rows
+   for large ledgers: copying then costs O(1) per change however fast
+   rows arrive, and a tail never takes longer than reading a copy.
+   Only the newest CKPT_KEEP checkpoints are kept (plus any one still
+   needed to recover the saved data files or to sync a known replica),
+   and the journal before the oldest kept is punched out of the file, so
+   every offset stays valid while the disk space is returned. */
+#define JOURNAL_FILE "journal.log"
+#define CKPT_DIR "checkpoints"
+#define JOURNAL_MAGIC 0x4c4e524au  /* "JRNL": records without origin */
+#define JOURNAL_MAGIC2 0x324e524au /* "JRN2" */
+#define CKPT_MAGIC "PFC\x01"
+#define CKPT_VERSION 5 /* 4 copied archived rows in; 5 names their segments */
+#define CHECKPOINT_EVERY 5000
+#define CKPT_KEEP 4
+#define JOURNAL_BUF (64 * 1024) /* whole records written per write() */
+/* JournalRec.forward flags. The records of an atomic group (one import
+   commit) carry IN_GROUP and the last one GROUP_END too; recovery stops
+   before a group whose end never reached the journal. */
+#define JOURNAL_FORWARD 0x1   /* clear: the op is applied in reverse (an undo) */
+#define JOURNAL_IN_GROUP 0x2
+#define JOURNAL_GROUP_END 0x4
+
+/* Durability (durability= in CONF_FILE). sync: every change is synced
+   to disk on its own. grouped (the default): one fdatasync() covers all
+   the changes concurrent daemon clients made meanwhile, and the writer
+   keeps adding to the group for up to commit_window_ms. async: changes
+   count as done once written and are synced when the writer is idle or
+   every ASYNC_SYNC_MS. Daemon clients are answered only once their rows
+   are durable, except under async. From the menu, with one writer, sync
+   and grouped both sync each change. */
+enum { DURABLE_SYNC, DURABLE_GROUPED, DURABLE_ASYNC };
+#define ASYNC_SYNC_MS 100
+#define GROUP_COMMIT_MAX (64 * 1024) /* rows waiting on one sync at most */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t len;      /* bytes of the encoded op that follows */
+    uint64_t seq;      /* ledger generation after this record */
+    int64_t ts;        /* time the change was made */
+    uint32_t forward;  /* JOURNAL_FORWARD and group flags */
+    uint32_t check;    /* FNV-1a of the op bytes */
+    uint64_t origin;     /* replica the change was made at, 0 = this one */
+    uint64_t origin_seq; /* its seq there */
+} JournalRec;
+
+#define JOURNAL_V1_HEAD offsetof(JournalRec, origin)
+
+/* Replica sync. Every ledger replica has a random id and a vector clock
+   (the highest seq applied from each other replica), so two replicas
+   only exchange the records the other is missing. Transactions travel
+   and categories under a global id (origin replica, id there). */
+#define SYNC_FILE "sync.state"
+#define IDMAP_FILE "idmap.dat"
+#define STAMP_FILE "stamps.dat"
+#define SYNC_MAGIC "PFS\x02"
+#define MAX_REPLICAS 32
+
+/* Backups: a full copy of a ledger's stores (checkpoint format), then
+   journal segments since the previous backup (incremental) or since the
+   last full one (differential). manifest.txt chains them together. */
+#define BACKUP_DIR DATA_DIR "/backups" /* default; one subdirectory per ledger */
+#define BACKUP_MANIFEST "manifest.txt"
+/* In the ledger's directory: per backup directory, the seq its next
+   incremental or differential backup reads the journal from */
+#define BACKUP_PIN_FILE "backup.pin"
+
+/* Cold-month archive: on request, months older than N years (default
+   archive_years) are moved out of the hot store into immutable
+   LZ-compressed segments, one per month and run, whose headers carry a
+   zone map so most queries skip them without decompressing. A segment
+   goes back into the hot store as a whole when one of its rows changes. */
+#define ARCHIVE_DIR "archive"
+#define ARCHIVE_MAGIC "PFA\x01"
+#define ARCHIVE_ZONE_CATS 16 /* category ids kept in the zone map */
+#define ARCHIVE_CACHE_SEGS 8 /* decompressed segments kept in memory */
+
+/* Daemon mode (--daemon): clients connect to DAEMON_SOCK and send rows,
+   each connection on its own thread. Rows go through a lock-free queue
+   to the one thread that changes the stores, which applies up to
+   INGEST_BATCH at a time and journals them with a single write. */
+#define DAEMON_SOCK DATA_DIR "/finance.sock"
+#define INGEST_BATCH 4096
+
+/* Watch folder (daemon mode, watch_dir in CONF_FILE): CSV files landing
+   there are imported by up to WATCH_WORKERS low-priority tasks, skipping
+   rows the ledger already has, then moved to WATCH_DONE or WATCH_FAILED
+   with a line in WATCH_LOG. A task claims a file by renaming it into
+   WATCH_CLAIMED first, so a file queued twice is imported once. */
+#define WATCH_WORKERS 4
+#define WATCH_CLAIMED "processing"
+#define WATCH_DONE "processed"
+#define WATCH_FAILED "failed"
+#define WATCH_LOG "ingest.log"
+#define AUTO_CATEGORY "Uncategorized"
+
+/* Daemon metrics (metrics_port in CONF_FILE): served over HTTP on
+   127.0.0.1 in the Prometheus text format. Every figure is a relaxed
+   atomic updated where it happens, and the writer publishes its gauges
+   after each batch, so a scrape takes no lock the writer uses. A
+   client gets METRICS_TIMEOUT_MS to send its request and as long again
+   to take the answer, so a stalled one cannot hold up the next. */
+#define METRICS_BUCKETS 12
+#define METRICS_TIMEOUT_MS 1000
+enum { MOP_ADD, MOP_IMPORT, MOP_COMMIT, MOP_WATCH_FILE, MOP_BATCH, MOP_FSYNC, MOP_COUNT };
+enum { MEM_TXNS, MEM_CATS, MEM_BUDGETS, MEM_INDEX, MEM_AGG, MEM_UNDO, MEM_JOURNAL, MEM_DEDUP, MEM_COUNT };
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    int32_t month;        /* YYYYMM of every row in the segment */
+    uint32_t count;
+    uint64_t raw_len;
+    uint64_t comp_len;
+    uint32_t check;       /* FNV-1a of the uncompressed rows */
+    int32_t min_day;      /* zone map: date_key() range, */
+    int32_t max_day;
+    int32_t min_id;       /* id range, */
+    int32_t max_id;
+    double min_amount;    /* amount range */
+    double max_amount;
+    uint32_t ncats;       /* and category ids; ARCHIVE_ZONE_CATS + 1 = more */
+    int32_t cats[ARCHIVE_ZONE_CATS];
+} ArchiveHeader;
+
+typedef struct {
+    ArchiveHeader h;
+    char file[32];
+} ArchiveSeg;
+
+/* Optional on-disk backend: a ledger's transactions in a B+tree of
+   fixed-size pages clustered by (date, id), plus a small tree mapping
+   id -> date. Pages go through an LRU buffer pool of BT_POOL_PAGES per
+   tree, so memory use does not grow with the ledger. Deletes do not
+   rebalance; emptied space is reused by later inserts in that range. */
+#define BT_FILE "transactions.bpt"
+#define BT_IDS_FILE "txnids.bpt"
+#define BT_MAGIC "PFB\x01"
+#define BT_PAGE 4096
+#define BT_POOL_PAGES 256
+#define TREE_CACHE_ROWS 4096 /* rows of a B+tree ledger kept in txns for editing */
+
+/* Shared snapshots: the data files are fixed-size records behind a
+   header, written whole and renamed into place, so --read-only report
+   processes map them and share one page-cache copy, then follow the
+   journal for changes made since. Readers hold a shared lock on
+   READERS_LOCK; while one does, writers also publish at every
+   checkpoint, not only on exit. Only the holder of WRITER_LOCK (in the
+   working directory, covering every ledger) changes anything. */
+#define READERS_LOCK "readers.lock"
+#define WRITER_LOCK "writer.lock"
+
+/* Derived structures (the id index and monthly aggregates) are saved
+   next to the data files and stamped with the generation they reflect.
+   A warm start maps them instead of rebuilding them; after a crash the
+   journal tail is replayed into them along with the stores. */
+#define DERIVED_FILE "derived.idx"
+#define DERIVED_MAGIC "PFI\x01"
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t generation;  /* of the data files saved alongside */
+    uint64_t ntxns;       /* rows in transactions.dat (0 with a B+tree) */
+    uint64_t index_cap;   /* 0: no id index stored */
+    uint64_t index_used;
+    uint64_t ncells;      /* cube cells, then narchived folded months */
+    uint64_t narchived;
+    uint64_t rows;
+    uint64_t missing_rates;
+    uint32_t has_cube;
+    uint32_t rates;       /* rates_fingerprint() the cube was built with */
+    uint32_t check;       /* FNV-1a of the cube section */
+    uint32_t head_check;  /* FNV-1a of the header up to here */
+} DerivedHeader;
+
+typedef struct {
+    int32_t a;
+    int32_t b;
+} BtKey;
+
+/* Page 0 of a tree file */
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t val_size;
+    uint32_t root;
+    uint32_t npages;
+    uint32_t height;
+    uint32_t clean;      /* 0 while pages on disk may be half written */
+    int32_t next_id;     /* transactions: next id to hand out */
+    uint64_t count;
+    uint64_t generation; /* journal seq the tree reflects when clean */
+} BtHeader;
+
+/* Start of every other page, followed by the keys, then the values
+   (leaves) or child page numbers (inner nodes) */
+typedef struct {
+    uint16_t leaf;
+    uint16_t n;
+    uint32_t next; /* leaves: right sibling, 0 = last */
+} BtNode;
+
+typedef struct {
+    uint32_t page;
+    int dirty;
+    uint64_t used; /* tick of the last use, for LRU eviction */
+    unsigned char *buf;
+} BtFrame;
+
+typedef struct {
+    int fd;
+    BtHeader h;
+    size_t leaf_cap;
+    size_t inner_cap;
+    int disk_clean;  /* the header on disk says clean */
+    BtFrame *frames;
+    uint64_t tick;
+} BTree;
+
+typedef struct {
+    BTree rows; /* (date_key, id) -> Transaction */
+    BTree ids;  /* (id, 0) -> date_key */
+} TxnTree;
+
+/* Range scan over one tree; holds a copy of the current leaf */
+typedef struct {
+    BTree *t;
+    BtKey hi;
+    size_t pos;
+    unsigned char buf[BT_PAGE];
+} BtCursor;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t seq;
+    int64_t ts;
+    uint64_t journal_offset; /* first record after this checkpoint */
+    uint64_t ncats;
+    uint64_t ntxns;
+    uint64_t nbudgets;
+} CheckpointHeader;
+
+typedef struct {
+    uint64_t seq;
+    int64_t ts;
+    uint64_t journal_offset;
+    char path[PATH_LEN * 2];
+} CheckpointInfo;
 
 typedef enum { TYPE_EXPENSE = 0, TYPE_INCOME = 1 } TxnType;
 
 typedef struct {
     int id;                 /* unique id */
     char date[DATE_STRLEN]; /* "YYYY-MM-DD" */
-    double amount;
+    char currency[CUR_LEN]; /* "EUR", "USD", ... */
+    double amount;          /* in the transaction's own currency */
     int category_id;        /* link to category */
     TxnType type;           /* expense/income */
     char note[MAX_NOTE];
 } Transaction;
 
+/* Layout of transactions.dat before currencies were added */
+typedef struct {
+    int id;
+    char date[DATE_STRLEN];
+    double amount;
+    int category_id;
+    TxnType type;
+    char note[MAX_NOTE];
+} TransactionV1;
+
 typedef struct {
     int id;
     char name[64];
@@ -42,6 +431,14 @@ typedef struct {
     double amount; /* budget amount for that month */
 } BudgetEntry;
 
+/* One FX quote: 1 unit of currency = rate units of the base currency,
+   effective from date until the next quote for the same currency. */
+typedef struct {
+    char currency[CUR_LEN];
+    char date[DATE_STRLEN];
+    double rate;
+} FxRate;
+
 /* Dynamic arrays */
 typedef struct {
     Transaction *data;
@@ -63,10 +460,463 @@ typedef struct {
     size_t cap;
 } BudgetStore;
 
+/* Kept sorted by (currency, date) so as-of lookups can binary search */
+typedef struct {
+    FxRate *data;
+    size_t size;
+    size_t cap;
+    int *keys; /* date_key() of each entry, parallel to data */
+} RateStore;
+
+/* Per-(month, category) totals of one ledger in the base currency.
+   Cells are keyed by category id within a ledger, or by name (id 0)
+   when cubes from different ledgers are merged. */
+typedef struct {
+    int month; /* YYYYMM */
+    int category_id;
+    char category[64];
+    double income;
+    double expense;
+    size_t missing; /* rows counted at rate 1 for want of a quote */
+} CubeCell;
+
+typedef struct {
+    CubeCell *cells;
+    size_t size;
+    size_t cap;
+    size_t rows;
+    size_t missing_rates;
+    size_t *slots;  /* hash of cells: index + 1, 0 = empty */
+    size_t nslots;
+    int *archived;  /* months whose archived rows are folded in */
+    size_t narchived;
+    size_t archivedcap;
+} Cube;
+
+/* Transaction id -> position in txns.data (open addressing) */
+typedef struct {
+    int *ids;
+    size_t *pos;
+    size_t cap;
+    size_t used;
+    void *map;     /* non-NULL: ids and pos live in this private file mapping */
+    size_t maplen;
+} IdIndex;
+
+/* A named set of stores living in its own directory. Only the active
+   ledger's stores are edited; they live in the globals below while it is
+   active and are parked here otherwise. */
+typedef struct {
+    char name[64];
+    char dir[PATH_LEN];
+    int loaded;
+    int broken;           /* could not be loaded safely: never activated or saved */
+    TxnStore txns;
+    CatStore cats;
+    BudgetStore budgets;
+    uint64_t generation;  /* seq of the last journal record applied */
+    uint64_t journal_end; /* offset just past the last intact record */
+    TxnTree *tree;        /* NULL: transactions are all in txns */
+    IdIndex index;        /* derived structures, parked like the stores */
+    Cube agg;
+    int agg_valid;
+    uint32_t agg_rates;   /* rates_fingerprint() agg was built with */
+    void *snap[3];        /* --read-only: mapped categories, transactions, budgets */
+    size_t snaplen[3];
+    ino_t snapino[3];     /* which published file each mapping is (0 = none) */
+    int readers_fd;       /* --read-only: holds the shared READERS_LOCK, or -1 */
+    int follow;           /* --read-only: keep up with the writer (0: unreadable B+tree) */
+    ArchiveSeg *arch;     /* archive segment headers, by month */
+    size_t narch;
+    size_t archcap;
+} Ledger;
+
+/* Operation log kinds and the transaction fields an edit touched. A
+   batch adds rows with consecutive ids under one record. */
+enum { OP_TXN_ADD = 1, OP_TXN_DEL, OP_TXN_EDIT, OP_CAT_ADD, OP_CAT_DEL, OP_CAT_RENAME, OP_BUDGET_SET, OP_TXN_BATCH };
+enum { F_DATE = 1, F_CURRENCY = 2, F_AMOUNT = 4, F_CATEGORY = 8, F_TYPE = 16, F_NOTE = 32, F_ALL = 63 };
+
+/* Stores plus the derived structures to keep current while mutating
+   them; agg may be NULL. With a tree, txns holds only the rows that
+   were looked up by id and every change is written through. */
+typedef struct {
+    TxnStore *txns;
+    CatStore *cats;
+    BudgetStore *budgets;
+    IdIndex *index;
+    Cube *agg;
+    TxnTree *tree; /* NULL, or the B+tree txns caches rows of */
+} StoreCtx;
+
+/* Bounded undo history. Ops are byte-encoded back to back and only carry
+   the fields they change (dates as YYYYMMDD ints, notes by length).
+   Ops sharing a group are undone together, e.g. one CSV import. */
+typedef struct {
+    unsigned char *buf;
+    size_t used;
+    size_t bufcap;
+    size_t *offs;   /* start of each op in buf */
+    size_t count;
+    size_t cap;
+    size_t cursor;  /* [0, cursor) can be undone, [cursor, count) redone */
+    uint32_t group;
+    int group_open;
+    uint32_t dropped_group; /* group whose start fell off the log */
+    uint64_t trims;         /* times ops were dropped from the front */
+} OpLog;
+
+/* A what-if session. Edits go straight into the active stores (so
+   reports see them) but their journal records are held here: the encoded
+   ops already carry the before-image of every field they touch, so
+   discarding applies them in reverse and committing hands them to the
+   journal. Both cost O(changes), never a copy of the stores. */
+typedef struct {
+    int active;
+    unsigned char *buf;   /* [u8 forward][u32 len][op bytes] per record */
+    size_t used;
+    size_t bufcap;
+    size_t *offs;
+    size_t count;
+    size_t cap;
+    size_t log_count;     /* undo log position when the session began */
+    size_t log_used;
+    uint64_t log_trims;
+} Sandbox;
+
+typedef struct {
+    uint64_t replica;
+    uint64_t seq;
+} ClockEntry;
+
+typedef struct {
+    ClockEntry e[MAX_REPLICAS];
+    size_t n;
+} VClock;
+
+typedef struct {
+    uint64_t id;
+    VClock clock; /* its clock as of the last exchange */
+} SyncPeer;
+
+/* A transaction created at another replica, or a category (both ids
+   negated, so the two never collide) */
+typedef struct {
+    int local_id;
+    int origin_id;
+    uint64_t origin;
+} IdMapEntry;
+
+/* Last writer of one transaction field (a = id, b = field bit), of
+   one budget (a = -category id, b = YYYYMM) or of a category's name
+   (a = -category id, b = 0) */
+typedef struct {
+    int a;
+    int b;
+    int64_t ts;
+    uint64_t replica;
+} Stamp;
+
+/* Sync state of the active ledger, loaded for each exchange */
+typedef struct {
+    uint64_t self;
+    uint64_t stamped;   /* local records up to this seq are in stamps */
+    VClock clock;
+    SyncPeer peers[MAX_REPLICAS];
+    size_t npeers;
+    IdMapEntry *map;
+    size_t nmap;
+    size_t mapcap;
+    size_t *map_slots;  /* by (origin, origin_id): index + 1, 0 = empty */
+    size_t map_nslots;
+    IdIndex map_local;  /* local id -> map entry */
+    Stamp *stamps;
+    size_t nstamps;
+    size_t stampcap;
+    size_t *stamp_slots;
+    size_t stamp_nslots;
+} SyncState;
+
+enum { BACKUP_FULL = 1, BACKUP_INCR, BACKUP_DIFF };
+
+typedef struct {
+    char kind[8];         /* "full", "incr" or "diff" */
+    int id;
+    int parent;           /* entry this one applies on top of, 0 for full */
+    uint64_t from;        /* journal seq the entry starts after */
+    uint64_t to;          /* ledger generation it brings the chain to */
+    uint64_t journal_end; /* journal offset just past seq to */
+    uint32_t check;       /* FNV-1a of the file */
+    char file[64];
+} BackupEntry;
+
+/* A decompressed segment kept for reuse */
+typedef struct {
+    char path[PATH_LEN + 64];
+    Transaction *rows;
+    size_t count;
+    uint64_t used; /* tick of the last use, for LRU eviction */
+} ArchiveCacheEntry;
+
+/* Walks the active ledger's transactions, then an optional array of
+   extra rows (e.g. archived ones). With a tree only rows dated in the
+   requested range are visited; otherwise callers filter. */
+typedef struct {
+    size_t i;
+    int started;
+    BtCursor cur;
+    const Transaction *extra;
+    size_t nextra;
+    size_t j;
+    int in_extra; /* the last row came from extra */
+    Transaction row;
+    size_t seen;  /* rows returned, counted into metrics at the end */
+} TxnIter;
+
+/* Latencies of one operation; buckets are not cumulative until output */
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t bucket[METRICS_BUCKETS + 1]; /* the last is +Inf */
+} Histogram;
+
+typedef struct {
+    Histogram op[MOP_COUNT];
+    _Atomic uint64_t rows_ingested, rows_duplicate, rows_invalid, rows_scanned;
+    _Atomic uint64_t queued, applied;
+    _Atomic uint64_t journal_writes, journal_bytes, checkpoints;
+    _Atomic uint64_t arch_hits, arch_misses, bt_hits, bt_misses;
+    /* gauges published by the writer */
+    _Atomic uint64_t journal_size, generation, transactions, since_ckpt, ckpt_due;
+    _Atomic uint64_t mem[MEM_COUNT];
+} Metrics;
+
+/* Counts by 64-bit key (row fingerprints, note hashes); 0 is no key */
+typedef struct {
+    uint64_t key;
+    uint32_t a;
+    uint32_t b;
+} FpCount;
+
+typedef struct {
+    FpCount *slots;
+    size_t cap;
+    size_t used;
+} FpMap;
+
+/* One daemon connection or watched file; the fields after sent belong
+   to the writer thread */
+typedef struct {
+    _Atomic uint64_t committed; /* rows applied and journaled, or given up on */
+    _Atomic uint64_t failed;    /* of them, rows the journal could not take */
+    uint64_t sent;              /* rows queued */
+    int dedup;                  /* skip rows the ledger already has */
+    uint64_t dups;              /* rows skipped as duplicates */
+    FpMap seen;                 /* by fingerprint: a = rows so far, b = of them added */
+} IngestClient;
+
+/* A parsed row on its way to the writer; its id is already reserved */
+typedef struct IngestItem {
+    struct IngestItem *_Atomic next;
+    IngestClient *client;
+    Transaction t;
+    char category[64];
+} IngestItem;
+
+/* Bump allocator: nothing is freed on its own, arena_free() drops
+   every block at once */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t cap;
+    unsigned char *data;
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head; /* the block being filled */
+} Arena;
+
+/* Valid rows of one staged block, in file order */
+typedef struct StageChunk {
+    struct StageChunk *next;
+    Transaction *rows;
+    size_t n;
+} StageChunk;
+
+typedef struct StageCat {
+    struct StageCat *next;
+    char name[64];
+    int id;        /* id to restore (keep_ids), 0 for the next one */
+} StageCat;
+
+/* A budget to set on commit; category_id as for staged rows */
+typedef struct StageBudget {
+    struct StageBudget *next;
+    BudgetEntry b;
+} StageBudget;
+
+/* An import prepared off to the side: rows are validated, categorized
+   and deduplicated into an arena and reach the ledger only on commit.
+   Rows of categories still to be created carry -(k + 1), k being the
+   category's place in newcats. A stage can be committed several times
+   (a long import, segment by segment); counts add up over all of them. */
+typedef struct {
+    Arena arena;   /* rows not committed yet */
+    StageChunk *first, *last;
+    StageBudget *budgets, *lastbudget;
+    size_t nbudgets;
+    StageCat *newcats, *lastcat;
+    size_t nnew;
+    size_t rows;   /* to be added */
+    size_t dups;   /* already in the ledger */
+    size_t bad;    /* lines that failed validation */
+    int learned;   /* ledger is built */
+    FpMap ledger;  /* by row fingerprint: a = rows in the ledger, b = copies met in the file */
+    uint64_t *dupfp; /* fingerprints of the duplicates since the last commit */
+    size_t ndupfp, dupfpcap;
+    size_t skip;   /* leading rows an interrupted run already added */
+    int skip_id;   /* id the first of them got */
+    int keep_ids;  /* rows and categories keep the ids the file gives them */
+    IdIndex staged;   /* keep_ids: ids staged since the last commit */
+    size_t orphans;   /* keep_ids: rows whose id is missing or taken, added last */
+    size_t claim_skip; /* keep_ids: rows still to stage that hold their id already */
+} ImportStage;
+
+/* Where a long import stopped, saved after each committed segment as
+   IMPORT_CKPT_FILE in the ledger's directory. The duplicates it skipped
+   so far are the first ndupfp fingerprints in IMPORT_DUPS_FILE. */
+typedef struct {
+    char magic[4];
+    char path[256];    /* as typed */
+    uint64_t offset;   /* bytes of the file imported */
+    int lineno;        /* lines of the file imported */
+    uint32_t head;     /* fnv32 of the first IMPORT_ID_BYTES bytes ... */
+    uint32_t tail;     /* ... and of the last before offset */
+    int first_id;      /* id of the import's first row */
+    int next_id;       /* ids [first_id, next_id) are its rows, or with
+                          keep_ids every row in the ledger */
+    int keep_ids;      /* restoring into an empty ledger, see ImportStage */
+    uint64_t rows;
+    uint64_t dups;
+    uint64_t ndupfp;
+    char currency[CUR_LEN]; /* reader state, see ImportSource */
+    char account[ACCT_LEN];
+    int section;
+} ImportCkpt;
+
+/* Fields a CSV column can hold, and the orders a date can be written in */
+enum { CSV_DATE, CSV_TYPE, CSV_AMOUNT, CSV_CATEGORY, CSV_NOTE, CSV_PAYEE, CSV_CURRENCY, CSV_DEBIT, CSV_CREDIT,
+       CSV_FIELDS };
+enum { DATE_YMD, DATE_DMY, DATE_MDY, DATE_GUESS };
+
+/* How a CSV file is written, worked out by csv_sniff() from its header
+   and first lines */
+typedef struct {
+    char delim;
+    char quote;          /* '"', or 0 when no field is quoted */
+    char decimal;        /* '.' or ',' */
+    int date_order;      /* DATE_YMD, DATE_DMY or DATE_MDY */
+    int col[CSV_FIELDS]; /* column of each field, -1 for none */
+    int ncols;
+    int rest;            /* the last column is a note and takes the rest of the line */
+    int native;          /* date,type,amount,category,note as csv_parse_row() reads it */
+} CsvDialect;
+
 /* Global in-memory stores */
 static TxnStore txns = {NULL,0,0,1};
 static CatStore cats = {NULL,0,0,1};
 static BudgetStore budgets = {NULL,0,0};
+static RateStore rates = {NULL,0,0,NULL};
+
+/* Derived structures for the active ledger */
+static IdIndex txn_index = {NULL,NULL,0,0,NULL,0};
+static TxnTree *txn_tree = NULL; /* active ledger's on-disk backend, if any */
+static Cube month_cube;
+static int month_cube_valid = 0;
+static OpLog oplog;
+static int journal_fd = -1; /* active ledger's journal, O_APPEND */
+static unsigned char *journal_buf = NULL; /* whole records not yet written */
+static size_t journal_buflen = 0, journal_bufcap = 0;
+static uint64_t journal_pending = 0; /* records in journal_buf */
+static int journal_atomic = 0;       /* between journal_atomic_begin() and _end() */
+static size_t journal_atomic_last = SIZE_MAX; /* its newest record in journal_buf, held back */
+static uint64_t journal_since_ckpt = 0;
+static int journal_unsynced = 0;        /* written since the last fdatasync() */
+static uint64_t journal_synced_at = 0;  /* now_ns() of the last one */
+static int journal_group_commit = 0;    /* the daemon writer syncs at group commits */
+static uint64_t journal_ckpt_rows = 0; /* transactions in the last checkpoint */
+static Sandbox sandbox;
+static SyncState sync_state;
+static uint64_t journal_origin = 0;     /* set while applying another replica's records */
+static uint64_t journal_origin_seq = 0;
+static ArchiveCacheEntry arch_cache[ARCHIVE_CACHE_SEGS];
+static uint64_t arch_tick = 0;
+static pthread_mutex_t arch_lock = PTHREAD_MUTEX_INITIALIZER; /* combined reports read from threads */
+
+static Ledger ledgers[MAX_LEDGERS];
+static size_t nledgers = 0;
+static size_t active_ledger = 0;
+
+/* Background preload: load_all() hands the active ledger to a
+   low-priority task and returns, so the menu is up at once. The loader reports each phase it
+   completes; preload_wait() blocks an action only until the phase it
+   needs and moves the results into the working stores. */
+enum { PRELOAD_NONE, PRELOAD_CATS, PRELOAD_ACTIVE, PRELOAD_ALL };
+static pthread_mutex_t preload_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t preload_cond = PTHREAD_COND_INITIALIZER;
+static int preload_ready = PRELOAD_ALL; /* phase the loader has completed */
+static int preload_phase = PRELOAD_ALL; /* phase taken over by the menu (main thread only) */
+static TaskGroup preload_group;
+
+/* Task scheduler, started on first use: deque [i][prio] of worker i,
+   the last row is the inject queue */
+static TaskDeque sched_deques[SCHED_MAX_THREADS + 1][PRIO_COUNT];
+static int sched_nthreads = 0;
+static _Thread_local int sched_self = -1; /* worker index, -1 off the pool */
+static _Atomic size_t sched_queued = 0;
+static _Atomic int sched_idle = 0; /* workers asleep on sched_cond */
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t sched_once = PTHREAD_ONCE_INIT;
+
+static int reader_mode = 0; /* --read-only: ledgers are mapped, never written */
+
+/* Ingestion queue (daemon mode): producers push at the head, the writer
+   pops at the tail; the stub keeps it from ever being empty of nodes */
+static IngestItem ingest_stub;
+static IngestItem *_Atomic ingest_head = &ingest_stub;
+static IngestItem *ingest_tail = &ingest_stub; /* writer only */
+static _Atomic int ingest_waiting = 0;         /* the writer is asleep */
+static pthread_mutex_t ingest_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ingest_cond = PTHREAD_COND_INITIALIZER; /* rows arrived */
+static pthread_cond_t ingest_done = PTHREAD_COND_INITIALIZER; /* a batch was committed */
+static volatile sig_atomic_t daemon_stop = 0;
+static IngestClient **ingest_unacked = NULL; /* writer only: client of each row written, not yet answered */
+static size_t ingest_nunacked = 0, ingest_unackedcap = 0;
+static uint64_t ingest_group_start = 0;      /* now_ns() when the oldest of them was taken */
+static Metrics metrics;
+static FpMap ingest_rows;  /* by row fingerprint: a = rows in the ledger */
+static FpMap ingest_notes; /* by note_key(): a = category id last used */
+static int ingest_known = 0; /* both are built */
+
+/* Watch folder: names of files that landed, for the watch tasks */
+typedef struct WatchFile {
+    struct WatchFile *next;
+    char name[256];
+} WatchFile;
+static WatchFile *watch_head = NULL, *watch_tail = NULL;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static int watch_active = 0; /* watch tasks running or queued */
+static int watch_fd = -1;    /* inotify, non-blocking; read by watch_poll() */
+static TaskGroup watch_group;
+
+/* Settings persisted in CONF_FILE */
+static char base_currency[CUR_LEN] = DEFAULT_CURRENCY;
+static int archive_years = 0; /* default age for archive now; 0 = none */
+static char watch_dir[PATH_LEN] = ""; /* daemon watch folder, "" = none */
+static int metrics_port = 0;          /* daemon metrics over HTTP, 0 = off */
+static int sched_threads = 0;         /* threads for parallel work, 0 = one per CPU */
+static int durability = DURABLE_GROUPED;
+static int commit_window_ms = 0;      /* grouped: longest a group stays open */
 
 /* Simple XOR obfuscation for file content (optional) */
 static int obfuscate_enabled = 0;
@@ -75,19 +925,159 @@ static unsigned char obf_key = 0;
 /* Utility forward declarations */
 void panic(const char *msg);
 void *xmalloc(size_t s);
+void *arena_alloc(Arena *a, size_t n);
+void arena_free(Arena *a);
 void ensure_txn_capacity();
 void ensure_cat_capacity();
 void ensure_budget_capacity();
+void ensure_rate_capacity();
 int find_category_by_id(int id);
 int find_category_index_by_id(int id);
 int next_int_id_from_store();
 
+/* Task scheduler */
+void task_group_init(TaskGroup *g, int prio);
+void task_spawn(TaskGroup *g, void (*fn)(void *), void *arg);
+void task_wait(TaskGroup *g);
+void task_group_destroy(TaskGroup *g);
+size_t parallel_chunks(size_t n, size_t min_grain);
+void parallel_for(size_t n, size_t min_grain, int prio, void (*fn)(void *ctx, size_t chunk, size_t lo, size_t hi),
+                  void *ctx);
+
+/* Parallel file I/O */
+void io_batch_init(IoBatch *b);
+int io_open(IoBatch *b, const char *path);
+int io_create(IoBatch *b, const char *path, int atomic, int sync);
+void io_read(IoBatch *b, int fd, void *buf, size_t len, off_t off, int xor);
+void io_write(IoBatch *b, int fd, const void *buf, size_t len, off_t off, int xor);
+void io_write_copy(IoBatch *b, int fd, const void *buf, size_t len, off_t off);
+int io_wait(IoBatch *b);
+
 /* Persistence */
 void load_all();
 void save_all();
-void save_binary_file(const char *path, void *buf, size_t count, size_t sz);
+void save_binary_file(const char *path, void *buf, size_t count, size_t sz, uint64_t generation, uint32_t next_id);
 size_t load_binary_file(const char *path, void *buf, size_t max_count, size_t sz);
 void obfuscate_buffer(unsigned char *buf, size_t len);
+void load_config();
+void save_config();
+void load_ledger(Ledger *L);
+void load_ledger_meta(Ledger *L);
+void load_ledger_rows(Ledger *L);
+void save_ledger(const Ledger *L);
+void save_ledger_submit(const Ledger *L, IoBatch *b);
+void save_binary_submit(IoBatch *b, const char *path, const void *buf, size_t count, size_t sz, uint64_t generation,
+                        uint32_t next_id);
+
+/* On-disk B+tree */
+int tt_open(TxnTree *tt, const char *dir, int create);
+void tt_close(TxnTree *tt);
+void tt_put(TxnTree *tt, const Transaction *t);
+int tt_del(TxnTree *tt, int id);
+int tt_get(TxnTree *tt, int id, Transaction *out);
+int tt_flush(TxnTree *tt, uint64_t generation, int next_id);
+int tt_rebuild(Ledger *L);
+void txn_iter_open(TxnIter *it, const char *from, const char *to, const Transaction *extra, size_t nextra);
+const Transaction *txn_iter_next(TxnIter *it);
+size_t txn_count();
+int ledger_use_tree(int on);
+
+/* Ledgers */
+void ledger_scan();
+int ledger_find(const char *name);
+int ledger_create(const char *name);
+void ledger_activate(size_t idx);
+void ledger_stash_active();
+void ledger_mount_all();
+void preload_start();
+void preload_wait(int phase);
+void cube_build(Cube *c, const Ledger *L, int from_month, int to_month);
+void cube_merge(Cube *dst, const Cube *src);
+void cube_free(Cube *c);
+void combined_report(int year, int month);
+void ledger_menu();
+
+/* Indexes, aggregates and logged store operations */
+void index_rebuild();
+long index_get(int id);
+Cube *month_aggregates();
+void aggregates_invalidate();
+uint32_t rates_fingerprint();
+void derived_submit(const Ledger *L, IoBatch *b);
+void derived_load(Ledger *L);
+void txn_insert(const Transaction *t);
+void txn_insert_batch(Transaction *rows, size_t n);
+void txn_update(size_t idx, const Transaction *nt);
+void txn_delete(size_t idx);
+int cat_insert(const char *name);
+int cat_insert_as(const char *name, int id);
+void cat_rename(size_t idx, const char *name);
+void cat_delete(size_t idx);
+void budget_put(int cid, int year, int month, double amount);
+void oplog_begin();
+void oplog_end();
+void oplog_clear();
+int undo(int steps);
+int redo(int steps);
+void undo_menu(int redo_mode);
+
+/* Journal, checkpoints and time travel */
+void journal_append(const unsigned char *op, size_t len, int forward);
+int journal_flush();
+int journal_sync();
+int journal_commit();
+void journal_atomic_begin();
+void journal_atomic_end();
+void journal_open_active();
+void journal_close();
+size_t journal_replay(Ledger *L, uint64_t off);
+void journal_recover(Ledger *L);
+int journal_has_tail(const char *dir, uint64_t generation);
+int checkpoint_active();
+int asof_build(const Ledger *L, time_t when, TxnStore *ts, CatStore *cs, BudgetStore *bs, size_t *replayed);
+void time_travel_menu();
+
+/* Shared read-only snapshots */
+int writer_lock();
+int snapshot_map(Ledger *L);
+void snapshot_privatize(Ledger *L);
+void reader_load(Ledger *L);
+int snapshot_refresh();
+int ledger_has_readers(const Ledger *L);
+
+/* What-if sandbox */
+void sandbox_begin();
+void sandbox_commit();
+void sandbox_discard();
+void sandbox_menu();
+
+/* Replica sync */
+int sync_export(const char *path, uint64_t peer);
+int sync_import(const char *path);
+int sync_serve(const char *sock_path);
+int sync_connect(const char *sock_path);
+void sync_menu();
+
+/* Backups */
+int backup_ledger(const char *dir, int kind);
+int restore_backup(const char *dir, int entry, const char *ledger_name);
+void backup_menu();
+
+/* Cold-month archive */
+void archive_load(Ledger *L);
+int archive_cold(int years);
+int archive_thaw(int id);
+void archive_recover(Ledger *L);
+int archive_find(const Ledger *L, int id, Transaction *out);
+void archive_fold(Cube *agg, int month);
+void archive_accumulate(Cube *c, const Ledger *L, int from_month, int to_month);
+Transaction *archive_select(const char *from, const char *to, double minamt, double maxamt, const char *cname,
+                            size_t *count);
+int archive_uses_category(int cid);
+size_t archive_row_count(const Ledger *L);
+int archive_copy(const char *src_dir, const char *dst_dir);
+int archive_copy_file(const char *from, const char *to);
+void archive_menu();
 
 /* CRUD */
 void add_category();
@@ -108,12 +1098,34 @@ double total_for_category_month(int cat_id, int year, int month);
 void monthly_summary(int year, int month);
 void category_summary(int year, int month);
 void budget_report(int year, int month);
+void report_missing_rates(size_t missing);
+
+/* Currencies and FX rates */
+int normalize_currency(char *code);
+void set_fx_rate(const char *currency, const char *date, double rate);
+void list_fx_rates();
+void fx_rebuild_keys();
+double fx_rate_asof(const char *currency, int key);
+int fx_rebase(const char *code);
+size_t fx_convert_column(const Transaction *rows, size_t n, double *out, unsigned char *miss);
+void currency_menu();
 
 /* Utilities: parse/format date, CSV import/export, search */
 int parse_date(const char *s, struct tm *out);
 int compare_dates(const char *a, const char *b); /* lexicographic works for YYYY-MM-DD */
+int date_key(const char *s); /* YYYYMMDD as an int */
 void export_csv(const char *path);
-void import_csv(const char *path);
+void import_file(const char *path, int dry_run);
+void stage_add(ImportStage *s, const Transaction *rows, char (*category)[64], size_t n);
+void stage_budget(ImportStage *s, const char *category, int year, int month, double amount);
+void stage_report(const ImportStage *s);
+int stage_commit(ImportStage *s);
+void stage_free(ImportStage *s);
+int csv_parse_row(char *line, Transaction *t, char *category, size_t catsz);
+int csv_split(char *line, const CsvDialect *d, char **f, int max);
+int csv_parse_dialect(char *line, const CsvDialect *d, Transaction *t, char *category, size_t catsz);
+int jsonl_parse_row(char *line, Transaction *t, char *category, size_t catsz);
+void export_jsonl(const char *path);
 void search_transactions();
 void prompt_press_enter();
 void clear_input();
@@ -122,16 +1134,35 @@ int read_int();
 double read_double();
 void read_line(char *buf, size_t sz);
 
+/* Daemon mode */
+void ingest_submit(IngestClient *c, const Transaction *t, const char *category);
+void ingest_wait(IngestClient *c);
+int daemon_run();
+
 /* Simple interactive menu */
 void interactive_menu();
 
-int main(void) {
+int main(int argc, char **argv) {
+    reader_mode = argc > 1 && strcmp(argv[1], "--read-only") == 0;
+    int daemon = argc > 1 && strcmp(argv[1], "--daemon") == 0;
     printf("Personal Finance Manager (C) — Advanced\n");
     printf("Note: This program stores data in current directory.\n");
     printf("Optional file obfuscation (XOR) is available from menu.\n\n");
+    if (daemon) {
+        if (!writer_lock()) return EXIT_FAILURE;
+        load_all();
+        preload_wait(PRELOAD_ALL);
+        int rc = daemon_run();
+        save_all();
+        journal_close();
+        return rc ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (!reader_mode && !writer_lock()) reader_mode = 1;
+    if (reader_mode) printf("Read-only: nothing is changed; changes made by another copy show up as they are made.\n\n");
     load_all();
     interactive_menu();
     save_all();
+    journal_close();
     printf("Goodbye.\n");
     return 0;
 }
@@ -149,6 +1180,66 @@ void *xmalloc(size_t s) {
     return p;
 }
 
+#define ARENA_BLOCK (1024 * 1024)
+
+void *arena_alloc(Arena *a, size_t n) {
+    const size_t align = _Alignof(max_align_t);
+    n = (n + align - 1) & ~(align - 1);
+    ArenaBlock *b = a->head;
+    if (!b || b->cap - b->used < n) {
+        size_t cap = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+        b = xmalloc(sizeof(ArenaBlock));
+        b->data = xmalloc(cap);
+        b->used = 0;
+        b->cap = cap;
+        b->next = a->head;
+        a->head = b;
+    }
+    void *p = b->data + b->used;
+    b->used += n;
+    return p;
+}
+
+void arena_free(Arena *a) {
+    while (a->head) {
+        ArenaBlock *b = a->head;
+        a->head = b->next;
+        free(b->data);
+        free(b);
+    }
+}
+
+/* -- metrics (see Metrics) -- */
+
+static void metric_add(_Atomic uint64_t *c, uint64_t n) {
+    atomic_fetch_add_explicit(c, n, memory_order_relaxed);
+}
+
+static void metric_set(_Atomic uint64_t *g, uint64_t v) {
+    atomic_store_explicit(g, v, memory_order_relaxed);
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Upper bounds of the latency buckets, in seconds */
+static const double metric_bounds[METRICS_BUCKETS] = {0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005,
+                                                       0.01, 0.05, 0.1, 0.5, 1, 5};
+
+/* Record one op that started at start (from now_ns()) */
+static void metric_observe(int op, uint64_t start) {
+    uint64_t ns = now_ns() - start;
+    Histogram *h = &metrics.op[op];
+    size_t b = 0;
+    while (b < METRICS_BUCKETS && (double)ns > metric_bounds[b] * 1e9) b++;
+    metric_add(&h->bucket[b], 1);
+    metric_add(&h->sum_ns, ns);
+    metric_add(&h->count, 1);
+}
+
 void ensure_txn_capacity() {
     if (txns.size + 1 > txns.cap) {
         txns.cap = (txns.cap == 0) ? 16 : txns.cap * 2;
@@ -170,6 +1261,13 @@ void ensure_budget_capacity() {
         if (!budgets.data) panic("realloc budgets");
     }
 }
+void ensure_rate_capacity() {
+    if (rates.size + 1 > rates.cap) {
+        rates.cap = (rates.cap == 0) ? 8 : rates.cap * 2;
+        rates.data = realloc(rates.data, rates.cap * sizeof(FxRate));
+        if (!rates.data) panic("realloc rates");
+    }
+}
 
 int find_category_by_id(int id) {
     for (size_t i = 0; i < cats.size; ++i) {
@@ -184,485 +1282,8783 @@ int find_category_index_by_id(int id) {
     return -1;
 }
 
-/* -------------------- Persistence -------------------- */
+/* -------------------- Task scheduler -------------------- */
 
-void obfuscate_buffer(unsigned char *buf, size_t len) {
-    if (!obfuscate_enabled || obf_key == 0) return;
-    for (size_t i = 0; i < len; ++i) buf[i] ^= obf_key;
+static void deque_push(TaskDeque *d, Task *t) {
+    pthread_mutex_lock(&d->lock);
+    if (d->count == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 64;
+        Task **buf = xmalloc(cap * sizeof(Task *));
+        for (size_t i = 0; i < d->count; ++i) buf[i] = d->buf[(d->head + i) % d->cap];
+        free(d->buf);
+        d->buf = buf;
+        d->head = 0;
+        d->cap = cap;
+    }
+    d->buf[(d->head + d->count++) % d->cap] = t;
+    pthread_mutex_unlock(&d->lock);
 }
 
-void save_binary_file(const char *path, void *buf, size_t count, size_t sz) {
-    FILE *f = fopen(path, "wb");
-    if (!f) {
-        fprintf(stderr, "Warning: unable to save %s\n", path);
-        return;
+/* Newest task (the owner's end) or, when steal is set, the oldest */
+static Task *deque_take(TaskDeque *d, int steal) {
+    Task *t = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->count) {
+        if (steal) {
+            t = d->buf[d->head];
+            d->head = (d->head + 1) % d->cap;
+        } else {
+            t = d->buf[(d->head + d->count - 1) % d->cap];
+        }
+        d->count--;
     }
-    size_t bytes = count * sz;
-    unsigned char *tmp = xmalloc(bytes);
-    memcpy(tmp, buf, bytes);
-    obfuscate_buffer(tmp, bytes);
-    fwrite(tmp, 1, bytes, f);
-    free(tmp);
-    fclose(f);
+    pthread_mutex_unlock(&d->lock);
+    return t;
 }
 
-size_t load_binary_file(const char *path, void *buf, size_t max_count, size_t sz) {
-    FILE *f = fopen(path, "rb");
-    if (!f) return 0;
-    fseek(f, 0, SEEK_END);
-    long filesize = ftell(f);
-    if (filesize <= 0) { fclose(f); return 0; }
-    fseek(f, 0, SEEK_SET);
-    size_t bytes = (size_t)filesize;
-    unsigned char *tmp = xmalloc(bytes);
-    size_t got = fread(tmp, 1, bytes, f);
-    fclose(f);
-    obfuscate_buffer(tmp, got);
-    size_t count = got / sz;
-    if (count > max_count) count = max_count;
-    memcpy(buf, tmp, count * sz);
-    free(tmp);
-    return count;
+/* A queued task of priority prio or more urgent: from our own deque,
+   then the inject queue, then stolen from the other workers */
+static Task *sched_find(int prio) {
+    if (!atomic_load(&sched_queued)) return NULL;
+    for (int p = 0; p <= prio; ++p) {
+        Task *t = NULL;
+        if (sched_self >= 0) t = deque_take(&sched_deques[sched_self][p], 0);
+        if (!t) t = deque_take(&sched_deques[SCHED_MAX_THREADS][p], 1);
+        for (int k = 1; !t && k <= sched_nthreads; ++k) {
+            int victim = (sched_self + k) % sched_nthreads;
+            if (victim != sched_self) t = deque_take(&sched_deques[victim][p], 1);
+        }
+        if (t) {
+            atomic_fetch_sub(&sched_queued, 1);
+            return t;
+        }
+    }
+    return NULL;
 }
 
-void load_all() {
-    /* load categories */
-    Category catbuf[1024];
-    size_t count = load_binary_file(CAT_FILE, catbuf, 1024, sizeof(Category));
-    if (count) {
-        cats.data = malloc(count * sizeof(Category));
-        memcpy(cats.data, catbuf, count * sizeof(Category));
-        cats.size = count;
-        cats.cap = count;
-        /* find next id */
-        int maxid = 0;
-        for (size_t i = 0; i < cats.size; ++i) if (cats.data[i].id > maxid) maxid = cats.data[i].id;
-        cats.next_id = maxid + 1;
-    }
-
-    /* load transactions (we allow many) */
-    /* Load iteratively */
-    FILE *ft = fopen(TRAN_FILE, "rb");
-    if (ft) {
-        fseek(ft, 0, SEEK_END);
-        long filesize = ftell(ft);
-        fseek(ft, 0, SEEK_SET);
-        if (filesize > 0) {
-            unsigned char *tmp = xmalloc((size_t)filesize);
-            fread(tmp, 1, (size_t)filesize, ft);
-            fclose(ft);
-            obfuscate_buffer(tmp, (size_t)filesize);
-            size_t countt = (size_t)filesize / sizeof(Transaction);
-            txns.data = malloc(countt * sizeof(Transaction));
-            memcpy(txns.data, tmp, countt * sizeof(Transaction));
-            txns.size = countt;
-            txns.cap = countt;
-            free(tmp);
-            int maxid = 0;
-            for (size_t i = 0; i < txns.size; ++i) if (txns.data[i].id > maxid) maxid = txns.data[i].id;
-            txns.next_id = maxid + 1;
-        } else fclose(ft);
-    }
+static void task_run(Task *t) {
+    TaskGroup *g = t->group;
+    t->fn(t->arg);
+    free(t);
+    pthread_mutex_lock(&g->lock);
+    if (--g->pending == 0) pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->lock);
+}
 
-    /* load budgets */
-    BudgetEntry bbuf[1024];
-    size_t bc = load_binary_file(BUD_FILE, bbuf, 1024, sizeof(BudgetEntry));
-    if (bc) {
-        budgets.data = malloc(bc * sizeof(BudgetEntry));
-        memcpy(budgets.data, bbuf, bc * sizeof(BudgetEntry));
-        budgets.size = bc;
-        budgets.cap = bc;
+static void *sched_worker(void *arg) {
+    sched_self = (int)(intptr_t)arg;
+    for (;;) {
+        Task *t = sched_find(PRIO_COUNT - 1);
+        if (t) {
+            task_run(t);
+            continue;
+        }
+        pthread_mutex_lock(&sched_lock);
+        atomic_fetch_add(&sched_idle, 1);
+        while (!atomic_load(&sched_queued)) pthread_cond_wait(&sched_cond, &sched_lock);
+        atomic_fetch_sub(&sched_idle, 1);
+        pthread_mutex_unlock(&sched_lock);
     }
+    return NULL;
 }
 
-void save_all() {
-    if (cats.size) save_binary_file(CAT_FILE, cats.data, cats.size, sizeof(Category));
-    if (txns.size) save_binary_file(TRAN_FILE, txns.data, txns.size, sizeof(Transaction));
-    if (budgets.size) save_binary_file(BUD_FILE, budgets.data, budgets.size, sizeof(BudgetEntry));
+/* One worker per CPU (or the workers setting) besides the submitting
+   thread, which helps while it waits; none on a single CPU */
+static void sched_start() {
+    long n = sched_threads ? sched_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > SCHED_MAX_THREADS + 1) n = SCHED_MAX_THREADS + 1;
+    for (int i = 0; i <= SCHED_MAX_THREADS; ++i)
+        for (int p = 0; p < PRIO_COUNT; ++p) pthread_mutex_init(&sched_deques[i][p].lock, NULL);
+    for (long i = 0; i + 1 < n; ++i) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, sched_worker, (void *)(intptr_t)sched_nthreads) != 0) break;
+        pthread_detach(tid);
+        sched_nthreads++;
+    }
 }
 
-/* -------------------- CRUD Category -------------------- */
+void task_group_init(TaskGroup *g, int prio) {
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->cond, NULL);
+    g->pending = 0;
+    g->prio = prio;
+}
 
-void add_category() {
-    char name[64];
-    printf("Category name: ");
-    read_line(name, sizeof(name));
-    if (strlen(name) == 0) { printf("Empty name aborted.\n"); return; }
-    ensure_cat_capacity();
-    Category c;
-    c.id = cats.next_id++;
-    strncpy(c.name, name, sizeof(c.name)-1);
-    c.name[sizeof(c.name)-1] = '\0';
-    cats.data[cats.size++] = c;
-    printf("Added category '%s' (id=%d).\n", c.name, c.id);
+/* Queue fn(arg) on g; without workers it runs right here */
+void task_spawn(TaskGroup *g, void (*fn)(void *), void *arg) {
+    pthread_once(&sched_once, sched_start);
+    Task *t = xmalloc(sizeof(Task));
+    t->fn = fn;
+    t->arg = arg;
+    t->group = g;
+    pthread_mutex_lock(&g->lock);
+    g->pending++;
+    pthread_mutex_unlock(&g->lock);
+    if (!sched_nthreads) {
+        task_run(t);
+        return;
+    }
+    deque_push(&sched_deques[sched_self >= 0 ? sched_self : SCHED_MAX_THREADS][g->prio], t);
+    atomic_fetch_add(&sched_queued, 1);
+    if (atomic_load(&sched_idle)) {
+        pthread_mutex_lock(&sched_lock);
+        pthread_cond_signal(&sched_cond);
+        pthread_mutex_unlock(&sched_lock);
+    }
 }
 
-void list_categories() {
-    printf("Categories:\n");
-    if (cats.size == 0) { printf(" (none)\n"); return; }
-    for (size_t i = 0; i < cats.size; ++i) {
-        printf("  id=%d  %s\n", cats.data[i].id, cats.data[i].name);
+/* Wait for everything spawned on g, running queued tasks no less urgent
+   than g's meanwhile; g can then be reused or destroyed */
+void task_wait(TaskGroup *g) {
+    for (;;) {
+        pthread_mutex_lock(&g->lock);
+        size_t pending = g->pending;
+        pthread_mutex_unlock(&g->lock);
+        if (!pending) break;
+        Task *t = sched_find(g->prio);
+        if (t) {
+            task_run(t);
+            continue;
+        }
+        pthread_mutex_lock(&g->lock);
+        if (g->pending) pthread_cond_wait(&g->cond, &g->lock);
+        pthread_mutex_unlock(&g->lock);
     }
 }
 
-void edit_category() {
-    list_categories();
-    printf("Enter category id to edit: ");
-    int id = read_int();
-    int idx = find_category_index_by_id(id);
-    if (idx < 0) { printf("Not found.\n"); return; }
-    printf("New name (enter for keep '%s'): ", cats.data[idx].name);
-    char buf[64];
-    read_line(buf, sizeof(buf));
-    if (strlen(buf)) strncpy(cats.data[idx].name, buf, sizeof(cats.data[idx].name)-1);
-    printf("Updated.\n");
+void task_group_destroy(TaskGroup *g) {
+    pthread_mutex_destroy(&g->lock);
+    pthread_cond_destroy(&g->cond);
 }
 
-void remove_category() {
-    list_categories();
-    printf("Enter category id to remove: ");
-    int id = read_int();
-    int idx = find_category_index_by_id(id);
-    if (idx < 0) { printf("Not found.\n"); return; }
-    /* check transactions referencing it */
-    for (size_t i = 0; i < txns.size; ++i) {
-        if (txns.data[i].category_id == id) {
-            printf("Category used by transactions — cannot delete.\n");
+/* Rows per chunk of a loop over n rows: at least min_grain, and about
+   SCHED_CHUNKS chunks once n is large */
+static size_t sched_grain(size_t n, size_t min_grain) {
+    size_t g = n / SCHED_CHUNKS;
+    return g < min_grain ? min_grain : g;
+}
+
+size_t parallel_chunks(size_t n, size_t min_grain) {
+    size_t g = sched_grain(n, min_grain);
+    return (n + g - 1) / g;
+}
+
+typedef struct {
+    void (*fn)(void *ctx, size_t chunk, size_t lo, size_t hi);
+    void *ctx;
+    size_t chunk;
+    size_t lo;
+    size_t hi;
+} ForChunk;
+
+static void for_chunk_run(void *arg) {
+    ForChunk *c = arg;
+    c->fn(c->ctx, c->chunk, c->lo, c->hi);
+}
+
+/* Call fn once per chunk of [0, n) (see parallel_chunks()), in
+   parallel unless there is only one chunk or no worker */
+void parallel_for(size_t n, size_t min_grain, int prio, void (*fn)(void *ctx, size_t chunk, size_t lo, size_t hi),
+                  void *ctx) {
+    pthread_once(&sched_once, sched_start);
+    size_t g = sched_grain(n, min_grain), nchunks = parallel_chunks(n, min_grain);
+    if (nchunks <= 1 || !sched_nthreads) {
+        for (size_t c = 0; c < nchunks; ++c) fn(ctx, c, c * g, c + 1 < nchunks ? (c + 1) * g : n);
+        return;
+    }
+    ForChunk *chunks = xmalloc(nchunks * sizeof(ForChunk));
+    TaskGroup group;
+    task_group_init(&group, prio);
+    for (size_t c = 0; c < nchunks; ++c) {
+        chunks[c] = (ForChunk){fn, ctx, c, c * g, c + 1 < nchunks ? (c + 1) * g : n};
+        task_spawn(&group, for_chunk_run, &chunks[c]);
+    }
+    task_wait(&group);
+    task_group_destroy(&group);
+    free(chunks);
+}
+
+/* -------------------- Parallel file I/O -------------------- */
+
+static void io_run(void *arg) {
+    IoJob *j = arg;
+    int ok = 1;
+    unsigned char *src = j->buf, *scratch = NULL;
+    if (j->write && j->xor && obfuscate_enabled && obf_key) {
+        if (posix_memalign((void **)&scratch, IO_ALIGN, j->len) != 0) panic("memalign");
+        memcpy(scratch, j->buf, j->len);
+        obfuscate_buffer(scratch, j->len);
+        src = scratch;
+    }
+    for (size_t done = 0; ok && done < j->len;) {
+        ssize_t n = j->write ? pwrite(j->fd, src + done, j->len - done, j->off + (off_t)done)
+                             : pread(j->fd, j->buf + done, j->len - done, j->off + (off_t)done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) ok = 0;
+        else done += (size_t)n;
+    }
+    if (ok && !j->write && j->xor) obfuscate_buffer(j->buf, j->len);
+    free(scratch);
+    if (j->owned) free(j->buf);
+    IoBatch *b = j->b;
+    free(j);
+    if (!ok) {
+        pthread_mutex_lock(&b->lock);
+        b->failed = 1;
+        pthread_mutex_unlock(&b->lock);
+    }
+}
+
+/* Split [off, off + len) at IO_CHUNK boundaries (an owned copy stays
+   whole) and queue one task per piece */
+static void io_submit(IoBatch *b, int fd, int write, int xor, unsigned char *buf, size_t len, off_t off, int owned) {
+    size_t pos = 0;
+    do {
+        size_t n = owned ? len : IO_CHUNK - (size_t)((off + (off_t)pos) % IO_CHUNK);
+        if (n > len - pos) n = len - pos;
+        IoJob *j = xmalloc(sizeof(IoJob));
+        j->b = b;
+        j->fd = fd;
+        j->write = write;
+        j->xor = xor;
+        j->owned = owned;
+        j->buf = buf + pos;
+        j->len = n;
+        j->off = off + (off_t)pos;
+        task_spawn(&b->group, io_run, j);
+        pos += n;
+    } while (pos < len);
+}
+
+void io_batch_init(IoBatch *b) {
+    memset(b, 0, sizeof(*b));
+    pthread_mutex_init(&b->lock, NULL);
+    task_group_init(&b->group, PRIO_HIGH);
+}
+
+static IoFile *io_file_add(IoBatch *b, int fd) {
+    if (b->nfiles == b->filescap) {
+        b->filescap = b->filescap ? b->filescap * 2 : 8;
+        b->files = realloc(b->files, b->filescap * sizeof(IoFile));
+        if (!b->files) panic("realloc io files");
+    }
+    IoFile *f = &b->files[b->nfiles++];
+    memset(f, 0, sizeof(*f));
+    f->fd = fd;
+    return f;
+}
+
+/* Open path for reading; the batch closes it. -1 if missing. */
+int io_open(IoBatch *b, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) io_file_add(b, fd);
+    return fd;
+}
+
+/* Create path for writing; the batch closes it. An atomic file is
+   written as tmp-<name> and renamed over path once everything queued
+   on the batch succeeded. */
+int io_create(IoBatch *b, const char *path, int atomic, int sync) {
+    char tmp[PATH_LEN + 72] = "";
+    if (atomic) {
+        const char *slash = strrchr(path, '/');
+        size_t dirlen = slash ? (size_t)(slash - path) + 1 : 0;
+        snprintf(tmp, sizeof(tmp), "%.*stmp-%s", (int)dirlen, path, path + dirlen);
+    }
+    int fd = open(atomic ? tmp : path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        pthread_mutex_lock(&b->lock);
+        b->failed = 1;
+        pthread_mutex_unlock(&b->lock);
+        return -1;
+    }
+    IoFile *f = io_file_add(b, fd);
+    f->sync = sync;
+    snprintf(f->path, sizeof(f->path), "%s", path);
+    if (atomic) snprintf(f->tmp, sizeof(f->tmp), "%s", tmp);
+    return fd;
+}
+
+/* buf must stay untouched until the batch is waited for */
+void io_read(IoBatch *b, int fd, void *buf, size_t len, off_t off, int xor) {
+    if (len) io_submit(b, fd, 0, xor, buf, len, off, 0);
+}
+
+void io_write(IoBatch *b, int fd, const void *buf, size_t len, off_t off, int xor) {
+    if (len) io_submit(b, fd, 1, xor, (unsigned char *)buf, len, off, 0);
+}
+
+/* For small buffers (headers) that do not outlive the caller */
+void io_write_copy(IoBatch *b, int fd, const void *buf, size_t len, off_t off) {
+    if (!len) return;
+    unsigned char *copy = xmalloc(len);
+    memcpy(copy, buf, len);
+    io_submit(b, fd, 1, 0, copy, len, off, 1);
+}
+
+/* Wait for everything queued on b, then sync, close and rename its
+   files. Returns 0 if anything failed (atomic files are then dropped). */
+int io_wait(IoBatch *b) {
+    task_wait(&b->group);
+    for (size_t i = 0; i < b->nfiles; ++i) {
+        IoFile *f = &b->files[i];
+        if (f->sync && fsync(f->fd) != 0) b->failed = 1;
+        if (close(f->fd) != 0 && f->path[0]) b->failed = 1;
+    }
+    for (size_t i = 0; i < b->nfiles; ++i) {
+        IoFile *f = &b->files[i];
+        if (!f->tmp[0]) continue;
+        if (b->failed || rename(f->tmp, f->path) != 0) {
+            b->failed = 1;
+            remove(f->tmp);
+        }
+    }
+    int ok = !b->failed;
+    free(b->files);
+    pthread_mutex_destroy(&b->lock);
+    task_group_destroy(&b->group);
+    return ok;
+}
+
+/* -------------------- Persistence -------------------- */
+
+void obfuscate_buffer(unsigned char *buf, size_t len) {
+    if (!obfuscate_enabled || obf_key == 0) return;
+    for (size_t i = 0; i < len; ++i) buf[i] ^= obf_key;
+}
+
+/* Queue a data file's header and payload on b; buf must stay untouched
+   until b is waited for */
+void save_binary_submit(IoBatch *b, const char *path, const void *buf, size_t count, size_t sz, uint64_t generation,
+                        uint32_t next_id) {
+    int fd = io_create(b, path, 1, 1); /* renamed into place whole, for readers mapping it */
+    if (fd < 0) {
+        fprintf(stderr, "Warning: unable to save %s\n", path);
+        return;
+    }
+    FileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, FILE_MAGIC, sizeof(h.magic));
+    h.version = FORMAT_VERSION;
+    h.rec_size = (uint32_t)sz;
+    h.count = count;
+    h.generation = generation;
+    h.next_id = next_id;
+    io_write_copy(b, fd, &h, sizeof(h), 0);
+    io_write(b, fd, buf, count * sz, sizeof(h), 1);
+}
+
+void save_binary_file(const char *path, void *buf, size_t count, size_t sz, uint64_t generation, uint32_t next_id) {
+    IoBatch b;
+    io_batch_init(&b);
+    save_binary_submit(&b, path, buf, count, sz, generation, next_id);
+    if (!io_wait(&b)) fprintf(stderr, "Warning: unable to save %s\n", path);
+}
+
+/* Read a whole binary file and undo obfuscation of the payload, which
+   is read in parallel chunks straight into the returned buffer.
+   On return *hdr tells whether a header was present (hdr->version 0 = legacy). */
+unsigned char *read_binary_file(const char *path, size_t *len, FileHeader *hdr) {
+    memset(hdr, 0, sizeof(*hdr));
+    *len = 0;
+    IoBatch b;
+    io_batch_init(&b);
+    int fd = io_open(&b, path);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size <= 0) {
+        io_wait(&b);
+        return NULL;
+    }
+    size_t got = (size_t)st.st_size, off = 0;
+    unsigned char head[sizeof(FileHeader)];
+    ssize_t hn = pread(fd, head, sizeof(head), 0);
+    if (hn >= (ssize_t)offsetof(FileHeader, generation) && memcmp(head, FILE_MAGIC, 4) == 0) {
+        memcpy(hdr, head, offsetof(FileHeader, generation));
+        off = hdr->version >= 3 ? sizeof(FileHeader) : offsetof(FileHeader, generation);
+        if (off > got) off = got;
+        memcpy(hdr, head, off);
+    }
+    unsigned char *tmp = xmalloc(got - off ? got - off : 1);
+    io_read(&b, fd, tmp, got - off, (off_t)off, 1);
+    if (!io_wait(&b)) {
+        fprintf(stderr, "Warning: unable to read %s\n", path);
+        free(tmp);
+        memset(hdr, 0, sizeof(*hdr));
+        return NULL;
+    }
+    *len = got - off;
+    return tmp;
+}
+
+size_t load_binary_file(const char *path, void *buf, size_t max_count, size_t sz) {
+    FileHeader h;
+    size_t got;
+    unsigned char *tmp = read_binary_file(path, &got, &h);
+    if (!tmp) return 0;
+    if (h.version && h.rec_size != sz) {
+        fprintf(stderr, "Warning: %s has unexpected record size — ignored\n", path);
+        free(tmp);
+        return 0;
+    }
+    size_t count = got / sz;
+    if (count > max_count) count = max_count;
+    memcpy(buf, tmp, count * sz);
+    free(tmp);
+    return count;
+}
+
+/* Transactions may be in the pre-currency layout; those are upgraded
+   to the base currency on load. */
+void load_transactions(const char *path, TxnStore *ts, FileHeader *hdr) {
+    FileHeader h;
+    size_t got;
+    unsigned char *tmp = read_binary_file(path, &got, &h);
+    *hdr = h;
+    if (!tmp) return;
+    size_t countt;
+    if (h.version == 0) {
+        countt = got / sizeof(TransactionV1);
+        ts->data = xmalloc((countt ? countt : 1) * sizeof(Transaction));
+        for (size_t i = 0; i < countt; ++i) {
+            TransactionV1 old;
+            memcpy(&old, tmp + i * sizeof(TransactionV1), sizeof(old));
+            Transaction *t = &ts->data[i];
+            memset(t, 0, sizeof(*t));
+            t->id = old.id;
+            memcpy(t->date, old.date, sizeof(t->date));
+            strcpy(t->currency, base_currency);
+            t->amount = old.amount;
+            t->category_id = old.category_id;
+            t->type = old.type;
+            memcpy(t->note, old.note, sizeof(t->note));
+        }
+    } else {
+        if (h.rec_size != sizeof(Transaction)) {
+            fprintf(stderr, "Warning: %s has unexpected record size — ignored\n", path);
+            free(tmp);
+            return;
+        }
+        countt = got / sizeof(Transaction);
+        if (countt) {
+            ts->data = (Transaction *)tmp; /* rows were read in place */
+            tmp = NULL;
+        } else {
+            ts->data = xmalloc(sizeof(Transaction));
+        }
+    }
+    free(tmp);
+    ts->size = countt;
+    ts->cap = countt ? countt : 1;
+    int maxid = 0;
+    for (size_t i = 0; i < ts->size; ++i) if (ts->data[i].id > maxid) maxid = ts->data[i].id;
+    ts->next_id = maxid + 1;
+    if (h.next_id > (uint32_t)ts->next_id) ts->next_id = (int)h.next_id;
+}
+
+void load_config() {
+    FILE *f = fopen(CONF_FILE, "r");
+    if (!f) return;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        char *eq = strchr(line, '=');
+        if (!eq) continue;
+        *eq = 0;
+        char *val = eq + 1;
+        val[strcspn(val, "\r\n")] = 0;
+        if (strcmp(line, "base_currency") == 0) {
+            char code[CUR_LEN + 4];
+            strncpy(code, val, sizeof(code) - 1);
+            code[sizeof(code) - 1] = 0;
+            if (normalize_currency(code)) strcpy(base_currency, code);
+        } else if (strcmp(line, "archive_years") == 0) {
+            archive_years = atoi(val);
+            if (archive_years < 0) archive_years = 0;
+        } else if (strcmp(line, "watch_dir") == 0) {
+            snprintf(watch_dir, sizeof(watch_dir), "%s", val);
+        } else if (strcmp(line, "metrics_port") == 0) {
+            metrics_port = atoi(val);
+            if (metrics_port < 0 || metrics_port > 65535) metrics_port = 0;
+        } else if (strcmp(line, "durability") == 0) {
+            if (strcmp(val, "sync") == 0) durability = DURABLE_SYNC;
+            else if (strcmp(val, "async") == 0) durability = DURABLE_ASYNC;
+            else durability = DURABLE_GROUPED;
+        } else if (strcmp(line, "commit_window_ms") == 0) {
+            commit_window_ms = atoi(val);
+            if (commit_window_ms < 0 || commit_window_ms > 1000) commit_window_ms = 0;
+        } else if (strcmp(line, "workers") == 0) {
+            sched_threads = atoi(val);
+            if (sched_threads < 0 || sched_threads > SCHED_MAX_THREADS + 1) sched_threads = 0;
+        }
+    }
+    fclose(f);
+}
+
+void save_config() {
+    FILE *f = fopen(CONF_FILE, "w");
+    if (!f) { fprintf(stderr, "Warning: unable to save %s\n", CONF_FILE); return; }
+    fprintf(f, "base_currency=%s\n", base_currency);
+    fprintf(f, "archive_years=%d\n", archive_years);
+    if (watch_dir[0]) fprintf(f, "watch_dir=%s\n", watch_dir);
+    if (metrics_port) fprintf(f, "metrics_port=%d\n", metrics_port);
+    if (sched_threads) fprintf(f, "workers=%d\n", sched_threads);
+    if (durability != DURABLE_GROUPED)
+        fprintf(f, "durability=%s\n", durability == DURABLE_SYNC ? "sync" : "async");
+    if (commit_window_ms) fprintf(f, "commit_window_ms=%d\n", commit_window_ms);
+    fclose(f);
+}
+
+/* Load one ledger's stores from its directory, then replay any journal
+   records newer than the files (changes made before a crash). Touches
+   nothing but *L (and read-only settings) so ledgers can be loaded
+   concurrently. */
+void load_ledger(Ledger *L) {
+    load_ledger_meta(L);
+    load_ledger_rows(L);
+}
+
+/* First phase: categories and budgets, which are small */
+void load_ledger_meta(Ledger *L) {
+    char path[PATH_LEN + 32];
+
+    /* load categories */
+    Category catbuf[1024];
+    snprintf(path, sizeof(path), "%s/%s", L->dir, CAT_FILE);
+    size_t count = load_binary_file(path, catbuf, 1024, sizeof(Category));
+    if (count) {
+        L->cats.data = xmalloc(count * sizeof(Category));
+        memcpy(L->cats.data, catbuf, count * sizeof(Category));
+        L->cats.size = count;
+        L->cats.cap = count;
+        /* find next id */
+        int maxid = 0;
+        for (size_t i = 0; i < L->cats.size; ++i) if (L->cats.data[i].id > maxid) maxid = L->cats.data[i].id;
+        L->cats.next_id = maxid + 1;
+    }
+
+    /* load budgets */
+    BudgetEntry bbuf[1024];
+    snprintf(path, sizeof(path), "%s/%s", L->dir, BUD_FILE);
+    size_t bc = load_binary_file(path, bbuf, 1024, sizeof(BudgetEntry));
+    if (bc) {
+        L->budgets.data = xmalloc(bc * sizeof(BudgetEntry));
+        memcpy(L->budgets.data, bbuf, bc * sizeof(BudgetEntry));
+        L->budgets.size = bc;
+        L->budgets.cap = bc;
+    }
+}
+
+/* Second phase: transactions (or their B+tree), derived structures,
+   journal replay and archive headers. A tree rebuilt after a crash
+   replaces the categories and budgets read before. */
+void load_ledger_rows(Ledger *L) {
+    char path[PATH_LEN + 32];
+    FileHeader h;
+
+    /* load transactions (we allow many), or open their B+tree */
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", L->dir, BT_FILE);
+    if (stat(path, &st) == 0) {
+        L->tree = xmalloc(sizeof(TxnTree));
+        int ok = tt_open(L->tree, L->dir, 0), rebuilt = 0;
+        if (!ok || !L->tree->rows.h.clean || !L->tree->ids.h.clean ||
+            L->tree->rows.h.generation != L->tree->ids.h.generation) { /* a crash between rebuild's renames */
+            fprintf(stderr, "Ledger '%s': B+tree was not closed cleanly — rebuilding it.\n", L->name);
+            rebuilt = tt_rebuild(L);
+            ok = rebuilt;
+        }
+        if (!ok) {
+            /* opening it anyway would lose rows silently */
+            fprintf(stderr, "Ledger '%s' cannot be opened: %s is damaged and neither a checkpoint nor the journal can "
+                            "rebuild it\n", L->name, path);
+            tt_close(L->tree);
+            free(L->tree);
+            L->tree = NULL;
+            L->broken = 1;
+            L->loaded = 1;
             return;
         }
+        if (!rebuilt) L->generation = L->tree->rows.h.generation;
+        L->txns.next_id = L->tree->rows.h.next_id > 1 ? L->tree->rows.h.next_id : 1;
+    } else {
+        snprintf(path, sizeof(path), "%s/%s", L->dir, TRAN_FILE);
+        load_transactions(path, &L->txns, &h);
+        L->generation = h.generation;
+    }
+    derived_load(L);
+    journal_recover(L);
+    archive_load(L);
+    L->loaded = 1;
+}
+
+/* All three files (or the B+tree in place of transactions.dat) are
+   written even when empty so they always agree on the generation the
+   journal is replayed from; the derived structures follow them */
+void save_ledger_submit(const Ledger *L, IoBatch *b) {
+    char path[PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s/%s", L->dir, CAT_FILE);
+    save_binary_submit(b, path, L->cats.data, L->cats.size, sizeof(Category), L->generation, 0);
+    snprintf(path, sizeof(path), "%s/%s", L->dir, TRAN_FILE);
+    if (L->tree) {
+        if (!tt_flush(L->tree, L->generation, L->txns.next_id))
+            fprintf(stderr, "Warning: unable to save %s/%s\n", L->dir, BT_FILE);
+    } else {
+        save_binary_submit(b, path, L->txns.data, L->txns.size, sizeof(Transaction), L->generation,
+                           (uint32_t)L->txns.next_id);
+    }
+    snprintf(path, sizeof(path), "%s/%s", L->dir, BUD_FILE);
+    save_binary_submit(b, path, L->budgets.data, L->budgets.size, sizeof(BudgetEntry), L->generation, 0);
+    derived_submit(L, b);
+}
+
+void save_ledger(const Ledger *L) {
+    IoBatch b;
+    io_batch_init(&b);
+    save_ledger_submit(L, &b);
+    if (!io_wait(&b)) fprintf(stderr, "Warning: unable to save ledger '%s'\n", L->name);
+}
+
+void load_all() {
+    load_config();
+
+    /* load FX rates (shared by all ledgers) */
+    FileHeader rh;
+    size_t rbytes;
+    unsigned char *rbuf = read_binary_file(RATE_FILE, &rbytes, &rh);
+    if (rbuf && rh.rec_size == sizeof(FxRate)) {
+        size_t rc = rbytes / sizeof(FxRate);
+        rates.data = xmalloc((rc ? rc : 1) * sizeof(FxRate));
+        memcpy(rates.data, rbuf, rc * sizeof(FxRate));
+        rates.size = rc;
+        rates.cap = rc ? rc : 1;
+    }
+    free(rbuf);
+    fx_rebuild_keys();
+
+    /* the main ledger loads in the background, then the others */
+    ledger_scan();
+    active_ledger = 0;
+    if (reader_mode) ledger_activate(0); /* mapping is instant */
+    else preload_start();
+}
+
+void save_all() {
+    if (reader_mode) return;
+    preload_wait(PRELOAD_ALL);
+    save_config();
+    journal_flush();
+    ledger_stash_active();
+    IoBatch b; /* every file of every ledger at once */
+    io_batch_init(&b);
+    if (rates.size) save_binary_submit(&b, RATE_FILE, rates.data, rates.size, sizeof(FxRate), 0, 0);
+    for (size_t i = 0; i < nledgers; ++i) {
+        if (ledgers[i].loaded && !ledgers[i].broken) save_ledger_submit(&ledgers[i], &b);
+    }
+    if (!io_wait(&b)) fprintf(stderr, "Warning: some data files could not be saved\n");
+}
+
+/* -------------------- On-disk B+tree -------------------- */
+
+#define BT_HEAD sizeof(BtNode)
+
+static int bt_cmp(BtKey x, BtKey y) {
+    if (x.a != y.a) return x.a < y.a ? -1 : 1;
+    if (x.b != y.b) return x.b < y.b ? -1 : 1;
+    return 0;
+}
+
+/* Pages are accessed with memcpy so they need no alignment */
+static BtNode bt_node(const unsigned char *pg) {
+    BtNode nd;
+    memcpy(&nd, pg, sizeof(nd));
+    return nd;
+}
+
+static void bt_set_node(unsigned char *pg, BtNode nd) {
+    memcpy(pg, &nd, sizeof(nd));
+}
+
+static BtKey bt_key(const unsigned char *pg, size_t i) {
+    BtKey k;
+    memcpy(&k, pg + BT_HEAD + i * sizeof(BtKey), sizeof(k));
+    return k;
+}
+
+static void bt_set_key(unsigned char *pg, size_t i, BtKey k) {
+    memcpy(pg + BT_HEAD + i * sizeof(BtKey), &k, sizeof(k));
+}
+
+static unsigned char *bt_val(const BTree *t, unsigned char *pg, size_t i) {
+    return pg + BT_HEAD + t->leaf_cap * sizeof(BtKey) + i * t->h.val_size;
+}
+
+static uint32_t bt_kid(const BTree *t, const unsigned char *pg, size_t i) {
+    uint32_t k;
+    memcpy(&k, pg + BT_HEAD + t->inner_cap * sizeof(BtKey) + i * sizeof(k), sizeof(k));
+    return k;
+}
+
+static void bt_set_kid(const BTree *t, unsigned char *pg, size_t i, uint32_t kid) {
+    memcpy(pg + BT_HEAD + t->inner_cap * sizeof(BtKey) + i * sizeof(kid), &kid, sizeof(kid));
+}
+
+/* First slot whose key is >= k (upper = 0) or > k (upper = 1) */
+static size_t bt_search(const unsigned char *pg, size_t n, BtKey k, int upper) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int c = bt_cmp(bt_key(pg, mid), k);
+        if (c < 0 || (upper && c == 0)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static int bt_write_header(BTree *t, uint32_t clean) {
+    unsigned char pg[BT_PAGE];
+    memset(pg, 0, sizeof(pg));
+    t->h.clean = clean;
+    memcpy(pg, &t->h, sizeof(t->h));
+    if (pwrite(t->fd, pg, BT_PAGE, 0) != BT_PAGE || fsync(t->fd) != 0) return 0;
+    t->disk_clean = (int)clean;
+    return 1;
+}
+
+/* The first page written after a flush marks the file unclean, so a
+   crash before the next flush is noticed on open */
+static void bt_write_out(BTree *t, BtFrame *f) {
+    if (t->disk_clean && !bt_write_header(t, 0))
+        fprintf(stderr, "Warning: unable to update B+tree header\n");
+    if (pwrite(t->fd, f->buf, BT_PAGE, (off_t)f->page * BT_PAGE) != BT_PAGE)
+        fprintf(stderr, "Warning: B+tree page write failed\n");
+    f->dirty = 0;
+}
+
+/* Pool frame holding page pg, loading it when asked */
+static BtFrame *bt_frame(BTree *t, uint32_t pg, int load) {
+    BtFrame *victim = &t->frames[0];
+    for (size_t i = 0; i < BT_POOL_PAGES; ++i) {
+        BtFrame *f = &t->frames[i];
+        if (f->buf && f->page == pg) {
+            f->used = ++t->tick;
+            metric_add(&metrics.bt_hits, 1);
+            return f;
+        }
+        if (f->used < victim->used) victim = f;
+    }
+    metric_add(&metrics.bt_misses, 1);
+    if (!victim->buf) victim->buf = xmalloc(BT_PAGE);
+    else if (victim->dirty) bt_write_out(t, victim);
+    victim->page = pg;
+    victim->dirty = 0;
+    victim->used = ++t->tick;
+    if (load) {
+        ssize_t got = pread(t->fd, victim->buf, BT_PAGE, (off_t)pg * BT_PAGE);
+        if (got < BT_PAGE) memset(victim->buf + (got > 0 ? got : 0), 0, BT_PAGE - (size_t)(got > 0 ? got : 0));
+    }
+    return victim;
+}
+
+static void bt_read(BTree *t, uint32_t pg, unsigned char *out) {
+    memcpy(out, bt_frame(t, pg, 1)->buf, BT_PAGE);
+}
+
+static void bt_write(BTree *t, uint32_t pg, const unsigned char *in) {
+    BtFrame *f = bt_frame(t, pg, 0);
+    memcpy(f->buf, in, BT_PAGE);
+    f->dirty = 1;
+}
+
+static uint32_t bt_alloc(BTree *t) {
+    return t->h.npages++;
+}
+
+static int bt_open(BTree *t, const char *path, uint32_t val_size, int create) {
+    memset(t, 0, sizeof(*t));
+    t->fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0600);
+    if (t->fd < 0) return 0;
+    t->frames = calloc(BT_POOL_PAGES, sizeof(BtFrame));
+    if (!t->frames) panic("calloc pool");
+    t->leaf_cap = (BT_PAGE - BT_HEAD) / (sizeof(BtKey) + val_size);
+    t->inner_cap = (BT_PAGE - BT_HEAD - sizeof(uint32_t)) / (sizeof(BtKey) + sizeof(uint32_t));
+    if (create) {
+        memcpy(t->h.magic, BT_MAGIC, 4);
+        t->h.version = FORMAT_VERSION;
+        t->h.val_size = val_size;
+        t->h.npages = 1;
+        t->h.height = 1;
+        t->h.root = bt_alloc(t);
+        unsigned char pg[BT_PAGE];
+        memset(pg, 0, sizeof(pg));
+        BtNode nd = {1, 0, 0};
+        bt_set_node(pg, nd);
+        bt_write(t, t->h.root, pg);
+        t->disk_clean = 1;
+        return 1;
+    }
+    unsigned char pg[BT_PAGE];
+    if (pread(t->fd, pg, BT_PAGE, 0) != BT_PAGE) return 0;
+    memcpy(&t->h, pg, sizeof(t->h));
+    t->disk_clean = (int)t->h.clean;
+    return memcmp(t->h.magic, BT_MAGIC, 4) == 0 && t->h.val_size == val_size;
+}
+
+/* Write every dirty page and sync them, then a clean header, so the
+   header never says clean before the pages are on disk */
+static int bt_flush(BTree *t) {
+    for (size_t i = 0; i < BT_POOL_PAGES; ++i) {
+        if (t->frames[i].dirty) bt_write_out(t, &t->frames[i]);
+    }
+    if (fsync(t->fd) != 0) return 0;
+    return bt_write_header(t, 1);
+}
+
+static void bt_close(BTree *t) {
+    if (t->fd >= 0) close(t->fd);
+    if (t->frames) {
+        for (size_t i = 0; i < BT_POOL_PAGES; ++i) free(t->frames[i].buf);
+    }
+    free(t->frames);
+    memset(t, 0, sizeof(*t));
+    t->fd = -1;
+}
+
+static void bt_leaf_insert(BTree *t, unsigned char *pg, size_t i, BtKey k, const void *val) {
+    BtNode nd = bt_node(pg);
+    size_t vs = t->h.val_size;
+    memmove(pg + BT_HEAD + (i + 1) * sizeof(BtKey), pg + BT_HEAD + i * sizeof(BtKey), (nd.n - i) * sizeof(BtKey));
+    memmove(bt_val(t, pg, i + 1), bt_val(t, pg, i), (nd.n - i) * vs);
+    bt_set_key(pg, i, k);
+    memcpy(bt_val(t, pg, i), val, vs);
+    nd.n++;
+    bt_set_node(pg, nd);
+}
+
+/* Insert or replace k below page pgno. When the page splits, the new
+   right sibling and its first key come back in *right and *sep and 1
+   is returned. */
+static int bt_insert_at(BTree *t, uint32_t pgno, BtKey k, const void *val, uint32_t *right, BtKey *sep) {
+    unsigned char pg[BT_PAGE], rp[BT_PAGE];
+    bt_read(t, pgno, pg);
+    BtNode nd = bt_node(pg);
+    memset(rp, 0, sizeof(rp));
+    if (nd.leaf) {
+        size_t i = bt_search(pg, nd.n, k, 0);
+        if (i < nd.n && bt_cmp(bt_key(pg, i), k) == 0) {
+            memcpy(bt_val(t, pg, i), val, t->h.val_size);
+            bt_write(t, pgno, pg);
+            return 0;
+        }
+        t->h.count++;
+        if (nd.n < t->leaf_cap) {
+            bt_leaf_insert(t, pg, i, k, val);
+            bt_write(t, pgno, pg);
+            return 0;
+        }
+        /* move the upper half to a new right sibling, then insert */
+        size_t keep = nd.n / 2, move = nd.n - keep;
+        *right = bt_alloc(t);
+        memcpy(rp + BT_HEAD, pg + BT_HEAD + keep * sizeof(BtKey), move * sizeof(BtKey));
+        memcpy(bt_val(t, rp, 0), bt_val(t, pg, keep), move * t->h.val_size);
+        BtNode rn = {1, (uint16_t)move, nd.next};
+        nd.n = (uint16_t)keep;
+        nd.next = *right;
+        bt_set_node(pg, nd);
+        bt_set_node(rp, rn);
+        if (i <= keep) bt_leaf_insert(t, pg, i, k, val);
+        else bt_leaf_insert(t, rp, i - keep, k, val);
+        *sep = bt_key(rp, 0);
+        bt_write(t, pgno, pg);
+        bt_write(t, *right, rp);
+        return 1;
+    }
+    size_t i = bt_search(pg, nd.n, k, 1);
+    uint32_t cr;
+    BtKey cs;
+    if (!bt_insert_at(t, bt_kid(t, pg, i), k, val, &cr, &cs)) return 0;
+    /* room for the child's new sibling: key cs at i, child cr at i + 1.
+       Work on n + 1 keys in scratch arrays, then split if they overflow. */
+    size_t n = nd.n;
+    BtKey keys[BT_PAGE / sizeof(BtKey)];
+    uint32_t kids[BT_PAGE / sizeof(BtKey) + 2];
+    for (size_t j = 0, o = 0; j < n; ++j, ++o) {
+        if (j == i) keys[o++] = cs;
+        keys[o] = bt_key(pg, j);
+    }
+    if (i == n) keys[n] = cs;
+    for (size_t j = 0, o = 0; j <= n; ++j, ++o) {
+        kids[o] = bt_kid(t, pg, j);
+        if (j == i) kids[++o] = cr;
+    }
+    n++;
+    size_t left = n <= t->inner_cap ? n : n / 2;
+    nd.n = (uint16_t)left;
+    memset(pg + BT_HEAD, 0, BT_PAGE - BT_HEAD);
+    bt_set_node(pg, nd);
+    for (size_t j = 0; j < left; ++j) bt_set_key(pg, j, keys[j]);
+    for (size_t j = 0; j <= left; ++j) bt_set_kid(t, pg, j, kids[j]);
+    bt_write(t, pgno, pg);
+    if (left == n) return 0;
+    /* keys[left] moves up; the rest go right */
+    *sep = keys[left];
+    *right = bt_alloc(t);
+    BtNode rn = {0, (uint16_t)(n - left - 1), 0};
+    bt_set_node(rp, rn);
+    for (size_t j = left + 1; j < n; ++j) bt_set_key(rp, j - left - 1, keys[j]);
+    for (size_t j = left + 1; j <= n; ++j) bt_set_kid(t, rp, j - left - 1, kids[j]);
+    bt_write(t, *right, rp);
+    return 1;
+}
+
+static void bt_insert(BTree *t, BtKey k, const void *val) {
+    uint32_t right;
+    BtKey sep;
+    if (!bt_insert_at(t, t->h.root, k, val, &right, &sep)) return;
+    unsigned char pg[BT_PAGE];
+    memset(pg, 0, sizeof(pg));
+    BtNode nd = {0, 1, 0};
+    bt_set_node(pg, nd);
+    bt_set_key(pg, 0, sep);
+    bt_set_kid(t, pg, 0, t->h.root);
+    bt_set_kid(t, pg, 1, right);
+    t->h.root = bt_alloc(t);
+    t->h.height++;
+    bt_write(t, t->h.root, pg);
+}
+
+/* Leaf that holds k if it is anywhere in the tree */
+static uint32_t bt_leaf_for(BTree *t, BtKey k, unsigned char *pg) {
+    uint32_t pgno = t->h.root;
+    for (;;) {
+        bt_read(t, pgno, pg);
+        BtNode nd = bt_node(pg);
+        if (nd.leaf) return pgno;
+        pgno = bt_kid(t, pg, bt_search(pg, nd.n, k, 1));
+    }
+}
+
+static int bt_find(BTree *t, BtKey k, void *val) {
+    unsigned char pg[BT_PAGE];
+    bt_leaf_for(t, k, pg);
+    BtNode nd = bt_node(pg);
+    size_t i = bt_search(pg, nd.n, k, 0);
+    if (i == nd.n || bt_cmp(bt_key(pg, i), k) != 0) return 0;
+    if (val) memcpy(val, bt_val(t, pg, i), t->h.val_size);
+    return 1;
+}
+
+static int bt_delete(BTree *t, BtKey k) {
+    unsigned char pg[BT_PAGE];
+    uint32_t pgno = bt_leaf_for(t, k, pg);
+    BtNode nd = bt_node(pg);
+    size_t i = bt_search(pg, nd.n, k, 0), vs = t->h.val_size;
+    if (i == nd.n || bt_cmp(bt_key(pg, i), k) != 0) return 0;
+    memmove(pg + BT_HEAD + i * sizeof(BtKey), pg + BT_HEAD + (i + 1) * sizeof(BtKey), (nd.n - i - 1) * sizeof(BtKey));
+    memmove(bt_val(t, pg, i), bt_val(t, pg, i + 1), (nd.n - i - 1) * vs);
+    nd.n--;
+    bt_set_node(pg, nd);
+    bt_write(t, pgno, pg);
+    t->h.count--;
+    return 1;
+}
+
+static void bt_seek(BtCursor *c, BTree *t, BtKey lo, BtKey hi) {
+    c->t = t;
+    c->hi = hi;
+    bt_leaf_for(t, lo, c->buf);
+    c->pos = bt_search(c->buf, bt_node(c->buf).n, lo, 0);
+}
+
+/* Next value in the range, NULL at its end; valid until the next call */
+static const unsigned char *bt_next(BtCursor *c, BtKey *k) {
+    BtNode nd = bt_node(c->buf);
+    while (c->pos >= nd.n) {
+        if (!nd.next) return NULL;
+        bt_read(c->t, nd.next, c->buf);
+        nd = bt_node(c->buf);
+        c->pos = 0;
+    }
+    BtKey key = bt_key(c->buf, c->pos);
+    if (bt_cmp(key, c->hi) > 0) return NULL;
+    if (k) *k = key;
+    return bt_val(c->t, c->buf, c->pos++);
+}
+
+/* -- the transaction store on top of two trees -- */
+
+/* The tree files of dir with suffix appended to their names */
+static int tt_open_as(TxnTree *tt, const char *dir, const char *suffix, int create) {
+    char path[PATH_LEN + 40];
+    snprintf(path, sizeof(path), "%s/%s%s", dir, BT_FILE, suffix);
+    int ok = bt_open(&tt->rows, path, sizeof(Transaction), create);
+    snprintf(path, sizeof(path), "%s/%s%s", dir, BT_IDS_FILE, suffix);
+    ok = bt_open(&tt->ids, path, sizeof(int32_t), create) && ok;
+    if (!ok) tt_close(tt);
+    return ok;
+}
+
+int tt_open(TxnTree *tt, const char *dir, int create) {
+    return tt_open_as(tt, dir, "", create);
+}
+
+void tt_close(TxnTree *tt) {
+    bt_close(&tt->rows);
+    bt_close(&tt->ids);
+}
+
+/* Insert or replace a transaction; a new date moves it in the tree */
+void tt_put(TxnTree *tt, const Transaction *t) {
+    int32_t day = date_key(t->date), old;
+    BtKey ik = {t->id, 0};
+    if (bt_find(&tt->ids, ik, &old) && old != day) {
+        BtKey ok = {old, t->id};
+        bt_delete(&tt->rows, ok);
+    }
+    BtKey rk = {day, t->id};
+    bt_insert(&tt->rows, rk, t);
+    bt_insert(&tt->ids, ik, &day);
+    if (t->id >= tt->rows.h.next_id) tt->rows.h.next_id = t->id + 1;
+}
+
+int tt_del(TxnTree *tt, int id) {
+    int32_t day;
+    BtKey ik = {id, 0};
+    if (!bt_find(&tt->ids, ik, &day)) return 0;
+    BtKey rk = {day, id};
+    bt_delete(&tt->rows, rk);
+    bt_delete(&tt->ids, ik);
+    return 1;
+}
+
+int tt_get(TxnTree *tt, int id, Transaction *out) {
+    int32_t day;
+    BtKey ik = {id, 0};
+    if (!bt_find(&tt->ids, ik, &day)) return 0;
+    BtKey rk = {day, id};
+    return bt_find(&tt->rows, rk, out);
+}
+
+int tt_flush(TxnTree *tt, uint64_t generation, int next_id) {
+    tt->rows.h.generation = tt->ids.h.generation = generation;
+    if (next_id > tt->rows.h.next_id) tt->rows.h.next_id = next_id;
+    int ok = bt_flush(&tt->rows);
+    return bt_flush(&tt->ids) && ok;
+}
+
+/* Transactions in the active ledger */
+size_t txn_count() {
+    return txn_tree ? (size_t)txn_tree->rows.h.count : txns.size;
+}
+
+/* from/to are dates, NULL or "" for open ends */
+void txn_iter_open(TxnIter *it, const char *from, const char *to, const Transaction *extra, size_t nextra) {
+    memset(it, 0, sizeof(*it));
+    it->extra = extra;
+    it->nextra = nextra;
+    if (txn_tree) {
+        BtKey lo = {from && *from ? date_key(from) : INT32_MIN, INT32_MIN};
+        BtKey hi = {to && *to ? date_key(to) : INT32_MAX, INT32_MAX};
+        bt_seek(&it->cur, &txn_tree->rows, lo, hi);
+    }
+}
+
+const Transaction *txn_iter_next(TxnIter *it) {
+    if (!it->in_extra) {
+        if (txn_tree) {
+            const unsigned char *v = bt_next(&it->cur, NULL);
+            if (v) {
+                memcpy(&it->row, v, sizeof(it->row));
+                it->seen++;
+                return &it->row;
+            }
+        } else if (it->i < txns.size) {
+            it->seen++;
+            return &txns.data[it->i++];
+        }
+        it->in_extra = 1;
+    }
+    if (it->j < it->nextra) {
+        it->seen++;
+        return &it->extra[it->j++];
+    }
+    if (it->seen) metric_add(&metrics.rows_scanned, it->seen);
+    it->seen = 0;
+    return NULL;
+}
+
+/* -------------------- Ledgers -------------------- */
+
+static int valid_ledger_name(const char *name) {
+    if (!*name || strlen(name) >= sizeof(ledgers[0].name)) return 0;
+    for (const char *p = name; *p; ++p) {
+        if (!isalnum((unsigned char)*p) && *p != '-' && *p != '_') return 0;
+    }
+    return 1;
+}
+
+static Ledger *ledger_add(const char *name, const char *dir) {
+    if (nledgers == MAX_LEDGERS) return NULL;
+    Ledger *L = &ledgers[nledgers++];
+    memset(L, 0, sizeof(*L));
+    snprintf(L->name, sizeof(L->name), "%s", name);
+    snprintf(L->dir, sizeof(L->dir), "%s", dir);
+    L->txns.next_id = 1;
+    L->cats.next_id = 1;
+    L->readers_fd = -1;
+    L->follow = 1;
+    return L;
+}
+
+/* Register the main ledger plus every subdirectory of LEDGER_DIR */
+void ledger_scan() {
+    nledgers = 0;
+    ledger_add(MAIN_LEDGER, DATA_DIR);
+    DIR *d = opendir(LEDGER_DIR);
+    if (!d) return;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (!valid_ledger_name(e->d_name) || strcmp(e->d_name, MAIN_LEDGER) == 0) continue;
+        char dir[PATH_LEN];
+        struct stat st;
+        snprintf(dir, sizeof(dir), "%s/%s", LEDGER_DIR, e->d_name);
+        if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+        if (!ledger_add(e->d_name, dir)) {
+            fprintf(stderr, "Warning: more than %d ledgers — ignoring the rest\n", MAX_LEDGERS);
+            break;
+        }
+    }
+    closedir(d);
+}
+
+int ledger_find(const char *name) {
+    for (size_t i = 0; i < nledgers; ++i) {
+        if (strcmp(ledgers[i].name, name) == 0) return (int)i;
+    }
+    return -1;
+}
+
+/* Returns the new ledger's index or -1 */
+int ledger_create(const char *name) {
+    if (!valid_ledger_name(name) || ledger_find(name) >= 0) return -1;
+    char dir[PATH_LEN];
+    snprintf(dir, sizeof(dir), "%s/%s", LEDGER_DIR, name);
+    if ((mkdir(LEDGER_DIR, 0700) != 0 && errno != EEXIST) || mkdir(dir, 0700) != 0) return -1;
+    Ledger *L = ledger_add(name, dir);
+    if (!L) return -1;
+    L->loaded = 1; /* nothing on disk yet */
+    return (int)(L - ledgers);
+}
+
+/* Copy the working stores back into the active ledger's slot */
+void ledger_stash_active() {
+    if (active_ledger >= nledgers || preload_phase < PRELOAD_ACTIVE) return; /* still loading */
+    Ledger *L = &ledgers[active_ledger];
+    L->txns = txns;
+    L->cats = cats;
+    L->budgets = budgets;
+    L->index = txn_index;
+    L->agg = month_cube;
+    L->agg_valid = month_cube_valid;
+    if (month_cube_valid) L->agg_rates = rates_fingerprint();
+}
+
+void ledger_activate(size_t idx) {
+    if (idx >= nledgers) return;
+    ledger_stash_active();
+    Ledger *L = &ledgers[idx];
+    if (!L->loaded) {
+        if (reader_mode) reader_load(L);
+        else load_ledger(L);
+    }
+    if (L->broken) {
+        printf("Ledger '%s' cannot be opened.\n", L->name);
+        if (idx == active_ledger) exit(1); /* starting up: there is nothing else to show */
+        return;
+    }
+    txns = L->txns;
+    cats = L->cats;
+    budgets = L->budgets;
+    txn_tree = L->tree;
+    txn_index = L->index;
+    month_cube = L->agg;
+    month_cube_valid = L->agg_valid;
+    journal_close();
+    active_ledger = idx;
+    if (!txn_tree && txn_index.used != txns.size) index_rebuild();
+    if (month_cube_valid && L->agg_rates != rates_fingerprint()) aggregates_invalidate();
+    oplog_clear();
+    if (reader_mode) return;
+    journal_open_active();
+    archive_recover(L);
+}
+
+/* Move the active ledger's transactions into an on-disk B+tree (on) or
+   back into memory. The stored data is the same either way, so the
+   journal and checkpoints stay valid. Returns 0 on failure. */
+int ledger_use_tree(int on) {
+    Ledger *L = &ledgers[active_ledger];
+    char path[PATH_LEN + 32];
+    if (on == (txn_tree != NULL)) return 1;
+    if (on) {
+        /* a tree that is not closed cleanly is rebuilt from a checkpoint,
+           and transactions.dat is about to go */
+        if (!checkpoint_active()) return 0;
+        TxnTree *tt = xmalloc(sizeof(TxnTree));
+        if (!tt_open(tt, L->dir, 1)) { free(tt); return 0; }
+        for (size_t i = 0; i < txns.size; ++i) tt_put(tt, &txns.data[i]);
+        if (!tt_flush(tt, L->generation, txns.next_id)) {
+            tt_close(tt);
+            free(tt);
+            return 0;
+        }
+        free(txns.data);
+        txns.data = NULL;
+        txns.size = txns.cap = 0;
+        txn_tree = L->tree = tt;
+        snprintf(path, sizeof(path), "%s/%s", L->dir, TRAN_FILE);
+        remove(path);
+    } else {
+        TxnIter it;
+        const Transaction *t;
+        txns.size = 0; /* rows looked up so far are all in the tree */
+        txn_iter_open(&it, NULL, NULL, NULL, 0);
+        while ((t = txn_iter_next(&it)) != NULL) {
+            ensure_txn_capacity();
+            txns.data[txns.size++] = *t;
+        }
+        txn_tree = NULL;
+        ledger_stash_active();
+        save_ledger(L); /* transactions.dat first, so the rows always exist on disk */
+        tt_close(L->tree);
+        free(L->tree);
+        L->tree = NULL;
+        snprintf(path, sizeof(path), "%s/%s", L->dir, BT_FILE);
+        remove(path);
+        snprintf(path, sizeof(path), "%s/%s", L->dir, BT_IDS_FILE);
+        remove(path);
+    }
+    index_rebuild();
+    aggregates_invalidate();
+    oplog_clear(); /* undo slots refer to the old layout of txns */
+    ledger_stash_active();
+    return 1;
+}
+
+static void ledger_load_task(void *arg) {
+    if (reader_mode) reader_load(arg);
+    else load_ledger(arg);
+}
+
+/* Load every ledger not yet in memory, one task per ledger */
+void ledger_mount_all() {
+    TaskGroup group;
+    task_group_init(&group, PRIO_HIGH);
+    for (size_t i = 0; i < nledgers; ++i) {
+        if (!ledgers[i].loaded) task_spawn(&group, ledger_load_task, &ledgers[i]);
+    }
+    task_wait(&group);
+    task_group_destroy(&group);
+}
+
+/* Take L's stores as the working ones without stashing the current
+   ones, so activating L afterwards stashes them back unchanged */
+static void ledger_adopt(const Ledger *L) {
+    txns = L->txns;
+    cats = L->cats;
+    budgets = L->budgets;
+    txn_index = L->index;
+    month_cube = L->agg;
+    month_cube_valid = L->agg_valid;
+}
+
+/* Generation stamped in a data file's header, 0 when unknown */
+static uint64_t file_generation(const char *path) {
+    FileHeader h;
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    size_t n = fread(&h, sizeof(h), 1, f);
+    fclose(f);
+    return n == 1 && memcmp(h.magic, FILE_MAGIC, 4) == 0 && h.version >= 3 ? h.generation : 0;
+}
+
+static void preload_publish(int phase) {
+    pthread_mutex_lock(&preload_lock);
+    preload_ready = phase;
+    pthread_cond_broadcast(&preload_cond);
+    pthread_mutex_unlock(&preload_lock);
+}
+
+/* Categories and budgets are published before the rows only when
+   loading the rest cannot change them: no journal records to replay
+   and no B+tree that might be rebuilt from a checkpoint */
+static void preload_task(void *arg) {
+    Ledger *L = arg;
+    char path[PATH_LEN + 32];
+    struct stat st;
+    load_ledger_meta(L);
+    snprintf(path, sizeof(path), "%s/%s", L->dir, BT_FILE);
+    int has_tree = stat(path, &st) == 0;
+    snprintf(path, sizeof(path), "%s/%s", L->dir, CAT_FILE);
+    if (!has_tree && !journal_has_tail(L->dir, file_generation(path))) preload_publish(PRELOAD_CATS);
+    load_ledger_rows(L);
+    preload_publish(PRELOAD_ACTIVE);
+    ledger_mount_all(); /* the other ledgers stream in behind */
+    preload_publish(PRELOAD_ALL);
+}
+
+/* Start loading the active ledger in the background; without workers
+   the task runs right here and the first preload_wait() takes it over */
+void preload_start() {
+    preload_ready = preload_phase = PRELOAD_NONE;
+    task_group_init(&preload_group, PRIO_LOW);
+    task_spawn(&preload_group, preload_task, &ledgers[active_ledger]);
+}
+
+/* Block until the loader has completed phase, then take over what it
+   loaded. Only the main thread calls this. */
+void preload_wait(int phase) {
+    if (preload_phase >= phase) return;
+    Ledger *L = &ledgers[active_ledger];
+    pthread_mutex_lock(&preload_lock);
+    if (preload_ready < phase) {
+        if (preload_ready < PRELOAD_ACTIVE) printf("Loading ledger '%s'...\n", L->name);
+        else printf("Loading the other ledgers...\n");
+        fflush(stdout);
+        while (preload_ready < phase) pthread_cond_wait(&preload_cond, &preload_lock);
+    }
+    int ready = preload_ready;
+    pthread_mutex_unlock(&preload_lock);
+    if (ready >= PRELOAD_ACTIVE && preload_phase < PRELOAD_ACTIVE) {
+        ledger_adopt(L); /* the working stores are still empty */
+        preload_phase = PRELOAD_ACTIVE;
+        ledger_activate(active_ledger);
+    } else if (preload_phase < PRELOAD_CATS) {
+        cats = L->cats;
+        budgets = L->budgets;
+        preload_phase = PRELOAD_CATS;
+    }
+    if (ready == PRELOAD_ALL) {
+        task_wait(&preload_group);
+        task_group_destroy(&preload_group);
+        preload_phase = PRELOAD_ALL;
+    }
+}
+
+static size_t cube_hash(int month, int category_id, const char *category) {
+    size_t h = (size_t)month * 2654435761u ^ (size_t)category_id * 40503u;
+    for (const char *p = category; *p; ++p) h = (h ^ (unsigned char)*p) * 16777619u;
+    return h;
+}
+
+static void cube_rehash(Cube *c) {
+    free(c->slots);
+    c->nslots = c->nslots ? c->nslots * 2 : 64;
+    c->slots = calloc(c->nslots, sizeof(size_t));
+    if (!c->slots) panic("calloc cube");
+    for (size_t i = 0; i < c->size; ++i) {
+        const CubeCell *cell = &c->cells[i];
+        size_t h = cube_hash(cell->month, cell->category_id, cell->category) & (c->nslots - 1);
+        while (c->slots[h]) h = (h + 1) & (c->nslots - 1);
+        c->slots[h] = i + 1;
+    }
+}
+
+/* Find a cell, creating it when create is set */
+static CubeCell *cube_lookup(Cube *c, int month, int category_id, const char *category, int create) {
+    if (c->nslots) {
+        size_t h = cube_hash(month, category_id, category) & (c->nslots - 1);
+        for (; c->slots[h]; h = (h + 1) & (c->nslots - 1)) {
+            CubeCell *cell = &c->cells[c->slots[h] - 1];
+            if (cell->month == month && cell->category_id == category_id &&
+                strcmp(cell->category, category) == 0) return cell;
+        }
+    }
+    if (!create) return NULL;
+    if (c->size + 1 > c->cap) {
+        c->cap = (c->cap == 0) ? 16 : c->cap * 2;
+        c->cells = realloc(c->cells, c->cap * sizeof(CubeCell));
+        if (!c->cells) panic("realloc cube");
+    }
+    CubeCell *cell = &c->cells[c->size++];
+    memset(cell, 0, sizeof(*cell));
+    cell->month = month;
+    cell->category_id = category_id;
+    snprintf(cell->category, sizeof(cell->category), "%s", category);
+    if (c->size * 2 > c->nslots) {
+        cube_rehash(c);
+    } else {
+        size_t h = cube_hash(month, category_id, category) & (c->nslots - 1);
+        while (c->slots[h]) h = (h + 1) & (c->nslots - 1);
+        c->slots[h] = c->size;
+    }
+    return cell;
+}
+
+typedef struct {
+    const TxnStore *ts;
+    int from_month;
+    int to_month;
+    Cube *parts; /* one per chunk */
+} CubeScan;
+
+static void cube_scan_chunk(void *ctx, size_t chunk, size_t lo, size_t hi) {
+    CubeScan *s = ctx;
+    Cube *c = &s->parts[chunk];
+    double *base_amt = xmalloc((hi - lo) * sizeof(double));
+    unsigned char *miss = xmalloc(hi - lo);
+    c->missing_rates += fx_convert_column(s->ts->data + lo, hi - lo, base_amt, miss);
+    for (size_t i = lo; i < hi; ++i) {
+        const Transaction *t = &s->ts->data[i];
+        int month = date_key(t->date) / 100;
+        if (month < s->from_month || month > s->to_month) continue;
+        CubeCell *cell = cube_lookup(c, month, t->category_id, "", 1);
+        if (t->type == TYPE_INCOME) cell->income += base_amt[i - lo];
+        else cell->expense += base_amt[i - lo];
+        cell->missing += miss[i - lo];
+        c->rows++;
+    }
+    free(miss);
+    free(base_amt);
+}
+
+/* Aggregate ts's transactions dated in months [from_month, to_month]
+   (YYYYMM) into c by category id; large stores are scanned in parallel
+   chunks whose cubes are then added up in order */
+static void cube_accumulate(Cube *c, const TxnStore *ts, int from_month, int to_month) {
+    size_t nchunks = parallel_chunks(ts->size, SCHED_GRAIN_ROWS);
+    CubeScan scan = {ts, from_month, to_month, c};
+    if (nchunks > 1) scan.parts = calloc(nchunks, sizeof(Cube));
+    if (!scan.parts) panic("calloc cube");
+    parallel_for(ts->size, SCHED_GRAIN_ROWS, PRIO_HIGH, cube_scan_chunk, &scan);
+    if (nchunks <= 1) return;
+    for (size_t k = 0; k < nchunks; ++k) {
+        Cube *part = &scan.parts[k];
+        for (size_t i = 0; i < part->size; ++i) {
+            const CubeCell *src = &part->cells[i];
+            CubeCell *d = cube_lookup(c, src->month, src->category_id, src->category, 1);
+            d->income += src->income;
+            d->expense += src->expense;
+            d->missing += src->missing;
+        }
+        c->rows += part->rows;
+        c->missing_rates += part->missing_rates;
+        cube_free(part);
+    }
+    free(scan.parts);
+}
+
+/* Aggregate a tree's rows dated in months [from_month, to_month] a
+   chunk at a time, so memory use stays flat */
+static void cube_accumulate_tree(Cube *c, BTree *t, int from_month, int to_month) {
+    enum { CHUNK = 1024 };
+    Transaction *chunk = xmalloc(CHUNK * sizeof(Transaction));
+    BtCursor cur;
+    BtKey lo = {from_month * 100, INT32_MIN}, hi = {to_month * 100 + 99, INT32_MAX};
+    bt_seek(&cur, t, lo, hi);
+    TxnStore ts = {chunk, 0, CHUNK, 0};
+    const unsigned char *v;
+    for (;;) {
+        v = bt_next(&cur, NULL);
+        if (v) memcpy(&chunk[ts.size++], v, sizeof(Transaction));
+        if (ts.size == CHUNK || (!v && ts.size)) {
+            cube_accumulate(c, &ts, from_month, to_month);
+            ts.size = 0;
+        }
+        if (!v) break;
+    }
+    free(chunk);
+}
+
+/* Aggregate L into a cube keyed by category name, starting from its
+   parked aggregates when they hold no archived months yet. Safe to run
+   concurrently for different ledgers. */
+void cube_build(Cube *c, const Ledger *L, int from_month, int to_month) {
+    Cube byid;
+    memset(&byid, 0, sizeof(byid));
+    memset(c, 0, sizeof(*c));
+    if (L->agg_valid && L->agg.narchived == 0 && L->agg_rates == rates_fingerprint()) {
+        for (size_t i = 0; i < L->agg.size; ++i) {
+            const CubeCell *s = &L->agg.cells[i];
+            if (s->month < from_month || s->month > to_month) continue;
+            CubeCell *d = cube_lookup(&byid, s->month, s->category_id, "", 1);
+            d->income += s->income;
+            d->expense += s->expense;
+            d->missing += s->missing;
+        }
+        byid.rows = L->agg.rows;
+        byid.missing_rates = L->agg.missing_rates;
+    } else if (L->tree) {
+        cube_accumulate_tree(&byid, &L->tree->rows, from_month, to_month);
+    } else {
+        cube_accumulate(&byid, &L->txns, from_month, to_month);
+    }
+    archive_accumulate(&byid, L, from_month, to_month);
+    for (size_t i = 0; i < byid.size; ++i) {
+        const CubeCell *s = &byid.cells[i];
+        const char *name = "UNKNOWN";
+        for (size_t k = 0; k < L->cats.size; ++k) {
+            if (L->cats.data[k].id == s->category_id) { name = L->cats.data[k].name; break; }
+        }
+        CubeCell *d = cube_lookup(c, s->month, 0, name, 1);
+        d->income += s->income;
+        d->expense += s->expense;
+        d->missing += s->missing;
+    }
+    c->rows = byid.rows;
+    c->missing_rates = byid.missing_rates;
+    cube_free(&byid);
+}
+
+/* Add src's cells into dst, matching categories by name */
+void cube_merge(Cube *dst, const Cube *src) {
+    for (size_t i = 0; i < src->size; ++i) {
+        const CubeCell *s = &src->cells[i];
+        CubeCell *d = cube_lookup(dst, s->month, 0, s->category, 1);
+        d->income += s->income;
+        d->expense += s->expense;
+        d->missing += s->missing;
+    }
+    dst->rows += src->rows;
+    dst->missing_rates += src->missing_rates;
+}
+
+void cube_free(Cube *c) {
+    free(c->cells);
+    free(c->slots);
+    free(c->archived);
+    memset(c, 0, sizeof(*c));
+}
+
+typedef struct {
+    const Ledger *ledger;
+    int from_month;
+    int to_month;
+    Cube cube;
+} CubeJob;
+
+static void cube_task(void *arg) {
+    CubeJob *job = arg;
+    cube_build(&job->cube, job->ledger, job->from_month, job->to_month);
+}
+
+/* Monthly summary across all ledgers: each ledger's cube is built by
+   its own task, then the cubes are merged. */
+void combined_report(int year, int month) {
+    ledger_stash_active();
+    ledger_mount_all();
+    int ym = year * 100 + month;
+    CubeJob jobs[MAX_LEDGERS];
+    TaskGroup group;
+    task_group_init(&group, PRIO_HIGH);
+    for (size_t i = 0; i < nledgers; ++i) {
+        jobs[i].ledger = &ledgers[i];
+        jobs[i].from_month = ym;
+        jobs[i].to_month = ym;
+        task_spawn(&group, cube_task, &jobs[i]);
+    }
+    task_wait(&group);
+    task_group_destroy(&group);
+    Cube total;
+    memset(&total, 0, sizeof(total));
+    printf("Combined Report %04d-%02d (%s):\n", year, month, base_currency);
+    for (size_t i = 0; i < nledgers; ++i) {
+        double in = 0.0, ex = 0.0;
+        if (ledgers[i].broken) {
+            printf("  %-16s (cannot be opened)\n", ledgers[i].name);
+            cube_free(&jobs[i].cube);
+            continue;
+        }
+        for (size_t k = 0; k < jobs[i].cube.size; ++k) {
+            in += jobs[i].cube.cells[k].income;
+            ex += jobs[i].cube.cells[k].expense;
+        }
+        printf("  %-16s Income: %.2f  Expense: %.2f  Net: %.2f\n", ledgers[i].name, in, ex, in - ex);
+        cube_merge(&total, &jobs[i].cube);
+        cube_free(&jobs[i].cube);
+    }
+    double in = 0.0, ex = 0.0;
+    printf("  By category:\n");
+    for (size_t k = 0; k < total.size; ++k) {
+        in += total.cells[k].income;
+        ex += total.cells[k].expense;
+        printf("    %-20s : %.2f\n", total.cells[k].category, total.cells[k].expense - total.cells[k].income);
+    }
+    printf("  %-16s Income: %.2f  Expense: %.2f  Net: %.2f\n", "ALL", in, ex, in - ex);
+    report_missing_rates(total.missing_rates);
+    cube_free(&total);
+}
+
+void ledger_menu() {
+    printf("Ledgers:\n");
+    for (size_t i = 0; i < nledgers; ++i) {
+        printf("  %c %-16s %s%s%s\n", i == active_ledger ? '*' : ' ', ledgers[i].name, ledgers[i].dir,
+               ledgers[i].tree ? " (B+tree)" : "",
+               ledgers[i].broken ? " (cannot be opened)" : ledgers[i].loaded ? "" : " (not loaded)");
+    }
+    printf("1=switch 2=create 3=combined report 4=load all 5=keep '%s' on disk (B+tree) 6=keep '%s' in memory : ",
+           ledgers[active_ledger].name, ledgers[active_ledger].name);
+    int c = read_int();
+    if (reader_mode && (c == 2 || c == 5 || c == 6)) { printf("Not available with --read-only.\n"); return; }
+    if (c == 1) {
+        printf("Ledger name: ");
+        char name[64]; read_line(name, sizeof(name));
+        int idx = ledger_find(name);
+        if (idx < 0) { printf("Not found.\n"); return; }
+        if (sandbox.active) { printf("Commit or discard the sandbox first.\n"); return; }
+        ledger_activate((size_t)idx);
+        printf("Active ledger: %s\n", ledgers[active_ledger].name);
+    } else if (c == 2) {
+        printf("New ledger name (letters, digits, - and _): ");
+        char name[64]; read_line(name, sizeof(name));
+        int idx = ledger_create(name);
+        if (idx < 0) { printf("Unable to create ledger '%s'.\n", name); return; }
+        printf("Created ledger '%s' in %s\n", ledgers[idx].name, ledgers[idx].dir);
+    } else if (c == 3) {
+        printf("Year: "); int y = read_int();
+        printf("Month: "); int m = read_int();
+        if (m < 1 || m > 12) { printf("Invalid month.\n"); return; }
+        combined_report(y, m);
+    } else if (c == 4) {
+        ledger_mount_all();
+        printf("All ledgers loaded.\n");
+    } else if (c == 5 || c == 6) {
+        if (sandbox.active) { printf("Commit or discard the sandbox first.\n"); return; }
+        if (!ledger_use_tree(c == 5)) printf("Unable to create the B+tree in %s.\n", ledgers[active_ledger].dir);
+        else if (c == 5) printf("'%s' now keeps its %zu transaction(s) in %s.\n", ledgers[active_ledger].name, txn_count(), BT_FILE);
+        else printf("'%s' now keeps its %zu transaction(s) in memory.\n", ledgers[active_ledger].name, txn_count());
+    }
+}
+
+/* -------------------- Indexes and aggregates -------------------- */
+
+static size_t id_hash(int id, size_t cap) {
+    return ((uint32_t)id * 2654435761u) & (cap - 1);
+}
+
+static void index_insert_raw(IdIndex *ix, int id, size_t pos) {
+    size_t h = id_hash(id, ix->cap);
+    while (ix->ids[h] != 0 && ix->ids[h] != id) h = (h + 1) & (ix->cap - 1);
+    if (ix->ids[h] == 0) ix->used++;
+    ix->ids[h] = id;
+    ix->pos[h] = pos;
+}
+
+static void index_free(IdIndex *ix) {
+    if (ix->map) {
+        munmap(ix->map, ix->maplen);
+    } else {
+        free(ix->ids);
+        free(ix->pos);
+    }
+    memset(ix, 0, sizeof(*ix));
+}
+
+static void index_grow(IdIndex *ix, size_t want) {
+    size_t cap = 64;
+    while (cap < want * 2) cap *= 2;
+    IdIndex nx = {calloc(cap, sizeof(int)), calloc(cap, sizeof(size_t)), cap, 0, NULL, 0};
+    if (!nx.ids || !nx.pos) panic("calloc index");
+    for (size_t i = 0; i < ix->cap; ++i) {
+        if (ix->ids[i]) index_insert_raw(&nx, ix->ids[i], ix->pos[i]);
+    }
+    index_free(ix);
+    *ix = nx;
+}
+
+static void index_put(IdIndex *ix, int id, size_t pos) {
+    if ((ix->used + 1) * 2 > ix->cap) index_grow(ix, ix->used + 1);
+    index_insert_raw(ix, id, pos);
+}
+
+/* Remove with backward shift so probe chains stay intact */
+static void index_del(IdIndex *ix, int id) {
+    if (!ix->cap) return;
+    size_t mask = ix->cap - 1;
+    size_t h = id_hash(id, ix->cap);
+    while (ix->ids[h] != id) {
+        if (ix->ids[h] == 0) return;
+        h = (h + 1) & mask;
+    }
+    size_t hole = h;
+    for (size_t j = (hole + 1) & mask; ix->ids[j]; j = (j + 1) & mask) {
+        size_t home = id_hash(ix->ids[j], ix->cap);
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            ix->ids[hole] = ix->ids[j];
+            ix->pos[hole] = ix->pos[j];
+            hole = j;
+        }
+    }
+    ix->ids[hole] = 0;
+    ix->used--;
+}
+
+static long index_lookup(const IdIndex *ix, int id) {
+    if (!ix->cap || id == 0) return -1;
+    for (size_t h = id_hash(id, ix->cap); ix->ids[h]; h = (h + 1) & (ix->cap - 1)) {
+        if (ix->ids[h] == id) return (long)ix->pos[h];
+    }
+    return -1;
+}
+
+typedef struct {
+    IdIndex *ix;
+    const TxnStore *ts;
+    _Atomic size_t used;
+} IndexFill;
+
+_Static_assert(sizeof(_Atomic int) == sizeof(int) && sizeof(_Atomic size_t) == sizeof(size_t),
+               "index slots are filled in place as atomics");
+
+/* index_insert_raw() for chunks filled concurrently: a slot is claimed
+   with a compare-and-swap on its id, and a duplicate id keeps its
+   highest position, as inserting in order would, however the chunks
+   are scheduled */
+static void index_fill_chunk(void *ctx, size_t chunk, size_t lo, size_t hi) {
+    (void)chunk;
+    IndexFill *f = ctx;
+    IdIndex *ix = f->ix;
+    size_t used = 0;
+    for (size_t i = lo; i < hi; ++i) {
+        int id = f->ts->data[i].id;
+        size_t h = id_hash(id, ix->cap);
+        for (;;) {
+            int cur = 0;
+            if (atomic_compare_exchange_strong_explicit((_Atomic int *)&ix->ids[h], &cur, id, memory_order_relaxed,
+                                                        memory_order_relaxed)) {
+                used++;
+                break;
+            }
+            if (cur == id) break;
+            h = (h + 1) & (ix->cap - 1);
+        }
+        _Atomic size_t *pos = (_Atomic size_t *)&ix->pos[h];
+        size_t old = atomic_load_explicit(pos, memory_order_relaxed);
+        while (old < i && !atomic_compare_exchange_weak_explicit(pos, &old, i, memory_order_relaxed, memory_order_relaxed)) {
+            /* old now holds the position another chunk stored */
+        }
+    }
+    atomic_fetch_add(&f->used, used);
+}
+
+static void index_build(IdIndex *ix, const TxnStore *ts) {
+    index_free(ix);
+    index_grow(ix, ts->size);
+    IndexFill fill = {ix, ts, 0};
+    parallel_for(ts->size, SCHED_GRAIN_ROWS, PRIO_HIGH, index_fill_chunk, &fill);
+    ix->used = atomic_load(&fill.used);
+}
+
+void index_rebuild() {
+    index_build(&txn_index, &txns);
+}
+
+void aggregates_invalidate() {
+    cube_free(&month_cube);
+    month_cube_valid = 0;
+}
+
+/* Base-currency totals of the active ledger by (month, category id),
+   built once and then kept current by every store operation */
+Cube *month_aggregates() {
+    if (!month_cube_valid) {
+        cube_free(&month_cube);
+        if (txn_tree) cube_accumulate_tree(&month_cube, &txn_tree->rows, 0, 999999);
+        else cube_accumulate(&month_cube, &txns, 0, 999999);
+        month_cube_valid = 1;
+    }
+    return &month_cube;
+}
+
+static void agg_apply(Cube *agg, const Transaction *t, int sign) {
+    if (!agg) return;
+    int key = date_key(t->date);
+    double r = fx_rate_asof(t->currency, key);
+    CubeCell *cell = cube_lookup(agg, key / 100, t->category_id, "", 1);
+    if (r == 0.0) {
+        r = 1.0;
+        if (sign > 0) {
+            agg->missing_rates++;
+            cell->missing++;
+        } else {
+            agg->missing_rates--;
+            cell->missing--;
+        }
+    }
+    if (t->type == TYPE_INCOME) cell->income += sign * t->amount * r;
+    else cell->expense += sign * t->amount * r;
+    if (sign > 0) agg->rows++; else agg->rows--;
+}
+
+/* The active ledger's stores with their derived structures */
+static StoreCtx active_ctx() {
+    StoreCtx c = {&txns, &cats, &budgets, &txn_index, month_cube_valid ? &month_cube : NULL, txn_tree};
+    return c;
+}
+
+/* -------------------- Store operations and undo -------------------- */
+
+#define UNDO_MAX_BYTES (1024 * 1024)
+#define UNDO_MAX_OPS 16384
+#define JOURNAL_MAX_OP (64 * 1024) /* largest encoded op; batches are split to fit */
+#define BATCH_ROW_MAX (21 + 255)   /* largest row of an OP_TXN_BATCH */
+
+/* Raw mutations: keep the id index and aggregates current, no logging.
+   They work on any StoreCtx so the journal can be replayed into stores
+   other than the active ones. */
+
+static void *grow_array(void *data, size_t *cap, size_t want, size_t sz, size_t initial) {
+    if (want <= *cap) return data;
+    size_t c = *cap ? *cap : initial;
+    while (c < want) c *= 2;
+    data = realloc(data, c * sz);
+    if (!data) panic("realloc store");
+    *cap = c;
+    return data;
+}
+
+/* Add a row to the in-memory store only. With a tree that store is a
+   cache of rows looked up for editing: once it holds TREE_CACHE_ROWS,
+   a row is dropped from it (clock order, the tree keeps it) first. */
+static void raw_txn_cache(StoreCtx *s, const Transaction *t) {
+    static size_t hand;
+    TxnStore *ts = s->txns;
+    if (s->tree && ts->size >= TREE_CACHE_ROWS) {
+        size_t victim = hand++ % ts->size;
+        index_del(s->index, ts->data[victim].id);
+        ts->data[victim] = ts->data[--ts->size];
+        if (victim < ts->size) index_put(s->index, ts->data[victim].id, victim);
+    }
+    ts->data = grow_array(ts->data, &ts->cap, ts->size + 1, sizeof(Transaction), 16);
+    ts->data[ts->size] = *t;
+    index_put(s->index, t->id, ts->size);
+    ts->size++;
+    if (t->id >= ts->next_id) ts->next_id = t->id + 1;
+}
+
+/* With a tree, new rows are written through to it and not cached */
+static void raw_txn_append(StoreCtx *s, const Transaction *t) {
+    if (!s->tree) raw_txn_cache(s, t);
+    else if (t->id >= s->txns->next_id) s->txns->next_id = t->id + 1;
+    if (s->tree) tt_put(s->tree, t);
+    agg_apply(s->agg, t, +1);
+}
+
+typedef struct {
+    int a, b;   /* sort key */
+    size_t row;
+} RowKey;
+
+static int rowkey_cmp(const void *x, const void *y) {
+    const RowKey *p = x, *q = y;
+    if (p->a != q->a) return p->a < q->a ? -1 : 1;
+    if (p->b != q->b) return p->b < q->b ? -1 : 1;
+    return p->row < q->row ? -1 : p->row > q->row;
+}
+
+/* agg_apply() for rows[0..n): amounts are converted as one column, then
+   rows are sorted by (month, category) so each cell is looked up once.
+   Rows reach a cell in their original order, so the sums are the same. */
+static void agg_apply_rows(Cube *agg, const Transaction *rows, size_t n, int sign) {
+    if (!agg || !n) return;
+    double *base = xmalloc(n * sizeof(double));
+    RowKey *k = xmalloc(n * sizeof(RowKey));
+    unsigned char *miss = xmalloc(n);
+    size_t missing = fx_convert_column(rows, n, base, miss);
+    for (size_t i = 0; i < n; ++i) {
+        k[i].a = date_key(rows[i].date) / 100;
+        k[i].b = rows[i].category_id;
+        k[i].row = i;
+    }
+    qsort(k, n, sizeof(RowKey), rowkey_cmp);
+    for (size_t i = 0, j; i < n; i = j) {
+        CubeCell *cell = cube_lookup(agg, k[i].a, k[i].b, "", 1);
+        for (j = i; j < n && k[j].a == k[i].a && k[j].b == k[i].b; ++j) {
+            const Transaction *t = &rows[k[j].row];
+            if (t->type == TYPE_INCOME) cell->income += sign * base[k[j].row];
+            else cell->expense += sign * base[k[j].row];
+            if (sign > 0) cell->missing += miss[k[j].row];
+            else cell->missing -= miss[k[j].row];
+        }
+    }
+    if (sign > 0) {
+        agg->missing_rates += missing;
+        agg->rows += n;
+    } else {
+        agg->missing_rates -= missing;
+        agg->rows -= n;
+    }
+    free(miss);
+    free(k);
+    free(base);
+}
+
+/* Append rows[0..n) with one reservation: the id index is grown once
+   up front, the tree is filled in (date, id) order so inserts walk its
+   leaves left to right, and aggregates are folded in a cell at a time */
+static void raw_txn_append_rows(StoreCtx *s, const Transaction *rows, size_t n) {
+    TxnStore *ts = s->txns;
+    IdIndex *ix = s->index;
+    if (!n) return;
+    if (s->tree) {
+        for (size_t i = 0; i < n; ++i) if (rows[i].id >= ts->next_id) ts->next_id = rows[i].id + 1;
+    } else {
+        ts->data = grow_array(ts->data, &ts->cap, ts->size + n, sizeof(Transaction), 16);
+        memcpy(ts->data + ts->size, rows, n * sizeof(Transaction));
+        if ((ix->used + n) * 2 > ix->cap) index_grow(ix, ix->used + n);
+        for (size_t i = 0; i < n; ++i) {
+            index_insert_raw(ix, rows[i].id, ts->size + i);
+            if (rows[i].id >= ts->next_id) ts->next_id = rows[i].id + 1;
+        }
+        ts->size += n;
+    }
+    if (s->tree) {
+        RowKey *k = xmalloc(n * sizeof(RowKey));
+        for (size_t i = 0; i < n; ++i) {
+            k[i].a = date_key(rows[i].date);
+            k[i].b = rows[i].id;
+            k[i].row = i;
+        }
+        qsort(k, n, sizeof(RowKey), rowkey_cmp);
+        for (size_t i = 0; i < n; ++i) tt_put(s->tree, &rows[k[i].row]);
+        free(k);
+    }
+    agg_apply_rows(s->agg, rows, n, +1);
+}
+
+/* Inverse of raw_txn_append_rows() while its rows are the last n */
+static void raw_txn_truncate(StoreCtx *s, size_t n) {
+    TxnStore *ts = s->txns;
+    const Transaction *rows = ts->data + ts->size - n;
+    agg_apply_rows(s->agg, rows, n, -1);
+    for (size_t i = 0; i < n; ++i) {
+        if (s->tree) tt_del(s->tree, rows[i].id);
+        index_del(s->index, rows[i].id);
+    }
+    ts->size -= n;
+}
+
+/* Swap-remove; the last row moves into idx */
+static void raw_txn_remove(StoreCtx *s, size_t idx) {
+    TxnStore *ts = s->txns;
+    agg_apply(s->agg, &ts->data[idx], -1);
+    if (s->tree) tt_del(s->tree, ts->data[idx].id);
+    index_del(s->index, ts->data[idx].id);
+    ts->data[idx] = ts->data[ts->size - 1];
+    ts->size--;
+    if (idx < ts->size) index_put(s->index, ts->data[idx].id, idx);
+}
+
+/* Exact inverse of raw_txn_remove(slot); a tree has no slots */
+static void raw_txn_restore(StoreCtx *s, size_t slot, const Transaction *t) {
+    TxnStore *ts = s->txns;
+    raw_txn_append(s, t);
+    if (s->tree) return;
+    size_t last = ts->size - 1;
+    if (slot >= last) return;
+    Transaction moved = ts->data[slot];
+    ts->data[slot] = ts->data[last];
+    ts->data[last] = moved;
+    index_put(s->index, ts->data[slot].id, slot);
+    index_put(s->index, moved.id, last);
+}
+
+static void raw_txn_set(StoreCtx *s, size_t idx, const Transaction *nt) {
+    agg_apply(s->agg, &s->txns->data[idx], -1);
+    s->txns->data[idx] = *nt;
+    if (s->tree) tt_put(s->tree, nt);
+    agg_apply(s->agg, nt, +1);
+}
+
+/* Position of transaction id in s->txns; with a tree, a row not in the
+   cache is read from it first. The position holds until the next call. */
+static long ctx_txn_index(StoreCtx *s, int id) {
+    long idx = index_lookup(s->index, id);
+    Transaction t;
+    if (idx >= 0 || !s->tree || !tt_get(s->tree, id, &t)) return idx;
+    raw_txn_cache(s, &t);
+    return (long)s->txns->size - 1;
+}
+
+/* Whether s holds transaction id, without caching it */
+static int ctx_txn_exists(StoreCtx *s, int id) {
+    Transaction t;
+    return index_lookup(s->index, id) >= 0 || (s->tree && tt_get(s->tree, id, &t));
+}
+
+long index_get(int id) {
+    StoreCtx s = active_ctx();
+    return ctx_txn_index(&s, id);
+}
+
+/* Whether the active ledger holds transaction id (archived rows aside) */
+static int txn_exists(int id) {
+    StoreCtx s = active_ctx();
+    return ctx_txn_exists(&s, id);
+}
+
+static void raw_cat_restore(StoreCtx *s, size_t slot, const Category *c) {
+    CatStore *cs = s->cats;
+    cs->data = grow_array(cs->data, &cs->cap, cs->size + 1, sizeof(Category), 8);
+    cs->data[cs->size++] = *c;
+    if (c->id >= cs->next_id) cs->next_id = c->id + 1;
+    if (slot < cs->size - 1) {
+        Category moved = cs->data[slot];
+        cs->data[slot] = cs->data[cs->size - 1];
+        cs->data[cs->size - 1] = moved;
+    }
+}
+
+static void raw_cat_remove(StoreCtx *s, size_t idx) {
+    s->cats->data[idx] = s->cats->data[s->cats->size - 1];
+    s->cats->size--;
+}
+
+static long ctx_cat_index(const StoreCtx *s, int id) {
+    for (size_t i = 0; i < s->cats->size; ++i) {
+        if (s->cats->data[i].id == id) return (long)i;
+    }
+    return -1;
+}
+
+/* -- encoding -- */
+
+static void log_put(const void *p, size_t n) {
+    if (oplog.used + n > oplog.bufcap) {
+        while (oplog.used + n > oplog.bufcap) oplog.bufcap = oplog.bufcap ? oplog.bufcap * 2 : 4096;
+        oplog.buf = realloc(oplog.buf, oplog.bufcap);
+        if (!oplog.buf) panic("realloc oplog");
+    }
+    memcpy(oplog.buf + oplog.used, p, n);
+    oplog.used += n;
+}
+
+static void log_put_str(const char *str) {
+    unsigned char len = (unsigned char)strnlen(str, 255);
+    log_put(&len, 1);
+    log_put(str, len);
+}
+
+static const unsigned char *log_get(const unsigned char *p, void *out, size_t n) {
+    memcpy(out, p, n);
+    return p + n;
+}
+
+static const unsigned char *log_get_str(const unsigned char *p, char *out, size_t sz) {
+    size_t len = *p++;
+    size_t keep = len < sz - 1 ? len : sz - 1;
+    memcpy(out, p, keep);
+    out[keep] = 0;
+    return p + len;
+}
+
+static void log_put_fields(int fields, const Transaction *t) {
+    if (fields & F_DATE) { int k = date_key(t->date); log_put(&k, sizeof(k)); }
+    if (fields & F_CURRENCY) log_put(t->currency, 3);
+    if (fields & F_AMOUNT) log_put(&t->amount, sizeof(t->amount));
+    if (fields & F_CATEGORY) log_put(&t->category_id, sizeof(t->category_id));
+    if (fields & F_TYPE) { unsigned char tp = (unsigned char)t->type; log_put(&tp, 1); }
+    if (fields & F_NOTE) log_put_str(t->note);
+}
+
+static const unsigned char *log_get_fields(const unsigned char *p, int fields, Transaction *t) {
+    if (fields & F_DATE) {
+        unsigned k;
+        p = log_get(p, &k, sizeof(k));
+        snprintf(t->date, sizeof(t->date), "%04u-%02u-%02u", (k / 10000) % 10000, (k / 100) % 100, k % 100);
+    }
+    if (fields & F_CURRENCY) { p = log_get(p, t->currency, 3); t->currency[3] = 0; }
+    if (fields & F_AMOUNT) p = log_get(p, &t->amount, sizeof(t->amount));
+    if (fields & F_CATEGORY) p = log_get(p, &t->category_id, sizeof(t->category_id));
+    if (fields & F_TYPE) t->type = (*p++ == TYPE_INCOME) ? TYPE_INCOME : TYPE_EXPENSE;
+    if (fields & F_NOTE) p = log_get_str(p, t->note, sizeof(t->note));
+    return p;
+}
+
+/* Fixed part of every encoded op */
+typedef struct {
+    unsigned char kind;
+    unsigned char fields;
+    uint32_t group;
+    int id;
+    uint32_t slot;
+} OpHead;
+
+/* Drop whole groups from the front until the log is back under 3/4 of
+   its bounds. A group still being recorded loses its undo ability. */
+static void oplog_trim() {
+    if (oplog.used <= UNDO_MAX_BYTES && oplog.count < UNDO_MAX_OPS) return;
+    size_t drop = 0;
+    while (drop < oplog.count &&
+           (oplog.used - oplog.offs[drop] > UNDO_MAX_BYTES * 3 / 4 || oplog.count - drop > UNDO_MAX_OPS * 3 / 4)) {
+        OpHead h;
+        memcpy(&h, oplog.buf + oplog.offs[drop], sizeof(h));
+        while (drop < oplog.count) {
+            OpHead g;
+            memcpy(&g, oplog.buf + oplog.offs[drop], sizeof(g));
+            if (g.group != h.group) break;
+            drop++;
+        }
+        if (drop == oplog.count && oplog.group_open) oplog.dropped_group = h.group;
+    }
+    if (drop) oplog.trims++;
+    size_t base = drop < oplog.count ? oplog.offs[drop] : oplog.used;
+    memmove(oplog.buf, oplog.buf + base, oplog.used - base);
+    oplog.used -= base;
+    for (size_t i = drop; i < oplog.count; ++i) oplog.offs[i - drop] = oplog.offs[i] - base;
+    oplog.count -= drop;
+    oplog.cursor = oplog.cursor > drop ? oplog.cursor - drop : 0;
+}
+
+static void log_begin_op(int kind, int fields, int id, size_t slot) {
+    if (oplog.cursor < oplog.count) {  /* a new op discards the redo tail */
+        oplog.used = oplog.offs[oplog.cursor];
+        oplog.count = oplog.cursor;
+    }
+    if (!oplog.group_open) oplog.group++;
+    if (oplog.count + 1 > oplog.cap) {
+        oplog.cap = oplog.cap ? oplog.cap * 2 : 64;
+        oplog.offs = realloc(oplog.offs, oplog.cap * sizeof(size_t));
+        if (!oplog.offs) panic("realloc oplog");
+    }
+    oplog.offs[oplog.count] = oplog.used;
+    OpHead h = {(unsigned char)kind, (unsigned char)fields, oplog.group, id, (uint32_t)slot};
+    log_put(&h, sizeof(h));
+}
+
+static void log_end_op() {
+    journal_append(oplog.buf + oplog.offs[oplog.count], oplog.used - oplog.offs[oplog.count], 1);
+    oplog.count++;
+    oplog.cursor = oplog.count;
+    oplog_trim();
+}
+
+/* Ops recorded between begin and end are undone as one step */
+void oplog_begin() {
+    oplog.group++;
+    oplog.group_open = 1;
+}
+
+void oplog_end() {
+    oplog.group_open = 0;
+    journal_commit();
+    if (oplog.dropped_group == oplog.group) {
+        /* the start of this group is gone; it cannot be undone */
+        oplog.count = oplog.cursor = 0;
+        oplog.used = 0;
+        oplog.trims++;
+        printf("Note: change too large to keep in undo history.\n");
+    }
+}
+
+void oplog_clear() {
+    oplog.used = oplog.count = oplog.cursor = 0;
+    oplog.group_open = 0;
+    oplog.trims++;
+}
+
+/* -- logged operations -- */
+
+void txn_insert(const Transaction *t) {
+    log_begin_op(OP_TXN_ADD, F_ALL, t->id, txns.size);
+    log_put_fields(F_ALL, t);
+    log_end_op();
+    StoreCtx s = active_ctx();
+    raw_txn_append(&s, t);
+}
+
+/* Add rows[0..n), already validated and with category ids, as ids id,
+   id + 1, ..., which the caller sees are free. They are journaled as
+   OP_TXN_BATCH records (as many rows per record as fit in
+   JOURNAL_MAX_OP) and each record's rows are appended to the stores
+   together. */
+static void txn_insert_from(Transaction *rows, size_t n, int id) {
+    StoreCtx s = active_ctx();
+    for (size_t i = 0; i < n;) {
+        size_t first = i, at;
+        uint32_t count = 0;
+        log_begin_op(OP_TXN_BATCH, F_ALL, id, txns.size);
+        at = oplog.used;
+        log_put(&count, sizeof(count));
+        while (i < n && oplog.used - at + BATCH_ROW_MAX <= JOURNAL_MAX_OP - sizeof(OpHead)) {
+            rows[i].id = id++;
+            log_put_fields(F_ALL, &rows[i++]);
+        }
+        count = (uint32_t)(i - first);
+        memcpy(oplog.buf + at, &count, sizeof(count));
+        log_end_op();
+        raw_txn_append_rows(&s, rows + first, count);
+    }
+}
+
+/* txn_insert_from() with the next ids in order */
+void txn_insert_batch(Transaction *rows, size_t n) {
+    txn_insert_from(rows, n, txns.next_id);
+}
+
+static int txn_diff(const Transaction *a, const Transaction *b) {
+    int f = 0;
+    if (strcmp(a->date, b->date) != 0) f |= F_DATE;
+    if (strcmp(a->currency, b->currency) != 0) f |= F_CURRENCY;
+    if (a->amount != b->amount) f |= F_AMOUNT;
+    if (a->category_id != b->category_id) f |= F_CATEGORY;
+    if (a->type != b->type) f |= F_TYPE;
+    if (strcmp(a->note, b->note) != 0) f |= F_NOTE;
+    return f;
+}
+
+/* Only the fields that changed are logged, old value then new */
+void txn_update(size_t idx, const Transaction *nt) {
+    const Transaction *old = &txns.data[idx];
+    int f = txn_diff(old, nt);
+    if (!f) return;
+    log_begin_op(OP_TXN_EDIT, f, old->id, idx);
+    log_put_fields(f, old);
+    log_put_fields(f, nt);
+    log_end_op();
+    StoreCtx s = active_ctx();
+    raw_txn_set(&s, idx, nt);
+}
+
+void txn_delete(size_t idx) {
+    log_begin_op(OP_TXN_DEL, F_ALL, txns.data[idx].id, idx);
+    log_put_fields(F_ALL, &txns.data[idx]);
+    log_end_op();
+    StoreCtx s = active_ctx();
+    raw_txn_remove(&s, idx);
+}
+
+int cat_insert(const char *name) {
+    return cat_insert_as(name, 0);
+}
+
+/* Add category name as id, or as the next id when id is 0 or taken */
+int cat_insert_as(const char *name, int id) {
+    Category c;
+    memset(&c, 0, sizeof(c));
+    c.id = id > 0 && find_category_index_by_id(id) < 0 ? id : cats.next_id;
+    if (c.id >= cats.next_id) cats.next_id = c.id + 1;
+    strncpy(c.name, name, sizeof(c.name) - 1);
+    log_begin_op(OP_CAT_ADD, 0, c.id, cats.size);
+    log_put_str(c.name);
+    log_end_op();
+    ensure_cat_capacity();
+    cats.data[cats.size++] = c;
+    return c.id;
+}
+
+void cat_rename(size_t idx, const char *name) {
+    Category *c = &cats.data[idx];
+    log_begin_op(OP_CAT_RENAME, 0, c->id, idx);
+    log_put_str(c->name);
+    log_put_str(name);
+    log_end_op();
+    strncpy(c->name, name, sizeof(c->name) - 1);
+    c->name[sizeof(c->name) - 1] = 0;
+}
+
+void cat_delete(size_t idx) {
+    log_begin_op(OP_CAT_DEL, 0, cats.data[idx].id, idx);
+    log_put_str(cats.data[idx].name);
+    log_end_op();
+    StoreCtx s = active_ctx();
+    raw_cat_remove(&s, idx);
+}
+
+void budget_put(int cid, int year, int month, double amount) {
+    size_t i = 0;
+    while (i < budgets.size && !(budgets.data[i].category_id == cid &&
+           budgets.data[i].year == year && budgets.data[i].month == month)) ++i;
+    unsigned char existed = i < budgets.size;
+    double old = existed ? budgets.data[i].amount : 0.0;
+    log_begin_op(OP_BUDGET_SET, existed, cid, i);
+    log_put(&year, sizeof(year));
+    log_put(&month, sizeof(month));
+    log_put(&old, sizeof(old));
+    log_put(&amount, sizeof(amount));
+    log_end_op();
+    if (existed) {
+        budgets.data[i].amount = amount;
+    } else {
+        ensure_budget_capacity();
+        BudgetEntry be = {cid, year, month, amount};
+        budgets.data[budgets.size++] = be;
+    }
+}
+
+/* -- applying encoded ops -- */
+
+/* Apply one encoded op to s, forwards (redo/replay) or backwards (undo) */
+static void op_apply_bytes(StoreCtx *s, const unsigned char *p, int forward) {
+    OpHead h;
+    p = log_get(p, &h, sizeof(h));
+    switch (h.kind) {
+        case OP_TXN_ADD:
+        case OP_TXN_DEL: {
+            Transaction t;
+            memset(&t, 0, sizeof(t));
+            t.id = h.id;
+            log_get_fields(p, F_ALL, &t);
+            int adding = (h.kind == OP_TXN_ADD) == forward;
+            long idx = ctx_txn_index(s, h.id);
+            if (adding && idx < 0) raw_txn_restore(s, h.slot, &t);
+            else if (!adding && idx >= 0) raw_txn_remove(s, (size_t)idx);
+            break;
+        }
+        case OP_TXN_BATCH: {
+            /* rows not applied yet (forward) or still present (backward) */
+            uint32_t n;
+            p = log_get(p, &n, sizeof(n));
+            Transaction *rows = xmalloc((n ? n : 1) * sizeof(Transaction));
+            size_t m = 0;
+            for (uint32_t i = 0; i < n; ++i) {
+                memset(&rows[m], 0, sizeof(Transaction));
+                rows[m].id = h.id + (int)i;
+                p = log_get_fields(p, F_ALL, &rows[m]);
+                if (ctx_txn_exists(s, rows[m].id) != forward) m++;
+            }
+            TxnStore *ts = s->txns;
+            size_t tail = 0;
+            if (!forward && m <= ts->size)
+                while (tail < m && ts->data[ts->size - m + tail].id == rows[tail].id) tail++;
+            if (forward) {
+                raw_txn_append_rows(s, rows, m);
+            } else if (tail == m) {
+                raw_txn_truncate(s, m); /* nothing moved since: the usual undo */
+            } else {
+                for (size_t i = m; i-- > 0;) {
+                    long idx = ctx_txn_index(s, rows[i].id);
+                    if (idx >= 0) raw_txn_remove(s, (size_t)idx);
+                }
+            }
+            free(rows);
+            break;
+        }
+        case OP_TXN_EDIT: {
+            long idx = ctx_txn_index(s, h.id);
+            if (idx < 0) break;
+            Transaction before = s->txns->data[idx], after = s->txns->data[idx];
+            p = log_get_fields(p, h.fields, &before);
+            log_get_fields(p, h.fields, &after);
+            raw_txn_set(s, (size_t)idx, forward ? &after : &before);
+            break;
+        }
+        case OP_CAT_ADD:
+        case OP_CAT_DEL: {
+            Category c;
+            memset(&c, 0, sizeof(c));
+            c.id = h.id;
+            log_get_str(p, c.name, sizeof(c.name));
+            long idx = ctx_cat_index(s, h.id);
+            int adding = (h.kind == OP_CAT_ADD) == forward;
+            if (adding && idx < 0) raw_cat_restore(s, h.slot, &c);
+            else if (!adding && idx >= 0) raw_cat_remove(s, (size_t)idx);
+            break;
+        }
+        case OP_CAT_RENAME: {
+            char before[64], after[64];
+            p = log_get_str(p, before, sizeof(before));
+            log_get_str(p, after, sizeof(after));
+            long idx = ctx_cat_index(s, h.id);
+            if (idx >= 0) strcpy(s->cats->data[idx].name, forward ? after : before);
+            break;
+        }
+        case OP_BUDGET_SET: {
+            BudgetStore *bs = s->budgets;
+            int year, month;
+            double before, after;
+            p = log_get(p, &year, sizeof(year));
+            p = log_get(p, &month, sizeof(month));
+            p = log_get(p, &before, sizeof(before));
+            log_get(p, &after, sizeof(after));
+            if (h.fields || forward) {
+                if (h.slot < bs->size) {
+                    bs->data[h.slot].amount = forward ? after : before;
+                } else {
+                    bs->data = grow_array(bs->data, &bs->cap, bs->size + 1, sizeof(BudgetEntry), 8);
+                    BudgetEntry be = {h.id, year, month, after};
+                    bs->data[bs->size++] = be;
+                }
+            } else if (bs->size) {
+                bs->size--; /* the entry was appended by this op */
+            }
+            break;
+        }
+    }
+}
+
+/* -- undo / redo -- */
+
+static void op_apply(size_t n, int forward) {
+    StoreCtx s = active_ctx();
+    size_t end = (n + 1 < oplog.count) ? oplog.offs[n + 1] : oplog.used;
+    op_apply_bytes(&s, oplog.buf + oplog.offs[n], forward);
+    journal_append(oplog.buf + oplog.offs[n], end - oplog.offs[n], forward);
+}
+
+static uint32_t op_group(size_t n) {
+    OpHead h;
+    memcpy(&h, oplog.buf + oplog.offs[n], sizeof(h));
+    return h.group;
+}
+
+/* Undo up to steps groups; returns how many were undone */
+int undo(int steps) {
+    int done = 0;
+    for (; done < steps && oplog.cursor > 0; ++done) {
+        uint32_t g = op_group(oplog.cursor - 1);
+        while (oplog.cursor > 0 && op_group(oplog.cursor - 1) == g) {
+            op_apply(oplog.cursor - 1, 0);
+            oplog.cursor--;
+        }
+    }
+    journal_commit();
+    return done;
+}
+
+int redo(int steps) {
+    int done = 0;
+    for (; done < steps && oplog.cursor < oplog.count; ++done) {
+        uint32_t g = op_group(oplog.cursor);
+        while (oplog.cursor < oplog.count && op_group(oplog.cursor) == g) {
+            op_apply(oplog.cursor, 1);
+            oplog.cursor++;
+        }
+    }
+    journal_commit();
+    return done;
+}
+
+void undo_menu(int redo_mode) {
+    printf("%s how many steps [1]: ", redo_mode ? "Redo" : "Undo");
+    int n = read_int();
+    if (n <= 0) n = 1;
+    int done = redo_mode ? redo(n) : undo(n);
+    if (done == 0) printf("Nothing to %s.\n", redo_mode ? "redo" : "undo");
+    else printf("%s %d step(s).\n", redo_mode ? "Redid" : "Undid", done);
+}
+
+/* -------------------- Journal, checkpoints and time travel -------------------- */
+
+#define FNV32_INIT 2166136261u
+
+static uint32_t fnv32_more(uint32_t h, const unsigned char *p, size_t n) {
+    for (size_t i = 0; i < n; ++i) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+static uint32_t fnv32(const unsigned char *p, size_t n) {
+    return fnv32_more(FNV32_INIT, p, n);
+}
+
+/* Flush f to disk and close it; returns 0 if anything failed */
+static int file_sync_close(FILE *f) {
+    int ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && !ferror(f);
+    return fclose(f) == 0 && ok;
+}
+
+/* Checkpoints of dir sorted by seq; caller frees */
+static size_t checkpoint_list(const char *dir, CheckpointInfo **out) {
+    char cdir[PATH_LEN + 32];
+    snprintf(cdir, sizeof(cdir), "%s/%s", dir, CKPT_DIR);
+    *out = NULL;
+    DIR *d = opendir(cdir);
+    if (!d) return 0;
+    size_t n = 0, cap = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (strncmp(e->d_name, "ckpt-", 5) != 0) continue;
+        CheckpointInfo ci;
+        CheckpointHeader h;
+        snprintf(ci.path, sizeof(ci.path), "%s/%s", cdir, e->d_name);
+        FILE *f = fopen(ci.path, "rb");
+        if (!f) continue;
+        int ok = fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, CKPT_MAGIC, 4) == 0;
+        fclose(f);
+        if (!ok) continue;
+        ci.seq = h.seq;
+        ci.ts = h.ts;
+        ci.journal_offset = h.journal_offset;
+        *out = grow_array(*out, &cap, n + 1, sizeof(CheckpointInfo), 8);
+        (*out)[n++] = ci;
+    }
+    closedir(d);
+    for (size_t i = 1; i < n; ++i) {  /* few entries: insertion sort */
+        CheckpointInfo ci = (*out)[i];
+        size_t j = i;
+        while (j > 0 && (*out)[j - 1].seq > ci.seq) { (*out)[j] = (*out)[j - 1]; --j; }
+        (*out)[j] = ci;
+    }
+    return n;
+}
+
+/* Write a full copy of the stores to path, taking the transactions from
+   tree when it is set; returns 0 on failure. Archived rows are not
+   copied: after the budgets come the number of archive segments and
+   their file names, which stay readable for as long as the checkpoint
+   is kept (see checkpoint_seg_path()). */
+static int checkpoint_write_path(const char *path, const TxnStore *ts, TxnTree *tree, const ArchiveSeg *segs,
+                                 size_t nsegs, const CatStore *cs, const BudgetStore *bs, uint64_t seq,
+                                 uint64_t journal_offset) {
+    FILE *f = fopen(path, "wb");
+    if (!f) return 0;
+    CheckpointHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CKPT_MAGIC, 4);
+    h.version = CKPT_VERSION;
+    h.seq = seq;
+    h.ts = (int64_t)time(NULL);
+    h.journal_offset = journal_offset;
+    h.ncats = cs->size;
+    h.ntxns = tree ? tree->rows.h.count : ts->size;
+    h.nbudgets = bs->size;
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(cs->data, sizeof(Category), cs->size, f);
+    if (tree) {
+        BtCursor cur;
+        BtKey lo = {INT32_MIN, INT32_MIN}, hi = {INT32_MAX, INT32_MAX};
+        const unsigned char *v;
+        bt_seek(&cur, &tree->rows, lo, hi);
+        while ((v = bt_next(&cur, NULL)) != NULL) fwrite(v, sizeof(Transaction), 1, f);
+    } else {
+        fwrite(ts->data, sizeof(Transaction), ts->size, f);
+    }
+    fwrite(bs->data, sizeof(BudgetEntry), bs->size, f);
+    uint64_t n = nsegs;
+    fwrite(&n, sizeof(n), 1, f);
+    for (size_t i = 0; i < nsegs; ++i) fwrite(segs[i].file, sizeof(segs[i].file), 1, f);
+    return file_sync_close(f);
+}
+
+static int checkpoint_write(const char *dir, const TxnStore *ts, TxnTree *tree, const CatStore *cs,
+                            const BudgetStore *bs, uint64_t seq, uint64_t journal_offset) {
+    char path[PATH_LEN + 64];
+    snprintf(path, sizeof(path), "%s/%s", dir, CKPT_DIR);
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) return 0;
+    snprintf(path, sizeof(path), "%s/%s/ckpt-%012llu.dat", dir, CKPT_DIR, (unsigned long long)seq);
+    const Ledger *L = &ledgers[active_ledger];
+    int ok = checkpoint_write_path(path, ts, tree, L->arch, L->narch, cs, bs, seq, journal_offset);
+    if (!ok) fprintf(stderr, "Warning: unable to write checkpoint %s\n", path);
+    return ok;
+}
+
+/* Header version of the checkpoint at path, 0 if it is unreadable */
+static uint32_t checkpoint_version(const char *path) {
+    FILE *f = fopen(path, "rb");
+    CheckpointHeader h;
+    int ok = f && fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, CKPT_MAGIC, 4) == 0;
+    if (f) fclose(f);
+    return ok ? h.version : 0;
+}
+
+/* Names of the archive segments the checkpoint at path refers to,
+   after its budgets (none before version 5); caller frees. -1 if they
+   cannot be read. */
+static long checkpoint_segs(const char *path, char (**names)[32]) {
+    FILE *f = fopen(path, "rb");
+    CheckpointHeader h;
+    uint64_t n = 0;
+    *names = NULL;
+    if (!f) return -1;
+    int ok = fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, CKPT_MAGIC, 4) == 0;
+    if (ok && h.version >= 5) {
+        long at = (long)(sizeof(h) + h.ncats * sizeof(Category) + h.ntxns * sizeof(Transaction) +
+                         h.nbudgets * sizeof(BudgetEntry));
+        ok = fseek(f, at, SEEK_SET) == 0 && fread(&n, sizeof(n), 1, f) == 1 && n < (1u << 20);
+        if (ok) {
+            *names = xmalloc((n ? n : 1) * sizeof(**names));
+            ok = fread(*names, sizeof(**names), n, f) == n;
+            for (uint64_t i = 0; ok && i < n; ++i) ok = memchr((*names)[i], 0, sizeof(**names)) != NULL;
+        }
+    }
+    fclose(f);
+    if (!ok) {
+        free(*names);
+        *names = NULL;
+        return -1;
+    }
+    return (long)n;
+}
+
+/* Where the segment name a checkpoint at ckpt refers to is: beside the
+   checkpoint (a segment thawed since, or the copy in a backup
+   directory), else in the archive of the ledger whose checkpoints
+   directory holds it. 0 if it is in neither. */
+static int checkpoint_seg_path(const char *ckpt, const char *name, char *out, size_t sz) {
+    const char *slash = strrchr(ckpt, '/');
+    int dl = slash ? (int)(slash - ckpt) : 1;
+    const char *dir = slash ? ckpt : ".";
+    struct stat st;
+    snprintf(out, sz, "%.*s/%s", dl, dir, name);
+    if (stat(out, &st) == 0) return 1;
+    snprintf(out, sz, "%.*s/../%s/%s", dl, dir, ARCHIVE_DIR, name);
+    return stat(out, &st) == 0;
+}
+
+static Transaction *archive_read(const char *path, size_t *count);
+static void archive_path(char *out, size_t sz, const char *dir, const char *file);
+static Transaction *archive_rows(const Ledger *L, const ArchiveSeg *s, size_t *count);
+
+/* Read the checkpoint at path, archived rows included: the segments it
+   names are decompressed one at a time and added to ts */
+static int checkpoint_read(const char *path, TxnStore *ts, CatStore *cs, BudgetStore *bs) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    CheckpointHeader h;
+    int ok = fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, CKPT_MAGIC, 4) == 0;
+    if (ok) {
+        cs->data = xmalloc((h.ncats ? h.ncats : 1) * sizeof(Category));
+        ts->data = xmalloc((h.ntxns ? h.ntxns : 1) * sizeof(Transaction));
+        bs->data = xmalloc((h.nbudgets ? h.nbudgets : 1) * sizeof(BudgetEntry));
+        cs->size = fread(cs->data, sizeof(Category), h.ncats, f);
+        ts->size = fread(ts->data, sizeof(Transaction), h.ntxns, f);
+        bs->size = fread(bs->data, sizeof(BudgetEntry), h.nbudgets, f);
+        cs->cap = h.ncats ? h.ncats : 1;
+        ts->cap = h.ntxns ? h.ntxns : 1;
+        bs->cap = h.nbudgets ? h.nbudgets : 1;
+        ok = cs->size == h.ncats && ts->size == h.ntxns && bs->size == h.nbudgets;
+    }
+    fclose(f);
+    char (*segs)[32];
+    long nsegs = ok ? checkpoint_segs(path, &segs) : -1;
+    ok = nsegs >= 0;
+    for (long i = 0; ok && i < nsegs; ++i) {
+        char seg[PATH_LEN + 128];
+        size_t n = 0;
+        Transaction *rows = checkpoint_seg_path(path, segs[i], seg, sizeof(seg)) ? archive_read(seg, &n) : NULL;
+        if (!rows) {
+            fprintf(stderr, "Warning: archive segment %s of %s is missing or damaged\n", segs[i], path);
+            ok = 0;
+            break;
+        }
+        ts->data = grow_array(ts->data, &ts->cap, ts->size + n, sizeof(Transaction), 16);
+        memcpy(ts->data + ts->size, rows, n * sizeof(Transaction));
+        ts->size += n;
+        free(rows);
+    }
+    if (nsegs >= 0) free(segs);
+    return ok;
+}
+
+/* Remove the thawed segments kept beside L's checkpoints (see
+   archive_thaw()) that no checkpoint names any more */
+static void checkpoint_drop_segs(Ledger *L) {
+    char dir[PATH_LEN + 32], path[PATH_LEN + 320];
+    snprintf(dir, sizeof(dir), "%s/%s", L->dir, CKPT_DIR);
+    DIR *d = opendir(dir);
+    if (!d) return;
+    CheckpointInfo *cks;
+    size_t n = checkpoint_list(L->dir, &cks);
+    char (**refs)[32] = xmalloc((n ? n : 1) * sizeof(*refs));
+    long *nrefs = xmalloc((n ? n : 1) * sizeof(long));
+    for (size_t i = 0; i < n; ++i) nrefs[i] = checkpoint_segs(cks[i].path, &refs[i]);
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (strncmp(e->d_name, "seg-", 4) != 0) continue;
+        int used = 0;
+        for (size_t i = 0; i < n && !used; ++i) {
+            used = nrefs[i] < 0; /* unreadable: keep what it may name */
+            for (long k = 0; k < nrefs[i] && !used; ++k) used = strcmp(refs[i][k], e->d_name) == 0;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if (!used) remove(path);
+    }
+    closedir(d);
+    for (size_t i = 0; i < n; ++i) if (nrefs[i] >= 0) free(refs[i]);
+    free(refs);
+    free(nrefs);
+    free(cks);
+}
+
+/* Read the next intact record; op must hold at least JOURNAL_MAX_OP bytes.
+   Returns the size of its header, 0 at the end of the intact part. */
+static size_t journal_read(FILE *f, JournalRec *r, unsigned char *op) {
+    size_t head = JOURNAL_V1_HEAD;
+    if (fread(r, head, 1, f) != 1) return 0;
+    if (r->magic == JOURNAL_MAGIC) {
+        r->origin = 0;
+    } else if (r->magic == JOURNAL_MAGIC2) {
+        if (fread((unsigned char *)r + head, sizeof(*r) - head, 1, f) != 1) return 0;
+        head = sizeof(*r);
+    } else {
+        return 0;
+    }
+    if (!r->origin) r->origin_seq = r->seq;
+    if (r->len > JOURNAL_MAX_OP) return 0;
+    if (fread(op, 1, r->len, f) != r->len) return 0;
+    return fnv32(op, r->len) == r->check ? head : 0;
+}
+
+/* Journal offset of the newest checkpoint at or before seq */
+static uint64_t journal_resume_offset(const char *dir, uint64_t seq) {
+    CheckpointInfo *cks;
+    size_t nck = checkpoint_list(dir, &cks);
+    uint64_t off = 0;
+    for (size_t i = 0; i < nck && cks[i].seq <= seq; ++i) off = cks[i].journal_offset;
+    free(cks);
+    return off;
+}
+
+#define BT_REBUILD_SUFFIX ".new"
+
+/* Fill the temporary tree nt from the checkpoint at path, returning its
+   categories, budgets and seq; 0 if the checkpoint is incomplete */
+static int tt_fill(TxnTree *nt, const char *dir, const char *path, CatStore *cs, BudgetStore *bs, uint64_t *seq) {
+    FILE *f = fopen(path, "rb");
+    CheckpointHeader h;
+    if (!f || fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, CKPT_MAGIC, 4) != 0 ||
+        !tt_open_as(nt, dir, BT_REBUILD_SUFFIX, 1)) {
+        if (f) fclose(f);
+        return 0;
+    }
+    CatStore c = {xmalloc((h.ncats ? h.ncats : 1) * sizeof(Category)), 0, h.ncats ? h.ncats : 1, 1};
+    BudgetStore b = {xmalloc((h.nbudgets ? h.nbudgets : 1) * sizeof(BudgetEntry)), 0, h.nbudgets ? h.nbudgets : 1};
+    c.size = fread(c.data, sizeof(Category), h.ncats, f);
+    uint64_t n = 0;
+    Transaction t;
+    while (n < h.ntxns && fread(&t, sizeof(t), 1, f) == 1) {
+        tt_put(nt, &t);
+        n++;
+    }
+    b.size = fread(b.data, sizeof(BudgetEntry), h.nbudgets, f);
+    fclose(f);
+    if (c.size != h.ncats || n != h.ntxns || b.size != h.nbudgets) {
+        free(c.data);
+        free(b.data);
+        tt_close(nt);
+        return 0;
+    }
+    for (size_t i = 0; i < c.size; ++i) if (c.data[i].id >= c.next_id) c.next_id = c.data[i].id + 1;
+    *cs = c;
+    *bs = b;
+    *seq = h.seq;
+    return 1;
+}
+
+/* Whether dir's journal still holds every change from the first on */
+static int journal_from_first(const char *dir) {
+    char path[PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s/%s", dir, JOURNAL_FILE);
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    unsigned char op[JOURNAL_MAX_OP];
+    JournalRec r;
+    int first = journal_read(f, &r, op) != 0 && r.seq == 1;
+    fclose(f);
+    return first;
+}
+
+/* Trees left half written by a crash are rebuilt into temporary files,
+   which replace the damaged ones only once complete. The rows come from
+   the newest intact checkpoint, whose categories and budgets replace
+   L's so every store restarts at its seq, or else from nothing when the
+   journal still reaches back to the first change. The journal is
+   replayed on top afterwards. Returns 0, leaving the tree files alone,
+   when neither is possible. */
+int tt_rebuild(Ledger *L) {
+    CheckpointInfo *cks;
+    size_t nck = checkpoint_list(L->dir, &cks);
+    TxnTree nt;
+    CatStore cs;
+    BudgetStore bs;
+    uint64_t seq = 0;
+    int ok = 0;
+    for (size_t i = nck; !ok && i-- > 0;) ok = tt_fill(&nt, L->dir, cks[i].path, &cs, &bs, &seq);
+    free(cks);
+    if (!ok && journal_from_first(L->dir) && tt_open_as(&nt, L->dir, BT_REBUILD_SUFFIX, 1)) {
+        CatStore c = {xmalloc(sizeof(Category)), 0, 1, 1};
+        BudgetStore b = {xmalloc(sizeof(BudgetEntry)), 0, 1};
+        cs = c;
+        bs = b;
+        ok = 1;
+    }
+    char from[PATH_LEN + 40], to[PATH_LEN + 40], ids_from[PATH_LEN + 40], ids_to[PATH_LEN + 40];
+    snprintf(from, sizeof(from), "%s/%s%s", L->dir, BT_FILE, BT_REBUILD_SUFFIX);
+    snprintf(to, sizeof(to), "%s/%s", L->dir, BT_FILE);
+    snprintf(ids_from, sizeof(ids_from), "%s/%s%s", L->dir, BT_IDS_FILE, BT_REBUILD_SUFFIX);
+    snprintf(ids_to, sizeof(ids_to), "%s/%s", L->dir, BT_IDS_FILE);
+    if (!ok) {
+        remove(from);
+        remove(ids_from);
+        return 0;
+    }
+    /* a crash between the renames leaves trees of different
+       generations, which load_ledger_rows() rebuilds again */
+    ok = tt_flush(&nt, seq, 0);
+    tt_close(&nt);
+    ok = ok && rename(ids_from, ids_to) == 0 && rename(from, to) == 0;
+    if (ok) {
+        tt_close(L->tree);
+        ok = tt_open(L->tree, L->dir, 0);
+    }
+    if (!ok) {
+        remove(from);
+        remove(ids_from);
+        free(cs.data);
+        free(bs.data);
+        return 0;
+    }
+    free(L->cats.data);
+    free(L->budgets.data);
+    L->cats = cs;
+    L->budgets = bs;
+    L->generation = seq;
+    return 1;
+}
+
+/* Offset just past the last intact record from off on that does not
+   belong to an atomic group whose end is missing; f is left at off */
+static uint64_t journal_complete_end(FILE *f, uint64_t off) {
+    unsigned char op[JOURNAL_MAX_OP];
+    JournalRec r;
+    size_t head;
+    uint64_t pos = off, end = off;
+    while ((head = journal_read(f, &r, op)) != 0) {
+        pos += head + r.len;
+        if (!(r.forward & JOURNAL_IN_GROUP) || (r.forward & JOURNAL_GROUP_END)) end = pos;
+    }
+    fseek(f, (long)off, SEEK_SET);
+    return end;
+}
+
+/* Replay the records from journal offset off on that are newer than
+   L->generation into L's stores, its id index and any aggregates loaded
+   with them, and note where the intact part of the journal ends (a torn
+   last record, or a group cut short, is left for later). Returns how
+   many were applied. */
+size_t journal_replay(Ledger *L, uint64_t off) {
+    char path[PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s/%s", L->dir, JOURNAL_FILE);
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    if ((long)off > size) {
+        fprintf(stderr, "Error: the journal of ledger '%s' ends at byte %ld, before the %llu its checkpoints "
+                "record; changes after its saved files cannot be recovered.\n", L->name, size,
+                (unsigned long long)off);
+        fclose(f);
+        L->journal_end = (uint64_t)size;
+        return 0;
+    }
+    fseek(f, (long)off, SEEK_SET);
+    StoreCtx s = {&L->txns, &L->cats, &L->budgets, &L->index, L->agg_valid ? &L->agg : NULL, L->tree};
+    unsigned char op[JOURNAL_MAX_OP];
+    JournalRec r;
+    size_t replayed = 0, head;
+    uint64_t stop = journal_complete_end(f, off);
+    L->journal_end = off;
+    while (L->journal_end < stop && (head = journal_read(f, &r, op)) != 0) {
+        L->journal_end += head + r.len;
+        if (r.seq <= L->generation) continue;
+        if (!replayed) snapshot_privatize(L); /* mapped rows cannot change */
+        if (!L->index.cap) index_build(&L->index, &L->txns);
+        op_apply_bytes(&s, op, (int)(r.forward & JOURNAL_FORWARD));
+        L->generation = r.seq;
+        replayed++;
+    }
+    fclose(f);
+    return replayed;
+}
+
+/* Bring L from its saved files up to the end of its journal; a torn
+   last record is dropped */
+void journal_recover(Ledger *L) {
+    L->journal_end = 0;
+    size_t replayed = journal_replay(L, journal_resume_offset(L->dir, L->generation));
+    if (replayed)
+        fprintf(stderr, "Recovered %zu change(s) for ledger '%s' from its journal.\n", replayed, L->name);
+}
+
+/* Whether dir's journal holds intact records newer than generation,
+   i.e. whether loading the ledger will replay anything */
+int journal_has_tail(const char *dir, uint64_t generation) {
+    char path[PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s/%s", dir, JOURNAL_FILE);
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    uint64_t off = journal_resume_offset(dir, generation);
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    if ((long)off > size) { /* damaged: journal_replay() reports it */
+        fclose(f);
+        return 0;
+    }
+    fseek(f, (long)off, SEEK_SET);
+    uint64_t stop = journal_complete_end(f, off);
+    unsigned char op[JOURNAL_MAX_OP];
+    JournalRec r;
+    int tail = 0;
+    size_t head;
+    while (!tail && off < stop && (head = journal_read(f, &r, op)) != 0) {
+        off += head + r.len;
+        tail = r.seq > generation;
+    }
+    fclose(f);
+    return tail;
+}
+
+static uint64_t journal_rows_from(const char *dir, uint64_t off);
+
+void journal_open_active() {
+    Ledger *L = &ledgers[active_ledger];
+    char path[PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s/%s", L->dir, JOURNAL_FILE);
+    struct stat st;
+    if (stat(path, &st) == 0 && (uint64_t)st.st_size > L->journal_end) {
+        if (truncate(path, (off_t)L->journal_end) != 0)
+            fprintf(stderr, "Warning: unable to drop damaged journal tail of %s\n", path);
+    }
+    journal_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (journal_fd < 0) {
+        fprintf(stderr, "Warning: unable to open %s — changes are not journaled\n", path);
+        return;
+    }
+    journal_ckpt_rows = txn_count();
+    CheckpointInfo *cks;
+    size_t nck = checkpoint_list(L->dir, &cks);
+    /* count what earlier sessions wrote since the newest checkpoint, so
+       short sessions still add up to one */
+    journal_since_ckpt = nck ? journal_rows_from(L->dir, cks[nck - 1].journal_offset) : 0;
+    free(cks);
+    if (nck == 0) checkpoint_active(); /* history starts here */
+}
+
+void journal_close() {
+    journal_atomic_end();
+    if (!journal_flush() && journal_pending) { /* the next ledger's journal must not get them */
+        fprintf(stderr, "Warning: %llu change(s) of ledger '%s' are in its data files only\n",
+                (unsigned long long)journal_pending, ledgers[active_ledger].name);
+        journal_buflen = 0;
+        journal_pending = 0;
+    }
+    journal_sync();
+    if (journal_fd >= 0) close(journal_fd);
+    journal_fd = -1;
+}
+
+/* Records go out whole, several per write(), so the file never holds
+   half a record that another process could read or append after. The
+   ledger's generation and journal end move past them only once all are
+   written; after a failure whatever part went out is cut off again and
+   they stay buffered for the next flush. Inside an atomic group its
+   newest record stays buffered, to be marked as the group's end. Returns
+   0 on failure. */
+int journal_flush() {
+    Ledger *L = &ledgers[active_ledger];
+    size_t off = 0, len = journal_buflen;
+    uint64_t recs = journal_pending;
+    if (journal_atomic_last != SIZE_MAX) {
+        len = journal_atomic_last;
+        recs--;
+    }
+    while (journal_fd >= 0 && off < len) {
+        ssize_t n = write(journal_fd, journal_buf + off, len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "Warning: journal write failed: %s\n", n < 0 ? strerror(errno) : "no space");
+            if (off && ftruncate(journal_fd, (off_t)L->journal_end) != 0)
+                fprintf(stderr, "Warning: unable to drop a partly written journal record\n");
+            return 0;
+        }
+        off += (size_t)n;
+        journal_unsynced = 1;
+        metric_add(&metrics.journal_writes, 1);
+        metric_add(&metrics.journal_bytes, (uint64_t)n);
+    }
+    if (journal_fd >= 0) {
+        L->generation += recs;
+        L->journal_end += len;
+    }
+    memmove(journal_buf, journal_buf + len, journal_buflen - len);
+    journal_buflen -= len;
+    journal_pending -= recs;
+    if (journal_atomic_last != SIZE_MAX) journal_atomic_last = 0;
+    return 1;
+}
+
+/* Make the records appended until journal_atomic_end() one group that
+   recovery applies whole or not at all. No checkpoint is taken inside a
+   group, so a due one is taken first. */
+void journal_atomic_begin() {
+    if (!sandbox.active && journal_fd >= 0 && journal_since_ckpt >= CHECKPOINT_EVERY &&
+        journal_since_ckpt >= journal_ckpt_rows)
+        checkpoint_active();
+    journal_atomic = 1;
+    journal_atomic_last = SIZE_MAX;
+}
+
+/* Mark the group's last record as its end; the caller commits it */
+void journal_atomic_end() {
+    if (journal_atomic_last != SIZE_MAX) {
+        JournalRec r;
+        memcpy(&r, journal_buf + journal_atomic_last, sizeof(r));
+        r.forward |= JOURNAL_GROUP_END;
+        memcpy(journal_buf + journal_atomic_last, &r, sizeof(r));
+    }
+    journal_atomic = 0;
+    journal_atomic_last = SIZE_MAX;
+}
+
+/* fdatasync() the journal if anything was written since the last one;
+   returns 0 if that failed */
+int journal_sync() {
+    if (journal_fd < 0 || !journal_unsynced) return 1;
+    uint64_t start = now_ns();
+    int ok = fdatasync(journal_fd) == 0;
+    if (!ok) fprintf(stderr, "Warning: journal sync failed: %s\n", strerror(errno));
+    journal_unsynced = 0;
+    journal_synced_at = now_ns();
+    metric_observe(MOP_FSYNC, start);
+    return ok;
+}
+
+/* End of a change: write it out and make it durable, unless durability
+   is async or the daemon will sync it with its group. Returns 0 if the
+   change may not survive a crash. */
+int journal_commit() {
+    if (!journal_flush()) return 0;
+    if (durability != DURABLE_ASYNC && !journal_group_commit) return journal_sync();
+    return 1;
+}
+
+/* Lowest seq of ours that a replica dir's ledger synced with still
+   reads from the journal, UINT64_MAX if none. Replicas that have
+   nothing from us are sent a snapshot and need no journal. */
+static uint64_t sync_pinned_seq(const char *dir) {
+    char path[PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s/%s", dir, SYNC_FILE);
+    FILE *f = fopen(path, "r");
+    if (!f) return UINT64_MAX;
+    uint64_t pin = UINT64_MAX, self = 0;
+    char line[256];
+    unsigned long long a, b, c;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "replica %llx", &a) == 1) self = a;
+        else if (sscanf(line, "stamped %llu", &a) == 1 && a < pin) pin = a;
+        else if (sscanf(line, "peer %llx %llx %llu", &a, &b, &c) == 3 && b == self && c && c < pin) pin = c;
+    }
+    fclose(f);
+    return pin;
+}
+
+/* Lowest seq a backup directory of dir's ledger still needs the
+   journal after, UINT64_MAX if none */
+static uint64_t backup_pinned_seq(const char *dir) {
+    char path[PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s/%s", dir, BACKUP_PIN_FILE);
+    FILE *f = fopen(path, "r");
+    if (!f) return UINT64_MAX;
+    uint64_t pin = UINT64_MAX;
+    char line[PATH_LEN + 64];
+    unsigned long long a;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "pin %llu", &a) == 1 && a < pin) pin = a;
+    }
+    fclose(f);
+    return pin;
+}
+
+/* Drop the checkpoints of the active ledger older than the newest
+   CKPT_KEEP and punch the journal before the oldest one left. Saved
+   data files older than that are published first rather than keeping
+   the journal they would be recovered from, and the journal the next
+   backup or a known replica reads is kept. */
+static void checkpoint_drop_segs(Ledger *L);
+static void checkpoint_prune(Ledger *L) {
+    CheckpointInfo *cks;
+    size_t n = checkpoint_list(L->dir, &cks);
+    if (n <= CKPT_KEEP) { free(cks); checkpoint_drop_segs(L); return; }
+    size_t keep = n - CKPT_KEEP;
+    char path[PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s/%s", L->dir, CAT_FILE);
+    if (file_generation(path) < cks[keep].seq) {
+        ledger_stash_active();
+        save_ledger(L);
+    }
+    uint64_t pins[3] = {file_generation(path), sync_pinned_seq(L->dir), backup_pinned_seq(L->dir)};
+    for (int i = 0; i < 3; ++i) /* keep the newest checkpoint at or before each */
+        while (keep > 0 && cks[keep].seq > pins[i]) keep--;
+    for (size_t i = 0; i < keep; ++i) remove(cks[i].path);
+    if (keep > 0) {
+        snprintf(path, sizeof(path), "%s/%s", L->dir, JOURNAL_FILE);
+        int fd = open(path, O_WRONLY);
+        /* a file system without hole punching keeps the whole journal */
+        if (fd >= 0 && cks[keep].journal_offset > 0)
+            (void)fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, (off_t)cks[keep].journal_offset);
+        if (fd >= 0) close(fd);
+    }
+    free(cks);
+    checkpoint_drop_segs(L);
+}
+
+/* Returns 0 if the checkpoint could not be written */
+int checkpoint_active() {
+    Ledger *L = &ledgers[active_ledger];
+    if (!journal_flush() || journal_pending) return 0; /* the stores are ahead of the generation */
+    journal_sync(); /* the checkpoint says to resume at the journal's end */
+    int ok = checkpoint_write(L->dir, &txns, txn_tree, &cats, &budgets, L->generation, L->journal_end);
+    journal_since_ckpt = 0;
+    journal_ckpt_rows = txn_count();
+    metric_add(&metrics.checkpoints, 1);
+    if (ledger_has_readers(L)) { /* publish, so readers need not wait for exit */
+        ledger_stash_active();
+        save_ledger(L);
+    }
+    checkpoint_prune(L);
+    return ok;
+}
+
+/* Rows an encoded op touches, so checkpoints keep pace with batches */
+static size_t op_rows(const unsigned char *op) {
+    OpHead h;
+    uint32_t n = 1;
+    memcpy(&h, op, sizeof(h));
+    if (h.kind == OP_TXN_BATCH) memcpy(&n, op + sizeof(h), sizeof(n));
+    return n;
+}
+
+/* Rows the records of dir's journal from offset off on touch */
+static uint64_t journal_rows_from(const char *dir, uint64_t off) {
+    char path[PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s/%s", dir, JOURNAL_FILE);
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    unsigned char op[JOURNAL_MAX_OP];
+    JournalRec r;
+    uint64_t rows = 0;
+    if (fseek(f, (long)off, SEEK_SET) == 0)
+        while (journal_read(f, &r, op) != 0) rows += op_rows(op);
+    fclose(f);
+    return rows;
+}
+
+/* Append one encoded op; forward = 0 records an undo of it */
+void journal_append(const unsigned char *op, size_t len, int forward) {
+    if (sandbox.active) {
+        unsigned char fw = (unsigned char)forward;
+        uint32_t n = (uint32_t)len;
+        sandbox.offs = grow_array(sandbox.offs, &sandbox.cap, sandbox.count + 1, sizeof(size_t), 64);
+        sandbox.buf = grow_array(sandbox.buf, &sandbox.bufcap, sandbox.used + 5 + len, 1, 4096);
+        sandbox.offs[sandbox.count++] = sandbox.used;
+        memcpy(sandbox.buf + sandbox.used, &fw, 1);
+        memcpy(sandbox.buf + sandbox.used + 1, &n, 4);
+        memcpy(sandbox.buf + sandbox.used + 5, op, len);
+        sandbox.used += 5 + len;
+        return;
+    }
+    if (journal_fd < 0) return;
+    /* callers apply an op after journaling it, so a due checkpoint waits
+       for the next append, when the stores match the generation again */
+    if (!journal_atomic && journal_since_ckpt >= CHECKPOINT_EVERY && journal_since_ckpt >= journal_ckpt_rows)
+        checkpoint_active();
+    Ledger *L = &ledgers[active_ledger];
+    uint32_t flags = (forward ? JOURNAL_FORWARD : 0) | (journal_atomic ? JOURNAL_IN_GROUP : 0);
+    JournalRec r = {JOURNAL_MAGIC2, (uint32_t)len, L->generation + journal_pending + 1, (int64_t)time(NULL),
+                    flags, fnv32(op, len), journal_origin, journal_origin_seq};
+    if (journal_atomic) journal_atomic_last = journal_buflen;
+    journal_buf = grow_array(journal_buf, &journal_bufcap, journal_buflen + sizeof(r) + len, 1, 4096);
+    memcpy(journal_buf + journal_buflen, &r, sizeof(r));
+    memcpy(journal_buf + journal_buflen + sizeof(r), op, len);
+    journal_buflen += sizeof(r) + len;
+    journal_pending++;
+    if (!oplog.group_open) journal_commit();
+    else if (journal_buflen >= JOURNAL_BUF) journal_flush();
+    journal_since_ckpt += op_rows(op);
+}
+
+/* Rebuild L's stores as they were at time when: start from the newest
+   checkpoint taken at or before it and replay the journal up to it.
+   Returns 0 when history does not reach back that far. */
+int asof_build(const Ledger *L, time_t when, TxnStore *ts, CatStore *cs, BudgetStore *bs, size_t *replayed) {
+    CheckpointInfo *cks;
+    size_t nck = checkpoint_list(L->dir, &cks);
+    long pick = -1;
+    for (size_t i = 0; i < nck; ++i) if (cks[i].ts <= (int64_t)when) pick = (long)i;
+    memset(ts, 0, sizeof(*ts));
+    memset(cs, 0, sizeof(*cs));
+    memset(bs, 0, sizeof(*bs));
+    *replayed = 0;
+    if (pick < 0 || !checkpoint_read(cks[pick].path, ts, cs, bs)) { free(cks); return 0; }
+    uint64_t off = cks[pick].journal_offset;
+    free(cks);
+    char path[PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s/%s", L->dir, JOURNAL_FILE);
+    FILE *f = fopen(path, "rb");
+    if (f) {
+        fseek(f, (long)off, SEEK_SET);
+        IdIndex ix = {NULL, NULL, 0, 0, NULL, 0};
+        index_build(&ix, ts);
+        StoreCtx s = {ts, cs, bs, &ix, NULL, NULL};
+        unsigned char op[JOURNAL_MAX_OP];
+        JournalRec r;
+        while (journal_read(f, &r, op) && r.ts <= (int64_t)when) {
+            op_apply_bytes(&s, op, (int)(r.forward & JOURNAL_FORWARD));
+            (*replayed)++;
+        }
+        index_free(&ix);
+        fclose(f);
+    }
+    return 1;
+}
+
+/* "YYYY-MM-DD" (end of that day) or "YYYY-MM-DD HH:MM" in local time */
+static int parse_when(const char *s, time_t *out) {
+    struct tm tm;
+    char date[DATE_STRLEN];
+    int hh = 23, mm = 59, ss = 59;
+    if (strlen(s) < 10) return 0;
+    memcpy(date, s, 10);
+    date[10] = 0;
+    if (!parse_date(date, &tm)) return 0;
+    if (s[10] && sscanf(s + 10, " %d:%d", &hh, &mm) == 2) ss = 0;
+    else if (s[10]) return 0;
+    tm.tm_hour = hh;
+    tm.tm_min = mm;
+    tm.tm_sec = ss;
+    tm.tm_isdst = -1;
+    *out = mktime(&tm);
+    return *out != (time_t)-1;
+}
+
+void time_travel_menu() {
+    printf("As of (YYYY-MM-DD or YYYY-MM-DD HH:MM): ");
+    char buf[64]; read_line(buf, sizeof(buf));
+    time_t when;
+    if (!parse_when(buf, &when)) { printf("Invalid time.\n"); return; }
+    journal_flush();
+    TxnStore pts;
+    CatStore pcs;
+    BudgetStore pbs;
+    size_t replayed;
+    if (!asof_build(&ledgers[active_ledger], when, &pts, &pcs, &pbs, &replayed)) {
+        printf("No history for this ledger goes back to %s.\n", buf);
+        return;
+    }
+    /* swap the past state in; the live stores and their derived
+       structures are put back untouched afterwards */
+    TxnStore live_t = txns;
+    CatStore live_c = cats;
+    BudgetStore live_b = budgets;
+    IdIndex live_ix = txn_index;
+    TxnTree *live_tree = txn_tree;
+    Cube live_cube = month_cube;
+    int live_cube_valid = month_cube_valid;
+    txns = pts;
+    cats = pcs;
+    budgets = pbs;
+    memset(&txn_index, 0, sizeof(txn_index));
+    memset(&month_cube, 0, sizeof(month_cube));
+    month_cube_valid = 0;
+    txn_tree = NULL; /* the past state is all in memory */
+    Ledger *L = &ledgers[active_ledger];
+    size_t live_narch = L->narch;
+    L->narch = 0; /* checkpoint_read() added the archived rows too */
+    index_rebuild();
+    printf("Viewing '%s' as of %s (%zu journal record(s) replayed after the checkpoint).\n",
+           ledgers[active_ledger].name, buf, replayed);
+    for (;;) {
+        printf("As of %s: 1=list 2=reports 3=search 0=back : ", buf);
+        int c = read_int();
+        if (c == 1) list_transactions(NULL, NULL);
+        else if (c == 2) {
+            printf("Year: "); int y = read_int();
+            printf("Month: "); int m = read_int();
+            monthly_summary(y, m);
+            category_summary(y, m);
+            budget_report(y, m);
+        } else if (c == 3) search_transactions();
+        else break;
+    }
+    free(txns.data);
+    free(cats.data);
+    free(budgets.data);
+    index_free(&txn_index);
+    cube_free(&month_cube);
+    txns = live_t;
+    cats = live_c;
+    budgets = live_b;
+    txn_index = live_ix;
+    txn_tree = live_tree;
+    month_cube = live_cube;
+    month_cube_valid = live_cube_valid;
+    L->narch = live_narch;
+}
+
+/* -------------------- Persisted indexes and aggregates -------------------- */
+
+/* Changes whenever a rate or the base currency does, so aggregates
+   converted with other rates are never reused */
+uint32_t rates_fingerprint() {
+    uint32_t h = fnv32((const unsigned char *)base_currency, strlen(base_currency));
+    for (size_t i = 0; i < rates.size; ++i) {
+        const FxRate *r = &rates.data[i];
+        h = fnv32_more(h, (const unsigned char *)r->currency, strlen(r->currency));
+        h = fnv32_more(h, (const unsigned char *)r->date, strlen(r->date));
+        h = fnv32_more(h, (const unsigned char *)&r->rate, sizeof(r->rate));
+    }
+    return h;
+}
+
+/* Queue whichever of L's id index and aggregates are complete on b, to
+   be written next to its data files; the active ledger must have been
+   stashed */
+void derived_submit(const Ledger *L, IoBatch *b) {
+    char path[PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s/%s", L->dir, DERIVED_FILE);
+    const IdIndex *ix = &L->index;
+    const Cube *c = &L->agg;
+    int with_index = !L->tree && ix->cap && ix->used == L->txns.size;
+    if (!with_index && !L->agg_valid) {
+        remove(path);
+        return;
+    }
+    DerivedHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DERIVED_MAGIC, sizeof(h.magic));
+    h.version = 2;
+    h.generation = L->generation;
+    h.ntxns = L->tree ? 0 : L->txns.size;
+    if (with_index) {
+        h.index_cap = ix->cap;
+        h.index_used = ix->used;
+    }
+    if (L->agg_valid) {
+        h.has_cube = 1;
+        h.rates = L->agg_rates;
+        h.ncells = c->size;
+        h.narchived = c->narchived;
+        h.rows = c->rows;
+        h.missing_rates = c->missing_rates;
+        h.check = fnv32_more(fnv32((const unsigned char *)c->cells, c->size * sizeof(CubeCell)),
+                             (const unsigned char *)c->archived, c->narchived * sizeof(int));
+    }
+    h.head_check = fnv32((const unsigned char *)&h, offsetof(DerivedHeader, head_check));
+    /* a new file is renamed over the old one, which may still be mapped */
+    int fd = io_create(b, path, 1, 1);
+    if (fd < 0) {
+        fprintf(stderr, "Warning: unable to save %s\n", path);
+        return;
+    }
+    off_t off = sizeof(h);
+    io_write_copy(b, fd, &h, sizeof(h), 0);
+    if (with_index) {
+        io_write(b, fd, ix->ids, ix->cap * sizeof(int), off, 0);
+        off += (off_t)(ix->cap * sizeof(int));
+        io_write(b, fd, ix->pos, ix->cap * sizeof(size_t), off, 0);
+        off += (off_t)(ix->cap * sizeof(size_t));
+    }
+    if (h.has_cube) {
+        io_write(b, fd, c->cells, c->size * sizeof(CubeCell), off, 0);
+        off += (off_t)(c->size * sizeof(CubeCell));
+        io_write(b, fd, c->archived, c->narchived * sizeof(int), off, 0);
+    }
+}
+
+/* Take over L's saved aggregates and map its saved id index when they
+   reflect exactly the stores just loaded. Checks are cheap: header
+   checksum, generation, sizes and a sample of ids. Anything that does
+   not match is left to be rebuilt. */
+void derived_load(Ledger *L) {
+    char path[PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s/%s", L->dir, DERIVED_FILE);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    DerivedHeader h;
+    struct stat st;
+    size_t ntxns = L->tree ? 0 : L->txns.size;
+    if (fstat(fd, &st) != 0 || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+        memcmp(h.magic, DERIVED_MAGIC, sizeof(h.magic)) != 0 || h.version != 2 ||
+        h.head_check != fnv32((const unsigned char *)&h, offsetof(DerivedHeader, head_check)) ||
+        h.generation != L->generation || h.ntxns != ntxns ||
+        (uint64_t)st.st_size != sizeof(h) + h.index_cap * (sizeof(int) + sizeof(size_t)) +
+                                    h.ncells * sizeof(CubeCell) + h.narchived * sizeof(int)) {
+        close(fd);
+        return;
+    }
+    if (h.has_cube && h.rates == rates_fingerprint()) {
+        Cube c;
+        memset(&c, 0, sizeof(c));
+        c.cap = h.ncells ? h.ncells : 1;
+        c.archivedcap = h.narchived ? h.narchived : 1;
+        c.cells = xmalloc(c.cap * sizeof(CubeCell));
+        c.archived = xmalloc(c.archivedcap * sizeof(int));
+        off_t off = (off_t)(sizeof(h) + h.index_cap * (sizeof(int) + sizeof(size_t)));
+        size_t cb = h.ncells * sizeof(CubeCell), ab = h.narchived * sizeof(int);
+        if (pread(fd, c.cells, cb, off) == (ssize_t)cb && pread(fd, c.archived, ab, off + (off_t)cb) == (ssize_t)ab &&
+            fnv32_more(fnv32((const unsigned char *)c.cells, cb), (const unsigned char *)c.archived, ab) == h.check) {
+            c.size = h.ncells;
+            c.narchived = h.narchived;
+            c.rows = h.rows;
+            c.missing_rates = h.missing_rates;
+            c.nslots = 32;
+            while (c.nslots < c.size) c.nslots *= 2;
+            cube_rehash(&c);
+            cube_free(&L->agg);
+            L->agg = c;
+            L->agg_valid = 1;
+            L->agg_rates = h.rates;
+        } else {
+            cube_free(&c);
+        }
+    }
+    if (h.index_cap && (h.index_cap & (h.index_cap - 1)) == 0 && h.index_used == ntxns) {
+        void *m = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            char *base = (char *)m + sizeof(h);
+            IdIndex ix = {(int *)base, (size_t *)(base + h.index_cap * sizeof(int)), h.index_cap, h.index_used,
+                          m, (size_t)st.st_size};
+            int ok = 1;
+            for (size_t i = 0; ok && i < ntxns; i += ntxns / 64 + 1)
+                ok = index_lookup(&ix, L->txns.data[i].id) == (long)i;
+            if (ok) {
+                index_free(&L->index);
+                L->index = ix;
+            } else {
+                munmap(m, (size_t)st.st_size);
+            }
+        }
+    }
+    close(fd);
+}
+
+/* -------------------- Sharing between processes -------------------- */
+
+/* One writer per directory: a second copy of the program started while
+   another holds WRITER_LOCK gets 0 and runs read-only. The lock goes
+   with the process, so a crashed writer never leaves it behind. */
+int writer_lock() {
+    int fd = open(WRITER_LOCK, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return 1; /* nowhere to coordinate; as before */
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        char pid[32] = "";
+        ssize_t n = pread(fd, pid, sizeof(pid) - 1, 0);
+        pid[n > 0 ? n : 0] = 0;
+        pid[strcspn(pid, "\n")] = 0;
+        printf("Another copy of the program%s%s%s is changing this directory.\n", pid[0] ? " (pid " : "", pid,
+               pid[0] ? ")" : "");
+        close(fd);
+        return 0;
+    }
+    char pid[32];
+    int n = snprintf(pid, sizeof(pid), "%ld\n", (long)getpid());
+    if (ftruncate(fd, 0) != 0 || pwrite(fd, pid, (size_t)n, 0) != n) {} /* informational only */
+    return 1; /* fd stays open: the lock lasts until exit */
+}
+
+static const char *const snap_files[3] = {CAT_FILE, TRAN_FILE, BUD_FILE};
+static const size_t snap_rec[3] = {sizeof(Category), sizeof(Transaction), sizeof(BudgetEntry)};
+
+/* Map one published data file. Returns 1 on success, 0 when it does
+   not exist (an empty store) and -1 when it cannot be mapped. */
+static int snapshot_map_file(const char *path, size_t rec, void **map, size_t *len, ino_t *ino, FileHeader *h) {
+    *map = NULL;
+    *len = 0;
+    *ino = 0;
+    memset(h, 0, sizeof(*h));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    int rc = -1;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(FileHeader) &&
+        pread(fd, h, sizeof(*h), 0) == (ssize_t)sizeof(*h) && memcmp(h->magic, FILE_MAGIC, 4) == 0 &&
+        h->version >= 3 && h->rec_size == rec && sizeof(*h) + h->count * rec <= (size_t)st.st_size) {
+        void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (m != MAP_FAILED) {
+            *map = m;
+            *len = (size_t)st.st_size;
+            *ino = st.st_ino;
+            rc = 1;
+        }
+    }
+    close(fd);
+    return rc;
+}
+
+static void snapshot_unmap(Ledger *L) {
+    for (int i = 0; i < 3; ++i) {
+        if (L->snap[i]) munmap(L->snap[i], L->snaplen[i]);
+        L->snap[i] = NULL;
+        L->snaplen[i] = 0;
+        L->snapino[i] = 0;
+    }
+}
+
+/* Point L's stores at its published data files. Each file is replaced
+   whole by rename, so a mapping never changes underneath; the three
+   must carry one generation, otherwise a writer is between renames and
+   this retries. Returns 0 when the files cannot be mapped (a B+tree
+   ledger, or files in an older format). */
+int snapshot_map(Ledger *L) {
+    char path[PATH_LEN + 32];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", L->dir, BT_FILE);
+    if (stat(path, &st) == 0) return 0;
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        void *m[3];
+        size_t len[3];
+        ino_t ino[3];
+        FileHeader h[3];
+        int rc[3], bad = 0, mixed = 0;
+        uint64_t gen = 0;
+        int have_gen = 0;
+        for (int i = 0; i < 3; ++i) {
+            snprintf(path, sizeof(path), "%s/%s", L->dir, snap_files[i]);
+            rc[i] = snapshot_map_file(path, snap_rec[i], &m[i], &len[i], &ino[i], &h[i]);
+            if (rc[i] < 0) bad = 1;
+            if (rc[i] <= 0) continue;
+            if (have_gen && h[i].generation != gen) mixed = 1;
+            gen = h[i].generation;
+            have_gen = 1;
+        }
+        if (bad || mixed) {
+            for (int i = 0; i < 3; ++i) if (m[i]) munmap(m[i], len[i]);
+            if (bad) return 0;
+            struct timespec ts = {0, 10 * 1000 * 1000};
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        snapshot_unmap(L);
+        if (L->cats.cap) free(L->cats.data); /* a private copy, see snapshot_privatize() */
+        if (L->txns.cap) free(L->txns.data);
+        if (L->budgets.cap) free(L->budgets.data);
+        index_free(&L->index);
+        cube_free(&L->agg);
+        L->agg_valid = 0;
+        for (int i = 0; i < 3; ++i) {
+            L->snap[i] = m[i];
+            L->snaplen[i] = len[i];
+            L->snapino[i] = ino[i];
+        }
+        /* cap 0: the rows are not ours to grow or free */
+        CatStore cs = {m[0] ? (Category *)((char *)m[0] + sizeof(FileHeader)) : NULL, h[0].count, 0, 1};
+        TxnStore ts = {m[1] ? (Transaction *)((char *)m[1] + sizeof(FileHeader)) : NULL, h[1].count, 0, 1};
+        BudgetStore bs = {m[2] ? (BudgetEntry *)((char *)m[2] + sizeof(FileHeader)) : NULL, h[2].count, 0};
+        for (size_t i = 0; i < cs.size; ++i) if (cs.data[i].id >= cs.next_id) cs.next_id = cs.data[i].id + 1;
+        for (size_t i = 0; i < ts.size; ++i) if (ts.data[i].id >= ts.next_id) ts.next_id = ts.data[i].id + 1;
+        if (h[1].next_id > (uint32_t)ts.next_id) ts.next_id = (int)h[1].next_id;
+        L->cats = cs;
+        L->txns = ts;
+        L->budgets = bs;
+        L->generation = gen;
+        derived_load(L);
+        L->journal_end = journal_resume_offset(L->dir, gen);
+        return 1;
+    }
+    return 0;
+}
+
+static void *snapshot_copy(const void *data, size_t n, size_t sz, size_t *cap) {
+    *cap = n;
+    if (!n) return NULL;
+    void *p = xmalloc(n * sz);
+    memcpy(p, data, n * sz);
+    return p;
+}
+
+/* Copy L's mapped stores into memory of its own before journal records
+   are applied to them. The mappings go, but their inodes are kept: the
+   copy is dropped again for the files the writer publishes next. */
+void snapshot_privatize(Ledger *L) {
+    if (!L->snap[0] && !L->snap[1] && !L->snap[2]) return;
+    L->cats.data = snapshot_copy(L->cats.data, L->cats.size, sizeof(Category), &L->cats.cap);
+    L->txns.data = snapshot_copy(L->txns.data, L->txns.size, sizeof(Transaction), &L->txns.cap);
+    L->budgets.data = snapshot_copy(L->budgets.data, L->budgets.size, sizeof(BudgetEntry), &L->budgets.cap);
+    for (int i = 0; i < 3; ++i) {
+        if (L->snap[i]) munmap(L->snap[i], L->snaplen[i]);
+        L->snap[i] = NULL;
+        L->snaplen[i] = 0;
+    }
+}
+
+/* Inodes of L's data files now, 0 for a missing one */
+static void snapshot_inodes(const Ledger *L, ino_t ino[3]) {
+    char path[PATH_LEN + 32];
+    struct stat st;
+    for (int i = 0; i < 3; ++i) {
+        snprintf(path, sizeof(path), "%s/%s", L->dir, snap_files[i]);
+        ino[i] = stat(path, &st) == 0 ? st.st_ino : 0;
+    }
+}
+
+/* Load L for --read-only: map its published files, telling writers a
+   reader is attached, and apply what the journal holds beyond them. A
+   B+tree ledger cannot be read safely while it is written and stays
+   empty; older files are loaded privately. */
+void reader_load(Ledger *L) {
+    char path[PATH_LEN + 32];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", L->dir, READERS_LOCK);
+    if (L->readers_fd < 0) {
+        L->readers_fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (L->readers_fd >= 0 && flock(L->readers_fd, LOCK_SH) != 0) {
+            close(L->readers_fd);
+            L->readers_fd = -1;
+        }
+    }
+    snprintf(path, sizeof(path), "%s/%s", L->dir, BT_FILE);
+    if (snapshot_map(L)) {
+        archive_load(L);
+        journal_replay(L, L->journal_end);
+    } else if (stat(path, &st) == 0) {
+        fprintf(stderr, "Ledger '%s' keeps its transactions in a B+tree, which cannot be opened read-only.\n",
+                L->name);
+        L->follow = 0;
+    } else {
+        fprintf(stderr, "Ledger '%s' cannot be mapped; loading a private copy.\n", L->name);
+        snapshot_inodes(L, L->snapino);
+        load_ledger(L);
+    }
+    L->loaded = 1;
+}
+
+/* Catch L up with its writer. The data files carry the generation they
+   were saved at and the journal every change after it, so a change only
+   costs reading its records; L is remapped only when the writer has
+   published new files. Returns 1 if L's stores were replaced. */
+static int snapshot_follow(Ledger *L) {
+    char path[PATH_LEN + 32];
+    struct stat st;
+    ino_t ino[3];
+    int changed = 0;
+    snapshot_inodes(L, ino);
+    if (memcmp(ino, L->snapino, sizeof(ino)) != 0 && snapshot_map(L)) {
+        archive_load(L);
+        changed = 1;
+    }
+    snprintf(path, sizeof(path), "%s/%s", L->dir, JOURNAL_FILE);
+    if (stat(path, &st) == 0 && (uint64_t)st.st_size > L->journal_end && journal_replay(L, L->journal_end))
+        changed = 1;
+    return changed;
+}
+
+/* Before each --read-only action: catch every loaded ledger up with
+   the changes made since the last action. Costs a few stat()s when
+   nothing changed. Returns 1 if any data was refreshed. */
+int snapshot_refresh() {
+    if (!reader_mode) return 0;
+    ledger_stash_active();
+    uint64_t n = 0;
+    int changed = 0;
+    for (size_t i = 0; i < nledgers; ++i) {
+        Ledger *L = &ledgers[i];
+        if (!L->loaded || !L->follow) continue;
+        uint64_t before = L->generation;
+        changed |= snapshot_follow(L);
+        n += L->generation > before ? L->generation - before : 0;
+    }
+    if (!changed) return 0;
+    ledger_adopt(&ledgers[active_ledger]); /* its old stores may be gone */
+    ledger_activate(active_ledger);
+    if (n) printf("(%llu newer change(s) picked up)\n", (unsigned long long)n);
+    return 1;
+}
+
+/* Whether a --read-only process has L mapped */
+int ledger_has_readers(const Ledger *L) {
+    char path[PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s/%s", L->dir, READERS_LOCK);
+    int fd = open(path, O_RDWR);
+    if (fd < 0) return 0;
+    int busy = flock(fd, LOCK_EX | LOCK_NB) != 0 && errno == EWOULDBLOCK;
+    close(fd); /* drops the probe lock, if taken */
+    return busy;
+}
+
+/* -------------------- What-if sandbox -------------------- */
+
+void sandbox_begin() {
+    if (sandbox.active) return;
+    journal_flush();
+    if (oplog.cursor < oplog.count) {  /* nothing to redo across the session boundary */
+        oplog.used = oplog.offs[oplog.cursor];
+        oplog.count = oplog.cursor;
+    }
+    sandbox.count = sandbox.used = 0;
+    sandbox.log_count = oplog.count;
+    sandbox.log_used = oplog.used;
+    sandbox.log_trims = oplog.trims;
+    sandbox.active = 1;
+}
+
+static const unsigned char *sandbox_record(size_t i, int *forward, uint32_t *len) {
+    const unsigned char *p = sandbox.buf + sandbox.offs[i];
+    *forward = p[0];
+    memcpy(len, p + 1, 4);
+    return p + 5;
+}
+
+void sandbox_commit() {
+    if (!sandbox.active) return;
+    sandbox.active = 0;
+    for (size_t i = 0; i < sandbox.count; ++i) {
+        int forward;
+        uint32_t len;
+        const unsigned char *op = sandbox_record(i, &forward, &len);
+        journal_append(op, len, forward);
+    }
+    journal_commit();
+    sandbox.count = sandbox.used = 0;
+}
+
+/* Undo the session's records newest first; the undo history goes back
+   to where it was unless it was trimmed meanwhile */
+void sandbox_discard() {
+    if (!sandbox.active) return;
+    StoreCtx s = active_ctx();
+    for (size_t i = sandbox.count; i-- > 0;) {
+        int forward;
+        uint32_t len;
+        const unsigned char *op = sandbox_record(i, &forward, &len);
+        op_apply_bytes(&s, op, !forward);
+    }
+    if (oplog.trims == sandbox.log_trims) {
+        oplog.count = oplog.cursor = sandbox.log_count;
+        oplog.used = sandbox.log_used;
+    } else {
+        oplog_clear();
+    }
+    sandbox.active = 0;
+    sandbox.count = sandbox.used = 0;
+}
+
+void sandbox_menu() {
+    if (!sandbox.active) {
+        printf("Start a what-if sandbox? Changes stay hypothetical until committed. (y/n): ");
+        char a[8]; read_line(a, sizeof(a));
+        if (a[0] != 'y' && a[0] != 'Y') return;
+        sandbox_begin();
+        printf("Sandbox started. Reports reflect sandbox changes.\n");
+        return;
+    }
+    printf("Sandbox has %zu change(s). c=commit d=discard, anything else to keep going: ", sandbox.count);
+    char a[8]; read_line(a, sizeof(a));
+    if (a[0] == 'c') {
+        size_t n = sandbox.count;
+        sandbox_commit();
+        printf("Committed %zu change(s).\n", n);
+    } else if (a[0] == 'd') {
+        size_t n = sandbox.count;
+        sandbox_discard();
+        printf("Discarded %zu change(s).\n", n);
+    }
+}
+
+/* -------------------- Replica sync -------------------- */
+
+/* A bundle is a SyncHead, nclock ClockEntry, then nrecs records of
+   [u64 origin][u64 origin_seq][i64 ts][u32 len][op]. Ops on the wire
+   always run forwards and name transactions by global id, categories
+   by global id and name, so they mean the same thing at every replica. */
+typedef struct {
+    char magic[4];
+    uint32_t nclock;
+    uint64_t sender;
+    uint64_t through; /* sender's generation when the bundle was made */
+    uint32_t nrecs;
+    uint32_t reserved;
+} SyncHead;
+
+#define SYNC_REC_HEAD 28
+#define SYNC_MAX_FILE (1024u * 1024u * 1024u) /* largest bundle file read */
+/* Over a socket a bundle is streamed: its head and clock, then its
+   records in messages of whole records up to SYNC_CHUNK bytes, then an
+   empty message. Nothing longer is accepted, so a peer cannot make us
+   allocate more than it actually sends. */
+#define SYNC_CHUNK (1024u * 1024u)
+#define SYNC_MAX_MSG (SYNC_CHUNK + SYNC_REC_HEAD + JOURNAL_MAX_OP)
+
+typedef struct {
+    unsigned char *p;
+    size_t used;
+    size_t cap;
+} ByteBuf;
+
+/* A journal op as what another replica must do to repeat it (undo
+   records turned around); ids are still local */
+typedef struct {
+    int kind;
+    int fields;
+    int id;          /* transaction or category id */
+    Transaction t;   /* the row (add/delete) or its new values (edit) */
+    char name[64];   /* category ops; the old name of a rename */
+    char new_name[64];
+    int year;
+    int month;
+    double amount;
+} PlainOp;
+
+static void bb_put(ByteBuf *b, const void *src, size_t n) {
+    b->p = grow_array(b->p, &b->cap, b->used + n, 1, 4096);
+    memcpy(b->p + b->used, src, n);
+    b->used += n;
+}
+
+static void bb_put_str(ByteBuf *b, const char *str) {
+    unsigned char len = (unsigned char)strnlen(str, 255);
+    bb_put(b, &len, 1);
+    bb_put(b, str, len);
+}
+
+/* -- clocks, peers, id map and stamps -- */
+
+static uint64_t clock_get(const VClock *c, uint64_t replica) {
+    for (size_t i = 0; i < c->n; ++i) {
+        if (c->e[i].replica == replica) return c->e[i].seq;
+    }
+    return 0;
+}
+
+static void clock_raise(VClock *c, uint64_t replica, uint64_t seq) {
+    for (size_t i = 0; i < c->n; ++i) {
+        if (c->e[i].replica == replica) {
+            if (seq > c->e[i].seq) c->e[i].seq = seq;
+            return;
+        }
+    }
+    if (c->n < MAX_REPLICAS) {
+        c->e[c->n].replica = replica;
+        c->e[c->n++].seq = seq;
+    }
+}
+
+static SyncPeer *peer_get(uint64_t id, int create) {
+    for (size_t i = 0; i < sync_state.npeers; ++i) {
+        if (sync_state.peers[i].id == id) return &sync_state.peers[i];
+    }
+    if (!create || sync_state.npeers == MAX_REPLICAS) return NULL;
+    SyncPeer *p = &sync_state.peers[sync_state.npeers++];
+    memset(p, 0, sizeof(*p));
+    p->id = id;
+    return p;
+}
+
+static size_t pair_hash(uint64_t a, uint64_t b) {
+    uint64_t h = (a ^ (b * 0x9e3779b97f4a7c15ull)) * 0xbf58476d1ce4e5b9ull;
+    return (size_t)(h ^ (h >> 31));
+}
+
+static void idmap_slot(size_t i) {
+    const IdMapEntry *e = &sync_state.map[i];
+    size_t mask = sync_state.map_nslots - 1;
+    size_t h = pair_hash(e->origin, (uint32_t)e->origin_id) & mask;
+    while (sync_state.map_slots[h]) h = (h + 1) & mask;
+    sync_state.map_slots[h] = i + 1;
+}
+
+static void idmap_add(uint64_t origin, int origin_id, int local_id) {
+    SyncState *S = &sync_state;
+    S->map = grow_array(S->map, &S->mapcap, S->nmap + 1, sizeof(IdMapEntry), 64);
+    IdMapEntry e = {local_id, origin_id, origin};
+    S->map[S->nmap] = e;
+    index_put(&S->map_local, local_id, S->nmap);
+    S->nmap++;
+    if (S->nmap * 2 > S->map_nslots) {
+        free(S->map_slots);
+        S->map_nslots = S->map_nslots ? S->map_nslots * 2 : 64;
+        S->map_slots = calloc(S->map_nslots, sizeof(size_t));
+        if (!S->map_slots) panic("calloc idmap");
+        for (size_t i = 0; i < S->nmap; ++i) idmap_slot(i);
+    } else {
+        idmap_slot(S->nmap - 1);
+    }
+}
+
+static long idmap_find(uint64_t origin, int origin_id) {
+    const SyncState *S = &sync_state;
+    if (!S->map_nslots) return -1;
+    size_t mask = S->map_nslots - 1;
+    for (size_t h = pair_hash(origin, (uint32_t)origin_id) & mask; S->map_slots[h]; h = (h + 1) & mask) {
+        const IdMapEntry *e = &S->map[S->map_slots[h] - 1];
+        if (e->origin == origin && e->origin_id == origin_id) return e->local_id;
+    }
+    return -1;
+}
+
+/* Global id of a local transaction id */
+static void gid_of(int local_id, uint64_t *origin, int *origin_id) {
+    long e = index_lookup(&sync_state.map_local, local_id);
+    if (e >= 0) {
+        *origin = sync_state.map[e].origin;
+        *origin_id = sync_state.map[e].origin_id;
+    } else {
+        *origin = sync_state.self;
+        *origin_id = local_id;
+    }
+}
+
+/* Local id of a global id; 0 if it never arrived here */
+static int local_of(uint64_t origin, int origin_id) {
+    if (origin == sync_state.self) return origin_id;
+    long l = idmap_find(origin, origin_id);
+    return l < 0 ? 0 : (int)l;
+}
+
+/* Global id of a local category: the replica that created it and its
+   id there */
+static void cat_gid_of(int cid, uint64_t *origin, int *origin_id) {
+    gid_of(-cid, origin, origin_id);
+    *origin_id = -*origin_id;
+}
+
+/* Local id of a global category id; 0 if it is not mapped here */
+static int cat_local_of(uint64_t origin, int origin_id) {
+    return -local_of(origin, -origin_id);
+}
+
+static void stamp_slot(size_t i) {
+    const Stamp *s = &sync_state.stamps[i];
+    size_t mask = sync_state.stamp_nslots - 1;
+    size_t h = pair_hash((uint32_t)s->a, (uint32_t)s->b) & mask;
+    while (sync_state.stamp_slots[h]) h = (h + 1) & mask;
+    sync_state.stamp_slots[h] = i + 1;
+}
+
+static Stamp *stamp_get(int a, int b) {
+    SyncState *S = &sync_state;
+    if (S->stamp_nslots) {
+        size_t mask = S->stamp_nslots - 1;
+        for (size_t h = pair_hash((uint32_t)a, (uint32_t)b) & mask; S->stamp_slots[h]; h = (h + 1) & mask) {
+            Stamp *s = &S->stamps[S->stamp_slots[h] - 1];
+            if (s->a == a && s->b == b) return s;
+        }
+    }
+    S->stamps = grow_array(S->stamps, &S->stampcap, S->nstamps + 1, sizeof(Stamp), 64);
+    Stamp s = {a, b, 0, 0};
+    S->stamps[S->nstamps++] = s;
+    if (S->nstamps * 2 > S->stamp_nslots) {
+        free(S->stamp_slots);
+        S->stamp_nslots = S->stamp_nslots ? S->stamp_nslots * 2 : 64;
+        S->stamp_slots = calloc(S->stamp_nslots, sizeof(size_t));
+        if (!S->stamp_slots) panic("calloc stamps");
+        for (size_t i = 0; i < S->nstamps; ++i) stamp_slot(i);
+    } else {
+        stamp_slot(S->nstamps - 1);
+    }
+    return &S->stamps[S->nstamps - 1];
+}
+
+/* Record a write made at (ts, replica); 0 if a later write to the same
+   target is already known, which then wins */
+static int stamp_claim(int a, int b, int64_t ts, uint64_t replica) {
+    Stamp *s = stamp_get(a, b);
+    if (ts < s->ts || (ts == s->ts && replica <= s->replica)) return 0;
+    s->ts = ts;
+    s->replica = replica;
+    return 1;
+}
+
+/* -- sync state files -- */
+
+static uint64_t random_replica_id() {
+    uint64_t id = 0;
+    FILE *f = fopen("/dev/urandom", "rb");
+    if (f) {
+        if (fread(&id, sizeof(id), 1, f) != 1) id = 0;
+        fclose(f);
+    }
+    if (!id) id = ((uint64_t)time(NULL) << 20) ^ (uint64_t)getpid() ^ (uint64_t)clock();
+    return id ? id : 1;
+}
+
+static void sync_save();
+
+static void sync_path(char *out, size_t sz, const char *file) {
+    snprintf(out, sz, "%s/%s", ledgers[active_ledger].dir, file);
+}
+
+static void sync_free() {
+    free(sync_state.map);
+    free(sync_state.map_slots);
+    index_free(&sync_state.map_local);
+    free(sync_state.stamps);
+    free(sync_state.stamp_slots);
+    memset(&sync_state, 0, sizeof(sync_state));
+}
+
+/* Load the active ledger's sync state; a ledger that never synced gets
+   a fresh replica id */
+static void sync_load() {
+    SyncState *S = &sync_state;
+    sync_free();
+    char path[PATH_LEN + 32];
+    sync_path(path, sizeof(path), SYNC_FILE);
+    FILE *f = fopen(path, "r");
+    if (f) {
+        char line[256];
+        unsigned long long a, b, c;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "replica %llx", &a) == 1) S->self = a;
+            else if (sscanf(line, "stamped %llu", &a) == 1) S->stamped = a;
+            else if (sscanf(line, "clock %llx %llu", &a, &b) == 2) clock_raise(&S->clock, a, b);
+            else if (sscanf(line, "peer %llx %llx %llu", &a, &b, &c) == 3) {
+                SyncPeer *p = peer_get(a, 1);
+                if (p) clock_raise(&p->clock, b, c);
+            } else if (sscanf(line, "peer %llx", &a) == 1) peer_get(a, 1);
+        }
+        fclose(f);
+    }
+
+    FileHeader h;
+    size_t len;
+    sync_path(path, sizeof(path), IDMAP_FILE);
+    unsigned char *buf = read_binary_file(path, &len, &h);
+    if (buf && h.rec_size == sizeof(IdMapEntry)) {
+        for (size_t i = 0; i + sizeof(IdMapEntry) <= len; i += sizeof(IdMapEntry)) {
+            IdMapEntry e;
+            memcpy(&e, buf + i, sizeof(e));
+            idmap_add(e.origin, e.origin_id, e.local_id);
+        }
+    }
+    free(buf);
+    sync_path(path, sizeof(path), STAMP_FILE);
+    buf = read_binary_file(path, &len, &h);
+    if (buf && h.rec_size == sizeof(Stamp)) {
+        for (size_t i = 0; i + sizeof(Stamp) <= len; i += sizeof(Stamp)) {
+            Stamp s;
+            memcpy(&s, buf + i, sizeof(s));
+            stamp_claim(s.a, s.b, s.ts, s.replica);
+        }
+    }
+    free(buf);
+    if (!S->self) {
+        S->self = random_replica_id();
+        sync_save();
+    }
+}
+
+static void sync_save() {
+    const SyncState *S = &sync_state;
+    uint64_t gen = ledgers[active_ledger].generation;
+    char path[PATH_LEN + 32];
+    sync_path(path, sizeof(path), SYNC_FILE);
+    FILE *f = fopen(path, "w");
+    if (!f) { fprintf(stderr, "Warning: unable to save %s\n", path); return; }
+    fprintf(f, "replica %016llx\n", (unsigned long long)S->self);
+    fprintf(f, "stamped %llu\n", (unsigned long long)S->stamped);
+    for (size_t i = 0; i < S->clock.n; ++i)
+        fprintf(f, "clock %016llx %llu\n", (unsigned long long)S->clock.e[i].replica,
+                (unsigned long long)S->clock.e[i].seq);
+    for (size_t i = 0; i < S->npeers; ++i) {
+        const SyncPeer *p = &S->peers[i];
+        fprintf(f, "peer %016llx\n", (unsigned long long)p->id);
+        for (size_t j = 0; j < p->clock.n; ++j)
+            fprintf(f, "peer %016llx %016llx %llu\n", (unsigned long long)p->id,
+                    (unsigned long long)p->clock.e[j].replica, (unsigned long long)p->clock.e[j].seq);
+    }
+    fclose(f);
+    sync_path(path, sizeof(path), IDMAP_FILE);
+    save_binary_file(path, S->map, S->nmap, sizeof(IdMapEntry), gen, 0);
+    sync_path(path, sizeof(path), STAMP_FILE);
+    save_binary_file(path, S->stamps, S->nstamps, sizeof(Stamp), gen, 0);
+}
+
+/* -- ops on the wire -- */
+
+/* Category names keyed by id, for rolling names back through the journal */
+static const char *names_get(const CatStore *cs, int id) {
+    for (size_t i = 0; i < cs->size; ++i) {
+        if (cs->data[i].id == id) return cs->data[i].name;
+    }
+    return "";
+}
+
+static void names_set(CatStore *cs, int id, const char *name) {
+    size_t i = 0;
+    while (i < cs->size && cs->data[i].id != id) ++i;
+    if (i == cs->size) {
+        cs->data = grow_array(cs->data, &cs->cap, cs->size + 1, sizeof(Category), 8);
+        cs->data[cs->size++].id = id;
+    }
+    snprintf(cs->data[i].name, sizeof(cs->data[i].name), "%s", name);
+}
+
+static void names_drop(CatStore *cs, int id) {
+    for (size_t i = 0; i < cs->size; ++i) {
+        if (cs->data[i].id == id) {
+            cs->data[i] = cs->data[--cs->size];
+            return;
+        }
+    }
+}
+
+static void op_plain(const unsigned char *p, int forward, PlainOp *o) {
+    OpHead h;
+    memset(o, 0, sizeof(*o));
+    p = log_get(p, &h, sizeof(h));
+    o->kind = h.kind;
+    o->fields = h.fields;
+    o->id = o->t.id = h.id;
+    switch (h.kind) {
+        case OP_TXN_ADD:
+        case OP_TXN_DEL:
+            log_get_fields(p, F_ALL, &o->t);
+            o->fields = F_ALL;
+            if (!forward) o->kind = h.kind == OP_TXN_ADD ? OP_TXN_DEL : OP_TXN_ADD;
+            break;
+        case OP_TXN_EDIT: {
+            Transaction before = o->t;
+            p = log_get_fields(p, h.fields, &before);
+            log_get_fields(p, h.fields, &o->t);
+            if (!forward) o->t = before;
+            break;
+        }
+        case OP_CAT_ADD:
+        case OP_CAT_DEL:
+            log_get_str(p, o->name, sizeof(o->name));
+            if (!forward) o->kind = h.kind == OP_CAT_ADD ? OP_CAT_DEL : OP_CAT_ADD;
+            break;
+        case OP_CAT_RENAME:
+            p = log_get_str(p, forward ? o->name : o->new_name, sizeof(o->name));
+            log_get_str(p, forward ? o->new_name : o->name, sizeof(o->name));
+            break;
+        case OP_BUDGET_SET: {
+            double before, after;
+            p = log_get(p, &o->year, sizeof(o->year));
+            p = log_get(p, &o->month, sizeof(o->month));
+            p = log_get(p, &before, sizeof(before));
+            log_get(p, &after, sizeof(after));
+            o->amount = forward ? after : before; /* undoing a new budget ships 0 */
+            break;
+        }
+    }
+}
+
+static void wire_put_fields(ByteBuf *b, int fields, const Transaction *t, const char *category) {
+    if (fields & F_DATE) { int k = date_key(t->date); bb_put(b, &k, sizeof(k)); }
+    if (fields & F_CURRENCY) bb_put(b, t->currency, 3);
+    if (fields & F_AMOUNT) bb_put(b, &t->amount, sizeof(t->amount));
+    if (fields & F_CATEGORY) bb_put_str(b, category);
+    if (fields & F_TYPE) { unsigned char tp = (unsigned char)t->type; bb_put(b, &tp, 1); }
+    if (fields & F_NOTE) bb_put_str(b, t->note);
+}
+
+static const unsigned char *wire_get_fields(const unsigned char *p, int fields, Transaction *t,
+                                            char *category, size_t sz) {
+    p = log_get_fields(p, fields & (F_DATE | F_CURRENCY | F_AMOUNT), t);
+    if (fields & F_CATEGORY) p = log_get_str(p, category, sz);
+    return log_get_fields(p, fields & (F_TYPE | F_NOTE), t);
+}
+
+static void wire_put_record(ByteBuf *b, uint64_t origin, uint64_t origin_seq, int64_t ts,
+                            const PlainOp *o, const CatStore *names) {
+    bb_put(b, &origin, sizeof(origin));
+    bb_put(b, &origin_seq, sizeof(origin_seq));
+    bb_put(b, &ts, sizeof(ts));
+    size_t at = b->used;
+    uint32_t len = 0;
+    bb_put(b, &len, sizeof(len));
+    unsigned char head[2] = {(unsigned char)o->kind, (unsigned char)(o->kind == OP_TXN_DEL ? 0 : o->fields)};
+    bb_put(b, head, 2);
+    switch (o->kind) {
+        case OP_TXN_ADD:
+        case OP_TXN_DEL:
+        case OP_TXN_EDIT: {
+            uint64_t gorigin;
+            int gid;
+            gid_of(o->id, &gorigin, &gid);
+            bb_put(b, &gorigin, sizeof(gorigin));
+            bb_put(b, &gid, sizeof(gid));
+            wire_put_fields(b, head[1], &o->t, names_get(names, o->t.category_id));
+            break;
+        }
+        case OP_CAT_ADD:
+        case OP_CAT_DEL:
+        case OP_CAT_RENAME: {
+            uint64_t gorigin;
+            int gid;
+            cat_gid_of(o->id, &gorigin, &gid);
+            bb_put(b, &gorigin, sizeof(gorigin));
+            bb_put(b, &gid, sizeof(gid));
+            bb_put_str(b, o->name);
+            if (o->kind == OP_CAT_RENAME) bb_put_str(b, o->new_name);
+            break;
+        }
+        case OP_BUDGET_SET:
+            bb_put_str(b, names_get(names, o->id));
+            bb_put(b, &o->year, sizeof(o->year));
+            bb_put(b, &o->month, sizeof(o->month));
+            bb_put(b, &o->amount, sizeof(o->amount));
+            break;
+    }
+    len = (uint32_t)(b->used - at - sizeof(len));
+    memcpy(b->p + at, &len, sizeof(len));
+}
+
+/* -- building bundles -- */
+
+/* Walk the active ledger's journal from the oldest record either job
+   needs: stamp local edits not stamped yet and, when peer is given,
+   append the records it is missing to out. Category names are first
+   rolled back to the start of the walk so every op ships the names it
+   was made with. Returns the number of records appended. */
+static uint32_t sync_scan(const SyncPeer *peer, ByteBuf *out) {
+    SyncState *S = &sync_state;
+    Ledger *L = &ledgers[active_ledger];
+    uint64_t ship_from = peer ? clock_get(&peer->clock, S->self) : L->generation;
+    uint64_t from = ship_from < S->stamped ? ship_from : S->stamped;
+    if (from >= L->generation) return 0;
+    char path[PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s/%s", L->dir, JOURNAL_FILE);
+    journal_flush();
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    long start = (long)journal_resume_offset(L->dir, from);
+    unsigned char op[JOURNAL_MAX_OP];
+    JournalRec r;
+    PlainOp o;
+
+    PlainOp *catops = NULL;
+    size_t ncat = 0, catcap = 0;
+    fseek(f, start, SEEK_SET);
+    while (journal_read(f, &r, op)) {
+        OpHead h;
+        memcpy(&h, op, sizeof(h));
+        if (r.seq <= from || h.kind < OP_CAT_ADD || h.kind > OP_CAT_RENAME) continue;
+        catops = grow_array(catops, &catcap, ncat + 1, sizeof(PlainOp), 8);
+        op_plain(op, (int)(r.forward & JOURNAL_FORWARD), &catops[ncat++]);
+    }
+    CatStore names = {NULL, 0, 0, 0};
+    for (size_t i = 0; i < cats.size; ++i) names_set(&names, cats.data[i].id, cats.data[i].name);
+    for (size_t i = ncat; i-- > 0;) {
+        if (catops[i].kind == OP_CAT_ADD) names_drop(&names, catops[i].id);
+        else names_set(&names, catops[i].id, catops[i].name);
+    }
+    free(catops);
+
+    uint32_t nrecs = 0;
+    fseek(f, start, SEEK_SET);
+    while (journal_read(f, &r, op)) {
+        if (r.seq <= from) continue;
+        uint64_t origin = r.origin ? r.origin : S->self;
+        int ship = peer && r.seq > ship_from && origin != peer->id &&
+                   (origin == S->self || r.origin_seq > clock_get(&peer->clock, origin));
+        OpHead h;
+        memcpy(&h, op, sizeof(h));
+        if (h.kind == OP_TXN_BATCH) {
+            /* ships as one add (or, undone, one delete) per row */
+            uint32_t n;
+            const unsigned char *p = log_get(op + sizeof(h), &n, sizeof(n));
+            for (uint32_t i = 0; ship && i < n; ++i) {
+                memset(&o, 0, sizeof(o));
+                o.kind = (r.forward & JOURNAL_FORWARD) ? OP_TXN_ADD : OP_TXN_DEL;
+                o.fields = F_ALL;
+                o.id = o.t.id = h.id + (int)i;
+                p = log_get_fields(p, F_ALL, &o.t);
+                wire_put_record(out, origin, r.origin_seq, r.ts, &o, &names);
+                nrecs++;
+            }
+            continue;
+        }
+        op_plain(op, (int)(r.forward & JOURNAL_FORWARD), &o);
+        if (!r.origin && r.seq > S->stamped) {
+            if (o.kind == OP_TXN_EDIT) {
+                for (int bit = F_DATE; bit <= F_NOTE; bit <<= 1)
+                    if (o.fields & bit) stamp_claim(o.id, bit, r.ts, S->self);
+            } else if (o.kind == OP_BUDGET_SET) {
+                stamp_claim(-o.id, o.year * 100 + o.month, r.ts, S->self);
+            } else if (o.kind == OP_CAT_RENAME) {
+                stamp_claim(-o.id, 0, r.ts, S->self);
+            }
+        }
+        if (ship) {
+            wire_put_record(out, origin, r.origin_seq, r.ts, &o, &names);
+            nrecs++;
+        }
+        if (o.kind == OP_CAT_ADD) names_set(&names, o.id, o.name);
+        else if (o.kind == OP_CAT_DEL) names_drop(&names, o.id);
+        else if (o.kind == OP_CAT_RENAME) names_set(&names, o.id, o.new_name);
+    }
+    fclose(f);
+    free(names.data);
+    S->stamped = L->generation;
+    return nrecs;
+}
+
+/* Whether the journal replays the active ledger from empty, i.e. its
+   first checkpoint holds nothing, archived or not */
+static int journal_from_empty() {
+    CheckpointInfo *cks;
+    size_t nck = checkpoint_list(ledgers[active_ledger].dir, &cks);
+    CheckpointHeader h;
+    int empty = 0;
+    FILE *f = nck ? fopen(cks[0].path, "rb") : NULL;
+    if (f) {
+        empty = fread(&h, sizeof(h), 1, f) == 1 && h.ncats + h.ntxns + h.nbudgets == 0;
+        fclose(f);
+    }
+    char (*segs)[32];
+    if (empty) empty = checkpoint_segs(cks[0].path, &segs) == 0;
+    if (empty) free(segs);
+    free(cks);
+    return empty;
+}
+
+/* Everything the ledger holds, for a replica that has nothing from us
+   when the journal does not reach back to the ledger's beginning */
+static uint32_t sync_snapshot(ByteBuf *out) {
+    uint64_t seq = ledgers[active_ledger].generation;
+    int64_t now = (int64_t)time(NULL);
+    uint32_t n = 0;
+    PlainOp o;
+    for (size_t i = 0; i < cats.size; ++i, ++n) {
+        memset(&o, 0, sizeof(o));
+        o.kind = OP_CAT_ADD;
+        o.id = cats.data[i].id;
+        strcpy(o.name, cats.data[i].name);
+        wire_put_record(out, sync_state.self, seq, now, &o, &cats);
+    }
+    TxnIter it;
+    const Transaction *t;
+    txn_iter_open(&it, NULL, NULL, NULL, 0);
+    for (; (t = txn_iter_next(&it)) != NULL; ++n) {
+        memset(&o, 0, sizeof(o));
+        o.kind = OP_TXN_ADD;
+        o.fields = F_ALL;
+        o.id = t->id;
+        o.t = *t;
+        wire_put_record(out, sync_state.self, seq, now, &o, &cats);
+    }
+    const Ledger *L = &ledgers[active_ledger];
+    for (size_t k = 0; k < L->narch; ++k) { /* one segment in memory at a time */
+        size_t na;
+        Transaction *rows = archive_rows(L, &L->arch[k], &na);
+        for (size_t i = 0; rows && i < na; ++i) {
+            if (index_get(rows[i].id) >= 0) continue; /* thawed, sent above */
+            memset(&o, 0, sizeof(o));
+            o.kind = OP_TXN_ADD;
+            o.fields = F_ALL;
+            o.id = rows[i].id;
+            o.t = rows[i];
+            wire_put_record(out, sync_state.self, seq, now, &o, &cats);
+            ++n;
+        }
+        free(rows);
+    }
+    for (size_t i = 0; i < budgets.size; ++i, ++n) {
+        memset(&o, 0, sizeof(o));
+        o.kind = OP_BUDGET_SET;
+        o.id = budgets.data[i].category_id;
+        o.year = budgets.data[i].year;
+        o.month = budgets.data[i].month;
+        o.amount = budgets.data[i].amount;
+        wire_put_record(out, sync_state.self, seq, now, &o, &cats);
+    }
+    return n;
+}
+
+/* Our id and clock, followed (with_records) by what peer is missing.
+   peer NULL is a replica we know nothing about. */
+static void sync_build(const SyncPeer *peer, int with_records, ByteBuf *b) {
+    const SyncState *S = &sync_state;
+    SyncHead h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SYNC_MAGIC, 4);
+    h.sender = S->self;
+    h.through = ledgers[active_ledger].generation;
+    VClock c = S->clock;
+    clock_raise(&c, S->self, h.through);
+    h.nclock = (uint32_t)c.n;
+    bb_put(b, &h, sizeof(h));
+    bb_put(b, c.e, c.n * sizeof(ClockEntry));
+    if (!with_records) return;
+    SyncPeer unknown;
+    memset(&unknown, 0, sizeof(unknown));
+    if (!peer) peer = &unknown;
+    if (clock_get(&peer->clock, S->self) || journal_from_empty()) {
+        h.nrecs = sync_scan(peer, b);
+    } else {
+        sync_scan(NULL, NULL);
+        h.nrecs = sync_snapshot(b);
+    }
+    memcpy(b->p, &h, sizeof(h));
+}
+
+/* -- applying bundles -- */
+
+static long cat_index_by_name(const char *name) {
+    for (size_t i = 0; i < cats.size; ++i) {
+        if (strcmp(cats.data[i].name, name) == 0) return (long)i;
+    }
+    return -1;
+}
+
+/* Index of the category with global id (gorigin, gid), else of the one
+   called name, which then takes that id; -1 if there is neither */
+static long sync_cat_index(uint64_t gorigin, int gid, const char *name) {
+    int lid = cat_local_of(gorigin, gid);
+    long i = lid ? find_category_index_by_id(lid) : -1;
+    if (i >= 0 || lid) return i;
+    i = cat_index_by_name(name);
+    if (i >= 0 && gorigin != sync_state.self) idmap_add(gorigin, -gid, -cats.data[i].id);
+    return i;
+}
+
+/* Id of the category called name, created if missing; 0 for no name */
+static int sync_category(const char *name) {
+    if (!*name) return 0;
+    long i = cat_index_by_name(name);
+    return i >= 0 ? cats.data[i].id : cat_insert(name);
+}
+
+/* Apply one wire op made at origin at time ts; returns 1 if it changed
+   anything. Conflicts resolve the same way at every replica: a deleted
+   transaction stays deleted, and each transaction field, each budget
+   and each category's name keeps the write with the later (time,
+   replica id). Categories are matched by the global id of the replica
+   that created them, or by name when two created the same one. */
+static int sync_apply_op(uint64_t origin, int64_t ts, const unsigned char *p) {
+    unsigned char kind = p[0], fields = p[1];
+    p += 2;
+    switch (kind) {
+        case OP_TXN_ADD:
+        case OP_TXN_DEL:
+        case OP_TXN_EDIT: {
+            uint64_t gorigin;
+            int gid;
+            p = log_get(p, &gorigin, sizeof(gorigin));
+            p = log_get(p, &gid, sizeof(gid));
+            Transaction t;
+            char category[64] = "";
+            memset(&t, 0, sizeof(t));
+            wire_get_fields(p, fields, &t, category, sizeof(category));
+            int lid = local_of(gorigin, gid);
+            long idx = lid ? index_get(lid) : -1;
+            if (idx < 0 && lid && archive_thaw(lid)) idx = index_get(lid);
+            if (kind == OP_TXN_ADD) {
+                if (idx >= 0) return 0;
+                if (!lid) {
+                    lid = txns.next_id;
+                    idmap_add(gorigin, gid, lid);
+                }
+                t.id = lid;
+                t.category_id = sync_category(category);
+                txn_insert(&t);
+                return 1;
+            }
+            if (idx < 0) return 0;
+            if (kind == OP_TXN_DEL) {
+                txn_delete((size_t)idx);
+                return 1;
+            }
+            int won = 0;
+            for (int bit = F_DATE; bit <= F_NOTE; bit <<= 1) {
+                if ((fields & bit) && stamp_claim(lid, bit, ts, origin)) won |= bit;
+            }
+            if (!won) return 0;
+            Transaction nt = txns.data[idx];
+            if (won & F_DATE) strcpy(nt.date, t.date);
+            if (won & F_CURRENCY) strcpy(nt.currency, t.currency);
+            if (won & F_AMOUNT) nt.amount = t.amount;
+            if (won & F_CATEGORY) nt.category_id = sync_category(category);
+            if (won & F_TYPE) nt.type = t.type;
+            if (won & F_NOTE) strcpy(nt.note, t.note);
+            txn_update((size_t)idx, &nt);
+            return 1;
+        }
+        case OP_CAT_ADD: {
+            uint64_t gorigin;
+            int gid;
+            char name[64];
+            p = log_get(p, &gorigin, sizeof(gorigin));
+            p = log_get(p, &gid, sizeof(gid));
+            log_get_str(p, name, sizeof(name));
+            if (!*name || sync_cat_index(gorigin, gid, name) >= 0) return 0;
+            int cid = cat_insert(name);
+            if (gorigin != sync_state.self) idmap_add(gorigin, -gid, -cid);
+            return 1;
+        }
+        case OP_CAT_DEL: {
+            /* As locally, a category goes only where nothing refers to
+               it. The origin had no rows or budgets left in it, so any
+               here were made concurrently and their records have not
+               reached the origin yet; when they do, the category is
+               created again there by name, and every replica ends up
+               keeping it. Deleting it here instead would leave them
+               dangling while the origin brings it back. */
+            uint64_t gorigin;
+            int gid;
+            char name[64];
+            p = log_get(p, &gorigin, sizeof(gorigin));
+            p = log_get(p, &gid, sizeof(gid));
+            log_get_str(p, name, sizeof(name));
+            long i = sync_cat_index(gorigin, gid, name);
+            if (i < 0) return 0;
+            int cid = cats.data[i].id;
+            TxnIter it;
+            const Transaction *t;
+            txn_iter_open(&it, NULL, NULL, NULL, 0);
+            while ((t = txn_iter_next(&it)) != NULL) {
+                if (t->category_id == cid) return 0;
+            }
+            for (size_t b = 0; b < budgets.size; ++b) {
+                if (budgets.data[b].category_id == cid) return 0;
+            }
+            if (archive_uses_category(cid)) return 0;
+            cat_delete((size_t)i);
+            return 1;
+        }
+        case OP_CAT_RENAME: {
+            uint64_t gorigin;
+            int gid;
+            char before[64], after[64];
+            p = log_get(p, &gorigin, sizeof(gorigin));
+            p = log_get(p, &gid, sizeof(gid));
+            p = log_get_str(p, before, sizeof(before));
+            log_get_str(p, after, sizeof(after));
+            long i = sync_cat_index(gorigin, gid, before);
+            if (i < 0 || !*after || !stamp_claim(-cats.data[i].id, 0, ts, origin)) return 0;
+            if (strcmp(cats.data[i].name, after) == 0 || cat_index_by_name(after) >= 0) return 0;
+            cat_rename((size_t)i, after);
+            return 1;
+        }
+        case OP_BUDGET_SET: {
+            char name[64];
+            int year, month;
+            double amount;
+            p = log_get_str(p, name, sizeof(name));
+            p = log_get(p, &year, sizeof(year));
+            p = log_get(p, &month, sizeof(month));
+            log_get(p, &amount, sizeof(amount));
+            int cid = sync_category(name);
+            if (!cid || !stamp_claim(-cid, year * 100 + month, ts, origin)) return 0;
+            budget_put(cid, year, month, amount);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Check a bundle's header and take the sender's clock from it */
+static SyncPeer *sync_read_head(const unsigned char *buf, size_t len, SyncHead *h) {
+    if (len < sizeof(*h)) return NULL;
+    memcpy(h, buf, sizeof(*h));
+    if (memcmp(h->magic, SYNC_MAGIC, 4) != 0 || h->nclock > MAX_REPLICAS ||
+        sizeof(*h) + h->nclock * sizeof(ClockEntry) > len) {
+        printf("Not a sync bundle.\n");
+        return NULL;
+    }
+    if (h->sender == sync_state.self) {
+        printf("Both sides are replica %016llx — was a ledger directory copied? "
+               "Start a replica from an empty ledger instead.\n", (unsigned long long)h->sender);
+        return NULL;
+    }
+    SyncPeer *peer = peer_get(h->sender, 1);
+    if (!peer) { printf("More than %d replicas.\n", MAX_REPLICAS); return NULL; }
+    memset(&peer->clock, 0, sizeof(peer->clock));
+    for (uint32_t i = 0; i < h->nclock; ++i) {
+        ClockEntry e;
+        memcpy(&e, buf + sizeof(*h) + i * sizeof(e), sizeof(e));
+        clock_raise(&peer->clock, e.replica, e.seq);
+    }
+    return peer;
+}
+
+/* A bundle being applied, possibly a piece at a time. Every record is
+   checked against our clock from before the bundle, so records sharing
+   one seq (a snapshot, a batch) all apply wherever the pieces split. */
+typedef struct {
+    SyncHead h;
+    VClock seen;
+    uint32_t left; /* records not read yet */
+    long applied;
+} SyncApply;
+
+/* Read a bundle's head from buf; *used gets its size */
+static int sync_apply_begin(SyncApply *a, const unsigned char *buf, size_t len, size_t *used) {
+    if (!sync_read_head(buf, len, &a->h)) return 0;
+    *used = sizeof(a->h) + a->h.nclock * sizeof(ClockEntry);
+    a->seen = sync_state.clock;
+    a->left = a->h.nrecs;
+    a->applied = 0;
+    oplog_begin();
+    return 1;
+}
+
+/* Apply the whole records in [p, p + len) that we have not seen;
+   0 if one is damaged or cut short */
+static int sync_apply_records(SyncApply *a, const unsigned char *p, size_t len) {
+    SyncState *S = &sync_state;
+    const unsigned char *end = p + len;
+    unsigned char op[JOURNAL_MAX_OP + 600]; /* slack so a damaged op cannot read past it */
+    while (p < end) {
+        uint64_t origin, origin_seq;
+        int64_t ts;
+        uint32_t n;
+        if (!a->left || (size_t)(end - p) < SYNC_REC_HEAD) return 0;
+        memcpy(&origin, p, 8);
+        memcpy(&origin_seq, p + 8, 8);
+        memcpy(&ts, p + 16, 8);
+        memcpy(&n, p + 24, 4);
+        p += SYNC_REC_HEAD;
+        if (n < 2 || n > JOURNAL_MAX_OP || (size_t)(end - p) < n) return 0;
+        memcpy(op, p, n);
+        memset(op + n, 0, sizeof(op) - n);
+        p += n;
+        a->left--;
+        if (origin == S->self || origin_seq <= clock_get(&S->clock, origin)) continue;
+        journal_origin = origin;
+        journal_origin_seq = origin_seq;
+        a->applied += sync_apply_op(origin, ts, op);
+        clock_raise(&a->seen, origin, origin_seq);
+    }
+    journal_origin = journal_origin_seq = 0;
+    return 1;
+}
+
+/* Finish applying; returns how many records changed something. Our
+   clock only advances when every record arrived: the ones applied from
+   a bundle cut short are journaled and simply do nothing when they come
+   again. */
+static long sync_apply_end(SyncApply *a) {
+    SyncState *S = &sync_state;
+    journal_origin = journal_origin_seq = 0;
+    oplog_end();
+    if (a->left) {
+        printf("The bundle was cut short after %u of %u change(s).\n", a->h.nrecs - a->left, a->h.nrecs);
+    } else {
+        S->clock = a->seen;
+        clock_raise(&S->clock, a->h.sender, a->h.through);
+    }
+    S->stamped = ledgers[active_ledger].generation;
+    return a->applied;
+}
+
+/* Apply the records of a bundle we have not seen; returns how many
+   changed something, -1 if the bundle is unusable */
+static long sync_apply_bundle(const unsigned char *buf, size_t len) {
+    SyncApply a;
+    size_t used;
+    if (!sync_apply_begin(&a, buf, len, &used)) return -1;
+    sync_apply_records(&a, buf + used, len - used);
+    return sync_apply_end(&a);
+}
+
+/* Remote changes are not undoable locally; the history restarts */
+static void sync_finish(long applied) {
+    if (applied > 0) oplog_clear();
+    journal_commit();
+    sync_save();
+    sync_free();
+}
+
+/* -- files and sockets -- */
+
+int sync_export(const char *path, uint64_t peer_id) {
+    sync_load();
+    const SyncPeer *peer = peer_id ? peer_get(peer_id, 0) : NULL;
+    if (peer_id && !peer) {
+        printf("Unknown replica %016llx.\n", (unsigned long long)peer_id);
+        sync_free();
+        return -1;
+    }
+    ByteBuf b = {NULL, 0, 0};
+    sync_build(peer, 1, &b);
+    SyncHead h;
+    memcpy(&h, b.p, sizeof(h));
+    FILE *f = fopen(path, "wb");
+    int ok = f && fwrite(b.p, 1, b.used, f) == b.used;
+    if (f && fclose(f) != 0) ok = 0;
+    if (ok) printf("Wrote %u change(s), %zu bytes, to %s\n", h.nrecs, b.used, path);
+    else printf("Unable to write %s\n", path);
+    free(b.p);
+    sync_finish(0);
+    return ok ? (int)h.nrecs : -1;
+}
+
+int sync_import(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) { printf("Unable to open %s\n", path); return -1; }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size <= 0 || (unsigned long)size > SYNC_MAX_FILE) { fclose(f); printf("Not a sync bundle.\n"); return -1; }
+    unsigned char *buf = xmalloc((size_t)size);
+    size_t len = fread(buf, 1, (size_t)size, f);
+    fclose(f);
+    sync_load();
+    sync_scan(NULL, NULL); /* stamp our own unsynced edits first */
+    long n = sync_apply_bundle(buf, len);
+    free(buf);
+    if (n >= 0) printf("Applied %ld change(s) from %s\n", n, path);
+    sync_finish(n);
+    return (int)n;
+}
+
+static int send_all(int fd, const void *buf, size_t n) {
+    const unsigned char *p = buf;
+    while (n) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return 0;
+        p += w;
+        n -= (size_t)w;
+    }
+    return 1;
+}
+
+static int recv_all(int fd, void *buf, size_t n) {
+    unsigned char *p = buf;
+    while (n) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return 0;
+        p += r;
+        n -= (size_t)r;
+    }
+    return 1;
+}
+
+static int send_msg(int fd, const ByteBuf *b) {
+    uint64_t n = b->used;
+    return send_all(fd, &n, sizeof(n)) && send_all(fd, b->p, b->used);
+}
+
+static unsigned char *recv_msg(int fd, size_t *len) {
+    uint64_t n;
+    if (!recv_all(fd, &n, sizeof(n)) || n > SYNC_MAX_MSG) return NULL;
+    unsigned char *buf = xmalloc(n ? (size_t)n : 1);
+    if (!recv_all(fd, buf, (size_t)n)) { free(buf); return NULL; }
+    *len = (size_t)n;
+    return buf;
+}
+
+static int send_piece(int fd, const unsigned char *p, size_t n) {
+    uint64_t len = n;
+    return send_all(fd, &len, sizeof(len)) && send_all(fd, p, n);
+}
+
+/* Stream a bundle built by sync_build */
+static int send_bundle(int fd, const ByteBuf *b) {
+    SyncHead h;
+    memcpy(&h, b->p, sizeof(h));
+    size_t at = sizeof(h) + h.nclock * sizeof(ClockEntry);
+    if (!send_piece(fd, b->p, at)) return 0;
+    while (at < b->used) {
+        size_t end = at;
+        while (end < b->used) {
+            uint32_t n;
+            memcpy(&n, b->p + end + 24, sizeof(n));
+            if (end > at && end + SYNC_REC_HEAD + n - at > SYNC_CHUNK) break;
+            end += SYNC_REC_HEAD + n;
+        }
+        if (!send_piece(fd, b->p + at, end - at)) return 0;
+        at = end;
+    }
+    return send_piece(fd, NULL, 0);
+}
+
+/* Receive a streamed bundle, applying each piece as it arrives;
+   returns what sync_apply_end does, -1 if it is unusable */
+static long recv_bundle(int fd) {
+    SyncApply a;
+    size_t len, used;
+    unsigned char *buf = recv_msg(fd, &len);
+    int ok = buf && sync_apply_begin(&a, buf, len, &used) && used == len;
+    free(buf);
+    if (!ok) return -1;
+    while (ok) {
+        buf = recv_msg(fd, &len);
+        ok = buf && len > 0 && sync_apply_records(&a, buf, len);
+        free(buf);
+    }
+    return sync_apply_end(&a);
+}
+
+/* Both sides send their id and clock, then exactly what the other is
+   missing. The listening side sends its bundle first so two large
+   bundles never wait on each other. */
+static int sync_session(int fd, int listener) {
+    ByteBuf out = {NULL, 0, 0};
+    unsigned char *hello = NULL;
+    size_t hlen = 0;
+    long applied = -1;
+    SyncHead h, sent;
+    sync_load();
+    sync_build(NULL, 0, &out);
+    int ok = listener ? (hello = recv_msg(fd, &hlen)) && send_msg(fd, &out)
+                      : send_msg(fd, &out) && (hello = recv_msg(fd, &hlen));
+    SyncPeer *peer = ok ? sync_read_head(hello, hlen, &h) : NULL;
+    if (peer) {
+        out.used = 0;
+        sync_build(peer, 1, &out);
+        memcpy(&sent, out.p, sizeof(sent));
+        if (listener) applied = send_bundle(fd, &out) ? recv_bundle(fd) : -1;
+        else if ((applied = recv_bundle(fd)) >= 0 && !send_bundle(fd, &out)) applied = -1;
+        if (applied >= 0)
+            printf("Sent %u change(s) (%zu bytes), applied %ld from replica %016llx.\n", sent.nrecs, out.used,
+                   applied, (unsigned long long)h.sender);
+    }
+    if (applied < 0) printf("Sync failed.\n");
+    free(out.p);
+    free(hello);
+    sync_finish(applied);
+    return (int)applied;
+}
+
+static int sync_socket(const char *sock_path, struct sockaddr_un *addr) {
+    if (strlen(sock_path) >= sizeof(addr->sun_path)) { printf("Socket path too long.\n"); return -1; }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, sock_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) printf("Unable to create socket: %s\n", strerror(errno));
+    return fd;
+}
+
+/* Wait for one replica to connect on a local socket and sync with it */
+int sync_serve(const char *sock_path) {
+    struct sockaddr_un addr;
+    int ls = sync_socket(sock_path, &addr);
+    if (ls < 0) return -1;
+    unlink(sock_path);
+    if (bind(ls, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(ls, 1) != 0) {
+        printf("Unable to listen on %s: %s\n", sock_path, strerror(errno));
+        close(ls);
+        return -1;
+    }
+    printf("Waiting for a replica on %s ...\n", sock_path);
+    fflush(stdout);
+    int fd = accept(ls, NULL, NULL);
+    close(ls);
+    unlink(sock_path);
+    if (fd < 0) return -1;
+    int n = sync_session(fd, 1);
+    close(fd);
+    return n;
+}
+
+int sync_connect(const char *sock_path) {
+    struct sockaddr_un addr;
+    int fd = sync_socket(sock_path, &addr);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        printf("Unable to connect to %s: %s\n", sock_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    int n = sync_session(fd, 0);
+    close(fd);
+    return n;
+}
+
+void sync_menu() {
+    if (sandbox.active) { printf("Commit or discard the sandbox first.\n"); return; }
+    sync_load();
+    printf("Ledger '%s' is replica %016llx at generation %llu.\n", ledgers[active_ledger].name,
+           (unsigned long long)sync_state.self, (unsigned long long)ledgers[active_ledger].generation);
+    for (size_t i = 0; i < sync_state.npeers; ++i) {
+        const SyncPeer *p = &sync_state.peers[i];
+        printf("  peer %016llx has our changes through %llu\n", (unsigned long long)p->id,
+               (unsigned long long)clock_get(&p->clock, sync_state.self));
+    }
+    sync_free();
+    printf("1=export changes to a file 2=import a file 3=wait on a local socket 4=connect to a local socket : ");
+    int c = read_int();
+    if (c < 1 || c > 4) return;
+    uint64_t peer = 0;
+    if (c == 1) {
+        printf("Peer replica id (blank = a new replica, sends everything): ");
+        char idbuf[32]; read_line(idbuf, sizeof(idbuf));
+        peer = strtoull(idbuf, NULL, 16);
+    }
+    printf(c <= 2 ? "File path: " : "Socket path: ");
+    char path[256]; read_line(path, sizeof(path));
+    if (strlen(path) == 0) { printf("Aborted.\n"); return; }
+    if (c == 1) sync_export(path, peer);
+    else if (c == 2) sync_import(path);
+    else if (c == 3) sync_serve(path);
+    else sync_connect(path);
+}
+
+/* -------------------- Backups -------------------- */
+
+static uint32_t file_check(const char *path, int *ok) {
+    FILE *f = fopen(path, "rb");
+    uint32_t h = FNV32_INIT;
+    *ok = f != NULL;
+    if (!f) return 0;
+    unsigned char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) h = fnv32_more(h, buf, n);
+    fclose(f);
+    return h;
+}
+
+/* Entries of dir's manifest in the order they were taken; caller frees.
+   owner receives the name of the ledger the directory belongs to. */
+static size_t backup_manifest(const char *dir, BackupEntry **out, char *owner, size_t owner_sz) {
+    char path[PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s/%s", dir, BACKUP_MANIFEST);
+    *out = NULL;
+    *owner = 0;
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    size_t n = 0, cap = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        BackupEntry e;
+        unsigned long long from, to, end;
+        char name[64];
+        memset(&e, 0, sizeof(e));
+        if (sscanf(line, "ledger %63s", name) == 1) {
+            snprintf(owner, owner_sz, "%s", name);
+        } else if (sscanf(line, "%7s %d %d %llu %llu %llu %x %63s", e.kind, &e.id, &e.parent, &from, &to, &end,
+                          &e.check, e.file) == 8) {
+            e.from = from;
+            e.to = to;
+            e.journal_end = end;
+            *out = grow_array(*out, &cap, n + 1, sizeof(BackupEntry), 16);
+            (*out)[n++] = e;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+/* Copy the active ledger's journal records after seq after into path.
+   Reading starts at hint, where the previous backup stopped, and only
+   falls back to the nearest checkpoint if that no longer lines up. */
+static int backup_segment(const Ledger *L, const char *path, uint64_t after, uint64_t hint, size_t *count) {
+    char jpath[PATH_LEN + 32];
+    snprintf(jpath, sizeof(jpath), "%s/%s", L->dir, JOURNAL_FILE);
+    *count = 0;
+    FILE *in = fopen(jpath, "rb");
+    if (!in) {
+        if (L->generation != after || !(in = fopen(path, "wb"))) return 0;
+        return file_sync_close(in); /* nothing to copy */
+    }
+    JournalRec r;
+    unsigned char op[JOURNAL_MAX_OP];
+    fseek(in, (long)hint, SEEK_SET);
+    size_t head = journal_read(in, &r, op);
+    if (!head || r.seq > after + 1) {
+        fseek(in, (long)journal_resume_offset(L->dir, after), SEEK_SET);
+        head = journal_read(in, &r, op);
+    }
+    FILE *out = fopen(path, "wb");
+    if (!out) { fclose(in); return 0; }
+    uint64_t expect = after + 1;
+    for (; head; head = journal_read(in, &r, op)) {
+        if (r.seq <= after) continue;
+        if (r.seq != expect) break; /* the journal no longer covers this */
+        fwrite(&r, head, 1, out);
+        fwrite(op, 1, r.len, out);
+        expect++;
+        (*count)++;
+    }
+    fclose(in);
+    int ok = file_sync_close(out);
+    return ok && expect == L->generation + 1;
+}
+
+/* Note in L's directory that backups in dir go on from seq, replacing
+   what an earlier backup there noted */
+static int backup_pin(const Ledger *L, const char *dir, uint64_t seq) {
+    char path[PATH_LEN + 32], tmp[PATH_LEN + 40], line[PATH_LEN + 64], d[PATH_LEN + 64];
+    snprintf(path, sizeof(path), "%s/%s", L->dir, BACKUP_PIN_FILE);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *in = fopen(path, "r"), *out = fopen(tmp, "w");
+    if (!out) {
+        if (in) fclose(in);
+        return 0;
+    }
+    unsigned long long a;
+    while (in && fgets(line, sizeof(line), in)) {
+        if (sscanf(line, "pin %llu %[^\n]", &a, d) == 2 && strcmp(d, dir) != 0) fputs(line, out);
+    }
+    if (in) fclose(in);
+    fprintf(out, "pin %llu %s\n", (unsigned long long)seq, dir);
+    return file_sync_close(out) && rename(tmp, path) == 0;
+}
+
+/* Back up the active ledger into dir; returns the new manifest entry's
+   id, 0 if there was nothing to back up, -1 on failure. Incremental and
+   differential backups read only the journal written since their base,
+   so they cost time proportional to the changes. */
+int backup_ledger(const char *dir, int kind) {
+    Ledger *L = &ledgers[active_ledger];
+    BackupEntry *ents;
+    char owner[64];
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        printf("Unable to create %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    size_t n = backup_manifest(dir, &ents, owner, sizeof(owner));
+    if (*owner && strcmp(owner, L->name) != 0) {
+        printf("%s holds backups of ledger '%s'.\n", dir, owner);
+        free(ents);
+        return -1;
+    }
+    journal_flush();
+    long base = -1;
+    for (size_t i = n; kind != BACKUP_FULL && i-- > 0;) {
+        if (kind == BACKUP_INCR || strcmp(ents[i].kind, "full") == 0) { base = (long)i; break; }
+    }
+    if (kind != BACKUP_FULL && base < 0) {
+        printf("No full backup yet — taking one.\n");
+        kind = BACKUP_FULL;
+    }
+    if (kind == BACKUP_INCR && ents[base].to == L->generation) {
+        printf("No changes since the last backup.\n");
+        free(ents);
+        return 0;
+    }
+    BackupEntry e;
+    memset(&e, 0, sizeof(e));
+    e.id = n ? ents[n - 1].id + 1 : 1;
+    e.to = L->generation;
+    e.journal_end = L->journal_end;
+    char path[PATH_LEN + 96];
+    size_t copied = 0;
+    int ok;
+    if (kind == BACKUP_FULL) {
+        strcpy(e.kind, "full");
+        e.from = e.to;
+        snprintf(e.file, sizeof(e.file), "full-%012llu.dat", (unsigned long long)e.to);
+        /* the archive's segments go beside it, each once per directory */
+        ok = 1;
+        for (size_t i = 0; ok && i < L->narch; ++i) {
+            char from[PATH_LEN + 64];
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/%s", dir, L->arch[i].file);
+            archive_path(from, sizeof(from), L->dir, L->arch[i].file);
+            ok = stat(path, &st) == 0 || archive_copy_file(from, path);
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, e.file);
+        if (ok) ok = checkpoint_write_path(path, &txns, txn_tree, L->arch, L->narch, &cats, &budgets, e.to,
+                                           e.journal_end);
+    } else {
+        const BackupEntry *b = &ents[base];
+        strcpy(e.kind, kind == BACKUP_INCR ? "incr" : "diff");
+        e.parent = b->id;
+        e.from = b->to;
+        snprintf(e.file, sizeof(e.file), "%s-%012llu-%012llu.log", e.kind, (unsigned long long)e.from,
+                 (unsigned long long)e.to);
+        snprintf(path, sizeof(path), "%s/%s", dir, e.file);
+        ok = backup_segment(L, path, b->to, b->journal_end, &copied);
+        if (!ok) printf("The journal does not cover every change since backup #%d — take a full backup.\n", b->id);
+    }
+    /* a differential backup reads from the newest full one, which is
+       never later than the newest backup an incremental one reads from */
+    uint64_t pin = e.to;
+    for (size_t i = n; kind != BACKUP_FULL && i-- > 0;) {
+        if (strcmp(ents[i].kind, "full") == 0) { pin = ents[i].to; break; }
+    }
+    free(ents);
+    if (ok) e.check = file_check(path, &ok);
+    if (!ok) {
+        remove(path);
+        printf("Backup failed.\n");
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, BACKUP_MANIFEST);
+    FILE *f = fopen(path, "a");
+    if (!f) { printf("Unable to update %s\n", path); return -1; }
+    if (n == 0 && !*owner) fprintf(f, "ledger %s\n", L->name);
+    fprintf(f, "%s %d %d %llu %llu %llu %08x %s\n", e.kind, e.id, e.parent, (unsigned long long)e.from,
+            (unsigned long long)e.to, (unsigned long long)e.journal_end, e.check, e.file);
+    if (!file_sync_close(f)) { printf("Unable to update %s\n", path); return -1; }
+    if (!backup_pin(L, dir, pin)) fprintf(stderr, "Warning: unable to save %s/%s\n", L->dir, BACKUP_PIN_FILE);
+    if (kind == BACKUP_FULL) printf("Backup #%d: full copy at change #%llu.\n", e.id, (unsigned long long)e.to);
+    else printf("Backup #%d: %zu change(s) since backup #%d.\n", e.id, copied, e.parent);
+    return e.id;
+}
+
+static long backup_find(const BackupEntry *ents, size_t n, int id) {
+    for (size_t i = 0; i < n; ++i) if (ents[i].id == id) return (long)i;
+    return -1;
+}
+
+/* Rebuild the ledger as of backup entry (0 = latest) by applying its
+   chain, full copy first, into a new ledger called ledger_name */
+int restore_backup(const char *dir, int entry, const char *ledger_name) {
+    BackupEntry *ents;
+    char owner[64];
+    size_t n = backup_manifest(dir, &ents, owner, sizeof(owner));
+    if (!n) { printf("No backups in %s.\n", dir); return -1; }
+    long at = entry > 0 ? backup_find(ents, n, entry) : (long)n - 1;
+    if (at < 0) { printf("No backup #%d.\n", entry); free(ents); return -1; }
+    size_t *chain = xmalloc(n * sizeof(size_t));
+    size_t depth = 0;
+    for (long i = at; i >= 0 && depth < n; i = backup_find(ents, n, ents[i].parent)) {
+        chain[depth++] = (size_t)i;
+        if (strcmp(ents[i].kind, "full") == 0) break;
+    }
+    char path[PATH_LEN + 96];
+    int ok = depth > 0 && strcmp(ents[chain[depth - 1]].kind, "full") == 0;
+    if (!ok) printf("Backup #%d has no full backup underneath it.\n", ents[at].id);
+    for (size_t k = 0; ok && k < depth; ++k) {
+        const BackupEntry *e = &ents[chain[k]];
+        snprintf(path, sizeof(path), "%s/%s", dir, e->file);
+        if (file_check(path, &ok) != e->check || !ok) {
+            printf("%s is missing or damaged.\n", path);
+            ok = 0;
+        }
+    }
+    TxnStore ts;
+    CatStore cs;
+    BudgetStore bs;
+    memset(&ts, 0, sizeof(ts));
+    memset(&cs, 0, sizeof(cs));
+    memset(&bs, 0, sizeof(bs));
+    uint64_t cur = 0;
+    int old_full = 0; /* written before fulls held or named the archived rows */
+    if (ok) {
+        const BackupEntry *full = &ents[chain[depth - 1]];
+        snprintf(path, sizeof(path), "%s/%s", dir, full->file);
+        ok = checkpoint_read(path, &ts, &cs, &bs);
+        cur = full->to;
+        old_full = checkpoint_version(path) < 4;
+    }
+    IdIndex ix = {NULL, NULL, 0, 0, NULL, 0};
+    StoreCtx s = {&ts, &cs, &bs, &ix, NULL, NULL};
+    if (ok) index_build(&ix, &ts);
+    for (size_t k = depth - 1; ok && k-- > 0;) {
+        snprintf(path, sizeof(path), "%s/%s", dir, ents[chain[k]].file);
+        FILE *f = fopen(path, "rb");
+        JournalRec r;
+        unsigned char op[JOURNAL_MAX_OP];
+        while (f && journal_read(f, &r, op)) {
+            if (r.seq <= cur) continue;  /* a differential overlapping what is applied */
+            if (r.seq != cur + 1) break;
+            op_apply_bytes(&s, op, (int)(r.forward & JOURNAL_FORWARD));
+            cur = r.seq;
+        }
+        if (f) fclose(f);
+    }
+    index_free(&ix);
+    if (ok && cur != ents[at].to) {
+        printf("Backup chain is incomplete: it stops at change #%llu.\n", (unsigned long long)cur);
+        ok = 0;
+    }
+    int idx = ok ? ledger_create(ledger_name) : -1;
+    if (ok && idx < 0) printf("Unable to create ledger '%s'.\n", ledger_name);
+    if (idx < 0) {
+        free(ts.data);
+        free(cs.data);
+        free(bs.data);
+        free(ents);
+        free(chain);
+        return -1;
+    }
+    Ledger *L = &ledgers[idx];
+    L->txns = ts;
+    L->cats = cs;
+    L->budgets = bs;
+    for (size_t i = 0; i < ts.size; ++i) if (ts.data[i].id >= L->txns.next_id) L->txns.next_id = ts.data[i].id + 1;
+    for (size_t i = 0; i < cs.size; ++i) if (cs.data[i].id >= L->cats.next_id) L->cats.next_id = cs.data[i].id + 1;
+    L->generation = cur;
+    save_ledger(L);
+    if (old_full && archive_copy(dir, L->dir) < 0) printf("Warning: unable to restore the archive from %s\n", dir);
+    archive_load(L);
+    printf("Restored backup #%d (%zu file(s), change #%llu) into ledger '%s'.\n", ents[at].id, depth,
+           (unsigned long long)cur, L->name);
+    free(ents);
+    free(chain);
+    return idx;
+}
+
+void backup_menu() {
+    if (sandbox.active) { printf("Commit or discard the sandbox first.\n"); return; }
+    const Ledger *L = &ledgers[active_ledger];
+    char def[PATH_LEN], dir[PATH_LEN];
+    snprintf(def, sizeof(def), "%s/%s", BACKUP_DIR, L->name);
+    printf("Backup directory [%s]: ", def);
+    read_line(dir, sizeof(dir));
+    if (strlen(dir) == 0) {
+        if (mkdir(BACKUP_DIR, 0700) != 0 && errno != EEXIST) { printf("Unable to create %s\n", BACKUP_DIR); return; }
+        strcpy(dir, def);
+    }
+    BackupEntry *ents;
+    char owner[64];
+    size_t n = backup_manifest(dir, &ents, owner, sizeof(owner));
+    for (size_t i = 0; i < n; ++i) {
+        printf("  #%-4d %s  change #%llu", ents[i].id, ents[i].kind, (unsigned long long)ents[i].to);
+        if (ents[i].parent) printf("  (on #%d)", ents[i].parent);
+        printf("\n");
+    }
+    free(ents);
+    printf("1=full backup 2=incremental 3=differential 4=restore into a new ledger : ");
+    int c = read_int();
+    if (c >= 1 && c <= 3) {
+        backup_ledger(dir, c == 1 ? BACKUP_FULL : c == 2 ? BACKUP_INCR : BACKUP_DIFF);
+    } else if (c == 4) {
+        printf("Backup # to restore [latest]: ");
+        int id = read_int();
+        printf("New ledger name: ");
+        char name[64]; read_line(name, sizeof(name));
+        if (strlen(name) == 0) { printf("Aborted.\n"); return; }
+        restore_backup(dir, id, name);
+    }
+}
+
+/* -------------------- Cold-month archive -------------------- */
+
+/* LZ77 codec in the style of LZ4. Each sequence is a token byte (literal
+   count in the high nibble, match length - LZ_MIN_MATCH in the low one;
+   15 means more length bytes follow, each adding up to 255), the
+   literals, then a little-endian 16-bit match offset. The last sequence
+   is literals only. */
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+#define LZ_MAX_OFFSET 65535
+
+static size_t lz_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+static size_t lz_put_len(unsigned char *o, size_t len) {
+    size_t k = 0;
+    for (; len >= 255; len -= 255) o[k++] = 255;
+    o[k++] = (unsigned char)len;
+    return k;
+}
+
+static size_t lz_sequence(unsigned char *o, const unsigned char *lit, size_t nlit, size_t offset, size_t mlen) {
+    size_t m = mlen ? mlen - LZ_MIN_MATCH : 0, k = 1;
+    o[0] = (unsigned char)((nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15));
+    if (nlit >= 15) k += lz_put_len(o + k, nlit - 15);
+    memcpy(o + k, lit, nlit);
+    k += nlit;
+    if (!mlen) return k;
+    o[k++] = (unsigned char)(offset & 255);
+    o[k++] = (unsigned char)(offset >> 8);
+    if (m >= 15) k += lz_put_len(o + k, m - 15);
+    return k;
+}
+
+/* Compress n bytes into out, which must hold lz_bound(n) bytes; returns
+   the compressed size */
+static size_t lz_compress(const unsigned char *in, size_t n, unsigned char *out) {
+    uint32_t *last = calloc((size_t)1 << LZ_HASH_BITS, sizeof(uint32_t)); /* position + 1 */
+    if (!last) panic("calloc lz");
+    size_t ip = 0, anchor = 0, op = 0;
+    while (ip + LZ_MIN_MATCH <= n) {
+        uint32_t v;
+        memcpy(&v, in + ip, sizeof(v));
+        uint32_t h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t cand = last[h], ref = cand - 1;
+        last[h] = (uint32_t)ip + 1;
+        if (!cand || ip - ref > LZ_MAX_OFFSET || memcmp(in + ref, in + ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+        size_t len = LZ_MIN_MATCH;
+        while (ip + len < n && in[ref + len] == in[ip + len]) len++;
+        op += lz_sequence(out + op, in + anchor, ip - anchor, ip - ref, len);
+        ip += len;
+        anchor = ip;
+    }
+    op += lz_sequence(out + op, in + anchor, n - anchor, 0, 0);
+    free(last);
+    return op;
+}
+
+static int lz_get_len(const unsigned char *in, size_t n, size_t *ip, size_t *len) {
+    unsigned char b;
+    do {
+        if (*ip >= n) return 0;
+        b = in[(*ip)++];
+        *len += b;
+    } while (b == 255);
+    return 1;
+}
+
+/* Returns 1 if in decodes to exactly out_len bytes */
+static int lz_decompress(const unsigned char *in, size_t n, unsigned char *out, size_t out_len) {
+    size_t ip = 0, op = 0;
+    while (ip < n) {
+        unsigned tok = in[ip++];
+        size_t nlit = tok >> 4, mlen = tok & 15;
+        if (nlit == 15 && !lz_get_len(in, n, &ip, &nlit)) return 0;
+        if (nlit > n - ip || nlit > out_len - op) return 0;
+        memcpy(out + op, in + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == n) break;
+        if (n - ip < 2) return 0;
+        size_t offset = in[ip] | (size_t)in[ip + 1] << 8;
+        ip += 2;
+        if (mlen == 15 && !lz_get_len(in, n, &ip, &mlen)) return 0;
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || mlen > out_len - op) return 0;
+        for (size_t i = 0; i < mlen; ++i, ++op) out[op] = out[op - offset]; /* may overlap */
+    }
+    return op == out_len;
+}
+
+static void archive_path(char *out, size_t sz, const char *dir, const char *file) {
+    snprintf(out, sz, "%s/%s/%s", dir, ARCHIVE_DIR, file);
+}
+
+/* Read the segment headers of L's archive, ordered by month */
+void archive_load(Ledger *L) {
+    char dir[PATH_LEN + 32], path[PATH_LEN + 64];
+    snprintf(dir, sizeof(dir), "%s/%s", L->dir, ARCHIVE_DIR);
+    L->narch = 0;
+    DIR *d = opendir(dir);
+    if (!d) return;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        ArchiveSeg seg;
+        if (strncmp(e->d_name, "seg-", 4) != 0 || strlen(e->d_name) >= sizeof(seg.file)) continue;
+        snprintf(seg.file, sizeof(seg.file), "%s", e->d_name);
+        archive_path(path, sizeof(path), L->dir, seg.file);
+        FILE *f = fopen(path, "rb");
+        if (!f) continue;
+        int ok = fread(&seg.h, sizeof(seg.h), 1, f) == 1 && memcmp(seg.h.magic, ARCHIVE_MAGIC, 4) == 0;
+        fclose(f);
+        if (!ok) continue;
+        L->arch = grow_array(L->arch, &L->archcap, L->narch + 1, sizeof(ArchiveSeg), 16);
+        L->arch[L->narch++] = seg;
+    }
+    closedir(d);
+    for (size_t i = 1; i < L->narch; ++i) {
+        ArchiveSeg seg = L->arch[i];
+        size_t j = i;
+        while (j > 0 && (L->arch[j - 1].h.month > seg.h.month ||
+                         (L->arch[j - 1].h.month == seg.h.month && strcmp(L->arch[j - 1].file, seg.file) > 0))) {
+            L->arch[j] = L->arch[j - 1];
+            --j;
+        }
+        L->arch[j] = seg;
+    }
+}
+
+/* Decompress and verify a segment file; caller frees */
+static Transaction *archive_read(const char *path, size_t *count) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    ArchiveHeader h;
+    unsigned char *comp = NULL;
+    Transaction *rows = NULL;
+    int ok = fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, ARCHIVE_MAGIC, 4) == 0 &&
+             h.raw_len == (uint64_t)h.count * sizeof(Transaction);
+    if (ok) {
+        comp = xmalloc(h.comp_len ? h.comp_len : 1);
+        rows = xmalloc(h.raw_len ? h.raw_len : 1);
+        ok = fread(comp, 1, h.comp_len, f) == h.comp_len &&
+             lz_decompress(comp, h.comp_len, (unsigned char *)rows, h.raw_len) &&
+             fnv32((unsigned char *)rows, h.raw_len) == h.check;
+    }
+    fclose(f);
+    free(comp);
+    if (!ok) { free(rows); return NULL; }
+    *count = h.count;
+    return rows;
+}
+
+/* A copy of a segment's rows (caller frees), decompressed at most once
+   while it stays among the ARCHIVE_CACHE_SEGS most recently used */
+static Transaction *archive_rows(const Ledger *L, const ArchiveSeg *s, size_t *count) {
+    char path[PATH_LEN + 64];
+    archive_path(path, sizeof(path), L->dir, s->file);
+    pthread_mutex_lock(&arch_lock);
+    ArchiveCacheEntry *hit = NULL, *victim = &arch_cache[0];
+    for (size_t i = 0; i < ARCHIVE_CACHE_SEGS; ++i) {
+        ArchiveCacheEntry *c = &arch_cache[i];
+        if (c->rows && strcmp(c->path, path) == 0) { hit = c; break; }
+        if (c->used < victim->used) victim = c;
+    }
+    metric_add(hit ? &metrics.arch_hits : &metrics.arch_misses, 1);
+    if (!hit) {
+        size_t n;
+        Transaction *rows = archive_read(path, &n);
+        if (rows) {
+            free(victim->rows);
+            victim->rows = rows;
+            victim->count = n;
+            snprintf(victim->path, sizeof(victim->path), "%s", path);
+            hit = victim;
+        }
+    }
+    Transaction *out = NULL;
+    *count = 0;
+    if (hit) {
+        hit->used = ++arch_tick;
+        out = xmalloc((hit->count ? hit->count : 1) * sizeof(Transaction));
+        memcpy(out, hit->rows, hit->count * sizeof(Transaction));
+        *count = hit->count;
+    }
+    pthread_mutex_unlock(&arch_lock);
+    if (!hit) fprintf(stderr, "Warning: archive segment %s is unreadable — skipped\n", path);
+    return out;
+}
+
+static int zone_has_category(const ArchiveHeader *h, int cid) {
+    if (h->ncats > ARCHIVE_ZONE_CATS) return 1;
+    for (uint32_t i = 0; i < h->ncats; ++i) if (h->cats[i] == cid) return 1;
+    return 0;
+}
+
+/* Could any category of the segment match the partial name? */
+static int zone_category_named(const ArchiveHeader *h, const char *cname) {
+    if (h->ncats > ARCHIVE_ZONE_CATS) return 1;
+    for (uint32_t i = 0; i < h->ncats; ++i) {
+        int idx = find_category_index_by_id(h->cats[i]);
+        if (strcasestr(idx >= 0 ? cats.data[idx].name : "UNKNOWN", cname)) return 1;
+    }
+    return 0;
+}
+
+/* Add L's archived rows dated in months [from_month, to_month] to c by
+   category id. A row still in the hot store (an archive run that stopped
+   before the ledger was saved) is counted there only. */
+void archive_accumulate(Cube *c, const Ledger *L, int from_month, int to_month) {
+    const IdIndex *ix = &txn_index;
+    IdIndex own = {NULL, NULL, 0, 0, NULL, 0};
+    for (size_t i = 0; i < L->narch; ++i) {
+        const ArchiveSeg *s = &L->arch[i];
+        if (s->h.month < from_month || s->h.month > to_month) continue;
+        if (L != &ledgers[active_ledger] && !own.cap) {
+            index_build(&own, &L->txns);
+            ix = &own;
+        }
+        size_t n, keep = 0;
+        Transaction *rows = archive_rows(L, s, &n);
+        if (!rows) continue;
+        for (size_t k = 0; k < n; ++k) if (index_lookup(ix, rows[k].id) < 0) rows[keep++] = rows[k];
+        TxnStore ts = {rows, keep, n, 0};
+        cube_accumulate(c, &ts, s->h.month, s->h.month);
+        free(rows);
+    }
+    index_free(&own);
+}
+
+/* Fold the archived rows of month into the active ledger's aggregates
+   the first time a report asks for it */
+void archive_fold(Cube *agg, int month) {
+    for (size_t i = 0; i < agg->narchived; ++i) if (agg->archived[i] == month) return;
+    agg->archived = grow_array(agg->archived, &agg->archivedcap, agg->narchived + 1, sizeof(int), 16);
+    agg->archived[agg->narchived++] = month;
+    archive_accumulate(agg, &ledgers[active_ledger], month, month);
+}
+
+/* Archived rows of the active ledger from segments whose zone map can
+   match the filters (empty dates and 0 amounts match anything). Rows
+   still need filtering one by one. Caller frees. */
+Transaction *archive_select(const char *from, const char *to, double minamt, double maxamt, const char *cname,
+                            size_t *count) {
+    const Ledger *L = &ledgers[active_ledger];
+    int lo = from && *from ? date_key(from) : 0;
+    int hi = to && *to ? date_key(to) : 99999999;
+    Transaction *out = NULL;
+    size_t n = 0, cap = 0;
+    for (size_t i = 0; i < L->narch; ++i) {
+        const ArchiveHeader *h = &L->arch[i].h;
+        if (h->max_day < lo || h->min_day > hi) continue;
+        if (minamt > 0 && h->max_amount < minamt) continue;
+        if (maxamt > 0 && h->min_amount > maxamt) continue;
+        if (cname && *cname && !zone_category_named(h, cname)) continue;
+        size_t k;
+        Transaction *rows = archive_rows(L, &L->arch[i], &k);
+        out = grow_array(out, &cap, n + k, sizeof(Transaction), 64);
+        for (size_t j = 0; j < k; ++j) if (index_get(rows[j].id) < 0) out[n++] = rows[j];
+        free(rows);
+    }
+    *count = n;
+    return out;
+}
+
+/* Look id up among L's archived rows; out may be NULL */
+int archive_find(const Ledger *L, int id, Transaction *out) {
+    for (size_t i = 0; i < L->narch; ++i) {
+        const ArchiveSeg *s = &L->arch[i];
+        if (id < s->h.min_id || id > s->h.max_id) continue;
+        size_t n;
+        Transaction *rows = archive_rows(L, s, &n);
+        for (size_t k = 0; k < n; ++k) {
+            if (rows[k].id != id) continue;
+            if (out) *out = rows[k];
+            free(rows);
+            return 1;
+        }
+        free(rows);
+    }
+    return 0;
+}
+
+/* Do any archived rows of the active ledger use category cid? */
+int archive_uses_category(int cid) {
+    const Ledger *L = &ledgers[active_ledger];
+    for (size_t i = 0; i < L->narch; ++i) {
+        const ArchiveSeg *s = &L->arch[i];
+        if (!zone_has_category(&s->h, cid)) continue;
+        if (s->h.ncats <= ARCHIVE_ZONE_CATS) return 1;
+        size_t n;
+        Transaction *rows = archive_rows(L, s, &n);
+        for (size_t k = 0; k < n && rows; ++k) {
+            if (rows[k].category_id == cid) { free(rows); return 1; }
+        }
+        free(rows);
+    }
+    return 0;
+}
+
+size_t archive_row_count(const Ledger *L) {
+    size_t n = 0;
+    for (size_t i = 0; i < L->narch; ++i) n += L->arch[i].h.count;
+    return n;
+}
+
+/* Write rows (all dated in month) as a new segment of L; the file is
+   synced under a temporary name, then renamed and made read-only */
+static int archive_write(Ledger *L, int month, const Transaction *rows, size_t n, ArchiveSeg *seg) {
+    ArchiveHeader *h = &seg->h;
+    memset(seg, 0, sizeof(*seg));
+    memcpy(h->magic, ARCHIVE_MAGIC, 4);
+    h->version = FORMAT_VERSION;
+    h->month = month;
+    h->count = (uint32_t)n;
+    h->raw_len = (uint64_t)n * sizeof(Transaction);
+    h->check = fnv32((const unsigned char *)rows, h->raw_len);
+    for (size_t i = 0; i < n; ++i) {
+        const Transaction *t = &rows[i];
+        int day = date_key(t->date);
+        if (i == 0 || day < h->min_day) h->min_day = day;
+        if (i == 0 || day > h->max_day) h->max_day = day;
+        if (i == 0 || t->id < h->min_id) h->min_id = t->id;
+        if (i == 0 || t->id > h->max_id) h->max_id = t->id;
+        if (i == 0 || t->amount < h->min_amount) h->min_amount = t->amount;
+        if (i == 0 || t->amount > h->max_amount) h->max_amount = t->amount;
+        if (h->ncats <= ARCHIVE_ZONE_CATS && !zone_has_category(h, t->category_id)) {
+            if (h->ncats < ARCHIVE_ZONE_CATS) h->cats[h->ncats] = t->category_id;
+            h->ncats++;
+        }
+    }
+    unsigned char *comp = xmalloc(lz_bound(h->raw_len));
+    h->comp_len = lz_compress((const unsigned char *)rows, h->raw_len, comp);
+    snprintf(seg->file, sizeof(seg->file), "seg-%06d-%012llu.arc", month, (unsigned long long)L->generation);
+    char path[PATH_LEN + 64], tmp[PATH_LEN + 80];
+    struct stat st;
+    archive_path(path, sizeof(path), L->dir, seg->file);
+    snprintf(tmp, sizeof(tmp), "%s/%s/tmp-%s", L->dir, ARCHIVE_DIR, seg->file);
+    FILE *f = stat(path, &st) == 0 ? NULL : fopen(tmp, "wb");
+    int ok = f != NULL;
+    if (f) {
+        fwrite(h, sizeof(*h), 1, f);
+        fwrite(comp, 1, h->comp_len, f);
+        ok = file_sync_close(f) && rename(tmp, path) == 0;
+        if (!ok) remove(tmp);
+        else chmod(path, 0400);
+    }
+    free(comp);
+    return ok;
+}
+
+typedef struct {
+    Ledger *L;
+    int month;
+    Transaction *rows;
+    size_t n;
+    ArchiveSeg *seg;
+    int ok;
+} ArchiveJob;
+
+static void archive_task(void *arg) {
+    ArchiveJob *j = arg;
+    j->ok = archive_write(j->L, j->month, j->rows, j->n, j->seg);
+}
+
+/* Move the active ledger's rows dated before the cutoff (years back from
+   this month) into new segments, one per month, compressed and written
+   in parallel by low-priority tasks (queued report or search work runs
+   first) while the caller waits for them. The segments are on
+   disk before the rows leave the hot store, which is then saved; the
+   move is not a change to the ledger, so it is neither journaled nor
+   undoable. Checkpoints and full backups name the segments, sync
+   snapshots stream them, and touching a row thaws its segment
+   (archive_thaw()).
+   Only run on request. Returns the number of rows moved, -1 on failure. */
+int archive_cold(int years) {
+    if (years <= 0 || sandbox.active || txn_tree) return 0; /* a B+tree ledger is on disk already */
+    Ledger *L = &ledgers[active_ledger];
+    time_t now = time(NULL);
+    struct tm *tm = localtime(&now);
+    int cutoff = (tm->tm_year + 1900 - years) * 100 + tm->tm_mon + 1;
+    int *months = NULL;
+    size_t nmonths = 0, mcap = 0, ncold = 0;
+    for (size_t i = 0; i < txns.size; ++i) {
+        int m = date_key(txns.data[i].date) / 100;
+        if (m >= cutoff) continue;
+        ncold++;
+        size_t k = 0;
+        while (k < nmonths && months[k] != m) ++k;
+        if (k < nmonths) continue;
+        months = grow_array(months, &mcap, nmonths + 1, sizeof(int), 16);
+        months[nmonths++] = m;
+    }
+    if (!ncold) { free(months); return 0; }
+    char dir[PATH_LEN + 32];
+    snprintf(dir, sizeof(dir), "%s/%s", L->dir, ARCHIVE_DIR);
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Warning: unable to create %s\n", dir);
+        free(months);
+        return -1;
+    }
+    /* cold rows grouped by month, in store order within each */
+    Transaction *rows = xmalloc(ncold * sizeof(Transaction));
+    ArchiveJob *jobs = calloc(nmonths, sizeof(ArchiveJob));
+    if (!jobs) panic("calloc archive jobs");
+    for (size_t i = 0; i < txns.size; ++i) {
+        int m = date_key(txns.data[i].date) / 100;
+        if (m >= cutoff) continue;
+        size_t k = 0;
+        while (months[k] != m) ++k;
+        jobs[k].n++;
+    }
+    size_t first = L->narch, at = 0;
+    L->arch = grow_array(L->arch, &L->archcap, L->narch + nmonths, sizeof(ArchiveSeg), 16);
+    for (size_t k = 0; k < nmonths; ++k) {
+        jobs[k].L = L;
+        jobs[k].month = months[k];
+        jobs[k].rows = rows + at;
+        jobs[k].seg = &L->arch[first + k];
+        at += jobs[k].n;
+        jobs[k].n = 0;
+    }
+    for (size_t i = 0; i < txns.size; ++i) {
+        int m = date_key(txns.data[i].date) / 100;
+        if (m >= cutoff) continue;
+        size_t k = 0;
+        while (months[k] != m) ++k;
+        jobs[k].rows[jobs[k].n++] = txns.data[i];
+    }
+    TaskGroup group;
+    task_group_init(&group, PRIO_LOW);
+    for (size_t k = 0; k < nmonths; ++k) task_spawn(&group, archive_task, &jobs[k]);
+    task_wait(&group);
+    task_group_destroy(&group);
+    int ok = 1;
+    for (size_t k = 0; k < nmonths; ++k) ok &= jobs[k].ok;
+    if (!ok) {
+        /* not referenced yet: drop this run's segments, rows stay hot */
+        char path[PATH_LEN + 64];
+        for (size_t k = 0; k < nmonths; ++k) {
+            if (!jobs[k].ok) continue;
+            archive_path(path, sizeof(path), L->dir, jobs[k].seg->file);
+            remove(path);
+        }
+    }
+    free(jobs);
+    free(rows);
+    free(months);
+    if (!ok) {
+        fprintf(stderr, "Warning: unable to write archive segment in %s — nothing archived\n", dir);
+        return -1;
+    }
+    L->narch = first + nmonths;
+    size_t keep = 0;
+    for (size_t i = 0; i < txns.size; ++i) {
+        if (date_key(txns.data[i].date) / 100 >= cutoff) txns.data[keep++] = txns.data[i];
+    }
+    txns.size = keep;
+    index_rebuild();
+    aggregates_invalidate();
+    oplog_clear(); /* undo entries may name rows that are gone */
+    ledger_stash_active();
+    save_ledger(L);
+    archive_load(L);
+    return (int)ncold;
+}
+
+/* Forget any decompressed copy of the segment at path */
+static void archive_uncache(const char *path) {
+    pthread_mutex_lock(&arch_lock);
+    for (size_t i = 0; i < ARCHIVE_CACHE_SEGS; ++i) {
+        ArchiveCacheEntry *c = &arch_cache[i];
+        if (!c->rows || strcmp(c->path, path) != 0) continue;
+        free(c->rows);
+        c->rows = NULL;
+        c->count = 0;
+    }
+    pthread_mutex_unlock(&arch_lock);
+}
+
+/* Put the rows of a thawed segment that are not hot back into the hot
+   store and save the ledger; returns 0 if the save failed, in which
+   case the segment file must stay */
+static int archive_merge(Ledger *L, Transaction *rows, size_t n) {
+    size_t keep = 0;
+    for (size_t k = 0; k < n; ++k) if (index_get(rows[k].id) < 0) rows[keep++] = rows[k];
+    StoreCtx s = active_ctx();
+    raw_txn_append_rows(&s, rows, keep);
+    aggregates_invalidate(); /* the month may have been folded in already */
+    oplog_clear(); /* as for archiving, undo slots no longer line up */
+    ledger_stash_active();
+    IoBatch b;
+    io_batch_init(&b);
+    save_ledger_submit(L, &b);
+    return io_wait(&b);
+}
+
+/* Move a thawed segment file beside the checkpoints, which may still
+   name it; checkpoint_prune() removes it once none does */
+static void archive_retire(const Ledger *L, const char *thaw, const char *name) {
+    char path[PATH_LEN + 320];
+    snprintf(path, sizeof(path), "%s/%s", L->dir, CKPT_DIR);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/%s/%s", L->dir, CKPT_DIR, name);
+    if (rename(thaw, path) != 0) remove(thaw);
+}
+
+/* Bring the segment holding archived row id back into the active
+   ledger's hot store, so the row can be edited, deleted or synced like
+   any other. Like archiving it moves storage without changing the
+   ledger: the segment is renamed thaw-* first, its rows are saved with
+   the ledger, then the file is retired to the checkpoints directory;
+   archive_recover() finishes a thaw that a crash cut short. Returns 1 if
+   id is hot now. */
+int archive_thaw(int id) {
+    Ledger *L = &ledgers[active_ledger];
+    if (sandbox.active || reader_mode) return 0;
+    for (size_t i = 0; i < L->narch; ++i) {
+        const ArchiveSeg *seg = &L->arch[i];
+        if (id < seg->h.min_id || id > seg->h.max_id) continue;
+        size_t n, k = 0;
+        Transaction *rows = archive_rows(L, seg, &n);
+        while (k < n && rows[k].id != id) ++k;
+        if (k == n) { free(rows); continue; }
+        char path[PATH_LEN + 64], thaw[PATH_LEN + 80];
+        archive_path(path, sizeof(path), L->dir, seg->file);
+        snprintf(thaw, sizeof(thaw), "%s/%s/thaw-%s", L->dir, ARCHIVE_DIR, seg->file);
+        if (rename(path, thaw) != 0) {
+            fprintf(stderr, "Warning: unable to thaw %s: %s\n", path, strerror(errno));
+            free(rows);
+            return 0;
+        }
+        archive_uncache(path);
+        if (archive_merge(L, rows, n)) archive_retire(L, thaw, seg->file);
+        else fprintf(stderr, "Warning: unable to save ledger '%s' — %s kept\n", L->name, thaw);
+        free(rows);
+        archive_load(L);
+        return 1;
+    }
+    return 0;
+}
+
+/* Finish any thaw of L (the active ledger) interrupted by a crash */
+void archive_recover(Ledger *L) {
+    char dir[PATH_LEN + 32], path[PATH_LEN + 320];
+    snprintf(dir, sizeof(dir), "%s/%s", L->dir, ARCHIVE_DIR);
+    DIR *d = opendir(dir);
+    if (!d) return;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (strncmp(e->d_name, "thaw-", 5) != 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        size_t n;
+        Transaction *rows = archive_read(path, &n);
+        if (!rows) {
+            fprintf(stderr, "Warning: unable to read %s — left in place\n", path);
+            continue;
+        }
+        if (archive_merge(L, rows, n)) archive_retire(L, path, e->d_name + 5);
+        free(rows);
+    }
+    closedir(d);
+}
+
+/* Copy the segment file from to to, read-only; 0 (and no file at to)
+   on failure */
+int archive_copy_file(const char *from, const char *to) {
+    FILE *in = fopen(from, "rb"), *out = in ? fopen(to, "wb") : NULL;
+    int ok = out != NULL;
+    unsigned char buf[65536];
+    size_t n;
+    while (ok && (n = fread(buf, 1, sizeof(buf), in)) > 0) ok = fwrite(buf, 1, n, out) == n;
+    if (in) fclose(in);
+    if (out) ok = file_sync_close(out) && ok;
+    if (!ok) {
+        remove(to);
+        return 0;
+    }
+    chmod(to, 0400);
+    return 1;
+}
+
+/* Copy segments of src_dir's archive missing from dst_dir's; segments
+   never change, so a file with the same name is the same segment */
+int archive_copy(const char *src_dir, const char *dst_dir) {
+    char sdir[PATH_LEN + 32], ddir[PATH_LEN + 32];
+    snprintf(sdir, sizeof(sdir), "%s/%s", src_dir, ARCHIVE_DIR);
+    snprintf(ddir, sizeof(ddir), "%s/%s", dst_dir, ARCHIVE_DIR);
+    DIR *d = opendir(sdir);
+    if (!d) return 0;
+    int copied = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (strncmp(e->d_name, "seg-", 4) != 0) continue;
+        char from[PATH_LEN + 320], to[PATH_LEN + 320];
+        struct stat st;
+        snprintf(from, sizeof(from), "%s/%s", sdir, e->d_name);
+        snprintf(to, sizeof(to), "%s/%s", ddir, e->d_name);
+        if (stat(to, &st) == 0) continue;
+        if (mkdir(ddir, 0700) != 0 && errno != EEXIST) break;
+        if (!archive_copy_file(from, to)) {
+            copied = -1;
+            break;
+        }
+        copied++;
+    }
+    closedir(d);
+    return copied;
+}
+
+void archive_menu() {
+    const Ledger *L = &ledgers[active_ledger];
+    if (archive_years) printf("Archive of '%s' (default: months older than %d year(s)):\n", L->name, archive_years);
+    else printf("Archive of '%s':\n", L->name);
+    if (L->narch == 0) printf("  (no archived months)\n");
+    for (size_t i = 0; i < L->narch; ++i) {
+        const ArchiveHeader *h = &L->arch[i].h;
+        printf("  %04d-%02d  %6u row(s)  %llu -> %llu bytes  %s\n", h->month / 100, h->month % 100, h->count,
+               (unsigned long long)h->raw_len, (unsigned long long)h->comp_len, L->arch[i].file);
+    }
+    printf("1=archive now 2=set default age : ");
+    int c = read_int();
+    if (c == 1) {
+        if (sandbox.active) { printf("Commit or discard the sandbox first.\n"); return; }
+        printf("Archive months older than how many years [%d]: ", archive_years ? archive_years : 2);
+        int y = read_int();
+        if (y <= 0) y = archive_years ? archive_years : 2;
+        int n = archive_cold(y);
+        if (n > 0) printf("Archived %d transaction(s).\n", n);
+        else if (n == 0) printf("Nothing to archive.\n");
+    } else if (c == 2) {
+        printf("Default age in years for archive now (0 = none) [%d]: ", archive_years);
+        char buf[16]; read_line(buf, sizeof(buf));
+        if (strlen(buf)) archive_years = atoi(buf) > 0 ? atoi(buf) : 0;
+        save_config();
+        printf("Policy saved.\n");
+    }
+}
+
+/* -------------------- CRUD Category -------------------- */
+
+void add_category() {
+    char name[64];
+    printf("Category name: ");
+    read_line(name, sizeof(name));
+    if (strlen(name) == 0) { printf("Empty name aborted.\n"); return; }
+    int id = cat_insert(name);
+    printf("Added category '%s' (id=%d).\n", name, id);
+}
+
+void list_categories() {
+    printf("Categories:\n");
+    if (cats.size == 0) { printf(" (none)\n"); return; }
+    for (size_t i = 0; i < cats.size; ++i) {
+        printf("  id=%d  %s\n", cats.data[i].id, cats.data[i].name);
+    }
+}
+
+void edit_category() {
+    list_categories();
+    printf("Enter category id to edit: ");
+    int id = read_int();
+    int idx = find_category_index_by_id(id);
+    if (idx < 0) { printf("Not found.\n"); return; }
+    printf("New name (enter for keep '%s'): ", cats.data[idx].name);
+    char buf[64];
+    read_line(buf, sizeof(buf));
+    if (strlen(buf)) cat_rename((size_t)idx, buf);
+    printf("Updated.\n");
+}
+
+void remove_category() {
+    list_categories();
+    printf("Enter category id to remove: ");
+    int id = read_int();
+    int idx = find_category_index_by_id(id);
+    if (idx < 0) { printf("Not found.\n"); return; }
+    /* check transactions referencing it */
+    TxnIter it;
+    const Transaction *t;
+    txn_iter_open(&it, NULL, NULL, NULL, 0);
+    while ((t = txn_iter_next(&it)) != NULL) {
+        if (t->category_id == id) {
+            printf("Category used by transactions — cannot delete.\n");
+            return;
+        }
+    }
+    if (archive_uses_category(id)) { printf("Category used by archived transactions — cannot delete.\n"); return; }
+    for (size_t i = 0; i < budgets.size; ++i) {
+        if (budgets.data[i].category_id == id) { printf("Category has budgets — cannot delete.\n"); return; }
+    }
+    /* remove by swapping last */
+    cat_delete((size_t)idx);
+    printf("Deleted.\n");
+}
+
+/* -------------------- CRUD Transactions -------------------- */
+
+void add_transaction() {
+    Transaction t;
+    memset(&t, 0, sizeof(t));
+
+    /* date */
+    time_t now = time(NULL);
+    struct tm *tmnow = localtime(&now);
+    char default_date[DATE_STRLEN];
+    snprintf(default_date, sizeof(default_date), "%04d-%02d-%02d", tmnow->tm_year+1900, tmnow->tm_mon+1, tmnow->tm_mday);
+    printf("Date (YYYY-MM-DD) [default %s]: ", default_date);
+    read_line(t.date, sizeof(t.date));
+    if (strlen(t.date) == 0) strcpy(t.date, default_date);
+    if (!parse_date(t.date, NULL)) { printf("Invalid date format.\n"); return; }
+
+    /* type */
+    printf("Type: 0=Expense, 1=Income [0]: ");
+    int tp = read_int();
+    if (tp != 1) t.type = TYPE_EXPENSE; else t.type = TYPE_INCOME;
+
+    /* amount */
+    printf("Amount: ");
+    t.amount = read_double();
+    if (t.amount <= 0) { printf("Amount must be > 0.\n"); return; }
+
+    /* currency */
+    printf("Currency [%s]: ", base_currency);
+    char curbuf[16];
+    read_line(curbuf, sizeof(curbuf));
+    if (strlen(curbuf) == 0) strcpy(curbuf, base_currency);
+    if (!normalize_currency(curbuf)) { printf("Invalid currency code.\n"); return; }
+    strcpy(t.currency, curbuf);
+
+    /* category */
+    list_categories();
+    if (cats.size == 0) {
+        printf("No categories exist — create one now.\n");
+        add_category();
+        if (cats.size == 0) { printf("No categories — abort.\n"); return; }
+    }
+    printf("Enter category id for this transaction: ");
+    int cid = read_int();
+    if (!find_category_by_id(cid)) { printf("Invalid category.\n"); return; }
+    t.category_id = cid;
+
+    /* note */
+    printf("Note (optional): ");
+    read_line(t.note, sizeof(t.note));
+    txn_insert_batch(&t, 1);
+    printf("Transaction added (id=%d).\n", t.id);
+}
+
+/* Archived rows are listed only for a date range */
+void list_transactions(const char *start_date, const char *end_date) {
+    size_t narch = 0;
+    Transaction *arch = (start_date || end_date) ? archive_select(start_date, end_date, 0, 0, NULL, &narch) : NULL;
+    printf("Transactions:");
+    if (txn_count() + narch == 0) { printf(" (none)\n"); free(arch); return; }
+    printf("\n");
+    TxnIter it;
+    const Transaction *t;
+    txn_iter_open(&it, start_date, end_date, arch, narch);
+    while ((t = txn_iter_next(&it)) != NULL) {
+        if (start_date && compare_dates(t->date, start_date) < 0) continue;
+        if (end_date && compare_dates(t->date, end_date) > 0) continue;
+        int idx = find_category_index_by_id(t->category_id);
+        const char *cname = (idx >= 0) ? cats.data[idx].name : "UNKNOWN";
+        printf("  id=%d  %s  %s  %.2f %s  [%s]  %s%s\n",
+               t->id,
+               t->date,
+               (t->type == TYPE_INCOME ? "IN" : "EX"),
+               t->amount,
+               t->currency,
+               cname,
+               t->note,
+               it.in_extra ? "  (archived)" : "");
+    }
+    free(arch);
+    size_t hidden = (start_date || end_date) ? 0 : archive_row_count(&ledgers[active_ledger]);
+    if (hidden) printf("  (%zu archived transaction(s) not shown — list a date range to include them)\n", hidden);
+}
+
+int find_txn_index_by_id(int id) {
+    return (int)index_get(id);
+}
+
+void edit_transaction() {
+    list_transactions(NULL, NULL);
+    printf("Enter transaction id to edit: ");
+    int id = read_int();
+    int idx = find_txn_index_by_id(id);
+    if (idx < 0 && archive_find(&ledgers[active_ledger], id, NULL)) {
+        if (sandbox.active) { printf("Transaction %d is archived; commit or discard the sandbox first.\n", id); return; }
+        if (!archive_thaw(id)) { printf("Unable to bring archived transaction %d back.\n", id); return; }
+        idx = find_txn_index_by_id(id);
+    }
+    if (idx < 0) { printf("Not found.\n"); return; }
+    Transaction edited = txns.data[idx];
+    Transaction *t = &edited;
+    printf("Date [%s]: ", t->date);
+    char buf[DATE_STRLEN];
+    read_line(buf, sizeof(buf));
+    if (strlen(buf)) {
+        if (parse_date(buf, NULL)) strncpy(t->date, buf, sizeof(t->date));
+        else printf("Invalid date — kept.\n");
+    }
+    printf("Type 0=Expense,1=Income [%d]: ", t->type);
+    int tp = read_int();
+    if (tp == 0 || tp == 1) t->type = tp;
+    printf("Amount [%.2f]: ", t->amount);
+    double a = read_double();
+    if (a > 0) t->amount = a;
+    printf("Currency [%s]: ", t->currency);
+    char curbuf[16];
+    read_line(curbuf, sizeof(curbuf));
+    if (strlen(curbuf)) {
+        if (normalize_currency(curbuf)) strcpy(t->currency, curbuf);
+        else printf("Invalid currency — kept.\n");
+    }
+    list_categories();
+    printf("Category id [%d]: ", t->category_id);
+    int cid = read_int();
+    if (cid && find_category_by_id(cid)) t->category_id = cid;
+    printf("Note [%s]: ", t->note);
+    char notebuf[MAX_NOTE];
+    read_line(notebuf, sizeof(notebuf));
+    if (strlen(notebuf)) strncpy(t->note, notebuf, sizeof(t->note)-1);
+    txn_update((size_t)idx, t);
+    printf("Updated.\n");
+}
+
+void remove_transaction() {
+    list_transactions(NULL, NULL);
+    printf("Enter transaction id to delete: ");
+    int id = read_int();
+    int idx = find_txn_index_by_id(id);
+    if (idx < 0 && archive_find(&ledgers[active_ledger], id, NULL)) {
+        if (sandbox.active) { printf("Transaction %d is archived; commit or discard the sandbox first.\n", id); return; }
+        if (!archive_thaw(id)) { printf("Unable to bring archived transaction %d back.\n", id); return; }
+        idx = find_txn_index_by_id(id);
+    }
+    if (idx < 0) { printf("Not found.\n"); return; }
+    txn_delete((size_t)idx);
+    printf("Deleted.\n");
+}
+
+/* -------------------- Budgets -------------------- */
+
+void set_budget() {
+    list_categories();
+    printf("Enter category id to set budget: ");
+    int cid = read_int();
+    if (!find_category_by_id(cid)) { printf("Invalid category.\n"); return; }
+    printf("Year (e.g., 2025): ");
+    int year = read_int();
+    printf("Month (1-12): ");
+    int month = read_int();
+    if (month < 1 || month > 12) { printf("Invalid month.\n"); return; }
+    printf("Budget amount for %04d-%02d: ", year, month);
+    double amt = read_double();
+    if (amt < 0) { printf("Invalid amount.\n"); return; }
+    budget_put(cid, year, month, amt);
+    printf("Budget set.\n");
+}
+
+void list_budgets() {
+    if (budgets.size == 0) { printf("No budgets.\n"); return; }
+    for (size_t i = 0; i < budgets.size; ++i) {
+        int idx = find_category_index_by_id(budgets.data[i].category_id);
+        const char *cname = (idx >= 0) ? cats.data[idx].name : "UNKNOWN";
+        printf("  %04d-%02d  %s  %.2f\n", budgets.data[i].year, budgets.data[i].month, cname, budgets.data[i].amount);
+    }
+}
+
+/* Net spending (expense minus income) in the base currency */
+double total_for_category_month(int cat_id, int year, int month) {
+    Cube *agg = month_aggregates();
+    archive_fold(agg, year * 100 + month);
+    const CubeCell *cell = cube_lookup(agg, year * 100 + month, cat_id, "", 0);
+    return cell ? cell->expense - cell->income : 0.0;
+}
+
+/* -------------------- Reports -------------------- */
+
+/* All report figures are in the base currency and come from the
+   incrementally maintained month aggregates, with archived months
+   folded in on first use */
+void report_missing_rates(size_t missing) {
+    if (missing)
+        printf("  (%zu transaction(s) have no FX rate and were counted 1:1)\n", missing);
+}
+
+void monthly_summary(int year, int month) {
+    Cube *agg = month_aggregates();
+    int ym = year * 100 + month;
+    double income = 0.0, expense = 0.0;
+    size_t missing = 0;
+    archive_fold(agg, ym);
+    for (size_t i = 0; i < agg->size; ++i) {
+        if (agg->cells[i].month != ym) continue;
+        income += agg->cells[i].income;
+        expense += agg->cells[i].expense;
+        missing += agg->cells[i].missing;
+    }
+    printf("Monthly Summary for %04d-%02d (%s):\n", year, month, base_currency);
+    printf("  Total Income:  %.2f\n", income);
+    printf("  Total Expense: %.2f\n", expense);
+    printf("  Net Savings:   %.2f\n", income - expense);
+    report_missing_rates(missing);
+}
+
+void category_summary(int year, int month) {
+    printf("Category Summary %04d-%02d (%s):\n", year, month, base_currency);
+    if (cats.size == 0) { printf(" (no categories)\n"); return; }
+    for (size_t i = 0; i < cats.size; ++i) {
+        double total = total_for_category_month(cats.data[i].id, year, month);
+        printf("  %-20s : %.2f\n", cats.data[i].name, total);
+    }
+}
+
+void budget_report(int year, int month) {
+    printf("Budget Report %04d-%02d (%s):\n", year, month, base_currency);
+    int found = 0;
+    for (size_t i = 0; i < budgets.size; ++i) {
+        if (budgets.data[i].year == year && budgets.data[i].month == month) {
+            found = 1;
+            int cid = budgets.data[i].category_id;
+            int idx = find_category_index_by_id(cid);
+            const char *name = (idx >= 0) ? cats.data[idx].name : "UNKNOWN";
+            double used = total_for_category_month(cid, year, month);
+            double bamt = budgets.data[i].amount;
+            printf("  %-16s Budget: %.2f  Used: %.2f  Remaining: %.2f\n", name, bamt, used, bamt - used);
+        }
+    }
+    if (!found) printf("  No budgets set for this month.\n");
+}
+
+/* -------------------- Currencies and FX rates -------------------- */
+
+/* Uppercase a 3-letter code in place; 0 if it is not one */
+int normalize_currency(char *code) {
+    if (strlen(code) != 3) return 0;
+    for (int i = 0; i < 3; ++i) {
+        if (!isalpha((unsigned char)code[i])) return 0;
+        code[i] = (char)toupper((unsigned char)code[i]);
+    }
+    return 1;
+}
+
+void fx_rebuild_keys() {
+    free(rates.keys);
+    rates.keys = xmalloc((rates.size ? rates.size : 1) * sizeof(int));
+    for (size_t i = 0; i < rates.size; ++i) rates.keys[i] = date_key(rates.data[i].date);
+}
+
+/* Index of the first entry of currency's slice, or -1; *count gets its length */
+static long fx_series(const char *currency, size_t *count) {
+    size_t lo = 0, hi = rates.size;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (strcmp(rates.data[mid].currency, currency) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    size_t end = lo;
+    while (end < rates.size && strcmp(rates.data[end].currency, currency) == 0) ++end;
+    *count = end - lo;
+    return (end > lo) ? (long)lo : -1;
+}
+
+#define FX_NONE ((size_t)-1)
+
+/* Last entry in [lo, hi) effective on or before key; FX_NONE if key
+   precedes them all */
+static size_t fx_asof_index(size_t lo, size_t hi, int key) {
+    size_t first = lo;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (rates.keys[mid] <= key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo > first ? lo - 1 : FX_NONE;
+}
+
+/* Rate into the base currency as of key; 0 if the currency has no quote
+   on or before that date */
+double fx_rate_asof(const char *currency, int key) {
+    if (strcmp(currency, base_currency) == 0) return 1.0;
+    size_t n;
+    long first = fx_series(currency, &n);
+    if (first < 0) return 0.0;
+    size_t i = fx_asof_index((size_t)first, (size_t)first + n, key);
+    return (i == FX_NONE) ? 0.0 : rates.data[i].rate;
+}
+
+/* Requote every rate against code, which becomes the base currency.
+   Each currency gets a quote wherever its own or code's rate changes
+   (once both have one), the old base gets the inverse of code's
+   quotes, and code's own quotes go. 0 if code has no quotes. */
+int fx_rebase(const char *code) {
+    size_t nb;
+    long bfirst = fx_series(code, &nb);
+    if (bfirst < 0) return 0;
+    /* a currency gets up to one quote per date of its own or code's */
+    size_t cap = 0, n = 0;
+    FxRate *out = NULL;
+    /* the old base sorts among the others by code */
+    int old_done = 0;
+    for (size_t i = 0; i <= rates.size; ) {
+        const char *cur = (i < rates.size) ? rates.data[i].currency : NULL;
+        if (!old_done && (!cur || strcmp(base_currency, cur) < 0)) {
+            out = grow_array(out, &cap, n + nb, sizeof(FxRate), 16);
+            for (size_t j = 0; j < nb; ++j) {
+                FxRate *r = &out[n++];
+                *r = rates.data[(size_t)bfirst + j];
+                strcpy(r->currency, base_currency);
+                r->rate = 1.0 / r->rate;
+            }
+            old_done = 1;
+            continue;
+        }
+        if (!cur) break;
+        size_t cn;
+        long cfirst = fx_series(cur, &cn);
+        i = (size_t)cfirst + cn;
+        if (strcmp(cur, code) == 0) continue;
+        /* merge the two date lists, skipping dates before both have started */
+        size_t a = 0, b = 0;
+        while (a < cn || b < nb) {
+            const FxRate *ra = (a < cn) ? &rates.data[(size_t)cfirst + a] : NULL;
+            const FxRate *rb = (b < nb) ? &rates.data[(size_t)bfirst + b] : NULL;
+            const FxRate *at = ra;
+            if (!ra || (rb && compare_dates(rb->date, ra->date) < 0)) at = rb;
+            int key = date_key(at->date);
+            if (ra && compare_dates(ra->date, at->date) == 0) ++a;
+            if (rb && compare_dates(rb->date, at->date) == 0) ++b;
+            size_t ci = fx_asof_index((size_t)cfirst, (size_t)cfirst + cn, key);
+            size_t bi = fx_asof_index((size_t)bfirst, (size_t)bfirst + nb, key);
+            if (ci == FX_NONE || bi == FX_NONE) continue;
+            out = grow_array(out, &cap, n + 1, sizeof(FxRate), 16);
+            FxRate *r = &out[n++];
+            *r = *at;
+            strcpy(r->currency, cur);
+            r->rate = rates.data[ci].rate / rates.data[bi].rate;
+        }
+    }
+    free(rates.data);
+    rates.data = out;
+    rates.size = n;
+    rates.cap = cap;
+    strcpy(base_currency, code);
+    fx_rebuild_keys();
+    aggregates_invalidate();
+    return 1;
+}
+
+void set_fx_rate(const char *currency, const char *date, double rate) {
+    size_t pos = 0;
+    while (pos < rates.size) {
+        int c = strcmp(rates.data[pos].currency, currency);
+        if (c == 0) c = compare_dates(rates.data[pos].date, date);
+        if (c == 0) { rates.data[pos].rate = rate; aggregates_invalidate(); return; }
+        if (c > 0) break;
+        ++pos;
+    }
+    ensure_rate_capacity();
+    memmove(&rates.data[pos + 1], &rates.data[pos], (rates.size - pos) * sizeof(FxRate));
+    FxRate r;
+    memset(&r, 0, sizeof(r));
+    strcpy(r.currency, currency);
+    strncpy(r.date, date, DATE_STRLEN - 1);
+    r.rate = rate;
+    rates.data[pos] = r;
+    rates.size++;
+    fx_rebuild_keys();
+    aggregates_invalidate();
+}
+
+void list_fx_rates() {
+    printf("Base currency: %s\n", base_currency);
+    if (rates.size == 0) { printf("No FX rates.\n"); return; }
+    for (size_t i = 0; i < rates.size; ++i) {
+        printf("  %s  from %s  1 %s = %.6f %s\n", rates.data[i].currency, rates.data[i].date,
+               rates.data[i].currency, rates.data[i].rate, base_currency);
+    }
+}
+
+#define FX_BLOCK 256
+#define FX_MAX_SERIES 32
+
+/* Convert rows[0..n) into the base currency. Works a block at a time:
+   each currency present in a block is looked up once for the block's
+   date span, and only blocks whose span crosses a rate change fall back
+   to per-row searches (limited to that span). The multiply itself runs
+   over contiguous arrays. Returns the number of rows with no rate; miss,
+   if not NULL, gets a flag per row. */
+size_t fx_convert_column(const Transaction *rows, size_t n, double *out, unsigned char *miss) {
+    int key[FX_BLOCK];
+    int sid[FX_BLOCK];
+    double amt[FX_BLOCK], rate[FX_BLOCK];
+    char codes[FX_MAX_SERIES][CUR_LEN];
+    size_t missing = 0;
+    for (size_t base = 0; base < n; base += FX_BLOCK) {
+        size_t m = (n - base < FX_BLOCK) ? n - base : FX_BLOCK;
+        const Transaction *blk = rows + base;
+        int nseries = 0;
+        int kmin[FX_MAX_SERIES], kmax[FX_MAX_SERIES];
+        for (size_t i = 0; i < m; ++i) {
+            key[i] = date_key(blk[i].date);
+            amt[i] = blk[i].amount;
+            int s = 0;
+            while (s < nseries && memcmp(codes[s], blk[i].currency, CUR_LEN) != 0) ++s;
+            if (s == nseries) {
+                if (nseries == FX_MAX_SERIES) { sid[i] = -1; continue; }
+                memcpy(codes[s], blk[i].currency, CUR_LEN);
+                kmin[s] = kmax[s] = key[i];
+                nseries++;
+            }
+            if (key[i] < kmin[s]) kmin[s] = key[i];
+            if (key[i] > kmax[s]) kmax[s] = key[i];
+            sid[i] = s;
+        }
+        for (int s = 0; s < nseries; ++s) {
+            double r = 1.0;
+            size_t lo = 0, hi = 0;
+            int constant = 1;
+            if (strcmp(codes[s], base_currency) != 0) {
+                size_t cnt;
+                long first = fx_series(codes[s], &cnt);
+                if (first < 0) {
+                    r = 0.0;
+                } else {
+                    lo = fx_asof_index((size_t)first, (size_t)first + cnt, kmin[s]);
+                    hi = fx_asof_index((size_t)first, (size_t)first + cnt, kmax[s]);
+                    if (hi == FX_NONE) r = 0.0; /* the whole span predates the first quote */
+                    else if (lo == hi) r = rates.data[lo].rate;
+                    else {
+                        constant = 0;
+                        if (lo == FX_NONE) lo = (size_t)first;
+                    }
+                }
+            }
+            for (size_t i = 0; i < m; ++i) {
+                if (sid[i] != s) continue;
+                if (constant) { rate[i] = r; continue; }
+                size_t k = fx_asof_index(lo, hi + 1, key[i]);
+                rate[i] = (k == FX_NONE) ? 0.0 : rates.data[k].rate;
+            }
+        }
+        for (size_t i = 0; i < m; ++i) {
+            if (sid[i] < 0) rate[i] = fx_rate_asof(blk[i].currency, key[i]);
+            if (miss) miss[base + i] = rate[i] == 0.0;
+            if (rate[i] == 0.0) { rate[i] = 1.0; missing++; }
+        }
+        double *dst = out + base;
+        for (size_t i = 0; i < m; ++i) dst[i] = amt[i] * rate[i];
+    }
+    return missing;
+}
+
+void currency_menu() {
+    printf("1=set base currency 2=add/update FX rate 3=list FX rates : ");
+    int c = read_int();
+    if (c == 1) {
+        printf("Base currency [%s]: ", base_currency);
+        char code[16]; read_line(code, sizeof(code));
+        if (strlen(code) == 0) return;
+        if (!normalize_currency(code)) { printf("Invalid currency code.\n"); return; }
+        if (strcmp(code, base_currency) == 0) return;
+        if (rates.size && !fx_rebase(code)) {
+            printf("No rate for %s against %s; add one first so the other rates can be requoted.\n",
+                   code, base_currency);
+            return;
+        }
+        if (!rates.size) {
+            strcpy(base_currency, code);
+            aggregates_invalidate();
+        }
+        printf("Base currency set to %s. Rates are quoted against the base currency.\n", base_currency);
+    } else if (c == 2) {
+        printf("Currency (e.g., USD): ");
+        char code[16]; read_line(code, sizeof(code));
+        if (!normalize_currency(code)) { printf("Invalid currency code.\n"); return; }
+        if (strcmp(code, base_currency) == 0) { printf("That is the base currency.\n"); return; }
+        printf("Effective date (YYYY-MM-DD): ");
+        char date[32]; read_line(date, sizeof(date));
+        if (!parse_date(date, NULL)) { printf("Invalid date.\n"); return; }
+        printf("1 %s = how many %s: ", code, base_currency);
+        double r = read_double();
+        if (r <= 0) { printf("Invalid rate.\n"); return; }
+        set_fx_rate(code, date, r);
+        printf("Rate saved.\n");
+    } else {
+        list_fx_rates();
+    }
+}
+
+/* -------------------- CSV import/export and search -------------------- */
+
+void export_csv(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) { printf("Unable to open file for export.\n"); return; }
+    fprintf(f, "id,date,type,amount,currency,category,note\n");
+    size_t narch;
+    Transaction *arch = archive_select(NULL, NULL, 0, 0, NULL, &narch);
+    TxnIter it;
+    const Transaction *t;
+    txn_iter_open(&it, NULL, NULL, arch, narch);
+    while ((t = txn_iter_next(&it)) != NULL) {
+        int idx = find_category_index_by_id(t->category_id);
+        const char *cname = (idx >= 0) ? cats.data[idx].name : "UNKNOWN";
+        fprintf(f, "%d,%s,%d,%.2f,%s,%s,%s\n", t->id, t->date, (int)t->type, t->amount, t->currency, cname, t->note);
+    }
+    free(arch);
+    fclose(f);
+    printf("Exported to %s\n", path);
+}
+
+/* -- JSON Lines export -- */
+
+static char *json_put_raw(char *w, const char *s) {
+    size_t n = strlen(s);
+    memcpy(w, s, n);
+    return w + n;
+}
+
+/* s as a JSON string; other bytes, UTF-8 or not, are copied as they are */
+static char *json_put_str(char *w, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    *w++ = '"';
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            *w++ = '\\';
+            *w++ = (char)c;
+        } else if (c == '\n' || c == '\t' || c == '\r') {
+            *w++ = '\\';
+            *w++ = c == '\n' ? 'n' : c == '\t' ? 't' : 'r';
+        } else if (c < 0x20) {
+            w = json_put_raw(w, "\\u00");
+            *w++ = hex[c >> 4];
+            *w++ = hex[c & 15];
+        } else {
+            *w++ = (char)c;
+        }
+    }
+    *w++ = '"';
+    return w;
+}
+
+static char *json_put_int(char *w, long long v) {
+    char buf[24];
+    int n = 0;
+    unsigned long long u = v < 0 ? 0ull - (unsigned long long)v : (unsigned long long)v;
+    if (v < 0) *w++ = '-';
+    do {
+        buf[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    while (n) *w++ = buf[--n];
+    return w;
+}
+
+/* x written so strtod() reads back the same double: as whole cents by
+   hand when that is exact, as nearly every amount is, else with 17
+   significant digits */
+static char *json_put_amount(char *w, double x) {
+    long long cents = (long long)(x * 100 + (x < 0 ? -0.5 : 0.5));
+    if (x > -1e13 && x < 1e13 && (double)cents / 100 == x) {
+        if (cents < 0) *w++ = '-';
+        if (cents < 0) cents = -cents;
+        w = json_put_int(w, cents / 100);
+        *w++ = '.';
+        *w++ = (char)('0' + cents / 10 % 10);
+        *w++ = (char)('0' + cents % 10);
+        return w;
+    }
+    return w + sprintf(w, "%.17g", x);
+}
+
+/* One transaction as a JSON Lines record, formatted by hand into line */
+static void jsonl_put_txn(FILE *f, char *line, const Transaction *t) {
+    int idx = find_category_index_by_id(t->category_id);
+    char *w = json_put_raw(line, "{\"kind\":\"transaction\",\"id\":");
+    w = json_put_int(w, t->id);
+    w = json_put_raw(w, ",\"date\":");
+    w = json_put_str(w, t->date);
+    w = json_put_raw(w, t->type == TYPE_INCOME ? ",\"type\":\"income\",\"amount\":" : ",\"type\":\"expense\",\"amount\":");
+    w = json_put_amount(w, t->amount);
+    w = json_put_raw(w, ",\"currency\":");
+    w = json_put_str(w, t->currency);
+    w = json_put_raw(w, ",\"category\":");
+    w = json_put_str(w, idx >= 0 ? cats.data[idx].name : "UNKNOWN");
+    w = json_put_raw(w, ",\"note\":");
+    w = json_put_str(w, t->note);
+    w = json_put_raw(w, "}\n");
+    fwrite(line, 1, (size_t)(w - line), f);
+}
+
+/* JSON Lines export: the categories, the budgets and then every
+   transaction, archived ones included, one object per line, formatted
+   by hand into a line buffer. Importing the file into an empty ledger
+   gives back the same data. */
+void export_jsonl(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) { printf("Unable to open file for export.\n"); return; }
+    setvbuf(f, NULL, _IOFBF, IO_CHUNK);
+    char line[4096]; /* fits a row whose note and category are all escapes */
+    char *w;
+    for (size_t i = 0; i < cats.size; ++i) {
+        w = json_put_raw(line, "{\"kind\":\"category\",\"id\":");
+        w = json_put_int(w, cats.data[i].id);
+        w = json_put_raw(w, ",\"name\":");
+        w = json_put_str(w, cats.data[i].name);
+        w = json_put_raw(w, "}\n");
+        fwrite(line, 1, (size_t)(w - line), f);
+    }
+    for (size_t i = 0; i < budgets.size; ++i) {
+        const BudgetEntry *b = &budgets.data[i];
+        int idx = find_category_index_by_id(b->category_id);
+        w = json_put_raw(line, "{\"kind\":\"budget\",\"category\":");
+        w = json_put_str(w, idx >= 0 ? cats.data[idx].name : "UNKNOWN");
+        w = json_put_raw(w, ",\"year\":");
+        w = json_put_int(w, b->year);
+        w = json_put_raw(w, ",\"month\":");
+        w = json_put_int(w, b->month);
+        w = json_put_raw(w, ",\"amount\":");
+        w = json_put_amount(w, b->amount);
+        w = json_put_raw(w, "}\n");
+        fwrite(line, 1, (size_t)(w - line), f);
+    }
+    size_t n = 0;
+    TxnIter it;
+    const Transaction *t;
+    txn_iter_open(&it, NULL, NULL, NULL, 0);
+    for (; (t = txn_iter_next(&it)) != NULL; ++n) jsonl_put_txn(f, line, t);
+    const Ledger *L = &ledgers[active_ledger];
+    for (size_t k = 0; k < L->narch; ++k) { /* one segment in memory at a time */
+        size_t na;
+        Transaction *rows = archive_rows(L, &L->arch[k], &na);
+        for (size_t i = 0; rows && i < na; ++i) {
+            if (index_get(rows[i].id) >= 0) continue; /* thawed, written above */
+            jsonl_put_txn(f, line, &rows[i]);
+            ++n;
+        }
+        free(rows);
+    }
+    if (fclose(f) != 0) { printf("Write error in %s.\n", path); return; }
+    printf("Exported %zu transaction(s), %zu categor%s and %zu budget(s) to %s\n", n, cats.size,
+           cats.size == 1 ? "y" : "ies", budgets.size, path);
+}
+
+static FpCount *fp_slot(FpMap *m, uint64_t key);
+static void fp_free(FpMap *m);
+static uint64_t row_fingerprint(const Transaction *t);
+
+/* Id for a staged row of category: an existing one, or the provisional
+   id of one the commit will create (as id, if the stage keeps ids) */
+static int stage_category_as(ImportStage *s, const char *category, int id) {
+    if (!category[0]) category = AUTO_CATEGORY;
+    for (size_t i = 0; i < cats.size; ++i) {
+        if (strcasecmp(cats.data[i].name, category) == 0) return cats.data[i].id;
+    }
+    int k = 0;
+    for (StageCat *c = s->newcats; c; c = c->next, ++k) {
+        if (strcasecmp(c->name, category) == 0) {
+            if (!c->id) c->id = id;
+            return -(k + 1);
+        }
+    }
+    StageCat *c = xmalloc(sizeof(StageCat));
+    snprintf(c->name, sizeof(c->name), "%s", category);
+    c->id = id;
+    c->next = NULL;
+    if (s->lastcat) s->lastcat->next = c;
+    else s->newcats = c;
+    s->lastcat = c;
+    return -(int)++s->nnew;
+}
+
+static int stage_category(ImportStage *s, const char *category) {
+    return stage_category_as(s, category, 0);
+}
+
+/* Stage rows[0..n), parsed and valid, named category[i]. A row is a
+   duplicate while the file has not had more copies of it than the
+   ledger holds, so repeated rows within a file still count. With
+   keep_ids a row keeps its id unless an earlier row holds it. */
+void stage_add(ImportStage *s, const Transaction *rows, char (*category)[64], size_t n) {
+    if (!s->learned) {
+        TxnIter it;
+        const Transaction *t;
+        txn_iter_open(&it, NULL, NULL, NULL, 0);
+        while ((t = txn_iter_next(&it)) != NULL) fp_slot(&s->ledger, row_fingerprint(t))->a++;
+        s->learned = 1;
+    }
+    StageChunk *c = arena_alloc(&s->arena, sizeof(StageChunk));
+    c->rows = arena_alloc(&s->arena, (n ? n : 1) * sizeof(Transaction));
+    c->n = 0;
+    c->next = NULL;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t key = row_fingerprint(&rows[i]);
+        FpCount *fp = fp_slot(&s->ledger, key);
+        if (++fp->b <= fp->a) {
+            s->dupfp = grow_array(s->dupfp, &s->dupfpcap, s->ndupfp + 1, sizeof(uint64_t), 256);
+            s->dupfp[s->ndupfp++] = key;
+            s->dups++;
+            continue;
+        }
+        Transaction *t = &c->rows[c->n++];
+        *t = rows[i];
+        t->category_id = stage_category(s, category[i]);
+        if (!s->keep_ids) continue;
+        if (s->claim_skip) { /* added before a crash, under this id */
+            s->claim_skip--;
+        } else if (t->id <= 0 || index_lookup(&s->staged, t->id) >= 0 || txn_exists(t->id)) {
+            t->id = 0; /* gets an id after the file's own, at the last commit */
+            s->orphans++;
+        } else {
+            index_put(&s->staged, t->id, 0);
+        }
+    }
+    if (s->last) s->last->next = c;
+    else s->first = c;
+    s->last = c;
+    s->rows += c->n;
+}
+
+/* Stage a budget for category's month */
+void stage_budget(ImportStage *s, const char *category, int year, int month, double amount) {
+    StageBudget *sb = arena_alloc(&s->arena, sizeof(StageBudget));
+    BudgetEntry be = {stage_category(s, category), year, month, amount};
+    sb->b = be;
+    sb->next = NULL;
+    if (s->lastbudget) s->lastbudget->next = sb;
+    else s->budgets = sb;
+    s->lastbudget = sb;
+    s->nbudgets++;
+}
+
+void stage_report(const ImportStage *s) {
+    printf("%zu new transaction(s), %zu duplicate(s) of rows already in the ledger, %zu bad line(s).\n",
+           s->rows, s->dups, s->bad);
+    if (s->nbudgets) printf("%zu budget(s) to set.\n", s->nbudgets);
+    if (!s->nnew) return;
+    printf("New categories:");
+    for (const StageCat *c = s->newcats; c; c = c->next) printf(" '%s'", c->name);
+    printf("\n");
+}
+
+static void stage_drop_cats(ImportStage *s) {
+    while (s->newcats) {
+        StageCat *c = s->newcats;
+        s->newcats = c->next;
+        free(c);
+    }
+    s->lastcat = NULL;
+    s->nnew = 0;
+}
+
+static int txn_id_cmp(const void *a, const void *b) {
+    int x = ((const Transaction *)a)->id, y = ((const Transaction *)b)->id;
+    return x < y ? -1 : x > y;
+}
+
+/* Add rows[0..n) under the ids they carry, free and unique as
+   stage_add() left them; sorted by id, each run of consecutive ids
+   goes in as one batch wherever it falls */
+static void txn_insert_keep(Transaction *rows, size_t n) {
+    qsort(rows, n, sizeof(Transaction), txn_id_cmp);
+    for (size_t i = 0, j; i < n; i = j) {
+        for (j = i + 1; j < n && rows[j].id == rows[i].id + (int)(j - i); ++j) {}
+        txn_insert_from(rows + i, j - i, rows[i].id);
+    }
+}
+
+/* Create the staged categories and add the staged rows, then empty the
+   stage for more. Rows an interrupted run already added (s->skip) are
+   checked against the ledger and passed over; returns 0, having changed
+   nothing, when they do not match. The caller brackets it with
+   oplog_begin() and oplog_end(); the journal gets its records as one
+   atomic group, so a crash cannot leave half of them. */
+int stage_commit(ImportStage *s) {
+    size_t left = s->skip;
+    for (const StageChunk *c = s->first; c && left; c = c->next) {
+        for (size_t i = 0; i < c->n && left; ++i, --left) {
+            long idx = index_get(s->keep_ids ? c->rows[i].id : s->skip_id + (int)(s->skip - left));
+            if (idx < 0 || row_fingerprint(&txns.data[idx]) != row_fingerprint(&c->rows[i])) return 0;
+        }
+    }
+    int *ids = xmalloc((s->nnew ? s->nnew : 1) * sizeof(int));
+    journal_atomic_begin();
+    /* categories with an id to restore first, so others cannot take it */
+    for (int pass = s->keep_ids ? 0 : 1; pass < 2; ++pass) {
+        size_t k = 0;
+        for (const StageCat *c = s->newcats; c; c = c->next, ++k) {
+            int keep = s->keep_ids && c->id > 0;
+            if (keep == pass) continue;
+            ids[k] = cat_insert_as(c->name, keep ? c->id : 0);
+            printf("Created category '%s' id=%d\n", c->name, ids[k]);
+        }
+    }
+    for (StageChunk *c = s->first; c; c = c->next) {
+        size_t from = s->skip < c->n ? s->skip : c->n;
+        s->skip_id += (int)from;
+        s->skip -= from;
+        c->rows += from; /* passed over for good */
+        c->n -= from;
+        size_t orphans = 0;
+        for (size_t i = 0; i < c->n; ++i) {
+            if (c->rows[i].category_id < 0) c->rows[i].category_id = ids[-c->rows[i].category_id - 1];
+            if (s->keep_ids && c->rows[i].id == 0) {
+                Transaction t = c->rows[orphans];
+                c->rows[orphans++] = c->rows[i];
+                c->rows[i] = t;
+            }
+        }
+        if (s->keep_ids) txn_insert_keep(c->rows + orphans, c->n - orphans);
+        else txn_insert_batch(c->rows, c->n);
+        c->n = orphans; /* moved to the front; they follow every kept id */
+    }
+    for (StageChunk *c = s->first; c && s->keep_ids; c = c->next) txn_insert_batch(c->rows, c->n);
+    s->orphans = 0;
+    index_free(&s->staged);
+    for (StageBudget *b = s->budgets; b; b = b->next) {
+        int cid = b->b.category_id < 0 ? ids[-b->b.category_id - 1] : b->b.category_id;
+        budget_put(cid, b->b.year, b->b.month, b->b.amount);
+    }
+    journal_atomic_end();
+    free(ids);
+    stage_drop_cats(s);
+    arena_free(&s->arena);
+    s->first = s->last = NULL;
+    s->budgets = s->lastbudget = NULL;
+    return 1;
+}
+
+/* Drop a staged import, committed or not */
+void stage_free(ImportStage *s) {
+    stage_drop_cats(s);
+    arena_free(&s->arena);
+    fp_free(&s->ledger);
+    index_free(&s->staged);
+    free(s->dupfp);
+    memset(s, 0, sizeof(*s));
+}
+
+/* -- resuming long imports -- */
+
+static volatile sig_atomic_t import_stop = 0;
+
+static void import_on_signal(int sig) {
+    (void)sig;
+    import_stop = 1;
+}
+
+/* fnv32 of the first and of the last IMPORT_ID_BYTES bytes of path's
+   first off bytes: enough to tell the file an import stopped in, even
+   after lines beyond off were fixed */
+static void import_id(const char *path, uint64_t off, uint32_t *head, uint32_t *tail) {
+    unsigned char buf[IMPORT_ID_BYTES];
+    size_t n = off < IMPORT_ID_BYTES ? (size_t)off : IMPORT_ID_BYTES;
+    FILE *f = fopen(path, "rb");
+    *head = *tail = 0;
+    if (!f) return;
+    if (fread(buf, 1, n, f) == n) *head = fnv32(buf, n);
+    if (fseek(f, (long)(off - n), SEEK_SET) == 0 && fread(buf, 1, n, f) == n) *tail = fnv32(buf, n);
+    fclose(f);
+}
+
+/* The checkpoint of an import of path that stopped in dir, if any */
+static int import_ckpt_load(const char *dir, const char *path, ImportCkpt *ck) {
+    char p[PATH_LEN + 32];
+    snprintf(p, sizeof(p), "%s/%s", dir, IMPORT_CKPT_FILE);
+    FILE *f = fopen(p, "rb");
+    if (!f) return 0;
+    int ok = fread(ck, sizeof(*ck), 1, f) == 1 && memcmp(ck->magic, IMPORT_CKPT_MAGIC, 4) == 0 &&
+             strncmp(ck->path, path, sizeof(ck->path)) == 0;
+    fclose(f);
+    uint32_t head, tail;
+    if (ok) import_id(path, ck->offset, &head, &tail);
+    return ok && head == ck->head && tail == ck->tail;
+}
+
+/* Record a committed segment: first the duplicates it skipped, then the
+   checkpoint that counts them, replaced whole */
+static int import_ckpt_save(const char *dir, ImportCkpt *ck, ImportStage *s) {
+    char p[PATH_LEN + 32], tmp[PATH_LEN + 40];
+    snprintf(p, sizeof(p), "%s/%s", dir, IMPORT_DUPS_FILE);
+    FILE *f = fopen(p, ck->ndupfp ? "ab" : "wb");
+    int ok = f != NULL;
+    if (f) {
+        fwrite(s->dupfp, sizeof(uint64_t), s->ndupfp, f);
+        ok = file_sync_close(f);
+    }
+    ck->ndupfp += s->ndupfp;
+    s->ndupfp = 0;
+    snprintf(p, sizeof(p), "%s/%s", dir, IMPORT_CKPT_FILE);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", p);
+    f = ok ? fopen(tmp, "wb") : NULL;
+    if (f) {
+        fwrite(ck, sizeof(*ck), 1, f);
+        ok = file_sync_close(f) && rename(tmp, p) == 0;
+    }
+    if (!ok) printf("Warning: unable to save the import checkpoint in %s.\n", dir);
+    return ok;
+}
+
+static void import_ckpt_remove(const char *dir) {
+    char p[PATH_LEN + 32];
+    snprintf(p, sizeof(p), "%s/%s", dir, IMPORT_CKPT_FILE);
+    remove(p);
+    snprintf(p, sizeof(p), "%s/%s", dir, IMPORT_DUPS_FILE);
+    remove(p);
+}
+
+/* Set s up as the uninterrupted import stood at ck: the ledger minus
+   the import's rows, the file's copies so far (rows added plus
+   duplicates skipped), and the rows of the segment cut short by a crash
+   to pass over. Returns 0 if the checkpoint is damaged, -1 if rows the
+   import added are gone (the import was undone, or rows deleted). */
+static int import_resume(ImportStage *s, const ImportCkpt *ck, const char *dir) {
+    char p[PATH_LEN + 32];
+    snprintf(p, sizeof(p), "%s/%s", dir, IMPORT_DUPS_FILE);
+    FILE *f = fopen(p, "rb");
+    uint64_t key;
+    size_t n = 0;
+    while (f && n < ck->ndupfp && fread(&key, sizeof(key), 1, f) == 1) {
+        fp_slot(&s->ledger, key)->b++;
+        n++;
+    }
+    if (f) fclose(f);
+    if (n < ck->ndupfp || truncate(p, (off_t)(n * sizeof(key))) != 0) return 0;
+    TxnIter it;
+    const Transaction *t;
+    long mine = 0;
+    txn_iter_open(&it, NULL, NULL, NULL, 0);
+    while ((t = txn_iter_next(&it)) != NULL) {
+        FpCount *fp = fp_slot(&s->ledger, row_fingerprint(t));
+        if (ck->keep_ids || (t->id >= ck->first_id && t->id < ck->next_id)) {
+            fp->b++;
+            mine++;
+        } else if (t->id < ck->first_id) {
+            fp->a++;
+        }
+    }
+    s->learned = 1;
+    s->rows = ck->rows;
+    s->dups = ck->dups;
+    s->skip_id = ck->next_id;
+    if (ck->keep_ids) { /* the ledger was empty: whatever is past ck->rows came from the next segment */
+        if (mine < (long)ck->rows) return -1;
+        s->keep_ids = 1;
+        s->skip = s->claim_skip = (size_t)mine - ck->rows;
+        return 1;
+    }
+    if (mine != (long)ck->next_id - ck->first_id) return -1; /* ids were given out consecutively */
+    for (int id = ck->next_id; id < txns.next_id && index_get(id) >= 0; ++id) s->skip++;
+    return 1;
+}
+
+#define IMPORT_SHOW_BAD 20 /* bad lines listed by line number */
+#define CSV_SNIFF_LINES 1024 /* lines csv_sniff() looks at */
+#define CSV_MAX_COLS 64
+
+enum { IMPORT_CSV, IMPORT_OFX, IMPORT_QIF, IMPORT_JSONL };
+
+/* Entries of a block besides rows (1) and bad lines (0, -1) */
+enum { ENTRY_LONG = -2, ENTRY_BLANK = 2, ENTRY_CATEGORY, ENTRY_BUDGET };
+
+/* Fields of an OFX or QIF record, as read */
+enum { REC_DATE, REC_AMOUNT, REC_PAYEE, REC_MEMO, REC_FITID, REC_CURRENCY, REC_CATEGORY, REC_FIELDS };
+
+typedef struct {
+    char *text;   /* CSV: the block's lines, NUL-terminated one after another */
+    size_t textcap;
+    size_t *offs; /* start of each line in text */
+    Transaction *rows;
+    char (*category)[64];
+    signed char *rc; /* csv_parse_row() result or ENTRY_* per entry */
+    int *line;    /* line each entry starts on */
+    const CsvDialect *dialect;
+    int format;
+} ImportBlock;
+
+/* A file being imported and where its reader is. Blocks end between
+   records, so all a resumed import needs to carry over is the OFX
+   statement currency and the QIF section. */
+typedef struct {
+    FILE *f;
+    int format;
+    int lineno;             /* lines read */
+    char currency[CUR_LEN]; /* OFX: CURDEF of the statement being read */
+    char account[ACCT_LEN]; /* OFX: its ACCTID */
+    int section;            /* QIF: in a list of transactions */
+    int orig;               /* OFX: inside ORIGCURRENCY */
+    int open;               /* a record is being read ... */
+    int open_line;          /* ... since this line */
+    char rec[REC_FIELDS][MAX_NOTE];
+    CsvDialect csv;
+} ImportSource;
+
+/* One loop per kind of line, so the program's own CSV layout keeps its
+   plain comma splitting */
+static void import_parse_chunk(void *ctx, size_t chunk, size_t lo, size_t hi) {
+    (void)chunk;
+    ImportBlock *b = ctx;
+    const CsvDialect *d = b->dialect;
+    if (b->format == IMPORT_JSONL) {
+        for (size_t i = lo; i < hi; ++i) {
+            char *line = b->text + b->offs[i];
+            b->rc[i] = line[strspn(line, " \t\r\n")] ? (signed char)jsonl_parse_row(line, &b->rows[i], b->category[i],
+                                                                                 sizeof(b->category[i])) : ENTRY_BLANK;
+        }
+        return;
+    }
+    if (d->native) {
+        for (size_t i = lo; i < hi; ++i) {
+            char *line = b->text + b->offs[i];
+            b->rc[i] = line[strspn(line, " \t\r\n")] ? (signed char)csv_parse_row(line, &b->rows[i], b->category[i],
+                                                                               sizeof(b->category[i])) : ENTRY_BLANK;
+        }
+        return;
+    }
+    for (size_t i = lo; i < hi; ++i) {
+        char *line = b->text + b->offs[i];
+        b->rc[i] = line[strspn(line, " \t\r\n")] ? (signed char)csv_parse_dialect(line, d, &b->rows[i], b->category[i],
+                                                                                   sizeof(b->category[i])) : ENTRY_BLANK;
+    }
+}
+
+/* Read up to IMPORT_BLOCK lines of a CSV or JSONL file and parse them
+   in parallel; a CSV header line is skipped. A line too long for the
+   buffer is kept as "" and comes back as ENTRY_LONG. */
+static size_t lines_read_block(ImportSource *s, ImportBlock *b) {
+    char line[4096];
+    size_t n = 0, textlen = 0;
+    while (n < IMPORT_BLOCK && fgets(line, sizeof(line), s->f)) {
+        size_t len = strlen(line) + 1;
+        int c;
+        if (len == sizeof(line) && line[len - 2] != '\n' && (c = getc(s->f)) != EOF && c != '\n') {
+            while ((c = getc(s->f)) != EOF && c != '\n') {} /* drop the rest of it */
+            line[0] = 0;
+            len = 1;
+        }
+        if (++s->lineno == 1 && s->format == IMPORT_CSV) continue; /* skip header */
+        b->text = grow_array(b->text, &b->textcap, textlen + len, 1, 64 * 1024);
+        memcpy(b->text + textlen, line, len);
+        b->offs[n] = textlen;
+        b->line[n++] = s->lineno;
+        textlen += len;
+    }
+    if (n) parallel_for(n, IMPORT_GRAIN, PRIO_HIGH, import_parse_chunk, b);
+    for (size_t i = 0; i < n; ++i) /* a line read has at least its newline */
+        if (!b->text[b->offs[i]]) b->rc[i] = ENTRY_LONG;
+    return n;
+}
+
+/* Amount with decimal separator decimal ('.' or ','; 0 = whichever it
+   looks like), the other one and spaces or apostrophes separating
+   thousands: "1,234.56", "-1.234,56", "+12" */
+static int import_amount(const char *s, char decimal, double *v) {
+    char buf[64], *w = buf, *end;
+    if (!decimal) {
+        const char *comma = strrchr(s, ',');
+        decimal = comma && !strchr(s, '.') && strspn(comma + 1, "0123456789") == strlen(comma + 1) &&
+                  strlen(comma + 1) <= 2 ? ',' : '.';
+    }
+    for (; *s && w < buf + sizeof(buf) - 1; ++s) {
+        if (*s == decimal) *w++ = '.';
+        else if (*s != ',' && *s != '.' && *s != ' ' && *s != '\'') *w++ = *s;
+    }
+    *w = 0;
+    *v = strtod(buf, &end);
+    return end != buf && !*end;
+}
+
+/* The numbers of a date such as "15.03.2024" or "3/15'24", up to three,
+   and their digit counts; *sep gets the first separator, or '\'' when
+   one comes before the year */
+static int date_numbers(const char *v, int num[3], int len[3], char *sep) {
+    int k = 0;
+    *sep = 0;
+    for (const char *p = v; *p && k < 3;) {
+        if (!isdigit((unsigned char)*p)) {
+            if (k && (!*sep || (*p == '\'' && k == 2))) *sep = *p;
+            p++;
+            continue;
+        }
+        num[k] = 0;
+        len[k] = 0;
+        while (isdigit((unsigned char)*p)) {
+            if (len[k]++ < 8) num[k] = num[k] * 10 + (*p - '0');
+            p++;
+        }
+        k++;
+    }
+    return k;
+}
+
+/* Date into YYYY-MM-DD (out has MAX_NOTE bytes), its numbers in order;
+   DATE_GUESS is month first as Quicken writes it ("3/15'24",
+   " 3/ 5/24"), day first when the first number cannot be a month or the
+   separator is '.'. YYYY-MM-DD and YYYYMMDD are read in any order, and
+   two-digit years are 19xx from 70 on ('\'' marks 20xx). Anything else is
+   copied for parse_date() to reject. */
+static void import_date(const char *v, int order, char *out) {
+    int num[3], len[3], y, m, d;
+    char sep;
+    int k = date_numbers(v, num, len, &sep);
+    if (k == 1 && len[0] == 8) {
+        y = num[0] / 10000, m = num[0] / 100 % 100, d = num[0] % 100;
+    } else if (k == 3 && len[0] == 4) {
+        y = num[0], m = num[1], d = num[2];
+    } else if (k == 3) {
+        if (order == DATE_GUESS) order = sep == '.' || (num[0] > 12 && num[1] <= 12) ? DATE_DMY : DATE_MDY;
+        int yi = order == DATE_YMD ? 0 : 2;
+        y = num[yi] < 100 ? (sep == '\'' || num[yi] < 70 ? 2000 : 1900) + num[yi] : num[yi];
+        m = order == DATE_MDY ? num[0] : num[1];
+        d = order == DATE_YMD ? num[2] : order == DATE_DMY ? num[0] : num[1];
+    } else {
+        snprintf(out, MAX_NOTE, "%s", v);
+        return;
+    }
+    int parts[3] = {y % 10000, m % 100, d % 100}, width[3] = {4, 2, 2};
+    for (int i = 0, at = 0; i < 3; ++i) { /* snprintf() is slow for every row of a file */
+        for (int j = width[i] - 1, v = parts[i]; j >= 0; --j, v /= 10) out[at + j] = (char)('0' + v % 10);
+        at += width[i];
+        out[at++] = i < 2 ? '-' : 0;
+    }
+}
+
+/* Note of an imported row: payee and memo, and the FITID if any at the
+   end, kept whole as "[fitid:ACCTID/FITID]" (FITIDs are unique per
+   account only) or, without an account, "[fitid:FITID]" */
+static void import_note(char *note, const char *payee, const char *memo, const char *fitid, const char *account) {
+    char ref[MAX_NOTE];
+    int reflen = !fitid[0] ? 0
+                 : account[0] ? snprintf(ref, sizeof(ref), "%s%.32s/%.64s]", FITID_TAG, account, fitid)
+                              : snprintf(ref, sizeof(ref), "%s%.64s]", FITID_TAG, fitid);
+    size_t room = MAX_NOTE - 1 - (size_t)reflen - (reflen ? 1 : 0);
+    if (payee[0] && memo[0] && strcmp(payee, memo) != 0)
+        snprintf(note, room + 1, "%s - %s", payee, memo);
+    else
+        snprintf(note, room + 1, "%s", payee[0] ? payee : memo);
+    if (reflen) {
+        size_t len = strlen(note);
+        snprintf(note + len, MAX_NOTE - len, "%s%s", len ? " " : "", ref);
+    }
+}
+
+/* Turn the fields read for one OFX or QIF record into entry k of b:
+   the sign of the amount gives the type, payee and memo make the note,
+   which ends with the FITID when there is one */
+static void import_record(ImportSource *s, ImportBlock *b, size_t k) {
+    char (*r)[MAX_NOTE] = s->rec;
+    Transaction *t = &b->rows[k];
+    memset(t, 0, sizeof(*t));
+    b->line[k] = s->open_line;
+    memcpy(b->category[k], r[REC_CATEGORY], strlen(r[REC_CATEGORY]) + 1);
+    double v;
+    if (!r[REC_DATE][0] || !import_amount(r[REC_AMOUNT], 0, &v)) {
+        b->rc[k] = 0;
+        return;
+    }
+    t->type = v < 0 ? TYPE_EXPENSE : TYPE_INCOME;
+    t->amount = v < 0 ? -v : v;
+    snprintf(t->currency, sizeof(t->currency), "%s",
+             normalize_currency(r[REC_CURRENCY]) ? r[REC_CURRENCY] : s->currency[0] ? s->currency : base_currency);
+    import_note(t->note, r[REC_PAYEE], r[REC_MEMO], r[REC_FITID], s->account);
+    size_t dl = strlen(r[REC_DATE]);
+    if (dl < DATE_STRLEN) memcpy(t->date, r[REC_DATE], dl);
+    b->rc[k] = dl < DATE_STRLEN && parse_date(t->date, NULL) ? 1 : -1;
+}
+
+/* Start a record, seen first on line */
+static void import_open(ImportSource *s, int line) {
+    for (int k = 0; k < REC_FIELDS; ++k) s->rec[k][0] = 0;
+    s->open = 1;
+    s->open_line = line;
+}
+
+/* Field k of the open record, cut to fit */
+static void import_field(ImportSource *s, int k, const char *v, size_t len) {
+    size_t cap = k == REC_CATEGORY ? 63 : MAX_NOTE - 1;
+    if (len > cap) len = cap;
+    memcpy(s->rec[k], v, len);
+    s->rec[k][len] = 0;
+}
+
+/* Next byte of the file, counting lines */
+static int import_getc(ImportSource *s) {
+    int c = getc_unlocked(s->f);
+    if (c == '\n') s->lineno++;
+    return c;
+}
+
+/* Trim an OFX value in place and decode the entities XML OFX uses */
+static void ofx_text(char *v) {
+    static const char *ent[][2] = {{"&amp;", "&"}, {"&lt;", "<"}, {"&gt;", ">"}, {"&quot;", "\""}, {"&apos;", "'"}};
+    char *r = v + strspn(v, " \t\r\n"), *w = v;
+    while (*r) {
+        size_t k = 0;
+        if (*r == '&') {
+            while (k < 5 && strncmp(r, ent[k][0], strlen(ent[k][0])) != 0) k++;
+        }
+        if (*r == '&' && k < 5) {
+            *w++ = ent[k][1][0];
+            r += strlen(ent[k][0]);
+        } else {
+            *w++ = *r++;
+        }
+    }
+    while (w > v && isspace((unsigned char)w[-1])) w--;
+    *w = 0;
+}
+
+/* Act on one OFX element: tag is upper case, "/NAME" for a closing
+   one, v the text after it. A record is complete at </STMTTRN>. */
+static void ofx_element(ImportSource *s, ImportBlock *b, size_t *n, const char *tag, char *v) {
+    static const char *fields[] = {"DTPOSTED", "TRNAMT", "NAME", "MEMO", "FITID", "CURSYM"}; /* by REC_* */
+    if (strcmp(tag, "STMTTRN") == 0) {
+        import_open(s, s->lineno + 1);
+    } else if (strcmp(tag, "/STMTTRN") == 0) {
+        if (s->open) import_record(s, b, (*n)++);
+        s->open = 0;
+    } else if (strcmp(tag, "CURDEF") == 0) {
+        if (normalize_currency(v)) strcpy(s->currency, v);
+    } else if (strcmp(tag, "ACCTID") == 0 && !s->open) { /* BANKACCTTO in a record is the other side */
+        snprintf(s->account, sizeof(s->account), "%.32s", v);
+    } else if (strcmp(tag, "ORIGCURRENCY") == 0 || strcmp(tag, "/ORIGCURRENCY") == 0) {
+        s->orig = tag[0] != '/';
+    } else if (s->open) {
+        for (int k = REC_DATE; k <= REC_CURRENCY; ++k) {
+            if (strcmp(tag, fields[k]) != 0) continue;
+            if (k == REC_CURRENCY && s->orig) break; /* the amount is not in that one */
+            if (k == REC_DATE && strspn(v, "0123456789") >= 8)
+                snprintf(s->rec[k], MAX_NOTE, "%.4s-%.2s-%.2s", v, v + 4, v + 6);
+            else
+                import_field(s, k, v, strlen(v));
+            break;
+        }
+    }
+}
+
+/* Read up to IMPORT_BLOCK transactions of an OFX (or QFX) file, SGML
+   or XML, one element at a time in constant memory. Headers,
+   processing instructions and everything outside STMTTRN records other
+   than CURDEF are passed over. */
+static size_t ofx_read_block(ImportSource *s, ImportBlock *b) {
+    char tag[32], val[MAX_NOTE];
+    size_t n = 0;
+    int c = import_getc(s);
+    while (n < IMPORT_BLOCK && c != EOF) {
+        if (c != '<') {
+            c = import_getc(s);
+            continue;
+        }
+        size_t tl = 0, vl = 0;
+        while ((c = import_getc(s)) != EOF && c != '>') {
+            if (tl < sizeof(tag) - 1) tag[tl++] = (char)toupper(c);
+        }
+        tag[tl] = 0;
+        while (c != EOF && (c = import_getc(s)) != EOF && c != '<') {
+            if (vl < sizeof(val) - 1) val[vl++] = (char)c;
+        }
+        val[vl] = 0;
+        ofx_text(val);
+        ofx_element(s, b, &n, tag, val);
+    }
+    if (c != EOF) {
+        ungetc(c, s->f); /* the next element's '<', for the next block or a resumed import */
+    } else if (s->open) {
+        s->rec[REC_DATE][0] = 0; /* cut off: report the record as incomplete */
+        import_record(s, b, n++);
+        s->open = 0;
+    }
+    return n;
+}
+
+/* Read up to IMPORT_BLOCK transactions of a QIF file, a line at a time.
+   Only the transaction lists (!Type:Bank, Cash, CCard, Oth A, Oth L)
+   are read; account, category and other lists are passed over, as are
+   split lines. L gives the category; transfers ("[Account]") and
+   classes ("/Class") are dropped from it. */
+static size_t qif_read_block(ImportSource *s, ImportBlock *b) {
+    static const char *lists[] = {"BANK", "CASH", "CCARD", "OTH A", "OTH L"};
+    char line[MAX_NOTE + 2];
+    size_t n = 0;
+    int c = 0;
+    while (n < IMPORT_BLOCK && c != EOF) {
+        size_t len = 0;
+        while ((c = import_getc(s)) != EOF && c != '\n') {
+            if (len < sizeof(line) - 1) line[len++] = (char)c;
+        }
+        while (len && (line[len - 1] == '\r' || line[len - 1] == ' ')) len--;
+        line[len] = 0;
+        char *v = line;
+        if (s->lineno <= 1 && strncmp(v, "\xEF\xBB\xBF", 3) == 0) v += 3; /* BOM */
+        if (!len && c == EOF) break;
+        if (v[0] == '!') {
+            if (strncasecmp(v, "!Type:", 6) == 0) {
+                s->section = 0;
+                for (size_t k = 0; k < sizeof(lists) / sizeof(lists[0]); ++k) {
+                    if (strcasecmp(v + 6, lists[k]) == 0) s->section = 1;
+                }
+            } else if (strncasecmp(v, "!Account", 8) == 0) {
+                s->section = 0;
+            }
+            continue;
+        }
+        if (!s->section || !v[0]) continue;
+        if (!s->open) import_open(s, s->lineno + (c == '\n' ? 0 : 1));
+        switch (v[0]) {
+        case 'D': import_date(v + 1, DATE_GUESS, s->rec[REC_DATE]); break;
+        case 'T': case 'U': import_field(s, REC_AMOUNT, v + 1, strlen(v + 1)); break;
+        case 'P': import_field(s, REC_PAYEE, v + 1, strlen(v + 1)); break;
+        case 'M': import_field(s, REC_MEMO, v + 1, strlen(v + 1)); break;
+        case 'L':
+            if (v[1] != '[') import_field(s, REC_CATEGORY, v + 1, strcspn(v + 1, "/"));
+            break;
+        case '^':
+            import_record(s, b, n++);
+            s->open = 0;
+            break;
+        default: break;
+        }
+    }
+    if (c == EOF && s->open) { /* a last record without ^ */
+        import_record(s, b, n++);
+        s->open = 0;
+    }
+    return n;
+}
+
+/* Header names of each CSV_* field, '|' between them */
+static const char *csv_names[CSV_FIELDS] = {
+    "date|booking date|transaction date|posting date|value date|datum|buchungstag",
+    "type",
+    "amount|betrag|montant|importe",
+    "category|kategorie",
+    "note|memo|description|details|narrative|reference|verwendungszweck",
+    "payee|name|counterparty|beneficiary|merchant",
+    "currency|ccy|waehrung",
+    "debit|withdrawal|paid out",
+    "credit|deposit|paid in",
+};
+
+static int csv_name_is(int k, const char *name) {
+    size_t n = strlen(name);
+    for (const char *p = csv_names[k]; *p;) {
+        size_t len = strcspn(p, "|");
+        if (len == n && strncasecmp(p, name, n) == 0) return 1;
+        p += len + (p[len] == '|');
+    }
+    return 0;
+}
+
+/* Occurrences of delim in line outside double quotes */
+static int csv_count(const char *line, char delim) {
+    int n = 0, quoted = 0;
+    for (; *line; ++line) {
+        if (*line == '"') quoted = !quoted;
+        else if (*line == delim && !quoted) n++;
+    }
+    return n;
+}
+
+/* Work out the dialect of a CSV file from its header and first
+   CSV_SNIFF_LINES lines, once, so the parse itself only follows it. The
+   delimiter is the one that splits most lines into as many columns as
+   the header; columns are found by header name, or taken by position as
+   date,type,amount,category,note when the names are not known; the
+   decimal separator and the date order are the ones the values show.
+   Leaves the file at its start. */
+static void csv_sniff(ImportSource *s) {
+    static const char delims[] = ",;\t|";
+    CsvDialect *d = &s->csv;
+    char line[1024], head[1024] = "";
+    int score[4] = {0}, hcount[4] = {0}, quoted[4] = {0}, lines = 0;
+    memset(d, 0, sizeof(*d));
+    while (lines < CSV_SNIFF_LINES && fgets(line, sizeof(line), s->f)) {
+        char *p = line;
+        if (!lines++ && strncmp(p, "\xEF\xBB\xBF", 3) == 0) p += 3; /* BOM */
+        if (!p[strspn(p, " \t\r\n")]) continue;
+        for (int k = 0; k < 4; ++k) {
+            char q[3] = {delims[k], '"', 0};
+            quoted[k] |= p[0] == '"' || strstr(p, q) != NULL;
+            if (lines == 1) hcount[k] = csv_count(p, delims[k]);
+            else if (hcount[k] && csv_count(p, delims[k]) == hcount[k]) score[k]++;
+        }
+        if (lines == 1) snprintf(head, sizeof(head), "%s", p);
+    }
+    int best = 0;
+    for (int k = 1; k < 4; ++k) {
+        if (score[k] > score[best] || (score[k] == score[best] && hcount[k] > hcount[best])) best = k;
+    }
+    d->delim = delims[best];
+    d->quote = quoted[best] ? '"' : 0;
+    char *f[CSV_MAX_COLS];
+    d->ncols = csv_split(head, d, f, CSV_MAX_COLS);
+    for (int k = 0; k < CSV_FIELDS; ++k) d->col[k] = -1;
+    for (int i = 0; i < d->ncols; ++i) {
+        for (int k = 0; k < CSV_FIELDS; ++k) {
+            if (d->col[k] < 0 && csv_name_is(k, f[i])) {
+                d->col[k] = i;
+                break;
+            }
+        }
+    }
+    if (d->col[CSV_DATE] < 0 || (d->col[CSV_AMOUNT] < 0 && d->col[CSV_DEBIT] < 0 && d->col[CSV_CREDIT] < 0)) {
+        for (int k = 0; k < CSV_FIELDS; ++k) d->col[k] = k <= CSV_NOTE ? k : -1;
+        d->ncols = CSV_NOTE + 1;
+    }
+    d->rest = !d->quote && (d->col[CSV_NOTE] == d->ncols - 1 || d->col[CSV_PAYEE] == d->ncols - 1);
+    /* values: which decimal separator, which date order */
+    int dot = 0, comma = 0, order[3] = {0}, nonstd = 0;
+    rewind(s->f);
+    for (int i = 0; i < lines && fgets(line, sizeof(line), s->f); ++i) {
+        if (!i || !line[strspn(line, " \t\r\n")]) continue;
+        int n = csv_split(line, d, f, CSV_MAX_COLS);
+        static const int amounts[] = {CSV_AMOUNT, CSV_DEBIT, CSV_CREDIT};
+        for (int j = 0; j < 3; ++j) {
+            int c = d->col[amounts[j]];
+            if (c < 0 || c >= n) continue;
+            const char *v = f[c], *sep = v + strcspn(v, ".,"), *last = NULL;
+            for (; *sep; sep += 1 + strcspn(sep + 1, ".,")) last = sep;
+            size_t digits = last ? strspn(last + 1, "0123456789") : 0;
+            if (last && digits >= 1 && digits <= 2 && !last[1 + digits]) {
+                if (*last == ',') comma++;
+                else dot++;
+            }
+        }
+        if (d->col[CSV_DATE] >= n) continue;
+        const char *v = f[d->col[CSV_DATE]];
+        int num[3], len[3];
+        char sep;
+        int k = date_numbers(v, num, len, &sep);
+        if (k == 1 && len[0] == 8) order[DATE_YMD]++;
+        else if (k == 3 && len[0] == 4) order[DATE_YMD]++;
+        else if (k == 3 && num[0] > 12 && num[1] <= 12) order[DATE_DMY]++;
+        else if (k == 3 && num[1] > 12 && num[0] <= 12) order[DATE_MDY]++;
+        nonstd += (k == 3 || (k == 1 && len[0] == 8)) && !parse_date(v, NULL); /* needs converting */
+    }
+    rewind(s->f);
+    d->decimal = comma > dot ? ',' : '.';
+    if (order[DATE_YMD] >= order[DATE_DMY] && order[DATE_YMD] >= order[DATE_MDY] && order[DATE_YMD])
+        d->date_order = DATE_YMD;
+    else if (order[DATE_DMY] != order[DATE_MDY])
+        d->date_order = order[DATE_DMY] > order[DATE_MDY] ? DATE_DMY : DATE_MDY;
+    else /* no day over 12 seen: go by the file's locale */
+        d->date_order = d->decimal == ',' || d->delim == ';' ? DATE_DMY : DATE_MDY;
+    d->native = d->delim == ',' && !d->quote && d->decimal == '.' && !nonstd && d->ncols == CSV_NOTE + 1;
+    for (int k = 0; k < CSV_FIELDS; ++k) d->native &= d->col[k] == (k <= CSV_NOTE ? k : -1);
+}
+
+/* OFX when the file starts with its header or an <OFX> element, QIF
+   when it starts with a "!Type:"-style line, JSONL with a '{', CSV
+   otherwise */
+static int import_format(FILE *f) {
+    char head[1024];
+    size_t n = fread(head, 1, sizeof(head) - 1, f);
+    head[n] = 0;
+    rewind(f);
+    char *p = head;
+    if (strncmp(p, "\xEF\xBB\xBF", 3) == 0) p += 3;
+    p += strspn(p, " \t\r\n");
+    if (strncmp(p, "OFXHEADER", 9) == 0 || (p[0] == '<' && strstr(p, "<OFX"))) return IMPORT_OFX;
+    if (p[0] == '!') return IMPORT_QIF;
+    if (p[0] == '{') return IMPORT_JSONL;
+    return IMPORT_CSV;
+}
+
+/* Import a CSV, OFX or QIF file (see import_format()). CSV expects header
+   date,type,amount,category,note or id included; OFX and QIF rows take
+   their type from the sign of the amount and their note from payee, memo
+   and FITID. The file is read IMPORT_BLOCK rows at a time (CSV lines are
+   parsed in parallel) into an ImportStage; a dry run reports what the
+   import would do and changes nothing. A file of up to IMPORT_SEGMENT
+   blocks is committed only if it has no bad lines. Longer files are
+   committed a segment at a time and checkpointed after each, so after a
+   crash or Ctrl-C importing the same file again resumes where it
+   stopped, with the same result as an uninterrupted run. The whole
+   import is one undo step. */
+void import_file(const char *path, int dry_run) {
+    FILE *f = fopen(path, "r");
+    if (!f) { printf("Open failed.\n"); return; }
+    const char *dir = ledgers[active_ledger].dir;
+    int resumable = !dry_run && !sandbox.active;
+    ImportSource src;
+    memset(&src, 0, sizeof(src));
+    src.f = f;
+    setvbuf(f, NULL, _IOFBF, IO_CHUNK);
+    src.format = import_format(f);
+    if (src.format == IMPORT_CSV) csv_sniff(&src);
+    size_t (*read_block)(ImportSource *, ImportBlock *) =
+        src.format == IMPORT_OFX ? ofx_read_block : src.format == IMPORT_QIF ? qif_read_block : lines_read_block;
+    ImportBlock b = {NULL, 0, xmalloc(IMPORT_BLOCK * sizeof(size_t)), xmalloc(IMPORT_BLOCK * sizeof(Transaction)),
+                     xmalloc(IMPORT_BLOCK * sizeof(*b.category)), xmalloc(IMPORT_BLOCK), xmalloc(IMPORT_BLOCK * sizeof(int)),
+                     &src.csv, src.format};
+    size_t blocks = 0;
+    ImportStage st;
+    ImportCkpt ck;
+    memset(&st, 0, sizeof(st));
+    int saved = 0; /* ck is on disk */
+    if (resumable && import_ckpt_load(dir, path, &ck)) {
+        printf("An import of this file stopped after line %d with %llu row(s) added. Resume there? (y/n) [y]: ",
+               ck.lineno, (unsigned long long)ck.rows);
+        char yn[8]; read_line(yn, sizeof(yn));
+        if (yn[0] != 'n' && yn[0] != 'N') {
+            int rc = import_resume(&st, &ck, dir);
+            if (rc <= 0 || fseek(f, (long)ck.offset, SEEK_SET) != 0) {
+                if (rc < 0)
+                    printf("Rows this import added are no longer in the ledger, so it cannot resume. Import the file "
+                           "again and answer n.\n");
+                else printf("Unable to resume; the import checkpoint is damaged.\n");
+                stage_free(&st);
+                fclose(f);
+                free(b.offs); free(b.rows); free(b.category); free(b.rc); free(b.line);
+                return;
+            }
+            src.lineno = ck.lineno;
+            memcpy(src.currency, ck.currency, sizeof(src.currency));
+            memcpy(src.account, ck.account, sizeof(src.account));
+            src.section = ck.section;
+            saved = 1;
+        } else {
+            import_ckpt_remove(dir);
+        }
+    }
+    if (!saved) {
+        memset(&ck, 0, sizeof(ck));
+        memcpy(ck.magic, IMPORT_CKPT_MAGIC, 4);
+        snprintf(ck.path, sizeof(ck.path), "%s", path);
+        ck.first_id = txns.next_id;
+    }
+    /* a JSON Lines export going back into an empty ledger restores it as
+       it was, ids included; every row in the ledger is then the import's,
+       so it checkpoints like any other until a row's id is missing or
+       repeats. Such rows wait for the last commit. */
+    if (!saved && src.format == IMPORT_JSONL && txn_count() == 0 && cats.size == 0 &&
+        archive_row_count(&ledgers[active_ledger]) == 0)
+        st.keep_ids = ck.keep_ids = 1;
+    struct sigaction sa, old_sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = import_on_signal;
+    import_stop = 0;
+    if (resumable) sigaction(SIGINT, &sa, &old_sa);
+    if (!dry_run) oplog_begin(); /* the whole import is one undo step */
+    int mismatch = 0;
+    for (;;) {
+        size_t n = read_block(&src, &b);
+        if (!n) break;
+        size_t m = 0; /* valid rows, moved to the front of b.rows */
+        for (size_t k = 0; k < n; ++k) {
+            if (b.rc[k] == ENTRY_BLANK) continue;
+            if (b.rc[k] == ENTRY_CATEGORY) {
+                stage_category_as(&st, b.category[k], b.rows[k].id);
+                continue;
+            }
+            if (b.rc[k] == ENTRY_BUDGET) { /* see jsonl_parse_row() */
+                stage_budget(&st, b.category[k], b.rows[k].id, b.rows[k].category_id, b.rows[k].amount);
+                continue;
+            }
+            if (b.rc[k] <= 0) {
+                if (st.bad++ < IMPORT_SHOW_BAD)
+                    printf("Line %d: %s\n", b.line[k], b.rc[k] == ENTRY_LONG ? "line too long" :
+                                                       b.rc[k] < 0 ? "invalid date" : "missing fields");
+                continue;
+            }
+            if (m != k) {
+                b.rows[m] = b.rows[k];
+                memcpy(b.category[m], b.category[k], sizeof(b.category[m]));
+            }
+            m++;
+        }
+        stage_add(&st, b.rows, b.category, m);
+        blocks++;
+        int stop = import_stop;
+        if (resumable && !st.bad && !st.orphans && (blocks % IMPORT_SEGMENT == 0 || stop)) {
+            if (!stage_commit(&st)) { mismatch = 1; break; }
+            journal_commit();
+            ck.offset = (uint64_t)ftell(f);
+            ck.lineno = src.lineno;
+            ck.next_id = txns.next_id;
+            ck.rows = st.rows;
+            ck.dups = st.dups;
+            memcpy(ck.currency, src.currency, sizeof(ck.currency));
+            memcpy(ck.account, src.account, sizeof(ck.account));
+            ck.section = src.section;
+            import_id(path, ck.offset, &ck.head, &ck.tail);
+            saved = import_ckpt_save(dir, &ck, &st) || saved;
+        }
+        /* past a bad line nothing more can be committed: stop staging rows
+           that would only be thrown away */
+        if (stop || (resumable && st.bad)) break;
+    }
+    if (ferror(f)) {
+        printf("Read error in %s.\n", path);
+        st.bad++;
+    }
+    int more = !feof(f); /* stopped early */
+    fclose(f);
+    free(b.text);
+    free(b.offs);
+    free(b.rows);
+    free(b.category);
+    free(b.rc);
+    free(b.line);
+    if (resumable) sigaction(SIGINT, &old_sa, NULL);
+    if (st.bad > IMPORT_SHOW_BAD) printf("... and %zu more bad line(s).\n", st.bad - IMPORT_SHOW_BAD);
+    if (st.bad && more) printf("Lines after line %d were not checked.\n", src.lineno);
+    if (mismatch) {
+        printf("The ledger changed since the import stopped, so it cannot resume. Import the file again and answer n.\n");
+    } else if (more && !st.bad) {
+        stage_report(&st);
+        printf("Import interrupted after line %d. Import the same file again to resume.\n", ck.lineno);
+    } else {
+        stage_report(&st);
+        if (dry_run) {
+            printf("Dry run: nothing was changed.\n");
+        } else if (st.bad && saved) {
+            printf("Import stopped: the rows before line %d are imported. Fix the bad lines and import the file "
+                   "again to resume there.\n", ck.lineno + 1);
+        } else if (st.bad) {
+            printf("Import cancelled: nothing was changed. Fix the bad lines and import again.\n");
+        } else if (!stage_commit(&st)) {
+            printf("The ledger changed since the import stopped, so it cannot resume. Import the file again and answer n.\n");
+        } else {
+            if (saved) import_ckpt_remove(dir);
+            printf("Import complete.\n");
+        }
+    }
+    if (!dry_run) oplog_end();
+    stage_free(&st);
+}
+
+/* Next field of *p up to one of delims; empty fields count. NULL once
+   the line is used up. */
+static char *csv_field(char **p, const char *delims) {
+    char *start = *p;
+    if (!start) return NULL;
+    char *end = start + strcspn(start, delims);
+    if (*end) {
+        *end = 0;
+        *p = end + 1;
+    } else {
+        *p = NULL;
+    }
+    return start;
+}
+
+/* Parse one "date,type,amount,category,note" line into t (no id or
+   category id yet) and the category name, which may be empty. Safe to
+   call from several threads. Returns 1, 0 for a line missing fields,
+   -1 for a bad date. */
+int csv_parse_row(char *line, Transaction *t, char *category, size_t catsz) {
+    char *rest = line, *token;
+    memset(t, 0, sizeof(*t));
+    category[0] = 0;
+    /* date */
+    token = csv_field(&rest, ",");
+    if (!token) return 0;
+    strncpy(t->date, token, DATE_STRLEN-1);
+    /* type */
+    token = csv_field(&rest, ",");
+    if (!token) return 0;
+    t->type = (atoi(token)==1)?TYPE_INCOME:TYPE_EXPENSE;
+    token = csv_field(&rest, ",");
+    if (!token) return 0;
+    t->amount = atof(token);
+    token = csv_field(&rest, ",\n");
+    if (!token) return 0;
+    snprintf(category, catsz, "%s", token);
+    token = csv_field(&rest, "\n");
+    if (token) strncpy(t->note, token, sizeof(t->note)-1);
+    strcpy(t->currency, base_currency);
+    /* trim whitespace/newline */
+    for (char *q=t->date; *q; ++q) if (*q=='\r' || *q=='\n') *q=0;
+    return parse_date(t->date, NULL) ? 1 : -1;
+}
+
+/* Split line in place into up to max columns of dialect d: quoted
+   columns are unquoted ("" stands for a quote), unquoted ones trimmed.
+   Returns how many there are. */
+int csv_split(char *line, const CsvDialect *d, char **f, int max) {
+    char *p = line;
+    int n = 0;
+    line[strcspn(line, "\r\n")] = 0;
+    while (p && n < max) {
+        while (*p == ' ') p++;
+        if (d->quote && *p == d->quote) {
+            char *w = ++p;
+            f[n++] = w;
+            while (*p && (*p != d->quote || p[1] == d->quote)) {
+                if (*p == d->quote) p++;
+                *w++ = *p++;
+            }
+            if (*p) p++;
+            char *e = strchr(p, d->delim);
+            *w = 0;
+            p = e ? e + 1 : NULL;
+            continue;
+        }
+        f[n++] = p;
+        char *e = d->rest && n == d->ncols ? NULL : strchr(p, d->delim);
+        char *end = e ? e : p + strlen(p);
+        while (end > p && end[-1] == ' ') end--;
+        *end = 0;
+        p = e ? e + 1 : NULL;
+    }
+    return n;
+}
+
+/* Whether a type column's value means income: 1, or one of these words
+   as the whole value in any case, so "Card payment" or "Charge" is an
+   expense */
+static int import_type_income(const char *tp) {
+    static const char *words[] = {"income", "credit", "cr", "deposit", "in"};
+    if (atoi(tp) == 1) return 1;
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); ++i) {
+        if (strcasecmp(tp, words[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+/* Parse one line of a CSV file in dialect d (see csv_sniff()) like
+   csv_parse_row(). The type comes from the type column when the row
+   has one, the amount's sign then being ignored; otherwise from the
+   sign of the amount, or from which of debit and credit is filled in. */
+int csv_parse_dialect(char *line, const CsvDialect *d, Transaction *t, char *category, size_t catsz) {
+    char *f[CSV_MAX_COLS];
+    const char *v[CSV_FIELDS];
+    int n = csv_split(line, d, f, CSV_MAX_COLS);
+    for (int k = 0; k < CSV_FIELDS; ++k) v[k] = d->col[k] >= 0 && d->col[k] < n ? f[d->col[k]] : "";
+    memset(t, 0, sizeof(*t));
+    category[0] = 0;
+    double amount;
+    if (!v[CSV_DATE][0]) return 0;
+    if (v[CSV_AMOUNT][0]) {
+        if (!import_amount(v[CSV_AMOUNT], d->decimal, &amount)) return 0;
+    } else if (v[CSV_DEBIT][0] || v[CSV_CREDIT][0]) {
+        int debit = v[CSV_DEBIT][0] != 0;
+        if (!import_amount(debit ? v[CSV_DEBIT] : v[CSV_CREDIT], d->decimal, &amount)) return 0;
+        if (amount < 0) amount = -amount;
+        if (debit) amount = -amount;
+    } else {
+        return 0;
+    }
+    if (v[CSV_TYPE][0]) {
+        t->type = import_type_income(v[CSV_TYPE]) ? TYPE_INCOME : TYPE_EXPENSE;
+        t->amount = amount < 0 ? -amount : amount; /* Type=Debit,Amount=-45.00 is an expense of 45 */
+    } else {
+        t->type = amount < 0 ? TYPE_EXPENSE : TYPE_INCOME;
+        t->amount = amount < 0 ? -amount : amount;
+    }
+    snprintf(category, catsz, "%s", v[CSV_CATEGORY]);
+    char cur[8];
+    snprintf(cur, sizeof(cur), "%s", v[CSV_CURRENCY]);
+    strcpy(t->currency, normalize_currency(cur) ? cur : base_currency);
+    import_note(t->note, v[CSV_PAYEE], v[CSV_NOTE], "", "");
+    char date[MAX_NOTE];
+    import_date(v[CSV_DATE], d->date_order, date);
+    size_t dl = strlen(date);
+    if (dl >= DATE_STRLEN) return -1;
+    memcpy(t->date, date, dl);
+    return parse_date(t->date, NULL) ? 1 : -1;
+}
+
+/* -- JSON Lines -- */
+
+/* A member of a flat JSON object: its key and value, strings decoded
+   in place. Members that are null, nested objects or arrays are left
+   out, as if absent. */
+typedef struct {
+    const char *key;
+    const char *val;
+    int str; /* val was a string, not a number or literal */
+} JsonMember;
+
+static int json_hex4(const char *p, unsigned *cp) {
+    *cp = 0;
+    for (int i = 0; i < 4; ++i) {
+        int c = (unsigned char)p[i], v = isdigit(c) ? c - '0' : isxdigit(c) ? (tolower(c) - 'a' + 10) : -1;
+        if (v < 0) return 0;
+        *cp = *cp * 16 + (unsigned)v;
+    }
+    return 1;
+}
+
+/* Decode in place the JSON string whose opening quote is just before
+   *p, leaving *p after the closing one; escapes never grow. NULL when
+   it is not closed or has a bad escape. */
+static char *json_string(char **p) {
+    char *r = *p, *w = *p;
+    while (*r != '"') {
+        if (!*r) return NULL;
+        if (*r != '\\') {
+            *w++ = *r++;
+            continue;
+        }
+        unsigned cp;
+        switch (*++r) {
+        case 'n': *w++ = '\n'; break;
+        case 't': *w++ = '\t'; break;
+        case 'r': *w++ = '\r'; break;
+        case 'b': *w++ = '\b'; break;
+        case 'f': *w++ = '\f'; break;
+        case '"': case '\\': case '/': *w++ = *r; break;
+        case 'u':
+            if (!json_hex4(r + 1, &cp) || cp == 0) return NULL; /* a NUL would cut the string short */
+            r += 4;
+            unsigned lo;
+            if (cp >= 0xD800 && cp < 0xDC00 && r[1] == '\\' && r[2] == 'u' && json_hex4(r + 3, &lo) &&
+                lo >= 0xDC00 && lo < 0xE000) { /* surrogate pair */
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                r += 6;
+            } else if (cp >= 0xD800 && cp < 0xE000) {
+                return NULL; /* half of a pair */
+            }
+            if (cp < 0x80) {
+                *w++ = (char)cp;
+            } else if (cp < 0x800) {
+                *w++ = (char)(0xC0 | cp >> 6);
+                *w++ = (char)(0x80 | (cp & 0x3F));
+            } else if (cp < 0x10000) {
+                *w++ = (char)(0xE0 | cp >> 12);
+                *w++ = (char)(0x80 | (cp >> 6 & 0x3F));
+                *w++ = (char)(0x80 | (cp & 0x3F));
+            } else {
+                *w++ = (char)(0xF0 | cp >> 18);
+                *w++ = (char)(0x80 | (cp >> 12 & 0x3F));
+                *w++ = (char)(0x80 | (cp >> 6 & 0x3F));
+                *w++ = (char)(0x80 | (cp & 0x3F));
+            }
+            break;
+        default: return NULL;
+        }
+        r++;
+    }
+    char *start = *p;
+    *p = r + 1;
+    *w = 0;
+    return start;
+}
+
+/* Split a JSON object written on one line into up to max members, in
+   place. Returns how many, -1 when the line is not an object. */
+static int json_object(char *p, JsonMember *m, int max) {
+    int n = 0;
+    p += strspn(p, " \t\r\n");
+    if (*p++ != '{') return -1;
+    p += strspn(p, " \t\r\n");
+    if (*p == '}') return 0;
+    for (;;) {
+        p += strspn(p, " \t\r\n");
+        if (*p++ != '"') return -1;
+        char *key = json_string(&p);
+        if (!key) return -1;
+        p += strspn(p, " \t\r\n");
+        if (*p++ != ':') return -1;
+        p += strspn(p, " \t\r\n");
+        char *val = p;
+        int str = *p == '"';
+        if (str) {
+            p++;
+            if (!(val = json_string(&p))) return -1;
+        } else if (*p == '{' || *p == '[') {
+            int depth = 0;
+            do {
+                if (*p == '"') {
+                    for (p++; *p && *p != '"'; p += *p == '\\' && p[1] ? 2 : 1) {}
+                } else if (*p == '{' || *p == '[') {
+                    depth++;
+                } else if (*p == '}' || *p == ']') {
+                    depth--;
+                }
+                if (!*p) return -1;
+                p++;
+            } while (depth > 0);
+            val = NULL;
+        } else {
+            p += strcspn(p, ",} \t\r\n");
+        }
+        char *end = p;
+        p += strspn(p, " \t\r\n");
+        char c = *p++;
+        if (!str && val) {
+            *end = 0; /* may be the ',' or '}' just read */
+            if (strcmp(val, "null") == 0) val = NULL;
+        }
+        if (val && n < max) {
+            m[n].key = key;
+            m[n].val = val;
+            m[n].str = str;
+            n++;
+        }
+        if (c == '}') return n;
+        if (c != ',') return -1;
+    }
+}
+
+/* Parse one line of a JSON Lines file as export_jsonl() writes it. A
+   "kind":"transaction" record (the default) goes into t and category
+   like csv_parse_row(), its "id" in t->id; its type is "income"/"expense"
+   (or 1/0, read as import_type_income() does) and the amount's sign is
+   then ignored, else the sign gives the type. A category record gives
+   ENTRY_CATEGORY with its name in category and id in t->id; a budget
+   record ENTRY_BUDGET with its category in category, year in t->id,
+   month in t->category_id and limit in t->amount. Other kinds read as
+   blank lines. A null member counts as absent. Returns 1, 0 for a record
+   missing fields (or not an object), -1 for a bad date or month, or an
+   ENTRY_*. Safe to call from several threads. */
+int jsonl_parse_row(char *line, Transaction *t, char *category, size_t catsz) {
+    enum { J_KIND, J_ID, J_DATE, J_TYPE, J_AMOUNT, J_CURRENCY, J_CATEGORY, J_NOTE, J_NAME, J_YEAR, J_MONTH, J_FIELDS };
+    static const char *names[J_FIELDS] = {"kind", "id", "date", "type", "amount", "currency", "category", "note",
+                                          "name", "year", "month"};
+    const char *v[J_FIELDS] = {"transaction", NULL, NULL, NULL, NULL, NULL, "", "", NULL, NULL, NULL};
+    JsonMember m[16];
+    int n = json_object(line, m, 16);
+    memset(t, 0, sizeof(*t));
+    category[0] = 0;
+    if (n < 0) return 0;
+    for (int i = 0; i < n; ++i) {
+        for (int k = 0; k < J_FIELDS; ++k) {
+            if (m[i].key[0] == names[k][0] && strcmp(m[i].key, names[k]) == 0) {
+                v[k] = m[i].val;
+                break;
+            }
+        }
+    }
+    char *end;
+    if (v[J_ID]) {
+        long id = strtol(v[J_ID], &end, 10);
+        if (end != v[J_ID] && !*end && id > 0 && id <= INT_MAX) t->id = (int)id;
+    }
+    if (strcmp(v[J_KIND], "category") == 0) {
+        if (!v[J_NAME] || !v[J_NAME][0]) return 0;
+        snprintf(category, catsz, "%s", v[J_NAME]);
+        return ENTRY_CATEGORY;
+    }
+    if (strcmp(v[J_KIND], "budget") == 0) {
+        if (!v[J_YEAR] || !v[J_MONTH] || !v[J_AMOUNT]) return 0;
+        t->id = 0;
+        t->amount = strtod(v[J_AMOUNT], &end);
+        if (end == v[J_AMOUNT] || *end) return 0;
+        t->id = atoi(v[J_YEAR]);
+        t->category_id = atoi(v[J_MONTH]);
+        snprintf(category, catsz, "%s", v[J_CATEGORY]);
+        return t->category_id >= 1 && t->category_id <= 12 ? ENTRY_BUDGET : -1;
+    }
+    if (strcmp(v[J_KIND], "transaction") != 0) return ENTRY_BLANK;
+    if (!v[J_DATE] || !v[J_AMOUNT]) return 0;
+    double amount = strtod(v[J_AMOUNT], &end);
+    if (end == v[J_AMOUNT] || *end) return 0;
+    t->amount = amount < 0 ? -amount : amount;
+    if (v[J_TYPE]) t->type = import_type_income(v[J_TYPE]) ? TYPE_INCOME : TYPE_EXPENSE;
+    else t->type = amount < 0 ? TYPE_EXPENSE : TYPE_INCOME;
+    char cur[8];
+    snprintf(cur, sizeof(cur), "%s", v[J_CURRENCY] ? v[J_CURRENCY] : "");
+    strcpy(t->currency, normalize_currency(cur) ? cur : base_currency);
+    snprintf(category, catsz, "%s", v[J_CATEGORY]);
+    size_t nl = strlen(v[J_NOTE]);
+    memcpy(t->note, v[J_NOTE], nl < MAX_NOTE ? nl : MAX_NOTE - 1);
+    size_t dl = strlen(v[J_DATE]);
+    if (dl >= DATE_STRLEN) return -1;
+    memcpy(t->date, v[J_DATE], dl);
+    return parse_date(t->date, NULL) ? 1 : -1;
+}
+
+/* -------------------- Search -------------------- */
+
+typedef struct {
+    const char *sdate, *edate, *cname, *text; /* "" = any */
+    double minamt, maxamt;                    /* 0 = any */
+    const Transaction *rows;                  /* for search_chunk() */
+    unsigned char *hit;
+} SearchQuery;
+
+/* Whether t matches q; *catn is set to its category's name */
+static int search_match(const SearchQuery *q, const Transaction *t, const char **catn) {
+    if (strlen(q->sdate) && compare_dates(t->date, q->sdate) < 0) return 0;
+    if (strlen(q->edate) && compare_dates(t->date, q->edate) > 0) return 0;
+    if (q->minamt > 0 && t->amount < q->minamt) return 0;
+    if (q->maxamt > 0 && t->amount > q->maxamt) return 0;
+    int idx = find_category_index_by_id(t->category_id);
+    *catn = (idx>=0)?cats.data[idx].name:"UNKNOWN";
+    if (strlen(q->cname) && strcasestr(*catn, q->cname) == NULL) return 0;
+    if (strlen(q->text) && strcasestr(t->note, q->text) == NULL) return 0;
+    return 1;
+}
+
+static void search_chunk(void *ctx, size_t chunk, size_t lo, size_t hi) {
+    (void)chunk;
+    const SearchQuery *q = ctx;
+    const char *catn;
+    for (size_t i = lo; i < hi; ++i) q->hit[i] = (unsigned char)search_match(q, &q->rows[i], &catn);
+}
+
+static void search_print(const Transaction *t, const char *catn, int archived) {
+    printf("  id=%d %s %s %.2f %s [%s] %s%s\n", t->id, t->date, (t->type==TYPE_INCOME?"IN":"EX"), t->amount, t->currency, catn, t->note,
+           archived ? " (archived)" : "");
+}
+
+/* Match rows in parallel, then print the hits in order */
+static void search_rows(SearchQuery *q, const Transaction *rows, size_t n, int archived) {
+    q->rows = rows;
+    q->hit = xmalloc(n ? n : 1);
+    parallel_for(n, SCHED_GRAIN_ROWS, PRIO_HIGH, search_chunk, q);
+    for (size_t i = 0; i < n; ++i) {
+        if (!q->hit[i]) continue;
+        int idx = find_category_index_by_id(rows[i].category_id);
+        search_print(&rows[i], idx >= 0 ? cats.data[idx].name : "UNKNOWN", archived);
+    }
+    free(q->hit);
+    metric_add(&metrics.rows_scanned, n);
+}
+
+void search_transactions() {
+    printf("Search: leave fields blank to ignore.\n");
+    printf("Start date (YYYY-MM-DD): ");
+    char sdate[DATE_STRLEN]; read_line(sdate, sizeof(sdate));
+    if (strlen(sdate) && !parse_date(sdate, NULL)) { printf("Invalid date.\n"); return; }
+    printf("End date (YYYY-MM-DD): ");
+    char edate[DATE_STRLEN]; read_line(edate, sizeof(edate));
+    if (strlen(edate) && !parse_date(edate, NULL)) { printf("Invalid date.\n"); return; }
+    printf("Category name (partial): "); char cname[64]; read_line(cname, sizeof(cname));
+    printf("Min amount (0 to ignore): "); double minamt = read_double();
+    printf("Max amount (0 to ignore): "); double maxamt = read_double();
+    printf("Text in note (partial): "); char text[64]; read_line(text, sizeof(text));
+    printf("Search results:\n");
+    size_t narch;
+    Transaction *arch = archive_select(sdate, edate, minamt, maxamt, cname, &narch);
+    SearchQuery q = {sdate, edate, cname, text, minamt, maxamt, NULL, NULL};
+    if (txn_tree) {
+        /* the tree visits only the date range; no need to split it */
+        TxnIter it;
+        const Transaction *t;
+        const char *catn;
+        txn_iter_open(&it, sdate, edate, arch, narch);
+        while ((t = txn_iter_next(&it)) != NULL) {
+            if (search_match(&q, t, &catn)) search_print(t, catn, it.in_extra);
+        }
+    } else {
+        search_rows(&q, txns.data, txns.size, 0);
+        search_rows(&q, arch, narch, 1);
+    }
+    free(arch);
+}
+
+/* -------------------- Daemon mode -------------------- */
+
+/* Vyukov's intrusive MPSC queue: a push is one atomic exchange, so
+   producers never wait for each other or for the writer */
+static void ingest_push(IngestItem *it) {
+    atomic_store_explicit(&it->next, NULL, memory_order_relaxed);
+    IngestItem *prev = atomic_exchange_explicit(&ingest_head, it, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, it, memory_order_release);
+}
+
+/* Writer only. NULL when empty, or when the newest item's producer is
+   between its two steps; it is seen on the next call. */
+static IngestItem *ingest_pop() {
+    IngestItem *tail = ingest_tail;
+    IngestItem *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &ingest_stub) {
+        if (!next) return NULL;
+        ingest_tail = tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (!next) {
+        if (tail != atomic_load_explicit(&ingest_head, memory_order_acquire)) return NULL;
+        ingest_push(&ingest_stub);
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+        if (!next) return NULL;
+    }
+    ingest_tail = next;
+    return tail;
+}
+
+static int ingest_empty() {
+    return ingest_tail == &ingest_stub && atomic_load(&ingest_head) == &ingest_stub;
+}
+
+/* Queue one parsed row for the writer, which gives it its id */
+void ingest_submit(IngestClient *c, const Transaction *t, const char *category) {
+    IngestItem *it = xmalloc(sizeof(*it));
+    it->client = c;
+    it->t = *t;
+    snprintf(it->category, sizeof(it->category), "%s", category);
+    c->sent++;
+    metric_add(&metrics.queued, 1);
+    ingest_push(it);
+    if (atomic_load(&ingest_waiting)) {
+        pthread_mutex_lock(&ingest_lock);
+        pthread_cond_signal(&ingest_cond);
+        pthread_mutex_unlock(&ingest_lock);
+    }
+}
+
+/* Block until every row c queued is in the stores and the journal */
+void ingest_wait(IngestClient *c) {
+    pthread_mutex_lock(&ingest_lock);
+    while (atomic_load(&c->committed) < c->sent) pthread_cond_wait(&ingest_done, &ingest_lock);
+    pthread_mutex_unlock(&ingest_lock);
+}
+
+static FpCount *fp_slot(FpMap *m, uint64_t key) {
+    if (!key) key = 1;
+    if ((m->used + 1) * 2 > m->cap) {
+        FpMap g = {calloc(m->cap ? m->cap * 2 : 1024, sizeof(FpCount)), m->cap ? m->cap * 2 : 1024, m->used};
+        if (!g.slots) panic("out of memory");
+        for (size_t i = 0; i < m->cap; ++i) {
+            if (!m->slots[i].key) continue;
+            size_t h = (size_t)(m->slots[i].key * 0x9e3779b97f4a7c15ull) & (g.cap - 1);
+            while (g.slots[h].key) h = (h + 1) & (g.cap - 1);
+            g.slots[h] = m->slots[i];
+        }
+        free(m->slots);
+        *m = g;
     }
-    /* remove by swapping last */
-    cats.data[idx] = cats.data[cats.size-1];
-    cats.size--;
-    printf("Deleted.\n");
+    size_t h = (size_t)(key * 0x9e3779b97f4a7c15ull) & (m->cap - 1);
+    while (m->slots[h].key && m->slots[h].key != key) h = (h + 1) & (m->cap - 1);
+    if (!m->slots[h].key) {
+        m->slots[h].key = key;
+        m->used++;
+    }
+    return &m->slots[h];
 }
 
-/* -------------------- CRUD Transactions -------------------- */
+static void fp_free(FpMap *m) {
+    free(m->slots);
+    memset(m, 0, sizeof(*m));
+}
 
-void add_transaction() {
-    Transaction t;
-    ensure_txn_capacity();
-    t.id = txns.next_id++;
+/* The bank's transaction id a note ends with ("... [fitid:ID]"), or
+   NULL; *len gets its length */
+static const char *note_fitid(const char *note, size_t *len) {
+    const char *p = strstr(note, FITID_TAG), *q;
+    if (!p) return NULL;
+    while ((q = strstr(p + 1, FITID_TAG)) != NULL) p = q;
+    p += strlen(FITID_TAG);
+    size_t n = strlen(p);
+    if (n < 2 || p[n - 1] != ']') return NULL;
+    *len = n - 1;
+    return p;
+}
 
-    /* date */
-    time_t now = time(NULL);
-    struct tm *tmnow = localtime(&now);
-    char default_date[DATE_STRLEN];
-    snprintf(default_date, sizeof(default_date), "%04d-%02d-%02d", tmnow->tm_year+1900, tmnow->tm_mon+1, tmnow->tm_mday);
-    printf("Date (YYYY-MM-DD) [default %s]: ", default_date);
-    read_line(t.date, sizeof(t.date));
-    if (strlen(t.date) == 0) strcpy(t.date, default_date);
-    if (!parse_date(t.date, NULL)) { printf("Invalid date format.\n"); return; }
+/* FNV-1a over what a bank export repeats exactly: date, type, amount
+   in cents, currency and note (not the category, which may be guessed).
+   A row with a FITID is known by its tag (account and FITID) and its
+   currency alone, so a later statement that repeats it with another
+   memo or date is still caught, while the same FITID from another
+   account is not taken for it. */
+static uint64_t row_fingerprint(const Transaction *t) {
+    uint64_t h = 14695981039346656037ull;
+    long long cents = (long long)(t->amount * 100 + (t->amount < 0 ? -0.5 : 0.5));
+    unsigned char tp = (unsigned char)t->type;
+    const unsigned char *parts[5] = {(const unsigned char *)t->date, &tp, (const unsigned char *)&cents,
+                                     (const unsigned char *)t->currency, (const unsigned char *)t->note};
+    size_t lens[5] = {strlen(t->date), 1, sizeof(cents), strlen(t->currency), strlen(t->note)};
+    size_t reflen;
+    const char *ref = note_fitid(t->note, &reflen);
+    if (ref) {
+        parts[0] = (const unsigned char *)FITID_TAG;
+        lens[0] = strlen(FITID_TAG);
+        parts[1] = (const unsigned char *)ref;
+        lens[1] = reflen;
+        lens[2] = lens[4] = 0;
+    }
+    for (int i = 0; i < 5; ++i) {
+        for (size_t j = 0; j < lens[i]; ++j) h = (h ^ parts[i][j]) * 1099511628211ull;
+        h = (h ^ 0xff) * 1099511628211ull;
+    }
+    return h;
+}
 
-    /* type */
-    printf("Type: 0=Expense, 1=Income [0]: ");
-    int tp = read_int();
-    if (tp != 1) t.type = TYPE_EXPENSE; else t.type = TYPE_INCOME;
+/* Hash of a note's letters only, so "CARD 4411 TESCO 03/05" and
+   "card 9120 tesco 04/05" match; 0 when it has none */
+static uint64_t note_key(const char *note) {
+    uint64_t h = 14695981039346656037ull;
+    int any = 0;
+    for (const char *p = note; *p; ++p) {
+        if (!isalpha((unsigned char)*p)) continue;
+        h = (h ^ (unsigned char)tolower((unsigned char)*p)) * 1099511628211ull;
+        any = 1;
+    }
+    return any ? h : 0;
+}
 
-    /* amount */
-    printf("Amount: ");
-    t.amount = read_double();
-    if (t.amount <= 0) { printf("Amount must be > 0.\n"); return; }
+/* Fingerprints and note categories of the rows already in the ledger,
+   built when the first row that needs them arrives */
+static void ingest_learn() {
+    if (ingest_known) return;
+    TxnIter it;
+    const Transaction *t;
+    txn_iter_open(&it, NULL, NULL, NULL, 0);
+    while ((t = txn_iter_next(&it)) != NULL) {
+        fp_slot(&ingest_rows, row_fingerprint(t))->a++;
+        uint64_t k = note_key(t->note);
+        if (k) fp_slot(&ingest_notes, k)->a = (uint32_t)t->category_id;
+    }
+    ingest_known = 1;
+}
 
-    /* category */
-    list_categories();
-    if (cats.size == 0) {
-        printf("No categories exist — create one now.\n");
-        add_category();
-        if (cats.size == 0) { printf("No categories — abort.\n"); return; }
+/* Category id for a queued row. Without a category it is guessed: the
+   one last used for the same note, else a category named in the note
+   (the longest such name), else AUTO_CATEGORY. */
+static int ingest_category(const IngestItem *it) {
+    const char *name = it->category;
+    if (!name[0]) {
+        ingest_learn();
+        uint64_t k = note_key(it->t.note);
+        FpCount *c = k ? fp_slot(&ingest_notes, k) : NULL;
+        if (c && c->a && find_category_by_id((int)c->a)) return (int)c->a;
+        size_t best = 0;
+        name = AUTO_CATEGORY;
+        for (size_t j = 0; j < cats.size; ++j) {
+            size_t len = strlen(cats.data[j].name);
+            if (len > best && strcasestr(it->t.note, cats.data[j].name) != NULL) {
+                best = len;
+                name = cats.data[j].name;
+            }
+        }
     }
-    printf("Enter category id for this transaction: ");
-    int cid = read_int();
-    if (!find_category_by_id(cid)) { printf("Invalid category.\n"); return; }
-    t.category_id = cid;
+    for (size_t j = 0; j < cats.size; ++j) {
+        if (strcasecmp(cats.data[j].name, name) == 0) return cats.data[j].id;
+    }
+    int cid = cat_insert(name);
+    printf("Created category '%s' id=%d\n", name, cid);
+    return cid;
+}
 
-    /* note */
-    printf("Note (optional): ");
-    read_line(t.note, sizeof(t.note));
-    txns.data[txns.size++] = t;
-    printf("Transaction added (id=%d).\n", t.id);
+/* Whether a row of a deduplicated feed is one the ledger already had:
+   its n-th copy in the feed is new only if the ledger held fewer than
+   n copies before the feed began, so repeated rows within a file (two
+   identical coffees) still count */
+static int ingest_duplicate(IngestClient *c, const Transaction *t) {
+    ingest_learn();
+    uint64_t fp = row_fingerprint(t);
+    FpCount *mine = fp_slot(&c->seen, fp);
+    FpCount *all = fp_slot(&ingest_rows, fp);
+    mine->a++;
+    return mine->a <= all->a - mine->b;
 }
 
-void list_transactions(const char *start_date, const char *end_date) {
-    printf("Transactions:");
-    if (txns.size == 0) { printf(" (none)\n"); return; }
-    printf("\n");
-    for (size_t i = 0; i < txns.size; ++i) {
-        Transaction *t = &txns.data[i];
-        if (start_date && compare_dates(t->date, start_date) < 0) continue;
-        if (end_date && compare_dates(t->date, end_date) > 0) continue;
-        int idx = find_category_index_by_id(t->category_id);
-        const char *cname = (idx >= 0) ? cats.data[idx].name : "UNKNOWN";
-        printf("  id=%d  %s  %s  %.2f  [%s]  %s\n",
-               t->id,
-               t->date,
-               (t->type == TYPE_INCOME ? "IN" : "EX"),
-               t->amount,
-               cname,
-               t->note);
+/* Answer the clients of every row written so far; ok = 0 when the
+   journal failed to write or sync them */
+static void ingest_release(int ok) {
+    if (!ingest_nunacked) return;
+    pthread_mutex_lock(&ingest_lock);
+    for (size_t i = 0, j; i < ingest_nunacked; i = j) {
+        for (j = i + 1; j < ingest_nunacked && ingest_unacked[j] == ingest_unacked[i]; ++j) {}
+        if (!ok) atomic_fetch_add(&ingest_unacked[i]->failed, j - i);
+        atomic_fetch_add(&ingest_unacked[i]->committed, j - i);
     }
+    pthread_cond_broadcast(&ingest_done);
+    pthread_mutex_unlock(&ingest_lock);
+    ingest_nunacked = 0;
 }
 
-int find_txn_index_by_id(int id) {
-    for (size_t i = 0; i < txns.size; ++i) if (txns.data[i].id == id) return (int)i;
-    return -1;
+/* Apply up to INGEST_BATCH queued rows: the new ones go in through one
+   txn_insert_batch() and one journal write, and their producers are
+   answered now or with the group commit. Returns how many were taken. */
+static size_t ingest_apply_batch() {
+    static IngestItem *batch[INGEST_BATCH];
+    size_t n = 0;
+    IngestItem *it;
+    while (n < INGEST_BATCH && (it = ingest_pop()) != NULL) batch[n++] = it;
+    if (!n) return 0;
+    static Transaction rows[INGEST_BATCH];
+    size_t m = 0;
+    uint64_t start = now_ns(), dups = 0;
+    int ok = 1;
+    oplog_begin();
+    for (size_t i = 0; i < n; ++i) {
+        IngestClient *c = batch[i]->client;
+        Transaction *t = &batch[i]->t;
+        if (c->dedup && ingest_duplicate(c, t)) {
+            c->dups++;
+            dups++;
+            continue;
+        }
+        t->category_id = ingest_category(batch[i]);
+        if (c->dedup) fp_slot(&c->seen, row_fingerprint(t))->b++;
+        if (ingest_known) {
+            fp_slot(&ingest_rows, row_fingerprint(t))->a++;
+            uint64_t k = note_key(t->note);
+            if (k) fp_slot(&ingest_notes, k)->a = (uint32_t)t->category_id;
+        }
+        rows[m++] = *t;
+        if (durability == DURABLE_SYNC) { /* every row on its own */
+            txn_insert_batch(rows, 1);
+            ok = journal_flush() && journal_sync() && ok;
+            m = 0;
+        }
+    }
+    txn_insert_batch(rows, m);
+    oplog_end();
+    oplog_clear(); /* nothing is undone in daemon mode */
+    metric_observe(MOP_BATCH, start);
+    metric_add(&metrics.rows_ingested, n - dups);
+    metric_add(&metrics.rows_duplicate, dups);
+    metric_add(&metrics.applied, n);
+    if (!ingest_nunacked) ingest_group_start = start;
+    ingest_unacked = grow_array(ingest_unacked, &ingest_unackedcap, ingest_nunacked + n, sizeof(IngestClient *), 4096);
+    for (size_t i = 0; i < n; ++i) {
+        ingest_unacked[ingest_nunacked++] = batch[i]->client;
+        free(batch[i]);
+    }
+    if (durability != DURABLE_GROUPED) ingest_release(journal_flush() && ok);
+    return n;
 }
 
-void edit_transaction() {
-    list_transactions(NULL, NULL);
-    printf("Enter transaction id to edit: ");
-    int id = read_int();
-    int idx = find_txn_index_by_id(id);
-    if (idx < 0) { printf("Not found.\n"); return; }
-    Transaction *t = &txns.data[idx];
-    printf("Date [%s]: ", t->date);
-    char buf[DATE_STRLEN];
-    read_line(buf, sizeof(buf));
-    if (strlen(buf)) {
-        if (parse_date(buf, NULL)) strncpy(t->date, buf, sizeof(t->date));
-        else printf("Invalid date — kept.\n");
+/* Sync every row written since the last group commit with one
+   fdatasync(), then answer their clients. Records a failed write left
+   buffered are retried first, so the answer covers all of them. */
+static void ingest_group_commit() {
+    int ok = journal_flush();
+    ok = journal_sync() && ok;
+    ingest_release(ok);
+}
+
+/* Sleep until rows arrive or ns pass; whether rows are waiting */
+static int ingest_idle_wait(uint64_t ns) {
+    pthread_mutex_lock(&ingest_lock);
+    atomic_store(&ingest_waiting, 1);
+    if (ingest_empty()) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += (time_t)(ns / 1000000000u);
+        until.tv_nsec += (long)(ns % 1000000000u);
+        if (until.tv_nsec >= 1000000000L) { until.tv_sec++; until.tv_nsec -= 1000000000L; }
+        pthread_cond_timedwait(&ingest_cond, &ingest_lock, &until);
     }
-    printf("Type 0=Expense,1=Income [%d]: ", t->type);
-    int tp = read_int();
-    if (tp == 0 || tp == 1) t->type = tp;
-    printf("Amount [%.2f]: ", t->amount);
-    double a = read_double();
-    if (a > 0) t->amount = a;
-    list_categories();
-    printf("Category id [%d]: ", t->category_id);
-    int cid = read_int();
-    if (cid && find_category_by_id(cid)) t->category_id = cid;
-    printf("Note [%s]: ", t->note);
-    char notebuf[MAX_NOTE];
-    read_line(notebuf, sizeof(notebuf));
-    if (strlen(notebuf)) strncpy(t->note, notebuf, sizeof(t->note)-1);
-    printf("Updated.\n");
+    atomic_store(&ingest_waiting, 0);
+    pthread_mutex_unlock(&ingest_lock);
+    return !ingest_empty();
 }
 
-void remove_transaction() {
-    list_transactions(NULL, NULL);
-    printf("Enter transaction id to delete: ");
-    int id = read_int();
-    int idx = find_txn_index_by_id(id);
-    if (idx < 0) { printf("Not found.\n"); return; }
-    txns.data[idx] = txns.data[txns.size-1];
-    txns.size--;
-    printf("Deleted.\n");
+/* Queue one CSV line; problems are reported to the client at once */
+static void daemon_row(IngestClient *c, char *line, FILE *out, const char *where, long lineno) {
+    Transaction t;
+    char category[64];
+    int rc = csv_parse_row(line, &t, category, sizeof(category));
+    if (rc > 0) {
+        ingest_submit(c, &t, category);
+    } else {
+        fprintf(out, "error %s%ld: %s\n", where, lineno, rc < 0 ? "invalid date" : "missing fields");
+        metric_add(&metrics.rows_invalid, 1);
+    }
 }
 
-/* -------------------- Budgets -------------------- */
+/* Open the file called name in the watch folder for a client's import.
+   Clients only reach files put there for ingestion: no other directory,
+   no hidden files, no symlinks. NULL if that is not such a file. */
+static FILE *daemon_import_open(const char *name) {
+    if (!watch_dir[0] || !name[0] || name[0] == '.' || strchr(name, '/') || strlen(name) > NAME_MAX) return NULL;
+    char path[PATH_LEN + 1024];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", watch_dir, name);
+    int fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) return NULL;
+    FILE *f = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? fdopen(fd, "r") : NULL;
+    if (!f) close(fd);
+    return f;
+}
 
-void set_budget() {
-    list_categories();
-    printf("Enter category id to set budget: ");
-    int cid = read_int();
-    if (!find_category_by_id(cid)) { printf("Invalid category.\n"); return; }
-    printf("Year (e.g., 2025): ");
-    int year = read_int();
-    printf("Month (1-12): ");
-    int month = read_int();
-    if (month < 1 || month > 12) { printf("Invalid month.\n"); return; }
-    printf("Budget amount for %04d-%02d: ", year, month);
-    double amt = read_double();
-    if (amt < 0) { printf("Invalid amount.\n"); return; }
-    /* find existing */
-    for (size_t i = 0; i < budgets.size; ++i) {
-        if (budgets.data[i].category_id == cid && budgets.data[i].year == year && budgets.data[i].month == month) {
-            budgets.data[i].amount = amt;
-            printf("Updated budget.\n");
-            return;
+static void daemon_answer(IngestClient *c, FILE *out) {
+    uint64_t failed = atomic_load(&c->failed);
+    if (failed)
+        fprintf(out, "error journal: %llu of %llu row(s) not saved\n", (unsigned long long)failed,
+                (unsigned long long)c->sent);
+    else fprintf(out, "ok %llu\n", (unsigned long long)c->sent);
+}
+
+/* One connection. Commands, one per line:
+     add DATE,TYPE,AMOUNT,CATEGORY,NOTE   queue a row (no reply)
+     import NAME                          queue every row of a CSV file
+                                          in the watch folder
+     commit                               wait until all are journaled
+   commit and the end of the input answer "ok N", N rows so far, or
+   "error journal: F of N row(s) not saved" once the journal failed to
+   write or sync F of them. */
+static void *daemon_client(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    FILE *in = fdopen(fd, "r");
+    int ofd = dup(fd);
+    FILE *out = ofd >= 0 ? fdopen(ofd, "w") : NULL;
+    if (!in || !out) {
+        if (in) fclose(in); else close(fd);
+        if (out) fclose(out); else if (ofd >= 0) close(ofd);
+        return NULL;
+    }
+    IngestClient c;
+    memset(&c, 0, sizeof(c));
+    atomic_init(&c.committed, 0);
+    atomic_init(&c.failed, 0);
+    char line[1024];
+    long lineno = 0;
+    while (fgets(line, sizeof(line), in)) {
+        lineno++;
+        line[strcspn(line, "\r\n")] = 0;
+        uint64_t start = now_ns();
+        if (strncmp(line, "add ", 4) == 0) {
+            daemon_row(&c, line + 4, out, "line ", lineno);
+            metric_observe(MOP_ADD, start);
+        } else if (strncmp(line, "import ", 7) == 0) {
+            FILE *f = daemon_import_open(line + 7);
+            if (!f) {
+                if (!watch_dir[0]) fprintf(out, "error line %ld: import needs watch_dir\n", lineno);
+                else fprintf(out, "error line %ld: no such file in the watch folder\n", lineno);
+                continue;
+            }
+            char row[1024], where[sizeof(line) + 1];
+            snprintf(where, sizeof(where), "%s:", line + 7);
+            for (long n = 1; fgets(row, sizeof(row), f); ++n)
+                if (n > 1) daemon_row(&c, row, out, where, n); /* skip header */
+            fclose(f);
+            metric_observe(MOP_IMPORT, start);
+        } else if (strcmp(line, "commit") == 0) {
+            ingest_wait(&c);
+            metric_observe(MOP_COMMIT, start);
+            daemon_answer(&c, out);
+            fflush(out);
+        } else if (line[0]) {
+            fprintf(out, "error line %ld: unknown command\n", lineno);
         }
     }
-    ensure_budget_capacity();
-    BudgetEntry be = {cid, year, month, amt};
-    budgets.data[budgets.size++] = be;
-    printf("Budget set.\n");
+    ingest_wait(&c); /* the writer must be done with c before it goes */
+    daemon_answer(&c, out);
+    fclose(out);
+    fclose(in);
+    return NULL;
 }
 
-void list_budgets() {
-    if (budgets.size == 0) { printf("No budgets.\n"); return; }
-    for (size_t i = 0; i < budgets.size; ++i) {
-        int idx = find_category_index_by_id(budgets.data[i].category_id);
-        const char *cname = (idx >= 0) ? cats.data[idx].name : "UNKNOWN";
-        printf("  %04d-%02d  %s  %.2f\n", budgets.data[i].year, budgets.data[i].month, cname, budgets.data[i].amount);
+static void *daemon_accept(void *arg) {
+    int ls = (int)(intptr_t)arg;
+    for (;;) {
+        int fd = accept(ls, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return NULL;
+        }
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, daemon_client, (void *)(intptr_t)fd) != 0) close(fd);
+        else pthread_detach(tid);
     }
 }
 
-double total_for_category_month(int cat_id, int year, int month) {
-    char smin[DATE_STRLEN], smax[DATE_STRLEN];
-    snprintf(smin, sizeof(smin), "%04d-%02d-01", year, month);
-    /* compute last day approximately by moving to next month and subtracting 1 day, but for filtering lexicographically use next month start minus small */
-    int nmonth = month == 12 ? 1 : month + 1;
-    int nyear = month == 12 ? year + 1 : year;
-    snprintf(smax, sizeof(smax), "%04d-%02d-01", nyear, nmonth);
-    double total = 0.0;
-    for (size_t i = 0; i < txns.size; ++i) {
-        Transaction *t = &txns.data[i];
-        if (t->category_id != cat_id) continue;
-        if (compare_dates(t->date, smin) < 0) continue;
-        if (compare_dates(t->date, smax) >= 0) continue;
-        if (t->type == TYPE_EXPENSE) total += t->amount;
-        else total -= t->amount; /* treat income as negative for category spending */
-    }
-    return total;
+/* Claim a landed file for this task by moving it into WATCH_CLAIMED,
+   beside any same-named file still being imported. Returns 0 if another
+   task got to it first. */
+static int watch_claim(const char *name, char *claimed, size_t sz) {
+    char from[PATH_LEN + 256];
+    snprintf(from, sizeof(from), "%s/%s", watch_dir, name);
+    snprintf(claimed, sz, "%s/%s/%s", watch_dir, WATCH_CLAIMED, name);
+    struct stat st;
+    pthread_mutex_lock(&watch_lock); /* no other claim picks the same name */
+    for (int n = 1; stat(claimed, &st) == 0 && n < 1000; ++n)
+        snprintf(claimed, sz, "%s/%s/%s.%d", watch_dir, WATCH_CLAIMED, name, n);
+    int ok = rename(from, claimed) == 0;
+    int err = errno;
+    pthread_mutex_unlock(&watch_lock);
+    if (!ok && err != ENOENT) fprintf(stderr, "Warning: unable to move %s to %s\n", from, claimed);
+    return ok;
 }
 
-/* -------------------- Reports -------------------- */
+/* Move a handled file from where it was claimed into sub (WATCH_DONE or
+   WATCH_FAILED), never over an earlier file of the same name */
+static void watch_move(const char *from, const char *name, const char *sub) {
+    char to[PATH_LEN + 300];
+    snprintf(to, sizeof(to), "%s/%s/%s", watch_dir, sub, name);
+    struct stat st;
+    for (int n = 1; stat(to, &st) == 0 && n < 1000; ++n)
+        snprintf(to, sizeof(to), "%s/%s/%s.%d", watch_dir, sub, name, n);
+    if (rename(from, to) != 0) fprintf(stderr, "Warning: unable to move %s to %s\n", from, to);
+}
 
-void monthly_summary(int year, int month) {
-    char smin[DATE_STRLEN], smax[DATE_STRLEN];
-    snprintf(smin, sizeof(smin), "%04d-%02d-01", year, month);
-    int nmonth = (month == 12) ? 1 : month+1;
-    int nyear = (month == 12) ? year+1 : year;
-    snprintf(smax, sizeof(smax), "%04d-%02d-01", nyear, nmonth);
-    double income = 0.0, expense = 0.0;
-    for (size_t i = 0; i < txns.size; ++i) {
-        Transaction *t = &txns.data[i];
-        if (compare_dates(t->date, smin) < 0) continue;
-        if (compare_dates(t->date, smax) >= 0) continue;
-        if (t->type == TYPE_INCOME) income += t->amount;
-        else expense += t->amount;
+/* Import one landed file through the ingestion queue, then file it away
+   and log how it went */
+static void watch_ingest(const char *name) {
+    char path[PATH_LEN + 300];
+    if (!watch_claim(name, path, sizeof(path))) return; /* queued twice and already taken */
+    uint64_t start = now_ns();
+    IngestClient c;
+    memset(&c, 0, sizeof(c));
+    atomic_init(&c.committed, 0);
+    atomic_init(&c.failed, 0);
+    c.dedup = 1;
+    uint64_t bad = 0;
+    FILE *f = fopen(path, "r");
+    if (f) {
+        char row[1024];
+        for (long n = 1; fgets(row, sizeof(row), f); ++n) {
+            if (n == 1) continue; /* header */
+            Transaction t;
+            char category[64];
+            if (csv_parse_row(row, &t, category, sizeof(category)) > 0) ingest_submit(&c, &t, category);
+            else if (row[strspn(row, " \t\r\n")]) bad++;
+        }
+        fclose(f);
+    }
+    ingest_wait(&c);
+    fp_free(&c.seen);
+    double ms = (double)(now_ns() - start) / 1e6;
+    metric_observe(MOP_WATCH_FILE, start);
+    metric_add(&metrics.rows_invalid, bad);
+    int failed = !f || (bad && !c.sent) || atomic_load(&c.failed);
+    watch_move(path, name, failed ? WATCH_FAILED : WATCH_DONE);
+    char line[512];
+    if (!f) snprintf(line, sizeof(line), "%s: failed, cannot be read", name);
+    else if (atomic_load(&c.failed))
+        snprintf(line, sizeof(line), "%s: failed, the journal could not save %llu of %llu row(s)", name,
+                 (unsigned long long)atomic_load(&c.failed), (unsigned long long)c.sent);
+    else
+        snprintf(line, sizeof(line), "%s: %s, %llu row(s), %llu new, %llu duplicate(s), %llu invalid, %.1f ms, %.0f rows/s",
+                 name, failed ? "failed" : "done", (unsigned long long)c.sent, (unsigned long long)(c.sent - c.dups),
+                 (unsigned long long)c.dups, (unsigned long long)bad, ms, ms > 0 ? (double)c.sent * 1e3 / ms : 0.0);
+    printf("%s\n", line);
+    fflush(stdout);
+    char logpath[PATH_LEN + 32];
+    snprintf(logpath, sizeof(logpath), "%s/%s", watch_dir, WATCH_LOG);
+    FILE *log = fopen(logpath, "a");
+    if (log) {
+        char when[32];
+        time_t now = time(NULL);
+        struct tm tm;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &tm));
+        fprintf(log, "%s %s\n", when, line);
+        fclose(log);
     }
-    printf("Monthly Summary for %04d-%02d:\n", year, month);
-    printf("  Total Income:  %.2f\n", income);
-    printf("  Total Expense: %.2f\n", expense);
-    printf("  Net Savings:   %.2f\n", income - expense);
 }
 
-void category_summary(int year, int month) {
-    printf("Category Summary %04d-%02d:\n", year, month);
-    if (cats.size == 0) { printf(" (no categories)\n"); return; }
-    for (size_t i = 0; i < cats.size; ++i) {
-        double total = total_for_category_month(cats.data[i].id, year, month);
-        printf("  %-20s : %.2f\n", cats.data[i].name, total);
+/* Import queued files until there are none left */
+static void watch_task(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&watch_lock);
+        WatchFile *w = watch_head;
+        if (w) {
+            watch_head = w->next;
+            if (!watch_head) watch_tail = NULL;
+        } else {
+            watch_active--;
+        }
+        pthread_mutex_unlock(&watch_lock);
+        if (!w) return;
+        watch_ingest(w->name);
+        free(w);
     }
 }
 
-void budget_report(int year, int month) {
-    printf("Budget Report %04d-%02d:\n", year, month);
-    int found = 0;
-    for (size_t i = 0; i < budgets.size; ++i) {
-        if (budgets.data[i].year == year && budgets.data[i].month == month) {
-            found = 1;
-            int cid = budgets.data[i].category_id;
-            int idx = find_category_index_by_id(cid);
-            const char *name = (idx >= 0) ? cats.data[idx].name : "UNKNOWN";
-            double used = total_for_category_month(cid, year, month);
-            double bamt = budgets.data[i].amount;
-            printf("  %-16s Budget: %.2f  Used: %.2f  Remaining: %.2f\n", name, bamt, used, bamt - used);
+/* Queue a file, starting another watch task if fewer than
+   WATCH_WORKERS are at it */
+static void watch_queue(const char *name) {
+    size_t len = strlen(name);
+    if (name[0] == '.' || len < 5 || len >= sizeof(((WatchFile *)0)->name) || strcasecmp(name + len - 4, ".csv") != 0)
+        return;
+    WatchFile *w = xmalloc(sizeof(*w));
+    w->next = NULL;
+    snprintf(w->name, sizeof(w->name), "%s", name);
+    pthread_mutex_lock(&watch_lock);
+    if (watch_tail) watch_tail->next = w; else watch_head = w;
+    watch_tail = w;
+    int spawn = watch_active < WATCH_WORKERS;
+    if (spawn) watch_active++;
+    pthread_mutex_unlock(&watch_lock);
+    if (spawn) task_spawn(&watch_group, watch_task, NULL);
+}
+
+/* Queue every file closed after writing or moved into watch_dir since
+   the last call; the writer calls this between batches */
+static void watch_poll() {
+    _Alignas(struct inotify_event) char buf[64 * 1024];
+    ssize_t n;
+    while (watch_fd >= 0 && ((n = read(watch_fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))) {
+        for (char *p = buf; n > 0 && p < buf + n;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->len && !(ev->mask & IN_ISDIR)) watch_queue(ev->name);
+            p += sizeof(*ev) + ev->len;
         }
     }
-    if (!found) printf("  No budgets set for this month.\n");
 }
 
-/* -------------------- CSV import/export and search -------------------- */
+/* Start watching watch_dir. Returns 0 if it cannot be watched. */
+static int watch_start() {
+    char sub[PATH_LEN + 32];
+    snprintf(sub, sizeof(sub), "%s/%s", watch_dir, WATCH_DONE);
+    mkdir(sub, 0755);
+    snprintf(sub, sizeof(sub), "%s/%s", watch_dir, WATCH_FAILED);
+    mkdir(sub, 0755);
+    snprintf(sub, sizeof(sub), "%s/%s", watch_dir, WATCH_CLAIMED);
+    mkdir(sub, 0755);
+    /* a watch task waits on the writer, so it must not run on it */
+    pthread_once(&sched_once, sched_start);
+    if (!sched_nthreads) {
+        printf("Unable to watch %s: no worker threads (set workers=2 or more).\n", watch_dir);
+        return 0;
+    }
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd < 0 || inotify_add_watch(fd, watch_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+        printf("Unable to watch %s: %s\n", watch_dir, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    watch_fd = fd;
+    task_group_init(&watch_group, PRIO_LOW);
+    /* files claimed before a crash go back to be imported again; rows
+       already taken from them are skipped as duplicates */
+    DIR *d = opendir(sub);
+    struct dirent *e;
+    while (d && (e = readdir(d)) != NULL) {
+        char from[PATH_LEN + 300], to[PATH_LEN + 256];
+        struct stat st;
+        if (e->d_name[0] == '.') continue;
+        snprintf(from, sizeof(from), "%s/%s", sub, e->d_name);
+        snprintf(to, sizeof(to), "%s/%s", watch_dir, e->d_name);
+        char *dot = strrchr(to, '.'); /* drop the ".n" of a second claim */
+        if (dot && dot[1] && !dot[strspn(dot + 1, "0123456789") + 1]) *dot = 0;
+        if (stat(to, &st) != 0 && rename(from, to) != 0)
+            fprintf(stderr, "Warning: unable to move %s to %s\n", from, to);
+    }
+    if (d) closedir(d);
+    d = opendir(watch_dir); /* files already waiting */
+    while (d && (e = readdir(d)) != NULL) watch_queue(e->d_name);
+    if (d) closedir(d);
+    printf("Watching %s for CSV files.\n", watch_dir);
+    return 1;
+}
 
-void export_csv(const char *path) {
-    FILE *f = fopen(path, "w");
-    if (!f) { printf("Unable to open file for export.\n"); return; }
-    fprintf(f, "id,date,type,amount,category,note\n");
-    for (size_t i = 0; i < txns.size; ++i) {
-        Transaction *t = &txns.data[i];
-        int idx = find_category_index_by_id(t->category_id);
-        const char *cname = (idx >= 0) ? cats.data[idx].name : "UNKNOWN";
-        fprintf(f, "%d,%s,%d,%.2f,%s,%s\n", t->id, t->date, (int)t->type, t->amount, cname, t->note);
+/* Writer-side gauges; read by metrics_render() from other threads */
+static void metrics_publish() {
+    const Ledger *L = &ledgers[active_ledger];
+    metric_set(&metrics.journal_size, L->journal_end);
+    metric_set(&metrics.generation, L->generation);
+    metric_set(&metrics.transactions, txn_count());
+    metric_set(&metrics.since_ckpt, journal_since_ckpt);
+    metric_set(&metrics.ckpt_due, journal_ckpt_rows > CHECKPOINT_EVERY ? journal_ckpt_rows : CHECKPOINT_EVERY);
+    metric_set(&metrics.mem[MEM_TXNS], txns.cap * sizeof(Transaction));
+    metric_set(&metrics.mem[MEM_CATS], cats.cap * sizeof(Category));
+    metric_set(&metrics.mem[MEM_BUDGETS], budgets.cap * sizeof(BudgetEntry));
+    metric_set(&metrics.mem[MEM_INDEX], txn_index.cap * (sizeof(int) + sizeof(size_t)));
+    metric_set(&metrics.mem[MEM_AGG], month_cube.cap * sizeof(CubeCell) + month_cube.nslots * sizeof(size_t));
+    metric_set(&metrics.mem[MEM_UNDO], oplog.bufcap + oplog.cap * sizeof(size_t));
+    metric_set(&metrics.mem[MEM_JOURNAL], journal_bufcap);
+    metric_set(&metrics.mem[MEM_DEDUP], (ingest_rows.cap + ingest_notes.cap) * sizeof(FpCount));
+}
+
+static uint64_t metric_get(_Atomic uint64_t *c) {
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+/* Append printf output to a growing buffer */
+static void metrics_printf(char **buf, size_t *len, size_t *cap, const char *fmt, ...) {
+    va_list ap;
+    for (;;) {
+        va_start(ap, fmt);
+        int n = vsnprintf(*buf + *len, *cap - *len, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if (*len + (size_t)n < *cap) { *len += (size_t)n; return; }
+        *cap = (*cap + (size_t)n) * 2;
+        *buf = realloc(*buf, *cap);
+        if (!*buf) panic("out of memory");
     }
-    fclose(f);
-    printf("Exported to %s\n", path);
 }
 
-/* Basic CSV import: expects header date,type,amount,category,note or id included */
-void import_csv(const char *path) {
-    FILE *f = fopen(path, "r");
-    if (!f) { printf("Open failed.\n"); return; }
-    char line[1024];
-    int lineno = 0;
-    while (fgets(line, sizeof(line), f)) {
-        lineno++;
-        if (lineno == 1) continue; /* skip header */
-        char *p = line;
-        /* parse by comma (simple) */
-        char *token;
-        char date[DATE_STRLEN] = {0};
-        int type = 0;
-        double amount = 0;
-        char category[64] = {0};
-        char note[MAX_NOTE] = {0};
-        /* date */
-        token = strtok(p, ",");
-        if (!token) continue;
-        strncpy(date, token, DATE_STRLEN-1);
-        /* type */
-        token = strtok(NULL, ",");
-        if (!token) continue;
-        type = atoi(token);
-        token = strtok(NULL, ",");
-        if (!token) continue;
-        amount = atof(token);
-        token = strtok(NULL, ",");
-        if (!token) continue;
-        strncpy(category, token, sizeof(category)-1);
-        token = strtok(NULL, "\n");
-        if (token) strncpy(note, token, sizeof(note)-1);
-        /* trim whitespace/newline */
-        for (char *q=date; *q; ++q) if (*q=='\r' || *q=='\n') *q=0;
-        if (!parse_date(date, NULL)) {
-            printf("Skipping invalid date on line %d\n", lineno); continue;
-        }
-        /* find or create category */
-        int cid = -1;
-        for (size_t i = 0; i < cats.size; ++i) {
-            if (strcasecmp(cats.data[i].name, category) == 0) { cid = cats.data[i].id; break; }
-        }
-        if (cid < 0) {
-            ensure_cat_capacity();
-            Category c;
-            c.id = cats.next_id++;
-            strncpy(c.name, category, sizeof(c.name)-1);
-            cats.data[cats.size++] = c;
-            cid = c.id;
-            printf("Created category '%s' id=%d\n", c.name, c.id);
-        }
-        ensure_txn_capacity();
-        Transaction t;
-        t.id = txns.next_id++;
-        strncpy(t.date, date, DATE_STRLEN-1);
-        t.type = (type==1)?TYPE_INCOME:TYPE_EXPENSE;
-        t.amount = amount;
-        t.category_id = cid;
-        strncpy(t.note, note, sizeof(t.note)-1);
-        txns.data[txns.size++] = t;
+/* The Prometheus text exposition of metrics; caller frees */
+static char *metrics_render(size_t *out_len) {
+    static const char *ops[MOP_COUNT] = {"add", "import", "commit", "watch_file", "batch", "fsync"};
+    static const char *stores[MEM_COUNT] = {"transactions", "categories", "budgets", "id_index",
+                                            "aggregates", "undo_log", "journal_buffer", "dedup"};
+    size_t len = 0, cap = 8192;
+    char *b = xmalloc(cap);
+    b[0] = '\0';
+#define P(...) metrics_printf(&b, &len, &cap, __VA_ARGS__)
+    P("# HELP finance_request_duration_seconds Time taken by daemon operations.\n"
+      "# TYPE finance_request_duration_seconds histogram\n");
+    for (int op = 0; op < MOP_COUNT; ++op) {
+        Histogram *h = &metrics.op[op];
+        uint64_t cum = 0;
+        for (int i = 0; i <= METRICS_BUCKETS; ++i) {
+            cum += metric_get(&h->bucket[i]);
+            if (i < METRICS_BUCKETS)
+                P("finance_request_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %llu\n", ops[op], metric_bounds[i],
+                  (unsigned long long)cum);
+            else
+                P("finance_request_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n", ops[op],
+                  (unsigned long long)cum);
+        }
+        P("finance_request_duration_seconds_sum{op=\"%s\"} %.9f\n", ops[op], (double)metric_get(&h->sum_ns) / 1e9);
+        P("finance_request_duration_seconds_count{op=\"%s\"} %llu\n", ops[op], (unsigned long long)cum);
     }
-    fclose(f);
-    printf("Import complete.\n");
+    struct { const char *name, *help, *type; _Atomic uint64_t *v; } plain[] = {
+        {"finance_rows_ingested_total", "Rows added to the ledger.", "counter", &metrics.rows_ingested},
+        {"finance_rows_duplicate_total", "Rows skipped as already in the ledger.", "counter", &metrics.rows_duplicate},
+        {"finance_rows_invalid_total", "Rows rejected as malformed.", "counter", &metrics.rows_invalid},
+        {"finance_rows_scanned_total", "Rows read by reports and queries.", "counter", &metrics.rows_scanned},
+        {"finance_journal_writes_total", "write() calls on the journal.", "counter", &metrics.journal_writes},
+        {"finance_journal_written_bytes_total", "Bytes appended to the journal.", "counter", &metrics.journal_bytes},
+        {"finance_checkpoints_total", "Journal checkpoints taken.", "counter", &metrics.checkpoints},
+        {"finance_journal_bytes", "Size of the active ledger's journal.", "gauge", &metrics.journal_size},
+        {"finance_ledger_generation", "Sequence number of the last change applied.", "gauge", &metrics.generation},
+        {"finance_transactions", "Transactions in the active ledger.", "gauge", &metrics.transactions},
+        {"finance_checkpoint_progress_records", "Journal records since the last checkpoint.", "gauge",
+         &metrics.since_ckpt},
+        {"finance_checkpoint_due_records", "Journal records at which the next checkpoint is taken.", "gauge",
+         &metrics.ckpt_due},
+    };
+    for (size_t i = 0; i < sizeof(plain) / sizeof(plain[0]); ++i)
+        P("# HELP %s %s\n# TYPE %s %s\n%s %llu\n", plain[i].name, plain[i].help, plain[i].name, plain[i].type,
+          plain[i].name, (unsigned long long)metric_get(plain[i].v));
+    uint64_t queued = metric_get(&metrics.queued), applied = metric_get(&metrics.applied);
+    P("# HELP finance_queue_depth Rows queued for the writer and not yet applied.\n"
+      "# TYPE finance_queue_depth gauge\nfinance_queue_depth %llu\n",
+      (unsigned long long)(queued > applied ? queued - applied : 0));
+    P("# HELP finance_cache_hits_total Lookups served from cache.\n# TYPE finance_cache_hits_total counter\n"
+      "finance_cache_hits_total{cache=\"archive\"} %llu\nfinance_cache_hits_total{cache=\"btree\"} %llu\n",
+      (unsigned long long)metric_get(&metrics.arch_hits), (unsigned long long)metric_get(&metrics.bt_hits));
+    P("# HELP finance_cache_misses_total Lookups that had to read from disk.\n"
+      "# TYPE finance_cache_misses_total counter\n"
+      "finance_cache_misses_total{cache=\"archive\"} %llu\nfinance_cache_misses_total{cache=\"btree\"} %llu\n",
+      (unsigned long long)metric_get(&metrics.arch_misses), (unsigned long long)metric_get(&metrics.bt_misses));
+    P("# HELP finance_memory_bytes Heap allocated per in-memory store.\n# TYPE finance_memory_bytes gauge\n");
+    for (int i = 0; i < MEM_COUNT; ++i)
+        P("finance_memory_bytes{store=\"%s\"} %llu\n", stores[i], (unsigned long long)metric_get(&metrics.mem[i]));
+#undef P
+    *out_len = len;
+    return b;
 }
 
-/* -------------------- Search -------------------- */
-void search_transactions() {
-    printf("Search: leave fields blank to ignore.\n");
-    printf("Start date (YYYY-MM-DD): ");
-    char sdate[DATE_STRLEN]; read_line(sdate, sizeof(sdate));
-    if (strlen(sdate) && !parse_date(sdate, NULL)) { printf("Invalid date.\n"); return; }
-    printf("End date (YYYY-MM-DD): ");
-    char edate[DATE_STRLEN]; read_line(edate, sizeof(edate));
-    if (strlen(edate) && !parse_date(edate, NULL)) { printf("Invalid date.\n"); return; }
-    printf("Category name (partial): "); char cname[64]; read_line(cname, sizeof(cname));
-    printf("Min amount (0 to ignore): "); double minamt = read_double();
-    printf("Max amount (0 to ignore): "); double maxamt = read_double();
-    printf("Text in note (partial): "); char text[64]; read_line(text, sizeof(text));
-    printf("Search results:\n");
-    for (size_t i = 0; i < txns.size; ++i) {
-        Transaction *t = &txns.data[i];
-        if (strlen(sdate) && compare_dates(t->date, sdate) < 0) continue;
-        if (strlen(edate) && compare_dates(t->date, edate) > 0) continue;
-        if (minamt > 0 && t->amount < minamt) continue;
-        if (maxamt > 0 && t->amount > maxamt) continue;
-        int idx = find_category_index_by_id(t->category_id);
-        const char *catn = (idx>=0)?cats.data[idx].name:"UNKNOWN";
-        if (strlen(cname) && strcasestr(catn, cname) == NULL) continue;
-        if (strlen(text) && strcasestr(t->note, text) == NULL) continue;
-        printf("  id=%d %s %s %.2f [%s] %s\n", t->id, t->date, (t->type==TYPE_INCOME?"IN":"EX"), t->amount, catn, t->note);
+/* Answer each HTTP request with the current metrics; one at a time, as
+   rendering only reads counters and every client is on a deadline */
+static void *metrics_serve(void *arg) {
+    int ls = (int)(intptr_t)arg;
+    for (;;) {
+        int fd = accept(ls, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return NULL;
+        }
+        struct timeval tv = {METRICS_TIMEOUT_MS / 1000, METRICS_TIMEOUT_MS % 1000 * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        uint64_t deadline = now_ns() + (uint64_t)METRICS_TIMEOUT_MS * 1000000u;
+        char req[4096];
+        size_t got = 0;
+        while (got < sizeof(req) - 1 && now_ns() < deadline) { /* not a byte at a time forever */
+            ssize_t n = read(fd, req + got, sizeof(req) - 1 - got);
+            if (n <= 0) break;
+            got += (size_t)n;
+            req[got] = '\0';
+            if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) break;
+        }
+        req[got] = '\0';
+        char head[256];
+        if (strncmp(req, "GET ", 4) != 0) {
+            const char *bad = "HTTP/1.1 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            if (write(fd, bad, strlen(bad)) < 0) { /* client gone */ }
+            close(fd);
+            continue;
+        }
+        size_t len;
+        char *body = metrics_render(&len);
+        deadline = now_ns() + (uint64_t)METRICS_TIMEOUT_MS * 1000000u;
+        int hn = snprintf(head, sizeof(head),
+                          "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+        const char *parts[2] = {head, body};
+        size_t sizes[2] = {(size_t)hn, len};
+        int gone = 0;
+        for (int p = 0; p < 2 && !gone; ++p)
+            for (size_t off = 0; off < sizes[p];) {
+                ssize_t n = write(fd, parts[p] + off, sizes[p] - off);
+                if (n <= 0 || now_ns() >= deadline) { gone = 1; break; }
+                off += (size_t)n;
+            }
+        free(body);
+        close(fd);
+    }
+}
+
+/* Serve metrics on 127.0.0.1:metrics_port. Returns 0 if that fails. */
+static int metrics_start() {
+    int ls = socket(AF_INET, SOCK_STREAM, 0);
+    if (ls < 0) { printf("Unable to create socket: %s\n", strerror(errno)); return 0; }
+    int one = 1;
+    setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)metrics_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    pthread_t tid;
+    if (bind(ls, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(ls, 16) != 0 ||
+        pthread_create(&tid, NULL, metrics_serve, (void *)(intptr_t)ls) != 0) {
+        printf("Unable to serve metrics on port %d: %s\n", metrics_port, strerror(errno));
+        close(ls);
+        return 0;
+    }
+    pthread_detach(tid);
+    printf("Metrics on http://127.0.0.1:%d/metrics\n", metrics_port);
+    return 1;
+}
+
+static void daemon_on_signal(int sig) {
+    (void)sig;
+    daemon_stop = 1;
+}
+
+/* Serve the active ledger on DAEMON_SOCK until SIGINT or SIGTERM; this
+   thread is the writer. Returns 0 if the socket cannot be set up. */
+int daemon_run() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN); /* a client that hangs up early */
+
+    struct sockaddr_un addr;
+    int ls = sync_socket(DAEMON_SOCK, &addr);
+    if (ls < 0) return 0;
+    unlink(DAEMON_SOCK);
+    pthread_t tid;
+    if (bind(ls, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(ls, 64) != 0 ||
+        pthread_create(&tid, NULL, daemon_accept, (void *)(intptr_t)ls) != 0) {
+        printf("Unable to listen on %s: %s\n", DAEMON_SOCK, strerror(errno));
+        close(ls);
+        return 0;
+    }
+    pthread_detach(tid);
+    printf("Serving ledger '%s' on %s; interrupt to stop.\n", ledgers[active_ledger].name, DAEMON_SOCK);
+    if (watch_dir[0]) watch_start();
+    metrics_publish();
+    if (metrics_port > 0) metrics_start();
+    fflush(stdout);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t total = 0, window = (uint64_t)commit_window_ms * 1000000u;
+    journal_group_commit = 1;
+    while (!daemon_stop) {
+        watch_poll();
+        size_t n = ingest_apply_batch();
+        total += n;
+        metrics_publish();
+        if (ingest_nunacked) { /* grouped: the group is open */
+            uint64_t age = now_ns() - ingest_group_start;
+            if (age < window && ingest_nunacked < GROUP_COMMIT_MAX && (n || ingest_idle_wait(window - age))) continue;
+            ingest_group_commit();
+            continue;
+        }
+        if (durability == DURABLE_ASYNC && journal_unsynced &&
+            (!n || now_ns() - journal_synced_at >= (uint64_t)ASYNC_SYNC_MS * 1000000u))
+            journal_sync();
+        if (n) continue;
+        ingest_idle_wait(200 * 1000 * 1000);
     }
+    size_t n;
+    while ((n = ingest_apply_batch()) != 0) total += n; /* rows already queued */
+    ingest_group_commit();
+    journal_group_commit = 0;
+    unlink(DAEMON_SOCK);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("Stopped after %.1f s: %llu transaction(s) ingested.\n", secs, (unsigned long long)total);
+    return 1;
 }
 
 /* -------------------- Input helpers -------------------- */
@@ -715,6 +10111,15 @@ int parse_date(const char *s, struct tm *out) {
     return 1;
 }
 
+int date_key(const char *s) {
+    int k = 0;
+    for (int i = 0; i < 10; ++i) {
+        if (i == 4 || i == 7) continue;
+        k = k * 10 + (s[i] - '0');
+    }
+    return k;
+}
+
 /* lexicographic compare works for YYYY-MM-DD */
 int compare_dates(const char *a, const char *b) {
     return strcmp(a, b);
@@ -741,9 +10146,28 @@ void toggle_obfuscation() {
     }
 }
 
+/* Loading phase a menu choice needs: the category and budget lists
+   only need the first; settings and other ledgers need everything */
+static int menu_preload_phase(int c) {
+    switch (c) {
+        case 6: case 7: return PRELOAD_CATS;
+        case 0: case 12: case 13: case 14: case 20: return PRELOAD_ALL;
+        default: return PRELOAD_ACTIVE;
+    }
+}
+
+/* Menu choices a --read-only process offers: the listings and reports */
+static int menu_read_only(int c) {
+    switch (c) {
+        case 0: case 2: case 6: case 7: case 8: case 9: case 11: case 14: return 1;
+        default: return 0;
+    }
+}
+
 void interactive_menu() {
     for (;;) {
         printf("\n=== Menu ===\n");
+        if (sandbox.active) printf("[SANDBOX: %zu uncommitted change(s)]\n", sandbox.count);
         printf("1) Add transaction\n");
         printf("2) List transactions\n");
         printf("3) Edit transaction\n");
@@ -752,13 +10176,25 @@ void interactive_menu() {
         printf("6) List/Edit/Delete categories\n");
         printf("7) Set/List budgets\n");
         printf("8) Reports (monthly/category/budget)\n");
-        printf("9) Export CSV\n");
-        printf("10) Import CSV\n");
+        printf("9) Export CSV/JSONL\n");
+        printf("10) Import CSV/OFX/QIF/JSONL\n");
         printf("11) Search transactions\n");
         printf("12) Toggle file obfuscation (current: %s)\n", obfuscate_enabled ? "ON" : "OFF");
+        printf("13) Currencies & FX rates (base: %s)\n", base_currency);
+        printf("14) Ledgers (active: %s)\n", ledgers[active_ledger].name);
+        printf("15) Undo\n");
+        printf("16) Redo\n");
+        printf("17) Time travel (reports/search as of a past time)\n");
+        printf("18) What-if sandbox (%s)\n", sandbox.active ? "commit/discard" : "start");
+        printf("19) Sync with another replica\n");
+        printf("20) Backup / restore\n");
+        printf("21) Archive old months\n");
         printf("0) Save & Exit\n");
         printf("Choice: ");
         int c = read_int();
+        preload_wait(menu_preload_phase(c));
+        if (reader_mode && !menu_read_only(c)) { printf("Not available with --read-only.\n"); continue; }
+        snapshot_refresh();
         switch (c) {
             case 1: add_transaction(); break;
             case 2: {
@@ -778,6 +10214,8 @@ void interactive_menu() {
                 list_categories();
                 printf("e=edit, d=delete, anything else to return: ");
                 char a[8]; read_line(a,sizeof(a));
+                if (reader_mode && (a[0]=='e' || a[0]=='d')) { printf("Not available with --read-only.\n"); break; }
+                if (a[0]=='e' || a[0]=='d') preload_wait(PRELOAD_ACTIVE);
                 if (a[0]=='e') edit_category();
                 else if (a[0]=='d') remove_category();
                 break;
@@ -785,7 +10223,8 @@ void interactive_menu() {
             case 7: {
                 printf("1=set budget 2=list budgets : ");
                 int b = read_int();
-                if (b==1) set_budget(); else list_budgets();
+                if (reader_mode && b==1) { printf("Not available with --read-only.\n"); break; }
+                if (b==1) { preload_wait(PRELOAD_ACTIVE); set_budget(); } else list_budgets();
                 break;
             }
             case 8: {
@@ -797,22 +10236,40 @@ void interactive_menu() {
                 break;
             }
             case 9: {
-                printf("Export path (e.g., out.csv): ");
+                printf("Export path (e.g., out.csv, or out.jsonl for JSON Lines): ");
                 char path[256]; read_line(path,sizeof(path));
                 if (strlen(path)==0) strcpy(path,"export.csv");
-                export_csv(path);
+                size_t plen = strlen(path);
+                if (plen > 6 && strcmp(path + plen - 6, ".jsonl") == 0) export_jsonl(path);
+                else export_csv(path);
                 break;
             }
             case 10: {
-                printf("CSV path to import: ");
+                printf("Path of the CSV, OFX, QIF or JSONL file to import: ");
                 char path[256]; read_line(path,sizeof(path));
                 if (strlen(path) == 0) { printf("Aborted.\n"); break; }
-                import_csv(path);
+                printf("Dry run, only report what would change? (y/n) [n]: ");
+                char dry[8]; read_line(dry,sizeof(dry));
+                import_file(path, dry[0]=='y' || dry[0]=='Y');
                 break;
             }
             case 11: search_transactions(); break;
             case 12: toggle_obfuscation(); break;
+            case 13: currency_menu(); break;
+            case 14: ledger_menu(); break;
+            case 15: undo_menu(0); break;
+            case 16: undo_menu(1); break;
+            case 17: time_travel_menu(); break;
+            case 18: sandbox_menu(); break;
+            case 19: sync_menu(); break;
+            case 20: backup_menu(); break;
+            case 21: archive_menu(); break;
             case 0:
+                if (sandbox.active) {
+                    printf("Commit the sandbox's %zu change(s) before exiting? (y/n): ", sandbox.count);
+                    char a[8]; read_line(a, sizeof(a));
+                    if (a[0] == 'y' || a[0] == 'Y') sandbox_commit(); else sandbox_discard();
+                }
                 save_all();
                 return;
             default: printf("Invalid.\n"); break;